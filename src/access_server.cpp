@@ -1,15 +1,84 @@
 #include "access_server.h"
+#include "erasure_stripe.h"
+#include "chunk_scan.h"
+#include "chunk_dedup.h"
+#include "chunk_fetch.h"
 
 #include <Poco/Logger.h>
 #include <Poco/Util/HelpFormatter.h>
 #include <Poco/Environment.h>
 #include <Poco/UUIDGenerator.h>
+#include <Poco/String.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <algorithm>
 #include <random>
+#include <set>
 
 namespace DistFS {
 
+// Bytes of chunks fetched or uploaded with one batched request.
+static const int64_t BATCH_BYTES = 16*1024*1024;
+
+// Shuffle the candidate servers of new chunks. The engine is seeded once per process, so every
+// chunk gets its own order.
+template <class T>
+static void shuffleServers(std::vector<T>& servers) {
+    static Mutex mutex;
+    static std::default_random_engine engine(std::random_device{}());
+    Mutex::ScopedLock lock(mutex);
+    std::shuffle(servers.begin(), servers.end(), engine);
+}
+
+// Servers for the fragments of a new stripe, a random one for each. The same server only takes
+// several fragments of a stripe if there are fewer servers than fragments.
+static std::vector<std::string> chooseStripeServers(const std::vector<std::pair<std::string, std::string>>& chunk_servers, int fragments) {
+    std::vector<std::string> addresses;
+    for(auto it=chunk_servers.begin(); it!=chunk_servers.end(); ++it) {
+        addresses.push_back(it->second);
+    }
+    shuffleServers(addresses);
+    if(addresses.size() > (size_t)fragments) {
+        addresses.resize((size_t)fragments);
+    }
+    if(!addresses.empty() && addresses.size() < (size_t)fragments) {
+        Application::instance().logger().warning("Only " + std::to_string(addresses.size()) + " chunk servers for " + std::to_string(fragments) + " fragments, the stripe survives fewer failures.");
+    }
+    return addresses;
+}
+
+// Create new chunks on the chains of servers they are placed on (chain -> indexes in `chunk_ids`
+// and `chunks`), the chunks of a chain in batched requests. Clears `all_ok` if a chunk has fewer
+// copies than its chain has servers, `some_ok` if it has none. Returns the copies of each chunk.
+static std::map<std::string, int> createChunksOnChains(const std::map<std::vector<std::string>, std::vector<int64_t>>& by_chain,
+        const std::vector<std::string>& chunk_ids, const std::vector<std::vector<uint8_t>>& chunks,
+        const std::string& compression, bool& all_ok, bool& some_ok) {
+    std::map<std::string, int> copies;
+    for(auto it=by_chain.begin(); it!=by_chain.end(); ++it) {
+        const std::vector<std::string>& chain = it->first;
+        for(size_t first=0; first<it->second.size();) {
+            std::vector<std::pair<std::string, const std::vector<uint8_t>*>> batch;
+            int64_t batch_bytes = 0;
+            for(; first<it->second.size() && (batch.empty() || batch_bytes + (int64_t)chunks[it->second[first]].size() <= BATCH_BYTES); first++) {
+                int64_t j = it->second[first];
+                batch.push_back({chunk_ids[j], &chunks[j]});
+                batch_bytes += (int64_t)chunks[j].size();
+            }
+            std::map<std::string, int> stored = requestCreateChunksChain(chain, batch, compression);
+
+            for(auto s=stored.begin(); s!=stored.end(); ++s) {
+                if(s->second < (int)chain.size()) {
+                    all_ok = false;
+                }
+                if(s->second == 0) {
+                    some_ok = false;
+                }
+            }
+            copies.insert(stored.begin(), stored.end());
+        }
+    }
+    return copies;
+}
+
 class GetFileRequestHandler: public HTTPRequestHandler {
 public:
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
@@ -22,11 +91,17 @@ public:
         int64_t begin_pos = 0;
         int64_t end_pos = -1;
 
-        if(query_map.find("begin_pos") != query_map.end()) {
-            begin_pos = std::stoi(query_map["begin_pos"]);
-        }
-        if(query_map.find("end_pos") != query_map.end()) {
-            end_pos = std::stoi(query_map["end_pos"]);
+        try {
+            if(query_map.find("begin_pos") != query_map.end()) {
+                begin_pos = std::stoll(query_map["begin_pos"]);
+            }
+            if(query_map.find("end_pos") != query_map.end()) {
+                end_pos = std::stoll(query_map["end_pos"]);
+            }
+        } catch(std::exception& e) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
         }
 
         std::string meta_server_addr = server.meta_server_addr;
@@ -57,9 +132,14 @@ public:
         }
 
         std::vector<std::string> required_chunks;
+        std::vector<int64_t> offsets = chunkOffsets(file_meta);
+        int64_t first_chunk_idx = 0;
         
-        if(end_pos != 0) {
-            for(int64_t i=begin_pos/chunk_size; i<=(end_pos-1)/chunk_size; i++) {
+        if(end_pos > begin_pos) {
+            auto chunk_begins_end = offsets.begin() + chunks_json->size();
+            first_chunk_idx = std::upper_bound(offsets.begin(), chunk_begins_end, begin_pos) - offsets.begin() - 1;
+            int64_t last_chunk_idx = std::upper_bound(offsets.begin(), chunk_begins_end, end_pos-1) - offsets.begin() - 1;
+            for(int64_t i=first_chunk_idx; i<=last_chunk_idx; i++) {
                 required_chunks.push_back(chunks_json->getElement<std::string>((unsigned int)i));
             }
         }
@@ -72,20 +152,67 @@ public:
         }
         //*/
 
+        if(file_meta->optValue<std::string>("layout", "replicated") == "rs") {
+            ReedSolomon code((int)file_meta->getValue<int64_t>("data_shards"), (int)file_meta->getValue<int64_t>("parity_shards"));
+            std::vector<ChunkExtent> extents;
+            std::vector<int64_t> chunk_lengths;
+            for(int i=0; i<required_chunks.size(); i++) {
+                int64_t chunk_begin = offsets[first_chunk_idx+i];
+                int64_t chunk_length = offsets[first_chunk_idx+i+1] - chunk_begin;
+                int64_t offset = std::max<int64_t>(begin_pos, chunk_begin) - chunk_begin;
+                int64_t extent = std::min<int64_t>(end_pos, chunk_begin+chunk_length) - chunk_begin - offset;
+                extents.push_back({required_chunks[i], offset, extent});
+                chunk_lengths.push_back(chunk_length);
+            }
+
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+            std::ostream& resp = response.send();
+            // The stripes are read and decoded like replicated chunks are fetched, a window ahead.
+            ChunkFetcher fetcher(extents, [&](size_t i, std::vector<uint8_t>& content) {
+                if(extents[i].chunk_id == HOLE_CHUNK_ID) {
+                    content.assign((size_t)extents[i].length, 0);
+                    return true;
+                }
+                try {
+                    content = readStripe(code, chunk_servers_json, extents[i].chunk_id, chunk_lengths[i], extents[i].offset, extents[i].length);
+                    return true;
+                } catch(Exception& e) {
+                    app.logger().error("Chunk " + extents[i].chunk_id + " of " + filename + " is lost: " + e.displayText());
+                    return false;
+                }
+            }, server.read_concurrency, server.read_window);
+            for(size_t i=0; i<extents.size(); i++) {
+                std::vector<uint8_t> content;
+                if(!fetcher.next(content)) {
+                    return;
+                }
+                resp.write((char*)content.data(), content.size());
+                AdmissionControl::streamed((int64_t)content.size());
+            }
+            return;
+        }
+
         bool ok = true;
-        std::vector<std::pair<std::string, std::string>> selected_chunk_servers;
+        // Replica addresses of every chunk, rotated to start at a random one to spread the load.
+        std::vector<std::vector<std::string>> chunk_addresses;
         for(int i=0; i<required_chunks.size(); i++) {
+            if(required_chunks[i] == HOLE_CHUNK_ID) {
+                // Zeros made up here.
+                chunk_addresses.push_back(std::vector<std::string>());
+                continue;
+            }
             JSON::Array::Ptr servers_json = chunk_servers_json->getArray(required_chunks[i]);
             if(servers_json.isNull() || servers_json->size() == 0) {
                 ok = false;
                 break;
             }
+            std::vector<std::string> addresses;
             int idx = std::rand() % servers_json->size();
-            JSON::Object::Ptr server_json = servers_json->getObject(idx);
-            std::string id = server_json->getValue<std::string>("id");
-            std::string address = server_json->getValue<std::string>("address");
-
-            selected_chunk_servers.push_back({id, address});
+            for(int j=0; j<servers_json->size(); j++) {
+                JSON::Object::Ptr server_json = servers_json->getObject((idx + j) % servers_json->size());
+                addresses.push_back(server_json->getValue<std::string>("address"));
+            }
+            chunk_addresses.push_back(addresses);
         }
         if(!ok) {
             response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
@@ -97,33 +224,42 @@ public:
 
         response.setStatusAndReason(HTTPResponse::HTTP_OK);
         std::ostream& resp = response.send();
-        for(int i=0; i<required_chunks.size(); i++) {
-            std::vector<uint8_t> content = getChunk(selected_chunk_servers[i].second, required_chunks[i]);
-            if(i != required_chunks.size()-1 && content.size() != chunk_size) {
-                ok = false;
-            }
 
-            if(i == 0) {
-                // Cut the beginning
-                auto first = content.cbegin() + (begin_pos - (begin_pos/chunk_size)*chunk_size);
-                auto last = content.cend();
-                std::vector<uint8_t> tmp(first, last);
-                content = tmp;
-            }
+        // Only ask the chunk servers for the part of each chunk inside [begin_pos, end_pos).
+        std::vector<ChunkExtent> extents;
+        for(int i=0; i<required_chunks.size(); i++) {
+            int64_t chunk_begin = offsets[first_chunk_idx+i];
+            int64_t offset = std::max<int64_t>(begin_pos, chunk_begin) - chunk_begin;
+            int64_t extent = std::min<int64_t>(end_pos, offsets[first_chunk_idx+i+1]) - chunk_begin - offset;
+            extents.push_back({required_chunks[i], offset, extent});
+        }
 
-            if(i == required_chunks.size()-1) {
-                auto first = content.cbegin();
-                // Not include the byte at end_pos. E.g. begin=3, end=4 will contains only 1 byte data.
-                // std iterator is also not include the element at end(), so we don't need to -1 here.
-                auto last = content.cbegin() + (end_pos - (end_pos/chunk_size)*chunk_size);
-                std::vector<uint8_t> tmp(first, last);
-                content = tmp;
+        // Fetched concurrently a window ahead, written out in order as the head arrives.
+        ChunkFetcher fetcher(extents, chunk_addresses, server.read_concurrency, server.read_window);
+        for(size_t i=0; i<extents.size(); i++) {
+            std::vector<uint8_t> content;
+            if(!fetcher.next(content)) {
+                app.logger().error("Chunk " + extents[i].chunk_id + " of " + filename + " is lost.");
+                return;
             }
             resp.write((char*)content.data(), content.size());
+            AdmissionControl::streamed((int64_t)content.size());
         }
     }
 };
 
+// Reads up to `length` more bytes of a request body into `content`, fewer only at its end.
+// Returns the bytes read.
+static size_t readBody(std::istream& istr, std::vector<uint8_t>& content, size_t length) {
+    size_t old_size = content.size();
+    content.resize(old_size + length);
+    istr.read((char*)content.data() + old_size, (std::streamsize)length);
+    size_t read = (size_t)istr.gcount();
+    content.resize(old_size + read);
+    AdmissionControl::streamed((int64_t)read);
+    return read;
+}
+
 class WriteFileRequestHandler: public HTTPRequestHandler {
 public:
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
@@ -132,21 +268,23 @@ public:
         
         std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
 
-        std::string filename = query_map["filename"];
+        filename = query_map["filename"];
 
         int64_t resize = -1;
-        if(query_map.find("resize") != query_map.end()) {
-            resize = std::stoi(query_map["resize"]);
-        }
-        
-        int64_t begin_pos = 0;
-        if(query_map.find("begin_pos") != query_map.end()) {
-            begin_pos = std::stoi(query_map["begin_pos"]);
+        begin_pos = 0;
+        try {
+            if(query_map.find("resize") != query_map.end()) {
+                resize = std::stoll(query_map["resize"]);
+            }
+            if(query_map.find("begin_pos") != query_map.end()) {
+                begin_pos = std::stoll(query_map["begin_pos"]);
+            }
+        } catch(std::exception& e) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
         }
         std::istream& istr = request.stream();
-        
-        std::vector<uint8_t> content;
-        std::copy(std::istream_iterator<uint8_t>(istr), std::istream_iterator<uint8_t>(), std::back_inserter(content));
 
         std::string meta_server_addr = server.meta_server_addr;
         
@@ -154,14 +292,23 @@ public:
         JSON::Object::Ptr file_meta = getFileMeta(meta_server_addr, filename);
         if(file_meta.isNull()) {
             // File not exist, create one.
-            int resp_code = requestCreateFile(meta_server_addr, filename);
+            std::string compression = "none";
+            if(query_map.find("compression") != query_map.end()) {
+                compression = query_map["compression"];
+            }
+            int resp_code = requestCreateFile(meta_server_addr, filename, compression, query_map["layout"], query_map["data_shards"], query_map["parity_shards"], query_map["dedup"]);
 
-            if(resp_code != HTTPResponse::HTTP_OK) {
+            if(resp_code == HTTPResponse::HTTP_BAD_REQUEST) {
+                // Parameters the meta server can't create the file with.
+                response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+                response.send();
+                return;
+            } else if(resp_code != HTTPResponse::HTTP_OK) {
                 response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
                 response.send();
                 return;
             }
-            JSON::Object::Ptr file_meta = getFileMeta(meta_server_addr, filename);
+            file_meta = getFileMeta(meta_server_addr, filename);
             if(file_meta.isNull()) {
                 response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
                 response.send();
@@ -169,203 +316,1019 @@ public:
             }
         }
 
-        int64_t chunk_size = file_meta->getValue<int64_t>("chunk_size");
-        int64_t original_length = file_meta->getValue<int64_t>("length");
+        chunk_size = file_meta->getValue<int64_t>("chunk_size");
+        original_length = file_meta->getValue<int64_t>("length");
         
         
         int64_t replica_count = file_meta->getValue<int64_t>("replica_count");
-        
-        int64_t end_pos = begin_pos + content.size();   // not include this pos
-        int64_t first_chunk_idx = begin_pos/chunk_size;
-        int64_t last_chunk_idx = (end_pos-1)/chunk_size;    // included
-        int64_t chunk_num = last_chunk_idx-first_chunk_idx+1;
+        compression = file_meta->optValue<std::string>("compression", "none");
 
-        if(begin_pos > original_length) {
-            // Only allow append, does not allow to expand the file.
-            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
-            response.send();
+        chunk_servers = requestGetActiveChunkServersList(server.meta_server_addr);
+        replica = std::min<int>((int)replica_count, (int)chunk_servers.size());
+        all_ok = true;
+        some_ok = true;
+
+        dedup = file_meta->optValue<bool>("dedup", false);
+        if(dedup) {
+            writeDeduplicated(server, file_meta, istr, response);
             return;
         }
 
+        // A write past the end leaves a gap that reads as zeros. It is written from the old end
+        // on with the gap as zeros, and the whole chunks of zeros become holes.
+        int64_t gap_end = begin_pos;
+        if(begin_pos > original_length) {
+            begin_pos = original_length;
+        }
+        begin_chunks_idx = begin_pos/chunk_size;
+
+        orig_chunks_json = file_meta->getArray("chunks");
+        chunk_servers_json = file_meta->getObject("chunk_servers");
+        versions_json = file_meta->has("versions") ? file_meta->getObject("versions") : JSON::Object::Ptr(new JSON::Object);
+        updated_versions = new JSON::Object;
+        appended_replicas = new JSON::Object;
+        if(file_meta->optValue<std::string>("layout", "replicated") == "rs") {
+            code = new ReedSolomon((int)file_meta->getValue<int64_t>("data_shards"), (int)file_meta->getValue<int64_t>("parity_shards"));
+        }
+
+        // The body is cut into chunks as it arrives. A batch of them is uploaded while the next one
+        // is received, so a write holds two batches at most, whatever its size.
+        int64_t batch_limit = std::max(server.write_batch, chunk_size);
+        std::vector<PendingChunk> batch;
+        int64_t batch_bytes = 0;
+        std::vector<PendingChunk> uploading;
+        SharedPtr<Thread> uploader;
         std::vector<std::string> chunk_ids;
         UUIDGenerator uuidGen;
-        for(int i=0; i<chunk_num; i++) {
-            chunk_ids.push_back(uuidGen.createOne().toString());
+        int64_t end_pos = begin_pos;    // not include this pos
+        int64_t holes = 0;
+        bool body_done = false;
+        try {
+            for(int64_t j=0; ; j++) {
+                int64_t chunk_begin = (begin_chunks_idx+j)*chunk_size;
+                int64_t chunk_end = chunk_begin + chunk_size;
+                int64_t piece_begin = std::max(begin_pos, chunk_begin);
+                PendingChunk piece;
+                piece.index = j;
+                int64_t piece_end = std::max(std::min(gap_end, chunk_end), piece_begin);
+                if(piece_begin == chunk_begin && piece_end == chunk_end) {
+                    // All of it in the gap, nothing to make up.
+                } else {
+                    piece.content.assign((size_t)(piece_end - piece_begin), 0);
+                    if(piece_end < chunk_end && !body_done) {
+                        size_t wanted = (size_t)(chunk_end - piece_end);
+                        size_t read = readBody(istr, piece.content, wanted);
+                        piece_end += (int64_t)read;
+                        body_done = read < wanted;
+                    }
+                }
+                if(piece_end == piece_begin) {
+                    break;
+                }
+                end_pos = piece_end;
+
+                // Nothing of the chunk is left as it was.
+                bool whole = piece_begin == chunk_begin && (piece_end == chunk_end || piece_end >= original_length);
+                if(whole && allZero(piece.content.data(), piece.content.size())) {
+                    std::vector<uint8_t>().swap(piece.content);
+                    piece.chunk_id = HOLE_CHUNK_ID;
+                    holes++;
+                } else {
+                    piece.chunk_id = uuidGen.createOne().toString();
+                }
+                chunk_ids.push_back(piece.chunk_id);
+                batch_bytes += (int64_t)piece.content.size();
+                batch.push_back(std::move(piece));
+
+                if(batch_bytes >= batch_limit) {
+                    if(!handOff(uploader, uploading, batch)) {
+                        break;
+                    }
+                    batch_bytes = 0;
+                }
+            }
+            if(!batch.empty()) {
+                handOff(uploader, uploading, batch);
+            }
+        } catch(...) {
+            // The uploading thread works on this handler's state.
+            if(!uploader.isNull()) {
+                uploader->join();
+            }
+            throw;
+        }
+        if(!uploader.isNull()) {
+            uploader->join();
+        }
+        if(chunk_ids.empty()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+            response.send();
+            return;
         }
 
-        std::vector<std::vector<uint8_t>> chunks;
+        app.logger().information("Wrote " + std::to_string(chunk_ids.size()) + " chunks, " + std::to_string(holes) + " of them holes.");
 
-        // first chunk
-        auto first = content.begin();
-        auto last = first;
+        if(some_ok) {
+            if(!appended_tail.empty()) {
+                chunk_ids[0] = appended_tail;
+            }
 
-        if(chunk_size - (begin_pos%chunk_size) <= content.size()) {
-            last = first + (chunk_size - (begin_pos%chunk_size));
-        } else {
-            last = content.end();
-        }
-        
-        
-        for(int i=0; i<chunk_num; i++) {
-            chunks.push_back(std::vector<uint8_t>(first, last));
-            first = last;
-            if(i+1<chunk_num-1) {
-                last += chunk_size;
+            // commit and update chunk list
+            URI uri("http://"+meta_server_addr);
+            uri.setPath("/update_file_meta");
+
+            HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+
+            PooledSession session(uri.getHost(), uri.getPort());
+            JSON::Object::Ptr req_json(new JSON::Object);
+
+            req_json->set("filename", filename);
+            if(end_pos > original_length) {
+                req_json->set("length", end_pos);
+            } else {
+                req_json->set("length", original_length);
+            }
+
+            if(updated_versions->size() > 0) {
+                req_json->set("versions", updated_versions);
+                req_json->set("appended_replicas", appended_replicas);
+            }
+
+            if(begin_pos == original_length && (begin_pos % chunk_size == 0 || updated_versions->size() > 0)) {
+                // Nothing but new chunks after the existing ones, the list itself stays.
+                JSON::Array::Ptr appended_json(new JSON::Array);
+                for(size_t i=(begin_pos % chunk_size == 0 ? 0 : 1); i<chunk_ids.size(); i++) {
+                    appended_json->add(chunk_ids[i]);
+                }
+                req_json->set("appended_chunks", appended_json);
             } else {
-                last = content.end();
+                JSON::Array::Ptr chunks_json(new JSON::Array);
+                for(int i=0; i<begin_chunks_idx; i++) {
+                    std::string chunk_id = orig_chunks_json->getElement<std::string>(i);
+                    chunks_json->add(chunk_id);
+                }
+                for(int i=0; i < chunk_ids.size(); i++) {
+                    chunks_json->add(chunk_ids[i]);
+                }
+                for(int i=begin_chunks_idx+chunk_ids.size(); i<orig_chunks_json->size(); i++) {
+                    std::string chunk_id = orig_chunks_json->getElement<std::string>(i);
+                    chunks_json->add(chunk_id);
+                }
+                req_json->set("chunks", chunks_json);
+            }
+
+            req_json->stringify(session.sendRequest(request));
+
+            HTTPResponse resp;
+            std::istream& resp_stream = session.receiveResponse(resp);
+            if(resp.getStatus() != HTTPResponse::HTTP_OK) {
+                app.logger().information("Failed to update metadata, response code: "+std::to_string(resp.getStatus()));
+
+                response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+                response.send();
+                return;
             }
+
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+            response.send();
+        } else {
+            // The rest of the body is left unread.
+            response.setKeepAlive(false);
+            response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+            response.send();
         }
-        std::cout << content.size() << std::endl;
 
-        app.logger().information("Writing " + std::to_string(chunk_num) + " chunks.");
+    }
 
-        bool all_ok = true;     // Operation finished on every chunk servers
-        bool some_ok = true;    // At least one chunk server finished our operation for each chunks
-        
-        int64_t begin_chunks_idx = (begin_pos/chunk_size);
+private:
+    // A chunk of the write: index in the chunks written, new id, and the part of its content the
+    // write covers (from begin_pos on in the first chunk). Empty for holes.
+    struct PendingChunk {
+        int64_t index;
+        std::string chunk_id;
+        std::vector<uint8_t> content;
+    };
 
-        JSON::Array::Ptr orig_chunks_json = file_meta->getArray("chunks");
-        JSON::Object::Ptr chunk_servers_json = file_meta->getObject("chunk_servers");
-        
-        int64_t i;
-        for(i=begin_chunks_idx; i<orig_chunks_json->size(); i++) {
+    // Waits for the batch being uploaded, then starts uploading `batch`. Returns false, and
+    // leaves `batch`, if an earlier batch failed.
+    bool handOff(SharedPtr<Thread>& uploader, std::vector<PendingChunk>& uploading, std::vector<PendingChunk>& batch) {
+        if(!uploader.isNull()) {
+            uploader->join();
+        }
+        if(!some_ok) {
+            return false;
+        }
+        uploading.swap(batch);
+        batch.clear();
+        uploader = new Thread;
+        std::vector<PendingChunk>* pending = &uploading;
+        std::string client = ClientScope::current();
+        uploader->startFunc([this, pending, client]() {
+            ClientScope client_scope(client);
+            try {
+                uploadBatch(*pending);
+            } catch(Exception& e) {
+                Application::instance().logger().error("Writing " + filename + " failed: " + e.displayText());
+                some_ok = false;
+            }
+        });
+        return true;
+    }
 
-            if(i-begin_chunks_idx < chunks.size()) {
-                // Update the chunks we already have (and rename them)
-                std::string orig_chunk_id = orig_chunks_json->getElement<std::string>(i);
-                std::string new_chunk_id = chunk_ids[i-begin_chunks_idx];
-                std::vector<uint8_t>& content = chunks[i-begin_chunks_idx];
-                JSON::Array::Ptr servers_json = chunk_servers_json->getArray(orig_chunk_id);
-                
-                bool chunk_some_ok = false;
-                for(int j=0; j<servers_json->size(); j++) {
-                    JSON::Object::Ptr server_json = servers_json->getObject(j);
-                    std::string chunk_server_id = server_json->getValue<std::string>("id");
-                    std::string chunk_server_addr = server_json->getValue<std::string>("address");
-
-                    int64_t content_begin_pos = 0;
-                    if(i == begin_chunks_idx) {
-                        content_begin_pos = begin_pos - begin_chunks_idx*chunk_size;
-                    }
-                    int64_t cur_chunk_length = content.size();
-                    
-                    std::cout << "Requesting update chunk on addr " + chunk_server_addr + " new_chunk id " + new_chunk_id << " content length " << content.size() << std::endl;
-                    int resp_code = requestUpdateChunk(chunk_server_addr, orig_chunk_id, new_chunk_id, content_begin_pos, content);
-                    if(resp_code != HTTPResponse::HTTP_OK) {
-                        all_ok = false;
+    // Stores the chunks of a batch: the tail grows in place, chunks the file has are updated under
+    // new ids, the others are created. Clears all_ok and some_ok as the write goes.
+    void uploadBatch(std::vector<PendingChunk>& batch) {
+        Application& app = Application::instance();
+        AccessServer& server = dynamic_cast<AccessServer&>(app);
+
+        if(dedup) {
+            uploadDeduplicated(batch);
+            return;
+        }
+
+        if(!code.isNull()) {
+            // Every chunk written becomes a new stripe. Fragments can't be patched in place, so
+            // a chunk that is only partly overwritten is read back and encoded again.
+            for(auto it=batch.begin(); it!=batch.end() && some_ok; ++it) {
+                if(it->chunk_id == HOLE_CHUNK_ID) {
+                    continue;
+                }
+                int64_t chunk_idx = begin_chunks_idx + it->index;
+                int64_t content_begin_pos = (it->index == 0) ? begin_pos - chunk_idx*chunk_size : 0;
+                std::vector<uint8_t>& content = it->content;
+
+                std::vector<uint8_t> stripe;
+                if(chunk_idx < orig_chunks_json->size()) {
+                    std::string orig_chunk_id = orig_chunks_json->getElement<std::string>((unsigned int)chunk_idx);
+                    int64_t orig_length = std::min<int64_t>(chunk_size, original_length - chunk_idx*chunk_size);
+                    if(orig_chunk_id == HOLE_CHUNK_ID) {
+                        stripe.assign((size_t)orig_length, 0);
                     } else {
-                        chunk_some_ok = true;
+                        try {
+                            stripe = readStripe(*code, chunk_servers_json, orig_chunk_id, orig_length, 0, orig_length);
+                        } catch(Exception& e) {
+                            app.logger().error("Chunk " + orig_chunk_id + " of " + filename + " is lost: " + e.displayText());
+                            some_ok = false;
+                            break;
+                        }
                     }
+                }
+                stripe.resize(std::max<size_t>(stripe.size(), (size_t)content_begin_pos + content.size()), 0);
+                std::copy(content.begin(), content.end(), stripe.begin() + content_begin_pos);
 
+                int stored = writeStripe(*code, chooseStripeServers(chunk_servers, code->totalShards()), it->chunk_id, stripe, compression);
+                if(stored < code->totalShards()) {
+                    all_ok = false;
                 }
-                if(!chunk_some_ok) {
+                // Only the data fragments would leave the stripe one failure from being lost.
+                int min_parity = server.rs_min_parity < 0 ? code->parityShards() : std::min(server.rs_min_parity, code->parityShards());
+                if(stored < code->dataShards() + min_parity) {
+                    app.logger().error("Only " + std::to_string(stored) + " fragments of chunk " + it->chunk_id + " of " + filename + " stored.");
                     some_ok = false;
                 }
-            } else {
-                // Maybe add a parameter to allow truncate the file directly using this api?
-                // We'll leave this else case here, and jump out of the loop for now.
-                i=orig_chunks_json->size();
-                break;
             }
-            
+            return;
         }
 
-        std::vector<std::pair<std::string, std::string>> chunk_servers = requestGetActiveChunkServersList(server.meta_server_addr);
+        // The new chunks, uploaded together at the end of the batch.
+        std::vector<std::string> created_ids;
+        std::vector<std::vector<uint8_t>> created;
+        // chain -> the new chunks placed on it
+        std::map<std::vector<std::string>, std::vector<int64_t>> by_chain;
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            int64_t i = begin_chunks_idx + it->index;
+            int64_t content_begin_pos = (it->index == 0) ? begin_pos - begin_chunks_idx*chunk_size : 0;
+            std::vector<uint8_t>& content = it->content;
+            if(it->chunk_id == HOLE_CHUNK_ID) {
+                continue;
+            }
+            if(it->index == 0 && appendTail(content)) {
+                continue;
+            }
 
-        int replica = (int)replica_count;
-        if(replica > chunk_servers.size()) {
-            replica = chunk_servers.size();
-        }
+            if(i < orig_chunks_json->size()) {
+                // Update the chunks we already have (and rename them)
+                std::string orig_chunk_id = orig_chunks_json->getElement<std::string>(i);
+                if(orig_chunk_id == HOLE_CHUNK_ID) {
+                    // Nothing to update, the hole's zeros around the write are created with it.
+                    std::vector<uint8_t> filled((size_t)std::min<int64_t>(chunk_size, original_length - i*chunk_size), 0);
+                    filled.resize(std::max(filled.size(), (size_t)content_begin_pos + content.size()), 0);
+                    std::copy(content.begin(), content.end(), filled.begin() + content_begin_pos);
+                    content.swap(filled);
+                } else {
+                    JSON::Array::Ptr servers_json = chunk_servers_json->getArray(orig_chunk_id);
+
+                    bool chunk_some_ok = false;
+                    for(int j=0; j<servers_json->size(); j++) {
+                        JSON::Object::Ptr server_json = servers_json->getObject(j);
+                        std::string chunk_server_addr = server_json->getValue<std::string>("address");
+
+                        std::cout << "Requesting update chunk on addr " + chunk_server_addr + " new_chunk id " + it->chunk_id << " content length " << content.size() << std::endl;
+                        int resp_code = requestUpdateChunk(chunk_server_addr, orig_chunk_id, it->chunk_id, content_begin_pos, content);
+                        if(resp_code != HTTPResponse::HTTP_OK) {
+                            all_ok = false;
+                        } else {
+                            chunk_some_ok = true;
+                        }
+                    }
+                    if(!chunk_some_ok) {
+                        some_ok = false;
+                    }
+                    continue;
+                }
+            }
 
-        for(;i-begin_chunks_idx < chunk_ids.size(); i++) {
             // create extra chunks on servers
-            std::string chunk_id = chunk_ids[i-begin_chunks_idx];
-            std::vector<uint8_t>& content = chunks[i-begin_chunks_idx];
-
             std::vector<int> indexes;
             for(int j=0; j<chunk_servers.size(); j++) {
                 indexes.push_back(j);
             }
-            std::shuffle(indexes.begin(), indexes.end(), std::default_random_engine());
+            shuffleServers(indexes);
 
-            bool chunk_some_ok = false;
+            // Upload once, the replicas pass the chunk on to each other.
+            std::vector<std::string> chain;
             for(int j=0; j<replica; j++) {
-                std::cout << "Requesting create chunk on addr " + chunk_servers[indexes[j]].second + " chunk id " + chunk_id << " content length " << content.size() << std::endl;
-                int resp_code = requestCreateChunk(chunk_servers[indexes[j]].second, chunk_id, content);
+                chain.push_back(chunk_servers[indexes[j]].second);
+            }
+            by_chain[chain].push_back((int64_t)created.size());
+            created_ids.push_back(it->chunk_id);
+            created.push_back(std::vector<uint8_t>());
+            created.back().swap(content);
+        }
 
-                if(resp_code != HTTPResponse::HTTP_OK) {
-                    all_ok = false;
-                } else {
-                    chunk_some_ok = true;
+        createChunksOnChains(by_chain, created_ids, created, compression, all_ok, some_ok);
+    }
+
+    // Appending to a partly filled tail chunk: its replicas grow in place under the next version
+    // instead of copying it to a new id. Replicas that don't take the append are left at the old
+    // version, the meta server stops handing them out. Returns false if the write doesn't start in
+    // the tail, or no replica could grow in place and the tail is to be copied to a new chunk.
+    bool appendTail(const std::vector<uint8_t>& content) {
+        Application& app = Application::instance();
+        int64_t i = begin_chunks_idx;
+        if(begin_pos != original_length || begin_pos % chunk_size == 0 || compression != "none" || i >= orig_chunks_json->size() ||
+                orig_chunks_json->getElement<std::string>(i) == HOLE_CHUNK_ID) {
+            return false;
+        }
+        std::string tail_id = orig_chunks_json->getElement<std::string>(i);
+        int64_t version = versions_json->optValue<int64_t>(tail_id, 0) + 1;
+        JSON::Array::Ptr servers_json = chunk_servers_json->getArray(tail_id);
+        JSON::Array::Ptr appended_json(new JSON::Array);
+        for(int j=0; j<servers_json->size(); j++) {
+            JSON::Object::Ptr server_json = servers_json->getObject(j);
+            int resp_code = 0;
+            try {
+                resp_code = requestAppendChunk(server_json->getValue<std::string>("address"), tail_id, begin_pos % chunk_size, version, content);
+            } catch(Exception& e) {
+                app.logger().warning("Append to chunk " + tail_id + " failed: " + e.displayText());
+            }
+            if(resp_code == HTTPResponse::HTTP_OK) {
+                appended_json->add(server_json->getValue<std::string>("id"));
+            }
+        }
+        if(appended_json->size() == 0) {
+            return false;
+        }
+        if(appended_json->size() < servers_json->size()) {
+            all_ok = false;
+        }
+        appended_tail = tail_id;
+        updated_versions->set(tail_id, version);
+        appended_replicas->set(tail_id, appended_json);
+        return true;
+    }
+
+    // The write, set before the body is read. The uploading thread only reads them.
+    std::string filename;
+    int64_t begin_pos;
+    int64_t begin_chunks_idx;
+    int64_t chunk_size;
+    int64_t original_length;
+    std::string compression;
+    JSON::Array::Ptr orig_chunks_json;
+    JSON::Object::Ptr chunk_servers_json;
+    JSON::Object::Ptr versions_json;
+    SharedPtr<ReedSolomon> code;    // null unless the file is erasure-coded
+    bool dedup;
+    std::vector<std::pair<std::string, std::string>> chunk_servers;
+    int replica;
+
+    // Outcome of the uploads, read once the uploading thread is joined.
+    bool all_ok;     // Operation finished on every chunk servers
+    bool some_ok;    // At least one chunk server finished our operation for each chunks
+    std::string appended_tail;
+    // Chunks appended to in place, with their new version and the servers that took the append.
+    JSON::Object::Ptr updated_versions;
+    JSON::Object::Ptr appended_replicas;
+    // Deduplicated writes: the pieces uploaded or found stored so far, how many of them were
+    // stored already, and the servers that have the new ones.
+    std::set<std::string> placed;
+    int64_t reused;
+    JSON::Object::Ptr created_replicas;
+
+    // The chunks of a deduplicated file the write touches are patched and cut again at
+    // content-defined boundaries. A cut only depends on the bytes since the one before, so the
+    // region is cut as the body arrives and the finished pieces are uploaded in batches, like the
+    // chunks of other files.
+    void writeDeduplicated(AccessServer& server, JSON::Object::Ptr file_meta, std::istream& istr, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ContentChunker chunker(chunk_size);
+        size_t read_size = std::max<size_t>(chunker.max_size, 64*1024);
+
+        // The part of the region not cut yet.
+        std::vector<uint8_t> pending;
+        size_t read = readBody(istr, pending, read_size);
+        if(read == 0) {
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+            response.send();
+            return;
+        }
+        int64_t end_pos = begin_pos + (int64_t)read;
+        bool body_done = read < read_size;
+
+        orig_chunks_json = file_meta->getArray("chunks");
+        chunk_servers_json = file_meta->getObject("chunk_servers");
+        placed.clear();
+        reused = 0;
+        created_replicas = new JSON::Object;
+
+        std::vector<int64_t> offsets = chunkOffsets(file_meta);
+        std::vector<std::string> orig_ids;
+        for(unsigned int i=0; i<orig_chunks_json->size(); i++) {
+            orig_ids.push_back(orig_chunks_json->getElement<std::string>(i));
+        }
+        original_length = offsets.back();
+        // A write past the end first extends the file by a hole up to where it begins.
+        if(begin_pos > original_length) {
+            orig_ids.push_back(HOLE_CHUNK_ID);
+            offsets.push_back(begin_pos);
+        }
+        size_t chunk_num = orig_ids.size();
+        int64_t extended_length = offsets.back();
+
+        auto readOriginal = [&](size_t i, std::vector<uint8_t>& chunk) {
+            std::vector<std::string> addresses;
+            JSON::Array::Ptr servers_json = chunk_servers_json->getArray(orig_ids[i]);
+            for(unsigned int j=0; !servers_json.isNull() && j<servers_json->size(); j++) {
+                addresses.push_back(servers_json->getObject(j)->getValue<std::string>("address"));
+            }
+            if(!readReplicatedChunk(addresses, orig_ids[i], 0, offsets[i+1]-offsets[i], chunk)) {
+                app.logger().error("Chunk " + orig_ids[i] + " of " + filename + " is lost.");
+                return false;
+            }
+            return true;
+        };
+
+        // Chunks [first, last) are rewritten, `last` is known once the body ends. An append takes
+        // the last chunk along, it was only cut where the file ended. Holes at the edges of the
+        // region are split instead of read: the parts outside the write stay holes.
+        size_t first = 0;
+        size_t last = 0;
+        if(chunk_num > 0) {
+            first = std::upper_bound(offsets.begin(), offsets.begin() + chunk_num, std::min(begin_pos, extended_length-1)) - offsets.begin() - 1;
+        }
+        int64_t region_begin = offsets[first];
+        int64_t region_end = end_pos;
+        std::vector<uint8_t> first_chunk;
+        if(first < chunk_num && orig_ids[first] == HOLE_CHUNK_ID) {
+            region_begin = begin_pos;
+        } else if(first < chunk_num) {
+            if(!readOriginal(first, first_chunk)) {
+                response.setKeepAlive(false);
+                response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+                response.send();
+                return;
+            }
+            pending.insert(pending.begin(), first_chunk.begin(), first_chunk.begin() + (begin_pos - offsets[first]));
+        }
+
+        int64_t batch_limit = std::max(server.write_batch, chunk_size);
+        std::vector<PendingChunk> batch;
+        int64_t batch_bytes = 0;
+        std::vector<PendingChunk> uploading;
+        SharedPtr<Thread> uploader;
+        std::vector<std::string> chunk_ids;
+        std::vector<int64_t> lengths;
+        int64_t holes = 0;
+        try {
+            for(;;) {
+                if(body_done && chunk_num > 0) {
+                    last = std::upper_bound(offsets.begin(), offsets.begin() + chunk_num, std::min(end_pos, extended_length)-1) - offsets.begin();
+                    region_end = std::max(end_pos, offsets[last]);
+                    if(orig_ids[last-1] == HOLE_CHUNK_ID) {
+                        region_end = std::max(end_pos, offsets[last-1]);
+                    } else if(region_end > end_pos) {
+                        // The rest of the last chunk the write touches.
+                        std::vector<uint8_t> chunk;
+                        if(last-1 == first) {
+                            chunk.swap(first_chunk);
+                        } else if(!readOriginal(last-1, chunk)) {
+                            some_ok = false;
+                            break;
+                        }
+                        pending.insert(pending.end(), chunk.begin() + (end_pos - offsets[last-1]), chunk.end());
+                    }
+                }
+
+                // Pieces of zeros are kept as holes, they are neither looked up nor uploaded.
+                std::vector<size_t> cuts = chunker.splitPrefix(pending.data(), pending.size(), body_done);
+                size_t position = 0;
+                for(auto it=cuts.begin(); it!=cuts.end(); ++it) {
+                    PendingChunk piece;
+                    piece.index = (int64_t)chunk_ids.size();
+                    if(allZero(pending.data() + position, *it)) {
+                        piece.chunk_id = HOLE_CHUNK_ID;
+                        holes++;
+                    } else {
+                        piece.chunk_id = contentChunkId(pending.data() + position, *it);
+                        piece.content.assign(pending.begin() + position, pending.begin() + position + *it);
+                    }
+                    chunk_ids.push_back(piece.chunk_id);
+                    lengths.push_back((int64_t)*it);
+                    batch_bytes += (int64_t)piece.content.size();
+                    batch.push_back(std::move(piece));
+                    position += *it;
+                }
+                pending.erase(pending.begin(), pending.begin() + position);
+
+                if(batch_bytes >= batch_limit || (body_done && !batch.empty())) {
+                    if(!handOff(uploader, uploading, batch)) {
+                        break;
+                    }
+                    batch_bytes = 0;
+                }
+                if(body_done) {
+                    break;
                 }
+                read = readBody(istr, pending, read_size);
+                end_pos += (int64_t)read;
+                body_done = read < read_size;
             }
-            if(!chunk_some_ok) {
-                some_ok = false;
+        } catch(...) {
+            // The uploading thread works on this handler's state.
+            if(!uploader.isNull()) {
+                uploader->join();
             }
+            throw;
+        }
+        if(!uploader.isNull()) {
+            uploader->join();
+        }
+        if(!some_ok) {
+            // The rest of the body is left unread.
+            response.setKeepAlive(false);
+            response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+            response.send();
+            return;
+        }
 
+        app.logger().information("Wrote " + std::to_string(chunk_ids.size()) + " chunks of " + filename + ", " + std::to_string(reused) +
+            " of them already stored, " + std::to_string(holes) + " holes.");
+
+        JSON::Array::Ptr chunks_json(new JSON::Array);
+        JSON::Array::Ptr lengths_json(new JSON::Array);
+        for(size_t i=0; i<first; i++) {
+            chunks_json->add(orig_ids[i]);
+            lengths_json->add(offsets[i+1]-offsets[i]);
+        }
+        if(region_begin > offsets[first]) {
+            chunks_json->add(HOLE_CHUNK_ID);
+            lengths_json->add(region_begin - offsets[first]);
+        }
+        for(size_t i=0; i<chunk_ids.size(); i++) {
+            chunks_json->add(chunk_ids[i]);
+            lengths_json->add(lengths[i]);
+        }
+        if(last > first && region_end < offsets[last]) {
+            chunks_json->add(HOLE_CHUNK_ID);
+            lengths_json->add(offsets[last] - region_end);
+        }
+        for(size_t i=last; i<chunk_num; i++) {
+            chunks_json->add(orig_ids[i]);
+            lengths_json->add(offsets[i+1]-offsets[i]);
         }
 
-        if(some_ok) {
-            // commit and update chunk list
-            URI uri("http://"+meta_server_addr);
-            uri.setPath("/update_file_meta");
+        JSON::Object::Ptr update_json(new JSON::Object);
+        update_json->set("filename", filename);
+        update_json->set("length", std::max(extended_length, end_pos));
+        update_json->set("chunks", chunks_json);
+        update_json->set("chunk_lengths", lengths_json);
+        update_json->set("created_replicas", created_replicas);
+        if(requestUpdateFileMeta(server.meta_server_addr, update_json) != HTTPResponse::HTTP_OK) {
+            app.logger().information("Failed to update metadata of " + filename);
+            response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+            response.send();
+            return;
+        }
 
-            HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.send();
+    }
 
-            HTTPClientSession session(uri.getHost(), uri.getPort());
-            JSON::Object::Ptr req_json(new JSON::Object);
+    // Stores the pieces of a deduplicated write. A piece gets the hash of its content as id, and
+    // is only uploaded if no deduplicated file references it yet, or its replicas are short.
+    void uploadDeduplicated(std::vector<PendingChunk>& batch) {
+        Application& app = Application::instance();
+        AccessServer& server = dynamic_cast<AccessServer&>(app);
 
-            req_json->set("filename", filename);
-            if(end_pos > original_length) {
-                req_json->set("length", end_pos);
+        std::vector<std::string> unique_ids;
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            if(it->chunk_id != HOLE_CHUNK_ID && placed.find(it->chunk_id) == placed.end()) {
+                unique_ids.push_back(it->chunk_id);
+            }
+        }
+        std::sort(unique_ids.begin(), unique_ids.end());
+        unique_ids.erase(std::unique(unique_ids.begin(), unique_ids.end()), unique_ids.end());
+        std::map<std::string, std::vector<std::string>> stored;
+        try {
+            stored = requestLookupChunks(server.meta_server_addr, unique_ids);
+        } catch(Exception& e) {
+            app.logger().warning("Fingerprint lookup failed, uploading every chunk: " + e.displayText());
+        }
+
+        // A chunk already stored only gets the replicas it is short of, on other servers.
+        std::vector<std::string> chunk_ids;
+        std::vector<std::vector<uint8_t>> chunks;
+        std::map<std::vector<std::string>, std::vector<int64_t>> by_chain;
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            if(it->chunk_id == HOLE_CHUNK_ID) {
+                continue;
+            }
+            if(!placed.insert(it->chunk_id).second) {
+                reused++;
+                continue;
+            }
+            const std::vector<std::string>& holders = stored[it->chunk_id];
+            std::vector<std::string> chain;
+            std::vector<size_t> indexes;
+            for(size_t j=0; j<chunk_servers.size(); j++) {
+                indexes.push_back(j);
+            }
+            shuffleServers(indexes);
+            for(size_t j=0; j<indexes.size() && holders.size() + chain.size() < (size_t)replica; j++) {
+                const std::string& address = chunk_servers[indexes[j]].second;
+                if(std::find(holders.begin(), holders.end(), address) == holders.end()) {
+                    chain.push_back(address);
+                }
+            }
+            if(chain.empty()) {
+                if(holders.empty()) {
+                    some_ok = false;
+                }
+                reused++;
             } else {
-                req_json->set("length", original_length);
+                by_chain[chain].push_back((int64_t)chunks.size());
+                chunk_ids.push_back(it->chunk_id);
+                chunks.push_back(std::vector<uint8_t>());
+                chunks.back().swap(it->content);
             }
+        }
+
+        std::map<std::string, int> copies = createChunksOnChains(by_chain, chunk_ids, chunks, compression, all_ok, some_ok);
 
-            JSON::Array::Ptr chunks_json(new JSON::Array);
-            for(int i=0; i<begin_chunks_idx; i++) {
-                std::string chunk_id = orig_chunks_json->getElement<std::string>(i);
-                chunks_json->add(chunk_id);
+        // Servers that have the new chunks, so the next write of them finds them before the chunk
+        // servers report them.
+        std::map<std::string, std::string> address_ids;
+        for(auto it=chunk_servers.begin(); it!=chunk_servers.end(); ++it) {
+            address_ids[it->second] = it->first;
+        }
+        for(auto it=by_chain.begin(); it!=by_chain.end(); ++it) {
+            for(auto jt=it->second.begin(); jt!=it->second.end(); ++jt) {
+                const std::string& chunk_id = chunk_ids[*jt];
+                if(copies[chunk_id] < (int)it->first.size()) {
+                    // Not known which of the chain have it.
+                    continue;
+                }
+                JSON::Array::Ptr servers_json(new JSON::Array);
+                for(auto address=it->first.begin(); address!=it->first.end(); ++address) {
+                    servers_json->add(address_ids[*address]);
+                }
+                created_replicas->set(chunk_id, servers_json);
             }
-            for(int i=0; i < chunk_ids.size(); i++) {
-                chunks_json->add(chunk_ids[i]);
+        }
+    }
+};
+
+// Re-encode a replicated file as Reed-Solomon stripes and drop its replicas. Meant for the job
+// that moves files to erasure coding once they have gone cold: a write to the file while it is
+// being converted is lost.
+class ConvertFileRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        AccessServer& server = dynamic_cast<AccessServer&>(app);
+
+        std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
+        std::string filename = query_map["filename"];
+
+        int data_shards = 6;
+        int parity_shards = 3;
+        SharedPtr<ReedSolomon> code;
+        try {
+            if(query_map.find("data_shards") != query_map.end()) {
+                data_shards = std::stoi(query_map["data_shards"]);
             }
-            for(int i=begin_chunks_idx+chunks.size(); i<orig_chunks_json->size(); i++) {
-                std::string chunk_id = orig_chunks_json->getElement<std::string>(i);
-                chunks_json->add(chunk_id);
+            if(query_map.find("parity_shards") != query_map.end()) {
+                parity_shards = std::stoi(query_map["parity_shards"]);
             }
+            code = new ReedSolomon(data_shards, parity_shards);
+        } catch(std::exception& e) {
+            // Not a number, or a code GF(256) can't do.
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
 
-            req_json->set("chunks", chunks_json);
+        JSON::Object::Ptr file_meta = getFileMeta(server.meta_server_addr, filename);
+        if(file_meta.isNull()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
+            return;
+        }
+        // Chunks of a deduplicated file may be shared with other files, their replicas can't go.
+        if(file_meta->optValue<std::string>("layout", "replicated") != "replicated" || file_meta->optValue<bool>("dedup", false)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_CONFLICT);
+            response.send();
+            return;
+        }
 
-            req_json->stringify(session.sendRequest(request));
+        int64_t length = file_meta->getValue<int64_t>("length");
+        int64_t chunk_size = file_meta->getValue<int64_t>("chunk_size");
+        std::string compression = file_meta->optValue<std::string>("compression", "none");
+        JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+        JSON::Object::Ptr chunk_servers_json = file_meta->getObject("chunk_servers");
+        std::vector<std::pair<std::string, std::string>> chunk_servers = requestGetActiveChunkServersList(server.meta_server_addr);
 
-            HTTPResponse resp;
-            std::istream& resp_stream = session.receiveResponse(resp);
-            if(resp.getStatus() != HTTPResponse::HTTP_OK) {
-                app.logger().information("Failed to update metadata, response code: "+std::to_string(resp.getStatus()));
+        // Every stripe has to be complete before the replicas go.
+        JSON::Array::Ptr stripes_json(new JSON::Array);
+        UUIDGenerator uuidGen;
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            std::string chunk_id = chunks_json->getElement<std::string>(i);
+            int64_t chunk_length = std::max<int64_t>(0, std::min<int64_t>(chunk_size, length - i*chunk_size));
+            if(chunk_id == HOLE_CHUNK_ID) {
+                stripes_json->add(HOLE_CHUNK_ID);
+                continue;
+            }
 
+            std::vector<std::string> addresses;
+            JSON::Array::Ptr servers_json = chunk_servers_json->getArray(chunk_id);
+            for(unsigned int j=0; !servers_json.isNull() && j<servers_json->size(); j++) {
+                addresses.push_back(servers_json->getObject(j)->getValue<std::string>("address"));
+            }
+            std::vector<uint8_t> content;
+            if(!readReplicatedChunk(addresses, chunk_id, 0, chunk_length, content)) {
+                app.logger().error("Converting " + filename + ": chunk " + chunk_id + " is unreadable.");
                 response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
                 response.send();
                 return;
             }
 
-            response.setStatusAndReason(HTTPResponse::HTTP_OK);
-            response.send();
-        } else {
+            std::string stripe_id = uuidGen.createOne().toString();
+            int stored = writeStripe(*code, chooseStripeServers(chunk_servers, code->totalShards()), stripe_id, content, compression);
+            if(stored < code->totalShards()) {
+                app.logger().error("Converting " + filename + ": only " + std::to_string(stored) + " fragments of chunk " + chunk_id + " stored.");
+                response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+                response.send();
+                return;
+            }
+            stripes_json->add(stripe_id);
+        }
+
+        JSON::Object::Ptr update_json(new JSON::Object);
+        update_json->set("filename", filename);
+        update_json->set("chunks", stripes_json);
+        update_json->set("layout", "rs");
+        update_json->set("data_shards", data_shards);
+        update_json->set("parity_shards", parity_shards);
+        if(requestUpdateFileMeta(server.meta_server_addr, update_json) != HTTPResponse::HTTP_OK) {
             response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
             response.send();
+            return;
+        }
+
+        // The file now lives in its stripes, the replicas are garbage. One request per server.
+        std::map<std::string, std::vector<std::string>> by_server;
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            std::string chunk_id = chunks_json->getElement<std::string>(i);
+            JSON::Array::Ptr servers_json = chunk_servers_json->getArray(chunk_id);
+            for(unsigned int j=0; !servers_json.isNull() && j<servers_json->size(); j++) {
+                by_server[servers_json->getObject(j)->getValue<std::string>("address")].push_back(chunk_id);
+            }
+        }
+        for(auto it=by_server.begin(); it!=by_server.end(); ++it) {
+            try {
+                requestDeleteChunks(it->first, it->second);
+            } catch(Exception& e) {
+                app.logger().warning("Deleting " + std::to_string(it->second.size()) + " replicas on " + it->first + " failed: " + e.displayText());
+            }
+        }
+
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.setContentType("application/json");
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", "success");
+        resp_json->set("chunks", (int64_t)stripes_json->size());
+        resp_json->stringify(response.send());
+    }
+};
+
+// Scan a range of a file where its chunks are stored: query is filename, op ("lines", "histogram"
+// or "grep"), pattern, regex (true for a PCRE), max_matches, begin_pos and end_pos. Each chunk
+// server holding a replica evaluates the extents it is asked for and only the counts, matches and
+// the partial lines at the extents' edges come back, which are put together here.
+class ScanFileRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        AccessServer& server = dynamic_cast<AccessServer&>(app);
+
+        std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
+        std::string filename = query_map["filename"];
+
+        ScanQuery query;
+        SharedPtr<ScanMerger> merger;
+        int64_t begin_pos = 0;
+        int64_t end_pos = -1;
+        try {
+            if(!parseScanOp(query_map.count("op") ? query_map["op"] : "lines", query.op)) {
+                throw InvalidArgumentException("op");
+            }
+            query.pattern = query_map["pattern"];
+            query.regex = query_map["regex"] == "true" || query_map["regex"] == "1";
+            if(query_map.find("max_matches") != query_map.end()) {
+                query.max_matches = std::stoll(query_map["max_matches"]);
+            }
+            if(query_map.find("begin_pos") != query_map.end()) {
+                begin_pos = std::stoll(query_map["begin_pos"]);
+            }
+            if(query_map.find("end_pos") != query_map.end()) {
+                end_pos = std::stoll(query_map["end_pos"]);
+            }
+            merger = new ScanMerger(query);
+        } catch(std::exception& e) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        JSON::Object::Ptr file_meta = getFileMeta(server.meta_server_addr, filename);
+        if(file_meta.isNull()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
+            return;
+        }
+
+        JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+        JSON::Object::Ptr chunk_servers_json = file_meta->getObject("chunk_servers");
+        int64_t length = file_meta->getValue<int64_t>("length");
+        int64_t chunk_size = file_meta->getValue<int64_t>("chunk_size");
+        if(end_pos == -1 || end_pos > length) {
+            end_pos = length;
+        }
+        begin_pos = std::max<int64_t>(begin_pos, 0);
+
+        std::vector<int64_t> offsets = chunkOffsets(file_meta);
+        std::vector<ChunkExtent> extents;
+        std::vector<int64_t> positions;     // of the extents in the scanned range
+        std::vector<int64_t> chunk_lengths;
+        if(begin_pos < end_pos) {
+            auto chunk_begins_end = offsets.begin() + chunks_json->size();
+            int64_t first_chunk_idx = std::upper_bound(offsets.begin(), chunk_begins_end, begin_pos) - offsets.begin() - 1;
+            int64_t last_chunk_idx = std::upper_bound(offsets.begin(), chunk_begins_end, end_pos-1) - offsets.begin() - 1;
+            for(int64_t i=first_chunk_idx; i<=last_chunk_idx; i++) {
+                int64_t chunk_begin = offsets[i];
+                int64_t offset = std::max<int64_t>(begin_pos, chunk_begin) - chunk_begin;
+                int64_t extent = std::min<int64_t>(end_pos, offsets[i+1]) - chunk_begin - offset;
+                extents.push_back({chunks_json->getElement<std::string>((unsigned int)i), offset, extent});
+                positions.push_back(chunk_begin + offset - begin_pos);
+                chunk_lengths.push_back(offsets[i+1] - chunk_begin);
+            }
         }
 
+        if(file_meta->optValue<std::string>("layout", "replicated") == "rs") {
+            // No chunk server has a whole chunk of a stripe, so those are scanned here.
+            ReedSolomon code((int)file_meta->getValue<int64_t>("data_shards"), (int)file_meta->getValue<int64_t>("parity_shards"));
+            for(size_t i=0; i<extents.size(); i++) {
+                try {
+                    std::vector<uint8_t> content;
+                    if(extents[i].chunk_id == HOLE_CHUNK_ID) {
+                        content.assign((size_t)extents[i].length, 0);
+                    } else {
+                        content = readStripe(code, chunk_servers_json, extents[i].chunk_id, chunk_lengths[i], extents[i].offset, extents[i].length);
+                    }
+                    merger->add(positions[i], extents[i].length, scanExtent(query, content.data(), content.size()));
+                } catch(Exception& e) {
+                    app.logger().error("Chunk " + extents[i].chunk_id + " of " + filename + " is lost: " + e.displayText());
+                    response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+                    response.send();
+                    return;
+                }
+            }
+        } else {
+            // Like get_file: a window of chunks at a time, batched per first replica, with the
+            // extents a batch didn't scan retried on the other replicas.
+            size_t window = (size_t)std::max<int64_t>(BATCH_BYTES / chunk_size, 1);
+            for(size_t begin=0; begin<extents.size(); begin+=window) {
+                size_t end = std::min(extents.size(), begin+window);
+                std::vector<std::vector<std::string>> addresses(end-begin);
+                std::map<std::string, std::vector<size_t>> by_server;
+                for(size_t i=begin; i<end; i++) {
+                    JSON::Array::Ptr servers_json = chunk_servers_json->getArray(extents[i].chunk_id);
+                    int count = servers_json.isNull() ? 0 : (int)servers_json->size();
+                    int idx = count == 0 ? 0 : std::rand() % count;
+                    for(int j=0; j<count; j++) {
+                        addresses[i-begin].push_back(servers_json->getObject((idx + j) % count)->getValue<std::string>("address"));
+                    }
+                    if(count > 0) {
+                        by_server[addresses[i-begin].front()].push_back(i);
+                    }
+                }
+
+                std::vector<ScanResult> results(end-begin);
+                std::vector<bool> scanned(end-begin, false);
+                for(size_t i=begin; i<end; i++) {
+                    if(extents[i].chunk_id == HOLE_CHUNK_ID) {
+                        // Nothing stores a hole, its zeros are scanned here.
+                        std::vector<uint8_t> zeros((size_t)extents[i].length, 0);
+                        results[i-begin] = scanExtent(query, zeros.data(), zeros.size());
+                        scanned[i-begin] = true;
+                    }
+                }
+                for(auto it=by_server.begin(); it!=by_server.end(); ++it) {
+                    std::vector<ChunkExtent> batch;
+                    for(auto i=it->second.begin(); i!=it->second.end(); ++i) {
+                        batch.push_back(extents[*i]);
+                    }
+                    std::vector<ScanResult> batch_results;
+                    std::vector<bool> batch_scanned = requestScanChunks(it->first, query, batch, batch_results);
+                    for(size_t j=0; j<it->second.size(); j++) {
+                        results[it->second[j]-begin] = batch_results[j];
+                        scanned[it->second[j]-begin] = batch_scanned[j];
+                    }
+                }
+
+                for(size_t i=begin; i<end; i++) {
+                    for(size_t j=1; !scanned[i-begin] && j<addresses[i-begin].size(); j++) {
+                        std::vector<ScanResult> retry;
+                        if(requestScanChunks(addresses[i-begin][j], query, {extents[i]}, retry).front()) {
+                            results[i-begin] = retry.front();
+                            scanned[i-begin] = true;
+                        }
+                    }
+                    if(!scanned[i-begin]) {
+                        app.logger().error("Chunk " + extents[i].chunk_id + " of " + filename + " could not be scanned.");
+                        response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+                        response.send();
+                        return;
+                    }
+                    merger->add(positions[i], extents[i].length, results[i-begin]);
+                }
+            }
+        }
+        merger->finish();
+
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", "success");
+        resp_json->set("lines", merger->lines);
+        if(query.op == SCAN_HISTOGRAM) {
+            JSON::Array::Ptr histogram_json(new JSON::Array);
+            for(auto it=merger->histogram.begin(); it!=merger->histogram.end(); ++it) {
+                histogram_json->add(*it);
+            }
+            resp_json->set("histogram", histogram_json);
+        } else if(query.op == SCAN_GREP) {
+            JSON::Array::Ptr matches_json(new JSON::Array);
+            for(auto it=merger->matches.begin(); it!=merger->matches.end(); ++it) {
+                JSON::Object::Ptr match_json(new JSON::Object);
+                match_json->set("line", it->line);
+                match_json->set("offset", begin_pos + it->offset);
+                match_json->set("text", it->text);
+                matches_json->add(match_json);
+            }
+            resp_json->set("matches", matches_json);
+            resp_json->set("truncated", merger->truncated);
+        }
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.setContentType("application/json");
+        resp_json->stringify(response.send());
     }
 };
 
 AccessServer::AccessServer() {
     help_requested = false;
+    admission = nullptr;
+    thread_pool = nullptr;
+    read_concurrency = 8;
+    read_window = 64*1024*1024;
+    write_batch = 16*1024*1024;
+    rs_min_parity = -1;
     request_handler_factory = new AccessServerRequestHandlerFactory(this);
 }
 
 AccessServer::~AccessServer() {
     delete request_handler_factory;
+    delete thread_pool;
+    delete admission;
 }
 
 void AccessServer::initialize(Application& self) {
@@ -412,6 +1375,13 @@ int AccessServer::main(const std::vector<std::string>& args) {
     SocketAddress listen_addr(port);
     server_id = Environment::nodeName() + ":" + std::to_string(listen_addr.port());
     meta_server_addr = config().getString("AccessServer.meta_server_address", "");
+    read_concurrency = std::max(config().getInt("AccessServer.read_concurrency", 8), 1);
+    read_window = std::max<int64_t>(config().getInt64("AccessServer.read_window", 64*1024*1024), 1);
+    write_batch = std::max<int64_t>(config().getInt64("AccessServer.write_batch", 16*1024*1024), 1);
+    rs_min_parity = config().getInt("AccessServer.rs_min_parity", -1);
+    if(rs_min_parity == 0) {
+        rs_min_parity = 1;
+    }
 
     logger().information("DistFS AccessServer " + server_id + " starting...");
     logger().information("Metadata server address: " + meta_server_addr);
@@ -419,8 +1389,32 @@ int AccessServer::main(const std::vector<std::string>& args) {
         logger().warning("Metadata Server not defined, use -m \"ADDRESS:PORT\" to set metadata server address.");
     }
 
+    // Requests past the limits are answered with 503 and Retry-After before they are handled.
+    AdmissionLimits limits;
+    if(!loadAdmissionLimits(config(), "AccessServer", limits)) {
+        logger().error("client_quotas is a comma separated list of \"client ops_per_second bytes_per_second\".");
+        return Application::EXIT_CONFIG;
+    }
+    admission = new AdmissionControl(limits);
+    // The chunk servers charge the reads and writes made for a client to that client.
+    admission->forward_client = true;
+
+    // Connections to the other servers are kept for the next request.
+    SessionPool::instance().configure(config(), "AccessServer");
+
+    // Up to max_queued connections wait for one of the threads, more are dropped.
+    int threads = std::max(config().getInt("AccessServer.threads", 16), 1);
+    HTTPServerParams* params = new HTTPServerParams;
+    params->setMaxThreads(threads);
+    params->setMaxQueued(config().getInt("AccessServer.max_queued", 64));
+    // An idle connection of another server's pool holds a thread until keep_alive_timeout, which
+    // has to be above their pool_idle_timeout.
+    params->setKeepAliveTimeout(Timespan(std::max(config().getInt("AccessServer.keep_alive_timeout", 5), 1), 0));
+    thread_pool = new ThreadPool(std::min(threads, 2), threads);
+
     ServerSocket server_socket(listen_addr);
-    http_server = new HTTPServer(request_handler_factory, server_socket, new HTTPServerParams);
+    http_server = new HTTPServer(new KeepAliveRequestHandlerFactory(*request_handler_factory), *thread_pool, server_socket, params);
+    admission->tcp_server = http_server;
 
     http_server->start();
     waitForTerminationRequest();
@@ -448,10 +1442,15 @@ HTTPRequestHandler* AccessServerRequestHandlerFactory::createRequestHandler(cons
     if(uri.getPath() == "/ping") {
         return new PingRequestHandler();
     } else if(uri.getPath() == "/get_file") {
-        return new GetFileRequestHandler();
+        return server->admission->admit(request, new GetFileRequestHandler());
     } else if(uri.getPath() == "/write_file") {
-        return new WriteFileRequestHandler();
+        return server->admission->admit(request, new WriteFileRequestHandler());
+    } else if(uri.getPath() == "/convert_file") {
+        return server->admission->admit(request, new ConvertFileRequestHandler());
+    } else if(uri.getPath() == "/scan_file") {
+        return server->admission->admit(request, new ScanFileRequestHandler());
     }
+    return nullptr;
 }
 
 }
\ No newline at end of file
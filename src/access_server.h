@@ -2,6 +2,9 @@
 #define DISTFS_ACCESS_SERVER_H
 
 #include "common.h"
+#include "admission.h"
+
+#include <Poco/ThreadPool.h>
 
 namespace DistFS {
 
@@ -18,6 +21,15 @@ public:
     virtual ~AccessServer();
 
     std::string meta_server_addr;
+    AdmissionControl* admission;
+    // Requests a read has under way at a time, and bytes it fetches ahead of the client.
+    int read_concurrency;
+    int64_t read_window;
+    // Bytes of a write received while the previous batch is uploaded.
+    int64_t write_batch;
+    // Parity fragments a stripe needs stored, on top of its data fragments, for a write of an
+    // erasure coded file to succeed. At least 1, -1 for all of them.
+    int rs_min_parity;
 
 protected:
     void initialize(Application& self) override;
@@ -30,6 +42,7 @@ protected:
     std::string server_id;
     bool help_requested;
 
+    ThreadPool* thread_pool;
     HTTPServer* http_server;
     AccessServerRequestHandlerFactory* request_handler_factory;
 };
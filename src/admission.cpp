@@ -0,0 +1,289 @@
+#include "admission.h"
+
+#include <Poco/StringTokenizer.h>
+#include <algorithm>
+#include <cmath>
+
+namespace DistFS {
+
+namespace {
+
+// Past this many clients, the ones with full buckets are forgotten.
+const size_t MAX_IDLE_CLIENTS = 4096;
+
+// Bytes the handler on this thread has streamed, null outside of admitted handlers.
+thread_local int64_t* thread_streamed = nullptr;
+
+// Counts the streamed bytes of the calling thread's handler while it lives.
+class StreamedScope {
+public:
+    StreamedScope(int64_t& bytes): previous(thread_streamed) {
+        thread_streamed = &bytes;
+    }
+    ~StreamedScope() {
+        thread_streamed = previous;
+    }
+private:
+    int64_t* previous;
+};
+
+// Runs an admitted request, releases its share of the server when it is deleted.
+class AdmittedRequestHandler: public HTTPRequestHandler {
+public:
+    AdmittedRequestHandler(AdmissionControl& control, HTTPRequestHandler* handler, const std::string& client, int64_t bytes):
+        control(control), handler(handler), client(client), bytes(bytes) {
+    }
+
+    ~AdmittedRequestHandler() {
+        delete handler;
+        control.release(bytes);
+    }
+
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        int64_t streamed = 0;
+        {
+            StreamedScope streamed_scope(streamed);
+            ClientScope client_scope(control.forward_client ? client : std::string());
+            handler->handleRequest(request, response);
+        }
+        // A request is charged what it said when it was admitted, and the rest once it is known.
+        int64_t sent = response.getContentLength64();
+        int64_t used = std::max<int64_t>(streamed, sent != HTTPMessage::UNKNOWN_CONTENT_LENGTH ? sent : 0);
+        if(!client.empty() && used > bytes) {
+            control.charge(client, used - bytes);
+        }
+    }
+
+protected:
+    AdmissionControl& control;
+    HTTPRequestHandler* handler;
+    std::string client;
+    int64_t bytes;
+};
+
+// The body isn't read, so the connection is closed after the answer.
+class RejectedRequestHandler: public HTTPRequestHandler {
+public:
+    RejectedRequestHandler(const std::string& status, int retry_after): status(status), retry_after(retry_after) {
+    }
+
+    void handleRequest(HTTPServerRequest&, HTTPServerResponse& response) override {
+        response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+        response.set("Retry-After", std::to_string(std::max(retry_after, 1)));
+        response.setKeepAlive(false);
+        response.setContentType("application/json");
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", status);
+        resp_json->set("retry_after", std::max(retry_after, 1));
+        resp_json->stringify(response.send());
+    }
+
+protected:
+    std::string status;
+    int retry_after;
+};
+
+}
+
+bool parseClientQuotas(const std::string& text, std::map<std::string, std::pair<double, int64_t>>& quotas) {
+    StringTokenizer entries(text, ",", StringTokenizer::TOK_TRIM|StringTokenizer::TOK_IGNORE_EMPTY);
+    for(auto it=entries.begin(); it!=entries.end(); ++it) {
+        StringTokenizer fields(*it, " \t", StringTokenizer::TOK_TRIM|StringTokenizer::TOK_IGNORE_EMPTY);
+        if(fields.count() != 3) {
+            return false;
+        }
+        try {
+            quotas[fields[0]] = std::make_pair(std::stod(fields[1]), (int64_t)std::stoll(fields[2]));
+        } catch(std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadAdmissionLimits(const AbstractConfiguration& config, const std::string& prefix, AdmissionLimits& limits) {
+    // Below the server's own queue limit, past which connections are dropped without an answer.
+    limits.max_queued = config.getInt(prefix + ".max_queued_requests", config.getInt(prefix + ".max_queued", 64) / 2);
+    limits.max_inflight_bytes = config.getInt64(prefix + ".max_inflight_bytes", 512*1024*1024);
+    limits.client_ops = config.getDouble(prefix + ".client_ops_per_second", 0);
+    limits.client_bytes = config.getInt64(prefix + ".client_bytes_per_second", 0);
+    limits.burst = std::max(config.getDouble(prefix + ".client_burst", 1), 0.001);
+    limits.retry_after = std::max(config.getInt(prefix + ".retry_after", 1), 1);
+    limits.cluster_secret = config.getString(prefix + ".cluster_secret", "");
+    return parseClientQuotas(config.getString(prefix + ".client_quotas", ""), limits.client_quotas);
+}
+
+AdmissionControl::AdmissionControl(const AdmissionLimits& limits):
+    tcp_server(nullptr),
+    forward_client(false),
+    limits(limits),
+    inflight(0),
+    inflight_bytes(0)
+{
+}
+
+bool AdmissionControl::fromCluster(const HTTPServerRequest& request) const {
+    const std::string& secret = limits.cluster_secret;
+    const std::string& given = request.get("X-DistFS-Cluster-Secret", "");
+    if(secret.empty() || given.size() != secret.size()) {
+        return false;
+    }
+    // Without an early exit, so the time taken doesn't tell how much of it matched.
+    unsigned char diff = 0;
+    for(size_t i=0; i<secret.size(); i++) {
+        diff |= (unsigned char)(secret[i] ^ given[i]);
+    }
+    return diff == 0;
+}
+
+std::string AdmissionControl::clientName(const HTTPServerRequest& request) const {
+    if(fromCluster(request)) {
+        return request.get("X-DistFS-Client", "");
+    }
+    return request.clientAddress().host().toString();
+}
+
+int64_t AdmissionControl::requestBytes(const HTTPServerRequest& request) {
+    if(request.getContentLength64() > 0) {
+        return request.getContentLength64();
+    }
+    try {
+        std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
+        if(query_map.find("length") != query_map.end()) {
+            return std::max<int64_t>(0, std::stoll(query_map["length"]));
+        }
+        if(query_map.find("begin_pos") != query_map.end() && query_map.find("end_pos") != query_map.end()) {
+            return std::max<int64_t>(0, std::stoll(query_map["end_pos"]) - std::stoll(query_map["begin_pos"]));
+        }
+    } catch(std::exception&) {
+        // The handler answers malformed requests.
+    }
+    return 0;
+}
+
+HTTPRequestHandler* AdmissionControl::admit(const HTTPServerRequest& request, HTTPRequestHandler* handler) {
+    std::string client = clientName(request);
+    int64_t bytes = requestBytes(request);
+    int queued = tcp_server != nullptr ? tcp_server->queuedConnections() : 0;
+
+    std::string rejected;
+    int retry_after = limits.retry_after;
+    {
+        ScopedLock<Mutex> lock(mutex);
+        // A single request larger than the limit still runs on an idle server.
+        if((limits.max_queued > 0 && queued >= limits.max_queued) ||
+                (limits.max_inflight_bytes > 0 && inflight > 0 && inflight_bytes + bytes > limits.max_inflight_bytes)) {
+            counters.overloaded++;
+            rejected = "overloaded";
+        } else if(!client.empty() && (retry_after = take(client, bytes)) > 0) {
+            counters.throttled++;
+            rejected = "throttled";
+        } else {
+            counters.admitted++;
+            inflight++;
+            inflight_bytes += bytes;
+        }
+    }
+    if(!rejected.empty()) {
+        delete handler;
+        return new RejectedRequestHandler(rejected, rejected == "overloaded" ? limits.retry_after : retry_after);
+    }
+    return new AdmittedRequestHandler(*this, handler, client, bytes);
+}
+
+void AdmissionControl::streamed(int64_t bytes) {
+    if(thread_streamed != nullptr) {
+        *thread_streamed += bytes;
+    }
+}
+
+void AdmissionControl::release(int64_t bytes) {
+    ScopedLock<Mutex> lock(mutex);
+    inflight--;
+    inflight_bytes -= bytes;
+}
+
+void AdmissionControl::charge(const std::string& client, int64_t bytes) {
+    ScopedLock<Mutex> lock(mutex);
+    auto it = buckets.find(client);
+    if(it != buckets.end() && it->second.bytes_rate > 0) {
+        refill(it->second);
+        it->second.bytes -= (double)bytes;
+    }
+}
+
+AdmissionControl::Stats AdmissionControl::stats() {
+    ScopedLock<Mutex> lock(mutex);
+    Stats result = counters;
+    result.inflight = inflight;
+    result.inflight_bytes = inflight_bytes;
+    result.clients = (int)buckets.size();
+    return result;
+}
+
+void AdmissionControl::refill(Bucket& bucket) {
+    double seconds = (double)bucket.refilled.elapsed() / 1e6;
+    bucket.refilled.update();
+    // Whatever the rate, a client can always save up for one request.
+    bucket.ops = std::min(std::max(bucket.ops_rate * limits.burst, 1.0), bucket.ops + seconds * bucket.ops_rate);
+    bucket.bytes = std::min(bucket.bytes_rate * limits.burst, bucket.bytes + seconds * bucket.bytes_rate);
+}
+
+int AdmissionControl::take(const std::string& client, int64_t bytes) {
+    auto it = buckets.find(client);
+    if(it == buckets.end()) {
+        double ops_rate = limits.client_ops;
+        double bytes_rate = (double)limits.client_bytes;
+        auto quota = limits.client_quotas.find(client);
+        if(quota != limits.client_quotas.end()) {
+            ops_rate = quota->second.first;
+            bytes_rate = (double)quota->second.second;
+        }
+        if(ops_rate <= 0 && bytes_rate <= 0) {
+            return 0;
+        }
+        if(buckets.size() >= MAX_IDLE_CLIENTS) {
+            forgetIdle();
+        }
+        Bucket& bucket = buckets[client];
+        bucket.ops_rate = std::max(ops_rate, 0.0);
+        bucket.bytes_rate = std::max(bytes_rate, 0.0);
+        bucket.ops = std::max(bucket.ops_rate * limits.burst, 1.0);
+        bucket.bytes = bucket.bytes_rate * limits.burst;
+        it = buckets.find(client);
+    }
+
+    Bucket& bucket = it->second;
+    refill(bucket);
+    double wait = 0;
+    if(bucket.ops_rate > 0 && bucket.ops < 1) {
+        wait = std::max(wait, (1 - bucket.ops) / bucket.ops_rate);
+    }
+    if(bucket.bytes_rate > 0 && bucket.bytes < 0) {
+        wait = std::max(wait, -bucket.bytes / bucket.bytes_rate);
+    }
+    if(wait > 0) {
+        return (int)std::ceil(wait);
+    }
+    if(bucket.ops_rate > 0) {
+        bucket.ops -= 1;
+    }
+    if(bucket.bytes_rate > 0) {
+        bucket.bytes -= (double)bytes;
+    }
+    return 0;
+}
+
+void AdmissionControl::forgetIdle() {
+    for(auto it=buckets.begin(); it!=buckets.end();) {
+        Bucket& bucket = it->second;
+        refill(bucket);
+        if(bucket.ops >= std::max(bucket.ops_rate * limits.burst, 1.0) && bucket.bytes >= bucket.bytes_rate * limits.burst) {
+            it = buckets.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
@@ -0,0 +1,118 @@
+#ifndef DISTFS_ADMISSION_H
+#define DISTFS_ADMISSION_H
+
+#include "common.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
+#include <Poco/Net/TCPServer.h>
+#include <map>
+
+namespace DistFS {
+
+using namespace Poco;
+using namespace Poco::Net;
+
+// What an AdmissionControl enforces. 0 turns a limit off.
+struct AdmissionLimits {
+    int max_queued = 0;                 // connections waiting for a server thread
+    int64_t max_inflight_bytes = 0;     // bytes the admitted requests carry or ask for
+    double client_ops = 0;              // requests per second of every client
+    int64_t client_bytes = 0;           // bytes per second of every client
+    double burst = 1;                   // seconds of quota a client can spend at once
+    int retry_after = 1;                // seconds an overloaded server asks clients to wait
+    // Quotas of particular clients instead of client_ops and client_bytes.
+    std::map<std::string, std::pair<double, int64_t>> client_quotas;
+    // Requests carrying it in X-DistFS-Cluster-Secret come from the servers of the cluster. Empty
+    // trusts no one.
+    std::string cluster_secret;
+};
+
+// Parses "client ops bytes, client ops bytes, ..." into `quotas`. Returns false if an entry
+// isn't three fields.
+bool parseClientQuotas(const std::string& text, std::map<std::string, std::pair<double, int64_t>>& quotas);
+
+// Reads the limits from `prefix`.max_queued_requests, .max_inflight_bytes, .client_ops_per_second,
+// .client_bytes_per_second, .client_burst, .client_quotas, .retry_after and .cluster_secret.
+// Returns false if client_quotas doesn't parse.
+bool loadAdmissionLimits(const AbstractConfiguration& config, const std::string& prefix, AdmissionLimits& limits);
+
+// Turns requests away before they are handled, with 503 and a Retry-After, when the server is
+// behind (too many connections queued for a thread, or too many bytes in flight) or their client
+// has used up its quota. A client is named by its address. Only a server of the cluster, proven
+// by the cluster secret, can name the client it asks for with an X-DistFS-Client header; its
+// requests that don't are the cluster's own, such as chain replication, and have no quota.
+//
+// Quotas are token buckets of requests and bytes per client. The bytes of a request are charged
+// when it is admitted if it says how many (a body's Content-Length, or the range it reads). When
+// it is done, the handler's streamed() bytes or the response's known length are charged past
+// that; a client in debt waits until its bucket has refilled past zero.
+class AdmissionControl {
+public:
+    AdmissionControl(const AdmissionLimits& limits);
+
+    // The server whose queue is watched, set once it exists.
+    const TCPServer* tcp_server;
+    // Whether the requests an admitted handler makes to other servers are made for its client,
+    // with a ClientScope. False for servers whose own requests are the cluster's.
+    bool forward_client;
+
+    // The handler to run for `request`: `handler` if it is admitted, and released when the handler
+    // is deleted, a handler answering 503 otherwise (and `handler` is deleted).
+    HTTPRequestHandler* admit(const HTTPServerRequest& request, HTTPRequestHandler* handler);
+
+    struct Stats {
+        UInt64 admitted = 0;
+        UInt64 overloaded = 0;      // rejected for the server's sake
+        UInt64 throttled = 0;       // rejected for a client's quota
+        int inflight = 0;
+        int64_t inflight_bytes = 0;
+        int clients = 0;
+    };
+    Stats stats();
+
+    // Whether the request comes from a server of the cluster.
+    bool fromCluster(const HTTPServerRequest& request) const;
+    // Empty for the cluster's own requests.
+    std::string clientName(const HTTPServerRequest& request) const;
+    // Bytes the request carries or asks for, 0 if it doesn't say.
+    static int64_t requestBytes(const HTTPServerRequest& request);
+
+    // Counts `bytes` of a body the calling thread's admitted handler has read or sent, for
+    // requests and responses of unknown length.
+    static void streamed(int64_t bytes);
+
+    // Called by the admitted handlers.
+    void charge(const std::string& client, int64_t bytes);
+    void release(int64_t bytes);
+
+protected:
+    struct Bucket {
+        double ops_rate = 0;
+        double bytes_rate = 0;
+        double ops = 0;
+        double bytes = 0;
+        Timestamp refilled;
+    };
+
+    Bucket& bucket(const std::string& client);
+    void refill(Bucket& bucket);
+    // Seconds until `client` may send a request of `bytes`, 0 if it may now (and it is charged).
+    int take(const std::string& client, int64_t bytes);
+    // Forgets the clients whose buckets are full again.
+    void forgetIdle();
+
+    AdmissionLimits limits;
+    Mutex mutex;
+    std::map<std::string, Bucket> buckets;
+    int inflight;
+    int64_t inflight_bytes;
+    Stats counters;
+
+private:
+    AdmissionControl(const AdmissionControl&);
+    AdmissionControl& operator = (const AdmissionControl&);
+};
+
+}
+#endif
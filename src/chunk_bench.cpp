@@ -0,0 +1,185 @@
+#include "chunk_bench.h"
+#include "chunk_server.h"
+#include "chunk_codec.h"
+
+#include <Poco/Thread.h>
+#include <Poco/Timestamp.h>
+#include <Poco/UUIDGenerator.h>
+#include <Poco/MemoryStream.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+
+namespace DistFS {
+
+namespace {
+
+// The latency at `fraction` of the sorted latencies, nearest rank.
+int64_t percentile(const std::vector<int64_t>& sorted, double fraction) {
+    if(sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * (double)sorted.size() + 0.999999);
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+}
+
+ChunkBenchmark::ChunkBenchmark(ChunkServer& server, const BenchConfig& config): server(server), config(config) {
+    run_id = UUIDGenerator().createRandom().toString();
+}
+
+std::string ChunkBenchmark::chunkId(int64_t index) const {
+    return "bench-" + run_id + "-" + std::to_string(index);
+}
+
+std::string ChunkBenchmark::updatedId(int64_t index) const {
+    return chunkId(index) + "-updated";
+}
+
+std::vector<BenchStats> ChunkBenchmark::run() {
+    std::vector<BenchStats> results;
+    std::default_random_engine random(std::random_device{}());
+
+    for(auto size=config.chunk_sizes.begin(); size!=config.chunk_sizes.end(); ++size) {
+        // Random bytes, compression gets nothing out of them.
+        content.resize((size_t)*size);
+        for(size_t i=0; i<content.size(); i++) {
+            content[i] = (uint8_t)random();
+        }
+        patch.assign(content.begin(), content.begin() + std::min<int64_t>(config.update_size, *size));
+        std::reverse(patch.begin(), patch.end());
+
+        for(auto threads=config.concurrency.begin(); threads!=config.concurrency.end(); ++threads) {
+            const char* operations[] = {"create", "get", "update", "delete"};
+            for(int i=0; i<4; i++) {
+                BenchStats stats = phase(operations[i], *size, *threads);
+                server.logger().information("Bench " + stats.operation + " " + std::to_string(*size) + " bytes x" +
+                    std::to_string(*threads) + ": " + std::to_string((int64_t)(stats.operations / std::max(stats.seconds, 1e-9))) + " ops/s");
+                results.push_back(stats);
+            }
+            // The updated chunks aren't part of any measurement.
+            for(int64_t i=0; i<config.operations; i++) {
+                server.chunk_store->remove(chunkId(i));
+                server.chunk_store->remove(updatedId(i));
+            }
+        }
+    }
+    return results;
+}
+
+BenchStats ChunkBenchmark::phase(const std::string& operation, int64_t chunk_size, int concurrency) {
+    BenchStats stats;
+    stats.operation = operation;
+    stats.chunk_size = chunk_size;
+    stats.concurrency = concurrency;
+    stats.operations = config.operations;
+
+    std::atomic<int64_t> next(0);
+    std::atomic<int64_t> errors(0);
+    std::atomic<int64_t> bytes(0);
+    std::vector<std::vector<int64_t>> latencies(concurrency);
+
+    Timestamp started;
+    std::vector<SharedPtr<Thread>> threads;
+    for(int t=0; t<concurrency; t++) {
+        threads.push_back(new Thread);
+        std::vector<int64_t>* thread_latencies = &latencies[t];
+        threads.back()->startFunc([&, thread_latencies]() {
+            IoScheduler::Scope io_scope(operation == "get" ? IO_INTERACTIVE : IO_WRITE);
+            for(int64_t i=next++; i<config.operations; i=next++) {
+                Timestamp op_started;
+                int64_t moved = -1;
+                try {
+                    moved = execute(operation, i, chunk_size);
+                } catch(Exception& e) {
+                    server.logger().warning("Bench " + operation + " of " + chunkId(i) + " failed: " + e.displayText());
+                }
+                thread_latencies->push_back(op_started.elapsed());
+                if(moved < 0) {
+                    errors++;
+                } else {
+                    bytes += moved;
+                }
+            }
+        });
+    }
+    for(auto it=threads.begin(); it!=threads.end(); ++it) {
+        (*it)->join();
+    }
+    stats.seconds = (double)started.elapsed() / 1e6;
+    stats.errors = errors;
+    stats.bytes = bytes;
+    for(auto it=latencies.begin(); it!=latencies.end(); ++it) {
+        stats.latencies.insert(stats.latencies.end(), it->begin(), it->end());
+    }
+    return stats;
+}
+
+int64_t ChunkBenchmark::execute(const std::string& operation, int64_t index, int64_t chunk_size) {
+    ChunkStore& store = *server.chunk_store;
+    if(operation == "create") {
+        // As create_chunk stores it.
+        if(config.codec != CODEC_NONE) {
+            server.storeChunk(chunkId(index), content, config.codec);
+        } else {
+            MemoryInputStream istr((const char*)content.data(), content.size());
+            store.create(chunkId(index), istr);
+        }
+        return chunk_size;
+    } else if(operation == "get") {
+        std::vector<uint8_t> read;
+        if(server.readChunk(chunkId(index), 0, -1, read) != HTTPResponse::HTTP_OK || (int64_t)read.size() != chunk_size) {
+            return -1;
+        }
+        return chunk_size;
+    } else if(operation == "update") {
+        // As update_chunk writes a new version next to the original.
+        int64_t begin_pos = (chunk_size - (int64_t)patch.size()) / 2;
+        ChunkMeta meta;
+        if(!store.meta(chunkId(index), meta)) {
+            return -1;
+        }
+        if(meta.codec != CODEC_NONE) {
+            std::vector<uint8_t> data = decompressChunk(meta.codec, store.read(chunkId(index), 0, meta.size), meta.uncompressed_size);
+            std::copy(patch.begin(), patch.end(), data.begin() + begin_pos);
+            server.storeChunk(updatedId(index), data, meta.codec);
+        } else if(!store.update(chunkId(index), updatedId(index), begin_pos, patch)) {
+            return -1;
+        }
+        return (int64_t)patch.size();
+    } else {
+        return store.remove(chunkId(index)) ? 0 : -1;
+    }
+}
+
+JSON::Object::Ptr ChunkBenchmark::toJSON(BenchStats& stats) {
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    double seconds = std::max(stats.seconds, 1e-9);
+    int64_t total = 0;
+    for(auto it=stats.latencies.begin(); it!=stats.latencies.end(); ++it) {
+        total += *it;
+    }
+
+    JSON::Object::Ptr latency_json(new JSON::Object);
+    latency_json->set("mean", stats.latencies.empty() ? 0 : total / (int64_t)stats.latencies.size());
+    latency_json->set("p50", percentile(stats.latencies, 0.5));
+    latency_json->set("p90", percentile(stats.latencies, 0.9));
+    latency_json->set("p99", percentile(stats.latencies, 0.99));
+    latency_json->set("p999", percentile(stats.latencies, 0.999));
+    latency_json->set("max", stats.latencies.empty() ? 0 : stats.latencies.back());
+
+    JSON::Object::Ptr json(new JSON::Object);
+    json->set("operation", stats.operation);
+    json->set("chunk_size", stats.chunk_size);
+    json->set("concurrency", stats.concurrency);
+    json->set("operations", stats.operations);
+    json->set("errors", stats.errors);
+    json->set("seconds", stats.seconds);
+    json->set("iops", (double)(stats.operations - stats.errors) / seconds);
+    json->set("bytes_per_second", (double)stats.bytes / seconds);
+    json->set("latency_us", latency_json);
+    return json;
+}
+
+}
@@ -0,0 +1,65 @@
+#ifndef DISTFS_CHUNK_BENCH_H
+#define DISTFS_CHUNK_BENCH_H
+
+#include "common.h"
+
+#include <cstdint>
+
+namespace DistFS {
+
+using namespace Poco;
+
+class ChunkServer;
+
+// What `difscs --bench` runs: every chunk size with every concurrency level.
+struct BenchConfig {
+    std::vector<int64_t> chunk_sizes;
+    std::vector<int> concurrency;
+    int64_t operations = 1000;      // per operation, size and concurrency
+    int64_t update_size = 4096;     // bytes an update overwrites in the middle of the chunk
+    UInt8 codec = 0;                // chunks are created compressed with it
+};
+
+// Latencies of one operation at one size and concurrency, in microseconds.
+struct BenchStats {
+    std::string operation;
+    int64_t chunk_size = 0;
+    int concurrency = 0;
+    int64_t operations = 0;
+    int64_t errors = 0;
+    int64_t bytes = 0;
+    double seconds = 0;
+    std::vector<int64_t> latencies;
+};
+
+// Drives the chunk server's own create, get, update and delete paths against its configured
+// store: the same store calls, I/O classes and sync queue the request handlers use, without the
+// network. Each round creates `operations` chunks, reads them back, updates each into a new
+// chunk and deletes the originals; the updated chunks are removed untimed afterwards.
+class ChunkBenchmark {
+public:
+    ChunkBenchmark(ChunkServer& server, const BenchConfig& config);
+
+    std::vector<BenchStats> run();
+
+    // {"operation", "chunk_size", "concurrency", "operations", "errors", "seconds", "iops",
+    // "bytes_per_second", "latency_us": {"mean", "p50", "p90", "p99", "p999", "max"}}
+    static JSON::Object::Ptr toJSON(BenchStats& stats);
+
+protected:
+    // Runs `operation` on chunks 0 .. operations-1 over `concurrency` threads.
+    BenchStats phase(const std::string& operation, int64_t chunk_size, int concurrency);
+    // Returns the bytes moved, throws or returns -1 on failure.
+    int64_t execute(const std::string& operation, int64_t index, int64_t chunk_size);
+    std::string chunkId(int64_t index) const;
+    std::string updatedId(int64_t index) const;
+
+    ChunkServer& server;
+    BenchConfig config;
+    std::string run_id;
+    std::vector<uint8_t> content;
+    std::vector<uint8_t> patch;
+};
+
+}
+#endif
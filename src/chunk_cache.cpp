@@ -0,0 +1,221 @@
+#include "chunk_cache.h"
+
+#include <functional>
+
+namespace DistFS {
+
+FrequencySketch::FrequencySketch(size_t width) {
+    size_t size = 16;
+    while(size < width) {
+        size <<= 1;
+    }
+    counters.assign(size * DEPTH, 0);
+    mask = size - 1;
+    additions = 0;
+    sample_size = size * 10;
+}
+
+size_t FrequencySketch::index(size_t hash, int row) const {
+    static const uint64_t seeds[DEPTH] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+    };
+    uint64_t h = ((uint64_t)hash + seeds[row]) * seeds[(row + 1) % DEPTH];
+    h ^= h >> 32;
+    return (size_t)row * (mask + 1) + ((size_t)h & mask);
+}
+
+void FrequencySketch::increment(size_t hash) {
+    bool added = false;
+    for(int row=0; row<DEPTH; row++) {
+        uint8_t& counter = counters[index(hash, row)];
+        if(counter < MAX_COUNT) {
+            counter++;
+            added = true;
+        }
+    }
+    if(added && ++additions >= sample_size) {
+        age();
+    }
+}
+
+int FrequencySketch::estimate(size_t hash) const {
+    int count = MAX_COUNT;
+    for(int row=0; row<DEPTH; row++) {
+        count = std::min<int>(count, counters[index(hash, row)]);
+    }
+    return count;
+}
+
+void FrequencySketch::age() {
+    for(auto it=counters.begin(); it!=counters.end(); ++it) {
+        *it >>= 1;
+    }
+    additions /= 2;
+}
+
+ChunkCache::Shard::Shard(int64_t capacity, size_t sketch_width):
+    sketch(sketch_width),
+    capacity(capacity),
+    used(0),
+    hits(0),
+    misses(0)
+{
+}
+
+ChunkCache::ChunkCache(int64_t capacity, int shard_count):
+    total_capacity(capacity)
+{
+    if(shard_count < 1) {
+        shard_count = 1;
+    }
+    int64_t shard_capacity = capacity / shard_count;
+    // Size the sketch for a few thousand chunks per shard at the default 4 KiB chunk size, more
+    // counters than entries keeps the estimates from colliding too often.
+    size_t sketch_width = (size_t)std::min<int64_t>(std::max<int64_t>(shard_capacity / 4096, 1024), 1 << 20);
+    for(int i=0; i<shard_count; i++) {
+        shards.push_back(new Shard(shard_capacity, sketch_width));
+    }
+}
+
+ChunkCache::Shard& ChunkCache::shardFor(size_t hash) {
+    return *shards[hash % shards.size()];
+}
+
+ChunkCache::Content ChunkCache::get(const std::string& chunk_id) {
+    size_t hash = std::hash<std::string>()(chunk_id);
+    Shard& shard = shardFor(hash);
+    FastMutex::ScopedLock lock(shard.mutex);
+
+    shard.sketch.increment(hash);
+    auto it = shard.entries.find(chunk_id);
+    if(it == shard.entries.end()) {
+        shard.misses++;
+        return Content();
+    }
+    shard.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_pos);
+    return it->second.content;
+}
+
+// Finds the least recently used entries that would have to go for `size` more bytes to fit.
+// The new chunk only wins if it is more popular than each of them. With `evict` set the
+// victims are removed, otherwise this only answers whether they would be.
+bool ChunkCache::makeRoom(Shard& shard, size_t hash, int64_t size, bool evict) {
+    if(size > shard.capacity) {
+        return false;
+    }
+    int64_t needed = shard.used + size - shard.capacity;
+    if(needed <= 0) {
+        return true;
+    }
+
+    int candidate = shard.sketch.estimate(hash);
+    auto victim = shard.lru.end();
+    int64_t freed = 0;
+    while(freed < needed && victim != shard.lru.begin()) {
+        --victim;
+        if(shard.sketch.estimate(std::hash<std::string>()(*victim)) >= candidate) {
+            return false;
+        }
+        freed += (int64_t)shard.entries[*victim].content->size();
+    }
+    if(freed < needed) {
+        return false;
+    }
+
+    if(evict) {
+        while(shard.used + size > shard.capacity) {
+            const std::string& chunk_id = shard.lru.back();
+            shard.used -= (int64_t)shard.entries[chunk_id].content->size();
+            shard.entries.erase(chunk_id);
+            shard.lru.pop_back();
+        }
+    }
+    return true;
+}
+
+bool ChunkCache::admits(const std::string& chunk_id, int64_t size) {
+    size_t hash = std::hash<std::string>()(chunk_id);
+    Shard& shard = shardFor(hash);
+    FastMutex::ScopedLock lock(shard.mutex);
+
+    if(shard.entries.find(chunk_id) != shard.entries.end()) {
+        return true;
+    }
+    return makeRoom(shard, hash, size, false);
+}
+
+bool ChunkCache::put(const std::string& chunk_id, const Content& content) {
+    size_t hash = std::hash<std::string>()(chunk_id);
+    Shard& shard = shardFor(hash);
+    FastMutex::ScopedLock lock(shard.mutex);
+
+    auto it = shard.entries.find(chunk_id);
+    if(it != shard.entries.end()) {
+        if(it->second.content->size() == content->size()) {
+            // Another request got here first, the content is the same.
+            return true;
+        }
+        // The chunk was appended to since that copy was read.
+        shard.used -= (int64_t)it->second.content->size();
+        shard.lru.erase(it->second.lru_pos);
+        shard.entries.erase(it);
+    }
+    if(!makeRoom(shard, hash, (int64_t)content->size(), true)) {
+        return false;
+    }
+
+    shard.lru.push_front(chunk_id);
+    Entry& entry = shard.entries[chunk_id];
+    entry.content = content;
+    entry.lru_pos = shard.lru.begin();
+    shard.used += (int64_t)content->size();
+    return true;
+}
+
+void ChunkCache::invalidate(const std::string& chunk_id) {
+    size_t hash = std::hash<std::string>()(chunk_id);
+    Shard& shard = shardFor(hash);
+    FastMutex::ScopedLock lock(shard.mutex);
+
+    auto it = shard.entries.find(chunk_id);
+    if(it == shard.entries.end()) {
+        return;
+    }
+    shard.used -= (int64_t)it->second.content->size();
+    shard.lru.erase(it->second.lru_pos);
+    shard.entries.erase(it);
+}
+
+int64_t ChunkCache::capacity() const {
+    return total_capacity;
+}
+
+int64_t ChunkCache::used() {
+    int64_t total = 0;
+    for(auto it=shards.begin(); it!=shards.end(); ++it) {
+        FastMutex::ScopedLock lock((*it)->mutex);
+        total += (*it)->used;
+    }
+    return total;
+}
+
+int64_t ChunkCache::hits() {
+    int64_t total = 0;
+    for(auto it=shards.begin(); it!=shards.end(); ++it) {
+        FastMutex::ScopedLock lock((*it)->mutex);
+        total += (*it)->hits;
+    }
+    return total;
+}
+
+int64_t ChunkCache::misses() {
+    int64_t total = 0;
+    for(auto it=shards.begin(); it!=shards.end(); ++it) {
+        FastMutex::ScopedLock lock((*it)->mutex);
+        total += (*it)->misses;
+    }
+    return total;
+}
+
+}
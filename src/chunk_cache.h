@@ -0,0 +1,95 @@
+#ifndef DISTFS_CHUNK_CACHE_H
+#define DISTFS_CHUNK_CACHE_H
+
+#include "common.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/SharedPtr.h>
+#include <unordered_map>
+#include <list>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// Approximate access counts for TinyLFU admission: a count-min sketch of four rows of small
+// saturating counters. All counters are halved every `sample_size` increments so the sketch
+// follows the recent popularity instead of the all-time one.
+class FrequencySketch {
+public:
+    FrequencySketch(size_t width);
+
+    void increment(size_t hash);
+    int estimate(size_t hash) const;
+
+protected:
+    size_t index(size_t hash, int row) const;
+    void age();
+
+    static const int DEPTH = 4;
+    static const uint8_t MAX_COUNT = 15;
+
+    std::vector<uint8_t> counters;      // DEPTH rows of `width` counters
+    size_t mask;
+    size_t additions;
+    size_t sample_size;
+};
+
+// Whole chunk contents kept in memory, within a fixed byte budget. Updates create a new id, but a
+// tail chunk grows in place when it is appended to: its entry is invalidated then, and a copy of
+// another length, cached by a read racing the append, is replaced by the next put().
+//
+// The cache is split into shards by chunk id, each with its own lock, LRU list and frequency
+// sketch, so handler threads rarely wait on each other. A new chunk is only let in when it has
+// been asked for more often than every entry it would push out (TinyLFU), which keeps a
+// sequential scan over cold chunks from flushing the hot ones.
+class ChunkCache {
+public:
+    typedef SharedPtr<std::vector<uint8_t>> Content;
+
+    ChunkCache(int64_t capacity, int shards);
+
+    // Looks the chunk up and counts the access towards its popularity.
+    Content get(const std::string& chunk_id);
+    // Whether a chunk of `size` bytes would be kept by put(), so callers can skip reading it.
+    bool admits(const std::string& chunk_id, int64_t size);
+    bool put(const std::string& chunk_id, const Content& content);
+    void invalidate(const std::string& chunk_id);
+
+    int64_t capacity() const;
+    int64_t used();
+    int64_t hits();
+    int64_t misses();
+
+protected:
+    struct Entry {
+        Content content;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    struct Shard {
+        Shard(int64_t capacity, size_t sketch_width);
+
+        FastMutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru;         // most recently used first
+        FrequencySketch sketch;
+        int64_t capacity;
+        int64_t used;
+        int64_t hits;
+        int64_t misses;
+    };
+
+    Shard& shardFor(size_t hash);
+    bool makeRoom(Shard& shard, size_t hash, int64_t size, bool evict);
+
+    std::vector<SharedPtr<Shard>> shards;
+    int64_t total_capacity;
+
+private:
+    ChunkCache(const ChunkCache&);
+    ChunkCache& operator = (const ChunkCache&);
+};
+
+}
+#endif
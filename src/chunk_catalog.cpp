@@ -0,0 +1,307 @@
+#include "chunk_catalog.h"
+
+#include <Poco/BinaryWriter.h>
+#include <Poco/BinaryReader.h>
+#include <Poco/Exception.h>
+#include <cstring>
+
+#if defined(POCO_OS_FAMILY_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace DistFS {
+
+bool ChunkCatalog::find(const std::string& chunk_id, ChunkMeta& meta) {
+    ScopedReadRWLock read_lock(lock);
+    auto it = chunks.find(chunk_id);
+    if(it == chunks.end()) {
+        return false;
+    }
+    meta = it->second;
+    return true;
+}
+
+void ChunkCatalog::put(const std::string& chunk_id, const ChunkMeta& meta) {
+    ScopedWriteRWLock write_lock(lock);
+    chunks[chunk_id] = meta;
+}
+
+bool ChunkCatalog::erase(const std::string& chunk_id) {
+    ScopedWriteRWLock write_lock(lock);
+    return chunks.erase(chunk_id) > 0;
+}
+
+std::vector<std::string> ChunkCatalog::ids() {
+    ScopedReadRWLock read_lock(lock);
+    std::vector<std::string> list;
+    list.reserve(chunks.size());
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        list.push_back(it->first);
+    }
+    return list;
+}
+
+std::map<std::string, UInt32> ChunkCatalog::versions() {
+    ScopedReadRWLock read_lock(lock);
+    std::map<std::string, UInt32> result;
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        if(it->second.version > 0) {
+            result[it->first] = it->second.version;
+        }
+    }
+    return result;
+}
+
+size_t ChunkCatalog::size() {
+    ScopedReadRWLock read_lock(lock);
+    return chunks.size();
+}
+
+void ChunkCatalog::save(const std::string& path) {
+    ScopedReadRWLock read_lock(lock);
+
+    std::ofstream ofile(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+    BinaryWriter writer(ofile, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+
+    writer.writeRaw("DFSC", 4);
+    writer << (UInt32)5;
+    writer << (UInt64)chunks.size();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        const ChunkMeta& meta = it->second;
+        writer << it->first;
+        writer << (Int64)meta.size;
+        writer << (Int64)meta.created;
+        writer << meta.overlay;
+        writer << meta.checksum_block_size;
+        writer << meta.block_checksums;
+        writer << meta.segment;
+        writer << (Int64)meta.offset;
+        writer << meta.codec;
+        writer << (Int64)meta.uncompressed_size;
+        writer << meta.version;
+    }
+    writer.flush();
+    ofile.close();
+
+    if(!ofile.good()) {
+        throw WriteFileException(path);
+    }
+}
+
+bool ChunkCatalog::load(const std::string& path) {
+    std::ifstream ifile(path.c_str(), std::ios::binary);
+    if(!ifile.good()) {
+        return false;
+    }
+    BinaryReader reader(ifile, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+
+    std::string magic;
+    reader.readRaw(4, magic);
+    UInt32 version = 0;
+    reader >> version;
+    // Version 3 catalogs predate compression, their chunks are all stored as is. Version 4 ones
+    // predate appends in place.
+    if(magic != "DFSC" || version < 3 || version > 5) {
+        return false;
+    }
+
+    UInt64 count = 0;
+    reader >> count;
+
+    std::unordered_map<std::string, ChunkMeta> loaded;
+    loaded.reserve((size_t)count);
+    for(UInt64 i=0; i<count && reader.good(); i++) {
+        std::string chunk_id;
+        Int64 size = 0;
+        Int64 created = 0;
+        Int64 offset = 0;
+        ChunkMeta meta;
+        reader >> chunk_id;
+        reader >> size;
+        reader >> created;
+        reader >> meta.overlay;
+        reader >> meta.checksum_block_size;
+        reader >> meta.block_checksums;
+        reader >> meta.segment;
+        reader >> offset;
+        if(version >= 4) {
+            Int64 uncompressed_size = 0;
+            reader >> meta.codec;
+            reader >> uncompressed_size;
+            meta.uncompressed_size = uncompressed_size;
+        }
+        if(version >= 5) {
+            reader >> meta.version;
+        }
+        meta.size = size;
+        meta.created = created;
+        meta.offset = offset;
+        loaded[chunk_id] = meta;
+    }
+    if(!reader.good()) {
+        return false;
+    }
+
+    ScopedWriteRWLock write_lock(lock);
+    chunks.swap(loaded);
+    return true;
+}
+
+#if defined(POCO_OS_FAMILY_UNIX)
+
+ChunkFile::ChunkFile(const std::string& path, DiskEngine* engine, bool direct, IoScheduler* scheduler):
+    file_path(path),
+    io_scheduler(scheduler),
+    direct_fd(-1),
+    direct_failed(false),
+    engine(engine)
+{
+    file_fd = ::open(path.c_str(), O_RDONLY);
+    if(file_fd < 0) {
+        throw FileNotFoundException(path);
+    }
+#if defined(O_DIRECT)
+    if(direct) {
+        // tmpfs and some others refuse O_DIRECT, those just keep using the page cache.
+        direct_fd = ::open(path.c_str(), O_RDONLY|O_DIRECT);
+    }
+#endif
+}
+
+ChunkFile::~ChunkFile() {
+    ::close(file_fd);
+    if(direct_fd >= 0) {
+        ::close(direct_fd);
+    }
+}
+
+int64_t ChunkFile::read(int64_t offset, uint8_t* buffer, int64_t length) {
+    IoScheduler::Ticket ticket(io_scheduler, length);
+    if(direct_fd >= 0 && !direct_failed) {
+        try {
+            return readDirect(offset, buffer, length);
+        } catch(ReadFileException& e) {
+            if(e.code() != EINVAL) {
+                throw;
+            }
+            // The device wants more than DIRECT_IO_ALIGNMENT.
+            direct_failed = true;
+        }
+    }
+    if(engine != nullptr) {
+        return engine->read(file_fd, offset, buffer, length);
+    }
+    int64_t done = DiskEngine::preadFully(file_fd, offset, buffer, length);
+    if(done < 0) {
+        throw ReadFileException(file_path, (int)-done);
+    }
+    return done;
+}
+
+int64_t ChunkFile::readDirect(int64_t offset, uint8_t* buffer, int64_t length) {
+    // O_DIRECT needs the offset, length and memory aligned, so read the enclosing aligned range
+    // into a bounce buffer.
+    const int64_t alignment = DiskEngine::DIRECT_IO_ALIGNMENT;
+    int64_t first = offset / alignment * alignment;
+    int64_t last = (offset + length + alignment - 1) / alignment * alignment;
+    AlignedBuffer aligned((size_t)(last - first), (size_t)alignment);
+
+    int64_t n = 0;
+    if(engine != nullptr) {
+        n = engine->read(direct_fd, first, aligned.data(), last - first);
+    } else {
+        n = DiskEngine::preadFully(direct_fd, first, aligned.data(), last - first);
+        if(n < 0) {
+            throw ReadFileException(file_path, (int)-n);
+        }
+    }
+
+    int64_t available = std::max<int64_t>(0, std::min(n - (offset - first), length));
+    std::memcpy(buffer, aligned.data() + (offset - first), (size_t)available);
+    return available;
+}
+
+void ChunkFile::prefetch(int64_t offset, int64_t length) {
+#if defined(POSIX_FADV_WILLNEED)
+    if(direct_fd < 0 || direct_failed) {
+        // Queues the reads and returns, the kernel's readahead does the rest.
+        ::posix_fadvise(file_fd, (off_t)offset, (off_t)std::max<int64_t>(length, 0), POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+int ChunkFile::fd() const {
+    return file_fd;
+}
+
+#else
+
+ChunkFile::ChunkFile(const std::string& path, DiskEngine* engine, bool direct, IoScheduler* scheduler):
+    file_path(path),
+    io_scheduler(scheduler),
+    stream(path.c_str(), std::ios::binary)
+{
+    if(!stream.good()) {
+        throw FileNotFoundException(path);
+    }
+}
+
+ChunkFile::~ChunkFile() {
+}
+
+int64_t ChunkFile::read(int64_t offset, uint8_t* buffer, int64_t length) {
+    IoScheduler::Ticket ticket(io_scheduler, length);
+    FastMutex::ScopedLock lock(stream_mutex);
+    stream.clear();
+    stream.seekg(offset);
+    stream.read((char*)buffer, length);
+    return (int64_t)stream.gcount();
+}
+
+void ChunkFile::prefetch(int64_t, int64_t) {
+}
+
+int ChunkFile::fd() const {
+    return -1;
+}
+
+#endif
+
+const std::string& ChunkFile::path() const {
+    return file_path;
+}
+
+IoScheduler* ChunkFile::scheduler() const {
+    return io_scheduler;
+}
+
+ChunkFileCache::ChunkFileCache(long capacity):
+    cache(capacity),
+    engine(nullptr),
+    direct(false),
+    scheduler(nullptr)
+{
+}
+
+void ChunkFileCache::setDiskEngine(DiskEngine* engine, bool direct, IoScheduler* scheduler) {
+    this->engine = engine;
+    this->direct = direct;
+    this->scheduler = scheduler;
+}
+
+SharedPtr<ChunkFile> ChunkFileCache::open(const std::string& path) {
+    SharedPtr<ChunkFile> file = cache.get(path);
+    if(file.isNull()) {
+        file = new ChunkFile(path, engine, direct, scheduler);
+        cache.add(path, file);
+    }
+    return file;
+}
+
+void ChunkFileCache::invalidate(const std::string& path) {
+    cache.remove(path);
+}
+
+}
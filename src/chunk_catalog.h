@@ -0,0 +1,116 @@
+#ifndef DISTFS_CHUNK_CATALOG_H
+#define DISTFS_CHUNK_CATALOG_H
+
+#include "common.h"
+#include "disk_engine.h"
+#include "io_scheduler.h"
+#include "chunk_codec.h"
+
+#include <Poco/RWLock.h>
+#include <Poco/Mutex.h>
+#include <Poco/LRUCache.h>
+#include <Poco/SharedPtr.h>
+#include <unordered_map>
+#include <fstream>
+#include <atomic>
+
+namespace DistFS {
+
+using namespace Poco;
+
+struct ChunkMeta {
+    int64_t size = 0;
+    int64_t created = 0;                // epoch microseconds
+    UInt32 checksum_block_size = 0;
+    std::vector<UInt32> block_checksums;    // CRC32C of each block of the content, empty if unknown
+    bool overlay = false;               // stored as an overlay instead of a plain chunk file
+    UInt32 segment = 0;                 // segment store: segment file and offset of the data
+    int64_t offset = 0;
+    UInt8 codec = CODEC_NONE;           // encoding of the stored bytes, size counts those
+    int64_t uncompressed_size = 0;      // size of the content when codec is set
+    UInt32 version = 0;                 // bumped by every append in place
+
+    // Size of the content as clients see it.
+    int64_t length() const { return codec == CODEC_NONE ? size : uncompressed_size; }
+};
+
+// In-memory index of every chunk the server holds, so requests and heartbeats don't need to stat
+// files or walk the chunk directory. It's saved on clean shutdown and loaded on the next start.
+class ChunkCatalog {
+public:
+    bool find(const std::string& chunk_id, ChunkMeta& meta);
+    void put(const std::string& chunk_id, const ChunkMeta& meta);
+    bool erase(const std::string& chunk_id);
+    std::vector<std::string> ids();
+    // Versions of the chunks that have been appended to in place, the others are at 0.
+    std::map<std::string, UInt32> versions();
+    size_t size();
+
+    void save(const std::string& path);
+    bool load(const std::string& path);
+
+protected:
+    RWLock lock;
+    std::unordered_map<std::string, ChunkMeta> chunks;
+};
+
+// An open chunk file used for positional reads. The descriptor stays valid for as long as someone
+// holds the handle, even if the file is evicted from the cache or unlinked in the meantime.
+// Reads go through `engine` when there is one. With `direct` they bypass the page cache through a
+// second O_DIRECT descriptor, if the filesystem supports it; fd() stays a buffered one for sendfile.
+// Every read is admitted by `scheduler` first, if there is one.
+class ChunkFile {
+public:
+    ChunkFile(const std::string& path, DiskEngine* engine = nullptr, bool direct = false, IoScheduler* scheduler = nullptr);
+    ~ChunkFile();
+
+    int64_t read(int64_t offset, uint8_t* buffer, int64_t length);
+    // Starts reading a range (length <= 0 for the rest of the file) into the page cache without
+    // waiting for it, so that a later read() finds it there. Does nothing for O_DIRECT files.
+    void prefetch(int64_t offset, int64_t length);
+    int fd() const;
+    const std::string& path() const;
+    IoScheduler* scheduler() const;
+
+protected:
+    std::string file_path;
+    IoScheduler* io_scheduler;
+#if defined(POCO_OS_FAMILY_UNIX)
+    int64_t readDirect(int64_t offset, uint8_t* buffer, int64_t length);
+
+    int file_fd;
+    int direct_fd;
+    // Set once the device refused an O_DIRECT read for its alignment, reads are buffered since.
+    std::atomic<bool> direct_failed;
+    DiskEngine* engine;
+#else
+    FastMutex stream_mutex;
+    std::ifstream stream;
+#endif
+
+private:
+    ChunkFile(const ChunkFile&);
+    ChunkFile& operator = (const ChunkFile&);
+};
+
+// LRU cache of open chunk files, keyed by path.
+class ChunkFileCache {
+public:
+    ChunkFileCache(long capacity);
+
+    // Files opened from now on read through `engine`, with O_DIRECT if `direct` is set, and are
+    // scheduled by `scheduler`.
+    void setDiskEngine(DiskEngine* engine, bool direct, IoScheduler* scheduler = nullptr);
+
+    SharedPtr<ChunkFile> open(const std::string& path);
+    void invalidate(const std::string& path);
+
+protected:
+    LRUCache<std::string, ChunkFile> cache;
+    DiskEngine* engine;
+    bool direct;
+    IoScheduler* scheduler;
+};
+
+}
+#endif
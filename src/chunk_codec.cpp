@@ -0,0 +1,75 @@
+#include "chunk_codec.h"
+
+#include <Poco/DeflatingStream.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/MemoryStream.h>
+#include <Poco/Exception.h>
+#include <sstream>
+
+namespace DistFS {
+
+using namespace Poco;
+
+std::string codecName(UInt8 codec) {
+    switch(codec) {
+    case CODEC_NONE:
+        return "none";
+    case CODEC_ZLIB:
+        return "zlib";
+    default:
+        return "unknown(" + std::to_string(codec) + ")";
+    }
+}
+
+bool parseCodec(const std::string& name, UInt8& codec) {
+    if(name == "none" || name.empty()) {
+        codec = CODEC_NONE;
+    } else if(name == "zlib") {
+        codec = CODEC_ZLIB;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::vector<uint8_t> compressChunk(UInt8 codec, const std::vector<uint8_t>& data) {
+    if(codec == CODEC_NONE) {
+        return data;
+    }
+    if(codec != CODEC_ZLIB) {
+        throw InvalidArgumentException("Unknown codec " + codecName(codec));
+    }
+
+    std::ostringstream compressed;
+    { // deflater scope, close() writes the end of the stream
+        // Level 1: logs and JSON still shrink several times, and chunks are compressed in the
+        // request handler.
+        DeflatingOutputStream deflater(compressed, DeflatingStreamBuf::STREAM_ZLIB, 1);
+        deflater.write((const char*)data.data(), data.size());
+        deflater.close();
+    }
+    std::string bytes = compressed.str();
+    return std::vector<uint8_t>(bytes.begin(), bytes.end());
+}
+
+std::vector<uint8_t> decompressChunk(UInt8 codec, const std::vector<uint8_t>& data, int64_t uncompressed_size) {
+    if(codec == CODEC_NONE) {
+        return data;
+    }
+    if(codec != CODEC_ZLIB) {
+        throw DataFormatException("Unknown codec " + codecName(codec));
+    }
+
+    MemoryInputStream compressed((const char*)data.data(), data.size());
+    InflatingInputStream inflater(compressed, InflatingStreamBuf::STREAM_ZLIB);
+    // One byte more than expected, so a chunk that inflates to more is noticed too.
+    std::vector<uint8_t> content((size_t)uncompressed_size + 1);
+    inflater.read((char*)content.data(), content.size());
+    if(inflater.bad() || inflater.gcount() != uncompressed_size) {
+        throw DataFormatException("Compressed chunk doesn't inflate to " + std::to_string(uncompressed_size) + " bytes");
+    }
+    content.resize((size_t)uncompressed_size);
+    return content;
+}
+
+}
@@ -0,0 +1,27 @@
+#ifndef DISTFS_CHUNK_CODEC_H
+#define DISTFS_CHUNK_CODEC_H
+
+#include <Poco/Types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DistFS {
+
+// How the stored bytes of a chunk are encoded. The value is persisted, never renumber.
+enum ChunkCodec {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,     // zlib stream, what HTTP calls Content-Encoding: deflate
+};
+
+// "none" or "zlib". parseCodec returns false for anything else.
+std::string codecName(Poco::UInt8 codec);
+bool parseCodec(const std::string& name, Poco::UInt8& codec);
+
+std::vector<uint8_t> compressChunk(Poco::UInt8 codec, const std::vector<uint8_t>& data);
+
+// Throws DataFormatException if `data` doesn't inflate to exactly `uncompressed_size` bytes.
+std::vector<uint8_t> decompressChunk(Poco::UInt8 codec, const std::vector<uint8_t>& data, int64_t uncompressed_size);
+
+}
+#endif
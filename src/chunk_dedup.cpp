@@ -0,0 +1,222 @@
+#include "chunk_dedup.h"
+#include "sha256.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DISTFS_CDC_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTFS_TARGET_AVX2
+#else
+#define DISTFS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace DistFS {
+
+namespace {
+
+// Gear value of a byte: a multiplicative hash, so the AVX2 path can compute it instead of looking it
+// up. The cut points depend on it, changing it moves every boundary and chunks written before
+// stop matching the new ones.
+inline uint32_t gearValue(uint32_t byte) {
+    uint32_t x = (byte + 0x9e3779b9u) * 0x85ebca6bu;
+    return x ^ (x >> 15);
+}
+
+struct GearTable {
+    uint32_t values[256];
+
+    GearTable() {
+        for(uint32_t i=0; i<256; i++) {
+            values[i] = gearValue(i);
+        }
+    }
+};
+
+const GearTable& gear() {
+    static const GearTable table;
+    return table;
+}
+
+void gearScan(const uint8_t* data, size_t begin, size_t end, uint32_t hash, uint32_t mask, std::vector<CutCandidate>& candidates) {
+    const uint32_t* table = gear().values;
+    for(size_t i=begin; i<end; i++) {
+        hash = (hash << 1) + table[data[i]];
+        if((hash & mask) == 0) {
+            candidates.push_back({i, hash});
+        }
+    }
+}
+
+#if defined(DISTFS_CDC_X86)
+
+inline int lowestBit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Eight consecutive positions at a time, without gathers (slow on CPUs with the GDS microcode
+// fix): the gear values are computed in the lanes, and h[j] = (h[j-1] << 1) + g[j] over the block
+// is a prefix sum in which every step back doubles. Only the last hash of a block carries into the
+// next one.
+DISTFS_TARGET_AVX2 void gearCandidatesAVX2(const uint8_t* data, size_t length, uint32_t mask, std::vector<CutCandidate>& candidates) {
+    const __m256i mask_vector = _mm256_set1_epi32((int)mask);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i seed = _mm256_set1_epi32((int)0x9e3779b9u);
+    const __m256i multiplier = _mm256_set1_epi32((int)0x85ebca6bu);
+    // The upper half adds lane 3 shifted by its distance; a count of 32 zeroes the lower half.
+    const __m256i lane3 = _mm256_set1_epi32(3);
+    const __m256i half_shifts = _mm256_setr_epi32(32, 32, 32, 32, 1, 2, 3, 4);
+    const __m256i carry_shifts = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+    const __m256i last_lane = _mm256_set1_epi32(7);
+
+    __m256i carry = zero;   // hash of the position before the block, in every lane
+    size_t i = 0;
+    for(; i + 8 <= length; i += 8) {
+        __m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(data + i)));
+        x = _mm256_mullo_epi32(_mm256_add_epi32(x, seed), multiplier);
+        __m256i sums = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+        // Within each 128-bit half the byte shifts bring in zeros, then across the halves.
+        sums = _mm256_add_epi32(sums, _mm256_slli_epi32(_mm256_slli_si256(sums, 4), 1));
+        sums = _mm256_add_epi32(sums, _mm256_slli_epi32(_mm256_slli_si256(sums, 8), 2));
+        sums = _mm256_add_epi32(sums, _mm256_sllv_epi32(_mm256_permutevar8x32_epi32(sums, lane3), half_shifts));
+        __m256i hashes = _mm256_add_epi32(sums, _mm256_sllv_epi32(carry, carry_shifts));
+        carry = _mm256_permutevar8x32_epi32(hashes, last_lane);
+
+        int hits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(hashes, mask_vector), zero)));
+        if(hits != 0) {
+            alignas(32) uint32_t values[8];
+            _mm256_store_si256((__m256i*)values, hashes);
+            for(; hits != 0; hits &= hits - 1) {
+                int lane = lowestBit((unsigned)hits);
+                candidates.push_back({i + lane, values[lane]});
+            }
+        }
+    }
+    gearScan(data, i, length, (uint32_t)_mm256_cvtsi256_si32(carry), mask, candidates);
+}
+
+bool detectAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+typedef void (*GearCandidatesFunction)(const uint8_t*, size_t, uint32_t, std::vector<CutCandidate>&);
+
+struct Implementation {
+    const char* name;
+    GearCandidatesFunction function;
+
+    Implementation() {
+#if defined(DISTFS_CDC_X86)
+        if(detectAVX2()) {
+            name = "avx2";
+            function = gearCandidatesAVX2;
+            return;
+        }
+#endif
+        name = "scalar";
+        function = gearCandidatesSoftware;
+    }
+};
+
+const Implementation& implementation() {
+    static const Implementation selected;
+    return selected;
+}
+
+// The `bits` highest bits: they depend on the whole window, the low ones only on its end.
+uint32_t topBits(int bits) {
+    return bits <= 0 ? 0 : (bits >= 32 ? 0xffffffffu : ~(0xffffffffu >> bits));
+}
+
+}
+
+void gearCandidatesSoftware(const uint8_t* data, size_t length, uint32_t mask, std::vector<CutCandidate>& candidates) {
+    gearScan(data, 0, length, 0, mask, candidates);
+}
+
+void gearCandidates(const uint8_t* data, size_t length, uint32_t mask, std::vector<CutCandidate>& candidates) {
+    implementation().function(data, length, mask, candidates);
+}
+
+const char* cdcImplementation() {
+    return implementation().name;
+}
+
+ContentChunker::ContentChunker(int64_t average) {
+    int bits = 8;
+    while(bits < 30 && ((int64_t)1 << (bits + 1)) <= average) {
+        bits++;
+    }
+    normal_size = (size_t)1 << bits;
+    min_size = normal_size / 4;
+    max_size = normal_size * 4;
+    mask_hard = topBits(bits + 1);
+    mask_easy = topBits(bits - 1);
+}
+
+std::vector<size_t> ContentChunker::split(const uint8_t* data, size_t length) const {
+    std::vector<CutCandidate> candidates;
+    gearCandidates(data, length, mask_easy, candidates);
+
+    std::vector<size_t> lengths;
+    auto candidate = candidates.begin();
+    for(size_t start=0; start<length;) {
+        size_t limit = std::min(max_size, length - start);
+        size_t cut = limit;
+        // Cutting at candidate->position gives a chunk of position + 1 - start bytes.
+        while(candidate != candidates.end() && candidate->position + 1 < start + min_size) {
+            ++candidate;
+        }
+        for(auto it=candidate; it!=candidates.end() && it->position + 1 - start <= limit; ++it) {
+            size_t size = it->position + 1 - start;
+            if(size >= normal_size || (it->hash & mask_hard) == 0) {
+                cut = size;
+                break;
+            }
+        }
+        lengths.push_back(cut);
+        start += cut;
+    }
+    return lengths;
+}
+
+std::vector<size_t> ContentChunker::splitPrefix(const uint8_t* data, size_t length, bool end) const {
+    if(end) {
+        return split(data, length);
+    }
+    std::vector<size_t> lengths;
+    if(length < max_size) {
+        return lengths;
+    }
+    std::vector<size_t> all = split(data, length);
+    size_t start = 0;
+    for(auto it=all.begin(); it!=all.end() && start + max_size <= length; ++it) {
+        lengths.push_back(*it);
+        start += *it;
+    }
+    return lengths;
+}
+
+std::string contentChunkId(const uint8_t* data, size_t length) {
+    return "sha256-" + Sha256::hex(data, length);
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef DISTFS_CHUNK_DEDUP_H
+#define DISTFS_CHUNK_DEDUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DistFS {
+
+// A position whose gear hash passed the chunker's loose mask.
+struct CutCandidate {
+    size_t position;    // last byte of the chunk if it is cut here
+    uint32_t hash;
+};
+
+// Content-defined chunking for deduplicated files, FastCDC style: a gear hash rolls over the
+// data, h = (h << 1) + gear[byte], so every hash depends on the last 32 bytes only and the same
+// content is cut at the same places wherever it is in a file. Below the average size a cut needs
+// more zero bits than above it, which keeps the sizes close to the average.
+class ContentChunker {
+public:
+    // `average` is rounded down to a power of two, at least 256. Chunks are between a quarter
+    // and four times that.
+    ContentChunker(int64_t average);
+
+    // Lengths of the chunks `data` is cut into. The last chunk ends at `length`.
+    std::vector<size_t> split(const uint8_t* data, size_t length) const;
+    // The same for `data` that goes on past `length`, unless `end`: only the chunks starting at
+    // least max_size before `length` are cut, the others depend on what follows.
+    std::vector<size_t> splitPrefix(const uint8_t* data, size_t length, bool end) const;
+
+    size_t min_size;
+    size_t normal_size;
+    size_t max_size;
+    uint32_t mask_hard;     // before normal_size
+    uint32_t mask_easy;     // after it, its bits are a subset of mask_hard's
+};
+
+// Appends the positions of `data` whose hash has none of the bits of `mask` set, in order. The
+// AVX2 path hashes eight positions per step.
+void gearCandidates(const uint8_t* data, size_t length, uint32_t mask, std::vector<CutCandidate>& candidates);
+void gearCandidatesSoftware(const uint8_t* data, size_t length, uint32_t mask, std::vector<CutCandidate>& candidates);
+
+// "avx2" or "scalar".
+const char* cdcImplementation();
+
+// Id of a chunk in a deduplicated file: "sha256-" and the hex digest of its content.
+std::string contentChunkId(const uint8_t* data, size_t length);
+
+}
+#endif
@@ -0,0 +1,326 @@
+#include "chunk_disk_set.h"
+
+#include <Poco/File.h>
+#include <Poco/Delegate.h>
+
+namespace DistFS {
+
+MultiDiskChunkStore::MultiDiskChunkStore(const std::vector<ChunkStore*>& stores, const std::vector<Path>& directories):
+    ChunkStore(directories.front()),
+    max_disk_errors(3),
+    disk_error_window(60)
+{
+    for(size_t i=0; i<stores.size(); i++) {
+        SharedPtr<Disk> disk(new Disk);
+        disk->store = stores[i];
+        disk->directory = directories[i];
+        disk->failed = false;
+        disks.push_back(disk);
+    }
+}
+
+MultiDiskChunkStore::~MultiDiskChunkStore() {
+    for(auto it=disks.begin(); it!=disks.end(); ++it) {
+        delete (*it)->store;
+    }
+}
+
+void MultiDiskChunkStore::open() {
+    for(size_t i=0; i<disks.size(); i++) {
+        Disk& disk = *disks[i];
+        disk.store->checksum_block_size = checksum_block_size;
+        disk.store->verify_reads = verify_reads;
+        disk.store->direct_io = direct_io;
+        disk.store->sync_queue = sync_queue;
+        disk.store->chunk_corrupted += delegate(this, &MultiDiskChunkStore::onChunkCorrupted);
+
+        try {
+            disk.store->open();
+        } catch(Exception& e) {
+            // A dead disk must not keep the others from serving.
+            isolate(i, e.displayText());
+            continue;
+        }
+
+        std::vector<std::string> chunks = disk.store->list();
+        ScopedWriteRWLock lock(placement_lock);
+        for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+            // The same chunk on two disks (a disk moved between servers?), the first one wins.
+            placement.insert({*it, i});
+        }
+    }
+}
+
+void MultiDiskChunkStore::close() {
+    for(auto it=disks.begin(); it!=disks.end(); ++it) {
+        if((*it)->failed) {
+            continue;
+        }
+        try {
+            (*it)->store->close();
+        } catch(Exception&) {
+            // Its catalog is rebuilt from the directory on the next start.
+        }
+    }
+}
+
+bool MultiDiskChunkStore::exists(const std::string& chunk_id) {
+    size_t index = 0;
+    return findDisk(chunk_id, index);
+}
+
+int64_t MultiDiskChunkStore::size(const std::string& chunk_id) {
+    return onDisk<int64_t>(diskOf(chunk_id), [&](ChunkStore& store) {
+        return store.size(chunk_id);
+    });
+}
+
+bool MultiDiskChunkStore::meta(const std::string& chunk_id, ChunkMeta& meta) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        return false;
+    }
+    return onDisk<bool>(*disks[index], [&](ChunkStore& store) {
+        return store.meta(chunk_id, meta);
+    });
+}
+
+SharedPtr<ChunkFile> MultiDiskChunkStore::openPlain(const std::string& chunk_id) {
+    return onDisk<SharedPtr<ChunkFile>>(diskOf(chunk_id), [&](ChunkStore& store) {
+        return store.openPlain(chunk_id);
+    });
+}
+
+std::vector<uint8_t> MultiDiskChunkStore::read(const std::string& chunk_id, int64_t offset, int64_t length) {
+    return onDisk<std::vector<uint8_t>>(diskOf(chunk_id), [&](ChunkStore& store) {
+        return store.read(chunk_id, offset, length);
+    });
+}
+
+void MultiDiskChunkStore::create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) {
+    // A chunk written again stays on its disk, so there is never a stale copy elsewhere.
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        index = chooseDisk();
+    }
+    onDisk<void>(*disks[index], [&](ChunkStore& store) {
+        store.create(chunk_id, content, source);
+    });
+    place(chunk_id, index);
+}
+
+bool MultiDiskChunkStore::update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        return false;
+    }
+
+    size_t old_index = 0;
+    if(findDisk(new_id, old_index) && old_index != index) {
+        remove(new_id);
+    }
+
+    bool updated = onDisk<bool>(*disks[index], [&](ChunkStore& store) {
+        return store.update(chunk_id, new_id, begin_pos, content);
+    });
+    if(updated) {
+        place(new_id, index);
+    }
+    return updated;
+}
+
+bool MultiDiskChunkStore::remove(const std::string& chunk_id) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        return false;
+    }
+    bool removed = onDisk<bool>(*disks[index], [&](ChunkStore& store) {
+        return store.remove(chunk_id);
+    });
+
+    ScopedWriteRWLock lock(placement_lock);
+    auto it = placement.find(chunk_id);
+    if(it != placement.end() && it->second == index) {
+        placement.erase(it);
+    }
+    return removed;
+}
+
+std::vector<std::string> MultiDiskChunkStore::list() {
+    ScopedReadRWLock lock(placement_lock);
+    std::vector<std::string> chunks;
+    chunks.reserve(placement.size());
+    for(auto it=placement.begin(); it!=placement.end(); ++it) {
+        chunks.push_back(it->first);
+    }
+    return chunks;
+}
+
+bool MultiDiskChunkStore::append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) {
+    return onDisk<bool>(diskOf(chunk_id), [&](ChunkStore& store) {
+        return store.append(chunk_id, offset, content, version);
+    });
+}
+
+std::map<std::string, UInt32> MultiDiskChunkStore::versions() {
+    std::map<std::string, UInt32> result;
+    for(auto it=disks.begin(); it!=disks.end(); ++it) {
+        if((*it)->failed) {
+            continue;
+        }
+        std::map<std::string, UInt32> disk_versions = (*it)->store->versions();
+        result.insert(disk_versions.begin(), disk_versions.end());
+    }
+    return result;
+}
+
+int MultiDiskChunkStore::compact(int limit) {
+    int compacted = 0;
+    for(auto it=disks.begin(); it!=disks.end() && compacted < limit; ++it) {
+        Disk& disk = **it;
+        if(disk.failed) {
+            continue;
+        }
+        compacted += onDisk<int>(disk, [&](ChunkStore& store) {
+            return store.compact(limit - compacted);
+        });
+    }
+    return compacted;
+}
+
+int64_t MultiDiskChunkStore::verify(const std::string& chunk_id) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        return 0;
+    }
+    return onDisk<int64_t>(*disks[index], [&](ChunkStore& store) {
+        return store.verify(chunk_id);
+    });
+}
+
+void MultiDiskChunkStore::quarantine(const std::string& chunk_id) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        return;
+    }
+    // The disk's event takes the chunk out of the placement.
+    onDisk<void>(*disks[index], [&](ChunkStore& store) {
+        store.quarantine(chunk_id);
+    });
+}
+
+MultiDiskChunkStore::Disk& MultiDiskChunkStore::diskOf(const std::string& chunk_id) {
+    size_t index = 0;
+    if(!findDisk(chunk_id, index)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    return *disks[index];
+}
+
+bool MultiDiskChunkStore::findDisk(const std::string& chunk_id, size_t& index) {
+    ScopedReadRWLock lock(placement_lock);
+    auto it = placement.find(chunk_id);
+    if(it == placement.end()) {
+        return false;
+    }
+    index = it->second;
+    return true;
+}
+
+size_t MultiDiskChunkStore::chooseDisk() {
+    // Free space, discounted by the I/O already queued on the disk so a busy disk isn't piled on.
+    // Start at a different disk every time so disks that score the same take turns.
+    bool found = false;
+    size_t best = 0;
+    double best_score = 0;
+    size_t start = (size_t)(next_disk++);
+    for(size_t n=0; n<disks.size(); n++) {
+        size_t i = (start + n) % disks.size();
+        Disk& disk = *disks[i];
+        if(disk.failed) {
+            continue;
+        }
+        double free_space = 0;
+        try {
+            free_space = (double)File(disk.directory).freeSpace();
+        } catch(Exception& e) {
+            diskError(disk, e.displayText());
+            continue;
+        }
+        double score = free_space / (1.0 + disk.inflight.value());
+        if(!found || score > best_score) {
+            found = true;
+            best = i;
+            best_score = score;
+        }
+    }
+    if(!found) {
+        throw IOException("No healthy disk left");
+    }
+    return best;
+}
+
+void MultiDiskChunkStore::place(const std::string& chunk_id, size_t index) {
+    ScopedWriteRWLock lock(placement_lock);
+    placement[chunk_id] = index;
+}
+
+void MultiDiskChunkStore::diskError(Disk& disk, const std::string& reason) {
+    {
+        ScopedLock<Mutex> lock(disk.errors_mutex);
+        disk.errors.push_back(Timestamp());
+        while(disk_error_window > 0 && !disk.errors.empty() && disk.errors.front().isElapsed((Timestamp::TimeDiff)disk_error_window * Timestamp::resolution())) {
+            disk.errors.pop_front();
+        }
+        if((int)disk.errors.size() < max_disk_errors) {
+            return;
+        }
+    }
+    for(size_t i=0; i<disks.size(); i++) {
+        if(disks[i].get() == &disk) {
+            isolate(i, reason);
+        }
+    }
+}
+
+void MultiDiskChunkStore::isolate(size_t index, const std::string& reason) {
+    Disk& disk = *disks[index];
+    if(disk.failed.exchange(true)) {
+        return;
+    }
+
+    {
+        ScopedWriteRWLock lock(placement_lock);
+        for(auto it=placement.begin(); it!=placement.end();) {
+            if(it->second == index) {
+                it = placement.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    disk_failed.notify(this, disk.directory.toString() + ": " + reason);
+}
+
+void MultiDiskChunkStore::onChunkCorrupted(const void* sender, const std::string& chunk_id) {
+    {
+        ScopedWriteRWLock lock(placement_lock);
+        auto it = placement.find(chunk_id);
+        if(it != placement.end() && disks[it->second]->store == sender) {
+            placement.erase(it);
+        }
+    }
+    chunk_corrupted.notify(this, chunk_id);
+}
+
+std::vector<uint8_t> MultiDiskChunkStore::readRaw(const std::string& chunk_id, int64_t offset, int64_t length) {
+    // read() is delegated as a whole, the disk's store does the checking.
+    return read(chunk_id, offset, length);
+}
+
+int64_t MultiDiskChunkStore::computeChecksums(const std::string& chunk_id) {
+    return verify(chunk_id);
+}
+
+}
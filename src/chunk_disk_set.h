@@ -0,0 +1,111 @@
+#ifndef DISTFS_CHUNK_DISK_SET_H
+#define DISTFS_CHUNK_DISK_SET_H
+
+#include "chunk_store.h"
+
+#include <Poco/RWLock.h>
+#include <Poco/AtomicCounter.h>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+
+namespace DistFS {
+
+// Spreads the chunks of one chunk server over several disks (JBOD). Every data directory has a
+// chunk store of its own, with its own disk engine as that disk's I/O queue. New chunks go to
+// the healthy disk with the most free space per operation in flight on it. New versions go to
+// the disk of their source, so reflinks and overlays keep working.
+//
+// A disk that keeps failing I/O is isolated: its chunks disappear from list(), so the next
+// heartbeat tells the meta server they are gone. The other disks carry on serving.
+class MultiDiskChunkStore: public ChunkStore {
+public:
+    // Takes ownership of `disks`. Their disk_engine and io_scheduler have to be set by the caller, the remaining
+    // settings are copied from this store on open().
+    MultiDiskChunkStore(const std::vector<ChunkStore*>& disks, const std::vector<Path>& directories);
+    ~MultiDiskChunkStore();
+
+    void open() override;
+    void close() override;
+
+    bool exists(const std::string& chunk_id) override;
+    int64_t size(const std::string& chunk_id) override;
+    bool meta(const std::string& chunk_id, ChunkMeta& meta) override;
+    SharedPtr<ChunkFile> openPlain(const std::string& chunk_id) override;
+    std::vector<uint8_t> read(const std::string& chunk_id, int64_t offset, int64_t length) override;
+
+    using ChunkStore::create;
+    void create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) override;
+    bool update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) override;
+    bool remove(const std::string& chunk_id) override;
+    std::vector<std::string> list() override;
+    bool append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) override;
+    std::map<std::string, UInt32> versions() override;
+
+    int compact(int limit) override;
+    int64_t verify(const std::string& chunk_id) override;
+    void quarantine(const std::string& chunk_id) override;
+
+    // Fired with the data directory and the reason whenever a disk is isolated.
+    BasicEvent<const std::string> disk_failed;
+
+    // I/O errors within disk_error_window seconds after which a disk is isolated. Older errors
+    // are forgotten (0 never forgets them), so a disk with the odd transient error stays in service.
+    int max_disk_errors;
+    int disk_error_window;
+
+protected:
+    struct Disk {
+        ChunkStore* store;
+        Path directory;
+        AtomicCounter inflight;
+        Mutex errors_mutex;
+        std::deque<Timestamp> errors;   // within disk_error_window, oldest first
+        std::atomic<bool> failed;
+    };
+
+    // Counts the operation towards the disk's load for as long as it runs.
+    class Operation {
+    public:
+        Operation(Disk& disk): disk(disk) { ++disk.inflight; }
+        ~Operation() { --disk.inflight; }
+    private:
+        Disk& disk;
+    };
+
+    // Run `operation` on the disk's store. I/O errors count towards isolating the disk, a missing
+    // file is an ordinary race with a delete and doesn't.
+    template <typename Result, typename Function>
+    Result onDisk(Disk& disk, Function operation) {
+        Operation counted(disk);
+        try {
+            return operation(*disk.store);
+        } catch(FileNotFoundException&) {
+            throw;
+        } catch(IOException& e) {
+            diskError(disk, e.displayText());
+            throw;
+        }
+    }
+
+    // The disk holding the chunk. Throws FileNotFoundException if no healthy disk does.
+    Disk& diskOf(const std::string& chunk_id);
+    bool findDisk(const std::string& chunk_id, size_t& index);
+    size_t chooseDisk();
+    void place(const std::string& chunk_id, size_t index);
+    void diskError(Disk& disk, const std::string& reason);
+    void isolate(size_t index, const std::string& reason);
+    void onChunkCorrupted(const void* sender, const std::string& chunk_id);
+
+    std::vector<uint8_t> readRaw(const std::string& chunk_id, int64_t offset, int64_t length) override;
+    int64_t computeChecksums(const std::string& chunk_id) override;
+
+    std::vector<SharedPtr<Disk>> disks;
+    AtomicCounter next_disk;
+    // chunk id -> index of the disk holding it
+    RWLock placement_lock;
+    std::unordered_map<std::string, size_t> placement;
+};
+
+}
+#endif
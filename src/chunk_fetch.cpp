@@ -0,0 +1,189 @@
+#include "chunk_fetch.h"
+
+#include <Poco/Thread.h>
+#include <algorithm>
+
+namespace DistFS {
+
+bool readReplicatedChunk(const std::vector<std::string>& addresses, const std::string& chunk_id, int64_t offset, int64_t extent, std::vector<uint8_t>& content) {
+    // A replica that fails its checksum answers with an error, fall back to the next one.
+    for(auto it=addresses.begin(); it!=addresses.end(); ++it) {
+        std::string address = *it;
+        try {
+            content = getChunk(address, chunk_id, offset, extent);
+        } catch(Exception& e) {
+            content.clear();
+        }
+        if((int64_t)content.size() == extent) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ChunkFetcher::ChunkFetcher(const std::vector<ChunkExtent>& extents, const std::vector<std::vector<std::string>>& addresses,
+        int concurrency, int64_t window_bytes):
+    extents(extents),
+    addresses(addresses),
+    window_bytes(std::max<int64_t>(window_bytes, 1)),
+    next_task(0),
+    next_extent(0),
+    outstanding(0),
+    stopped(false),
+    contents(extents.size()),
+    done(extents.size(), 0)
+{
+    concurrency = std::max(concurrency, 1);
+    int64_t slice_bytes = std::max<int64_t>(this->window_bytes / concurrency, 1);
+    for(size_t begin=0; begin<extents.size();) {
+        std::map<std::string, size_t> by_server;
+        int64_t bytes = 0;
+        size_t end = begin;
+        for(; end<extents.size() && (end == begin || bytes + extents[end].length <= slice_bytes); end++) {
+            bytes += extents[end].length;
+            if(addresses[end].empty()) {
+                continue;
+            }
+            auto it = by_server.find(addresses[end].front());
+            if(it == by_server.end()) {
+                it = by_server.insert(std::make_pair(addresses[end].front(), tasks.size())).first;
+                tasks.push_back({std::vector<size_t>(), 0});
+            }
+            tasks[it->second].indexes.push_back(end);
+            tasks[it->second].bytes += extents[end].length;
+        }
+        begin = end;
+    }
+    start(concurrency);
+}
+
+ChunkFetcher::ChunkFetcher(const std::vector<ChunkExtent>& extents, Reader read, int concurrency, int64_t window_bytes):
+    extents(extents),
+    addresses(no_addresses),
+    read(read),
+    window_bytes(std::max<int64_t>(window_bytes, 1)),
+    next_task(0),
+    next_extent(0),
+    outstanding(0),
+    stopped(false),
+    contents(extents.size()),
+    done(extents.size(), 0)
+{
+    for(size_t i=0; i<extents.size(); i++) {
+        tasks.push_back({std::vector<size_t>(1, i), extents[i].length});
+    }
+    start(std::max(concurrency, 1));
+}
+
+void ChunkFetcher::start(int concurrency) {
+    for(size_t i=0; i<std::min(tasks.size(), (size_t)concurrency); i++) {
+        threads.push_back(new Thread);
+        std::string client = ClientScope::current();
+        threads.back()->startFunc([this, client]() {
+            ClientScope client_scope(client);
+            work();
+        });
+    }
+}
+
+ChunkFetcher::~ChunkFetcher() {
+    {
+        ScopedLock<Mutex> lock(mutex);
+        stopped = true;
+        changed.broadcast();
+    }
+    for(auto it=threads.begin(); it!=threads.end(); ++it) {
+        (*it)->join();
+    }
+}
+
+bool ChunkFetcher::next(std::vector<uint8_t>& content) {
+    size_t i;
+    {
+        ScopedLock<Mutex> lock(mutex);
+        if(next_extent >= extents.size()) {
+            return false;
+        }
+        i = next_extent++;
+        if(!hole(i)) {
+            while(!done[i]) {
+                changed.wait(mutex);
+            }
+            content.swap(contents[i]);
+            std::vector<uint8_t>().swap(contents[i]);
+            outstanding -= extents[i].length;
+            changed.broadcast();
+            return (int64_t)content.size() == extents[i].length;
+        }
+    }
+    // Zeros made up here.
+    content.assign((size_t)extents[i].length, 0);
+    return true;
+}
+
+void ChunkFetcher::work() {
+    for(;;) {
+        size_t task;
+        {
+            ScopedLock<Mutex> lock(mutex);
+            // The first task past the window still starts when nothing is outstanding.
+            while(!stopped && next_task < tasks.size() && outstanding > 0 && outstanding + tasks[next_task].bytes > window_bytes) {
+                changed.wait(mutex);
+            }
+            if(stopped || next_task >= tasks.size()) {
+                return;
+            }
+            task = next_task++;
+            outstanding += tasks[task].bytes;
+        }
+        fetch(tasks[task]);
+    }
+}
+
+void ChunkFetcher::fetch(const Task& task) {
+    if(read) {
+        std::vector<std::vector<uint8_t>> results(task.indexes.size());
+        for(size_t j=0; j<task.indexes.size(); j++) {
+            if(!read(task.indexes[j], results[j])) {
+                results[j].clear();
+            }
+        }
+        ScopedLock<Mutex> lock(mutex);
+        for(size_t j=0; j<task.indexes.size(); j++) {
+            contents[task.indexes[j]].swap(results[j]);
+            done[task.indexes[j]] = 1;
+        }
+        changed.broadcast();
+        return;
+    }
+
+    std::vector<ChunkExtent> batch;
+    for(auto it=task.indexes.begin(); it!=task.indexes.end(); ++it) {
+        batch.push_back(extents[*it]);
+    }
+    const std::string& address = addresses[task.indexes.front()].front();
+    std::vector<std::vector<uint8_t>> results;
+    try {
+        results = requestGetChunks(address, batch);
+    } catch(Exception& e) {
+        Application::instance().logger().warning("Batched read from " + address + " failed: " + e.displayText());
+    }
+    results.resize(task.indexes.size());
+
+    for(size_t j=0; j<task.indexes.size(); j++) {
+        size_t i = task.indexes[j];
+        if((int64_t)results[j].size() != extents[i].length) {
+            std::vector<std::string> others(addresses[i].begin()+1, addresses[i].end());
+            readReplicatedChunk(others, extents[i].chunk_id, extents[i].offset, extents[i].length, results[j]);
+        }
+    }
+
+    ScopedLock<Mutex> lock(mutex);
+    for(size_t j=0; j<task.indexes.size(); j++) {
+        contents[task.indexes[j]].swap(results[j]);
+        done[task.indexes[j]] = 1;
+    }
+    changed.broadcast();
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef DISTFS_CHUNK_FETCH_H
+#define DISTFS_CHUNK_FETCH_H
+
+#include "common.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/SharedPtr.h>
+#include <functional>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// Read `extent` bytes at `offset` of a chunk from the first replica that delivers them all.
+bool readReplicatedChunk(const std::vector<std::string>& addresses, const std::string& chunk_id, int64_t offset, int64_t extent, std::vector<uint8_t>& content);
+
+// Reads the extents of a replicated file over `concurrency` threads and hands their contents
+// back in order, so a read takes about as long as its slowest server needs for its share instead
+// of the sum of every round trip.
+//
+// The extents are cut in file order into tasks of about window_bytes / concurrency: the chunks
+// of a slice that share a first replica are one batched request to it, and chunks the batch
+// didn't deliver are read from the other replicas. Tasks start in order, as long as the bytes
+// fetched but not yet taken by next() stay within window_bytes. Extents without addresses are
+// holes and come back as zeros.
+class ChunkFetcher {
+public:
+    // Reads extent i into the buffer, false if it couldn't.
+    typedef std::function<bool(size_t, std::vector<uint8_t>&)> Reader;
+
+    // addresses[i] are the replicas of extents[i], the first one asked first.
+    ChunkFetcher(const std::vector<ChunkExtent>& extents, const std::vector<std::vector<std::string>>& addresses,
+        int concurrency, int64_t window_bytes);
+    // Every extent read with `read` on its own, for chunks that aren't plain replicas. Holes are
+    // up to `read` too.
+    ChunkFetcher(const std::vector<ChunkExtent>& extents, Reader read, int concurrency, int64_t window_bytes);
+    // Waits for the requests under way.
+    ~ChunkFetcher();
+
+    // The content of the next extent, as soon as it is there. False if no replica delivered it,
+    // or all extents were taken.
+    bool next(std::vector<uint8_t>& content);
+
+protected:
+    struct Task {
+        std::vector<size_t> indexes;
+        int64_t bytes;
+    };
+
+    void start(int concurrency);
+    void work();
+    void fetch(const Task& task);
+    // Extent i is a hole, made up as zeros.
+    bool hole(size_t i) const {
+        return !read && addresses[i].empty();
+    }
+
+    const std::vector<ChunkExtent>& extents;
+    std::vector<std::vector<std::string>> no_addresses;
+    const std::vector<std::vector<std::string>>& addresses;
+    Reader read;
+    int64_t window_bytes;
+    std::vector<Task> tasks;
+
+    Mutex mutex;
+    Condition changed;
+    size_t next_task;
+    size_t next_extent;
+    int64_t outstanding;    // bytes of started tasks not yet taken
+    bool stopped;
+    std::vector<std::vector<uint8_t>> contents;
+    std::vector<char> done;
+    std::vector<SharedPtr<Thread>> threads;
+
+private:
+    ChunkFetcher(const ChunkFetcher&);
+    ChunkFetcher& operator = (const ChunkFetcher&);
+};
+
+}
+#endif
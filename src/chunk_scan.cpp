@@ -0,0 +1,571 @@
+#include "chunk_scan.h"
+
+#include <Poco/BinaryWriter.h>
+#include <Poco/BinaryReader.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/JSON/Parser.h>
+#include <Poco/Util/Application.h>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DISTFS_SCAN_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTFS_TARGET_AVX2
+#else
+#define DISTFS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace DistFS {
+
+using namespace Poco::Net;
+using namespace Poco::Util;
+
+namespace {
+
+// Index of the lowest set bit, `mask` must not be 0.
+inline unsigned lowestBit(UInt32 mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+const uint8_t* lastByte(const uint8_t* data, size_t length, uint8_t byte) {
+    for(size_t i=length; i>0; i--) {
+        if(data[i-1] == byte) {
+            return data + i - 1;
+        }
+    }
+    return nullptr;
+}
+
+}
+
+size_t countByteSoftware(const uint8_t* data, size_t length, uint8_t byte) {
+    size_t count = 0;
+    for(size_t i=0; i<length; i++) {
+        count += data[i] == byte;
+    }
+    return count;
+}
+
+bool allZeroSoftware(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for(; i + 8 <= length; i += 8) {
+        UInt64 word;
+        memcpy(&word, data + i, 8);
+        if(word != 0) {
+            return false;
+        }
+    }
+    for(; i<length; i++) {
+        if(data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const uint8_t* findSubstringSoftware(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length) {
+    if(needle_length == 0) {
+        return data;
+    }
+    const uint8_t* end = data + length;
+    const uint8_t* at = data;
+    while(end - at >= (ptrdiff_t)needle_length) {
+        at = (const uint8_t*)memchr(at, needle[0], (size_t)(end - at) - needle_length + 1);
+        if(at == nullptr) {
+            return nullptr;
+        }
+        if(memcmp(at + 1, needle + 1, needle_length - 1) == 0) {
+            return at;
+        }
+        at++;
+    }
+    return nullptr;
+}
+
+void byteHistogram(const uint8_t* data, size_t length, UInt64* counts) {
+    // Consecutive equal bytes would make every increment wait for the previous one; four tables
+    // let neighbouring bytes count independently.
+    UInt64 tables[4][256] = {};
+    size_t i = 0;
+    for(; i + 4 <= length; i += 4) {
+        tables[0][data[i]]++;
+        tables[1][data[i+1]]++;
+        tables[2][data[i+2]]++;
+        tables[3][data[i+3]]++;
+    }
+    for(; i<length; i++) {
+        tables[0][data[i]]++;
+    }
+    for(int value=0; value<256; value++) {
+        counts[value] += tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+    }
+}
+
+namespace {
+
+#if defined(DISTFS_SCAN_X86)
+
+// A matching byte compares to -1, so subtracting the compare counts it in every byte lane. The
+// lanes are added up with psadbw before they can overflow.
+size_t countByteSSE2(const uint8_t* data, size_t length, uint8_t byte) {
+    const __m128i target = _mm_set1_epi8((char)byte);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i total = zero;
+    size_t i = 0;
+    while(i + 16 <= length) {
+        __m128i lanes = zero;
+        for(int round=0; round<255 && i + 16 <= length; round++, i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(block, target));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(lanes, zero));
+    }
+    UInt64 sums[2];
+    _mm_storeu_si128((__m128i*)sums, total);
+    return (size_t)(sums[0] + sums[1]) + countByteSoftware(data + i, length - i, byte);
+}
+
+DISTFS_TARGET_AVX2 size_t countByteAVX2(const uint8_t* data, size_t length, uint8_t byte) {
+    const __m256i target = _mm256_set1_epi8((char)byte);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+    while(i + 32 <= length) {
+        __m256i lanes = zero;
+        for(int round=0; round<255 && i + 32 <= length; round++, i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(block, target));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(lanes, zero));
+    }
+    UInt64 sums[4];
+    _mm256_storeu_si256((__m256i*)sums, total);
+    return (size_t)(sums[0] + sums[1] + sums[2] + sums[3]) + countByteSoftware(data + i, length - i, byte);
+}
+
+bool allZeroSSE2(const uint8_t* data, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 128 <= length; i += 128) {
+        const __m128i* block = (const __m128i*)(data + i);
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+            _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+        any = _mm_or_si128(any, _mm_or_si128(_mm_or_si128(_mm_loadu_si128(block + 4), _mm_loadu_si128(block + 5)),
+            _mm_or_si128(_mm_loadu_si128(block + 6), _mm_loadu_si128(block + 7))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) {
+            return false;
+        }
+    }
+    return allZeroSoftware(data + i, length - i);
+}
+
+DISTFS_TARGET_AVX2 bool allZeroAVX2(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for(; i + 128 <= length; i += 128) {
+        const __m256i* block = (const __m256i*)(data + i);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(block), _mm256_loadu_si256(block + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(block + 2), _mm256_loadu_si256(block + 3)));
+        if(!_mm256_testz_si256(any, any)) {
+            return false;
+        }
+    }
+    return allZeroSoftware(data + i, length - i);
+}
+
+// Compare the needle's first byte at 16 positions and its last byte 16 positions further along;
+// only where both match are the bytes in between compared.
+const uint8_t* findSubstringSSE2(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length) {
+    if(needle_length < 2) {
+        return findSubstringSoftware(data, length, needle, needle_length);
+    }
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[needle_length-1]);
+    size_t i = 0;
+    for(; i + needle_length - 1 + 16 <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(data + i + needle_length - 1));
+        UInt32 mask = (UInt32)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while(mask != 0) {
+            unsigned bit = lowestBit(mask);
+            if(memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringSoftware(data + i, length - i, needle, needle_length);
+}
+
+DISTFS_TARGET_AVX2 const uint8_t* findSubstringAVX2(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length) {
+    if(needle_length < 2) {
+        return findSubstringSoftware(data, length, needle, needle_length);
+    }
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[needle_length-1]);
+    size_t i = 0;
+    for(; i + needle_length - 1 + 32 <= length; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(data + i + needle_length - 1));
+        UInt32 mask = (UInt32)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while(mask != 0) {
+            unsigned bit = lowestBit(mask);
+            if(memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringSoftware(data + i, length - i, needle, needle_length);
+}
+
+bool detectAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+typedef size_t (*CountByteFunction)(const uint8_t*, size_t, uint8_t);
+typedef const uint8_t* (*FindSubstringFunction)(const uint8_t*, size_t, const uint8_t*, size_t);
+typedef bool (*AllZeroFunction)(const uint8_t*, size_t);
+
+struct Implementation {
+    const char* name;
+    CountByteFunction count_byte;
+    FindSubstringFunction find_substring;
+    AllZeroFunction all_zero;
+
+    Implementation() {
+#if defined(DISTFS_SCAN_X86)
+        // SSE2 is part of x86-64.
+        if(detectAVX2()) {
+            name = "avx2";
+            count_byte = countByteAVX2;
+            find_substring = findSubstringAVX2;
+            all_zero = allZeroAVX2;
+        } else {
+            name = "sse2";
+            count_byte = countByteSSE2;
+            find_substring = findSubstringSSE2;
+            all_zero = allZeroSSE2;
+        }
+#else
+        name = "scalar";
+        count_byte = countByteSoftware;
+        find_substring = findSubstringSoftware;
+        all_zero = allZeroSoftware;
+#endif
+    }
+};
+
+const Implementation& implementation() {
+    static const Implementation selected;
+    return selected;
+}
+
+}
+
+size_t countByte(const uint8_t* data, size_t length, uint8_t byte) {
+    return implementation().count_byte(data, length, byte);
+}
+
+const uint8_t* findSubstring(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length) {
+    return implementation().find_substring(data, length, needle, needle_length);
+}
+
+bool allZero(const uint8_t* data, size_t length) {
+    return implementation().all_zero(data, length);
+}
+
+const char* scanImplementation() {
+    return implementation().name;
+}
+
+std::string scanOpName(ScanOp op) {
+    switch(op) {
+    case SCAN_HISTOGRAM:
+        return "histogram";
+    case SCAN_GREP:
+        return "grep";
+    default:
+        return "lines";
+    }
+}
+
+bool parseScanOp(const std::string& name, ScanOp& op) {
+    if(name == "lines") {
+        op = SCAN_LINES;
+    } else if(name == "histogram") {
+        op = SCAN_HISTOGRAM;
+    } else if(name == "grep") {
+        op = SCAN_GREP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+LineMatcher::LineMatcher(const ScanQuery& query):
+    pattern(query.pattern)
+{
+    if(query.op == SCAN_GREP && query.regex) {
+        regex = new RegularExpression(query.pattern);
+    }
+}
+
+bool LineMatcher::matches(const uint8_t* line, size_t length) const {
+    if(!regex.isNull()) {
+        // Searched for anywhere in the line, like grep; match(subject) would anchor it.
+        RegularExpression::Match match;
+        return regex->match(std::string((const char*)line, length), 0, match) > 0;
+    }
+    return findSubstring(line, length, (const uint8_t*)pattern.data(), pattern.size()) != nullptr;
+}
+
+ScanResult scanExtent(const ScanQuery& query, const uint8_t* data, size_t length) {
+    ScanResult result;
+    if(query.op == SCAN_HISTOGRAM) {
+        result.histogram.assign(256, 0);
+        byteHistogram(data, length, result.histogram.data());
+        result.lines = (int64_t)result.histogram['\n'];
+        return result;
+    }
+    result.lines = (int64_t)countByte(data, length, '\n');
+    if(query.op != SCAN_GREP) {
+        return result;
+    }
+
+    const uint8_t* end = data + length;
+    const uint8_t* first = (const uint8_t*)memchr(data, '\n', length);
+    if(first == nullptr) {
+        result.head.assign((const char*)data, length);
+        return result;
+    }
+    const uint8_t* last = lastByte(data, length, '\n');
+    result.has_newline = true;
+    result.head.assign((const char*)data, (size_t)(first - data));
+    result.tail.assign((const char*)last + 1, (size_t)(end - last - 1));
+
+    // The complete lines are first+1 .. last, the newline at `last` ending the final one. One more match than asked for tells the caller
+    // the list was cut.
+    LineMatcher matcher(query);
+    size_t limit = (size_t)std::max<int64_t>(query.max_matches, 0) + 1;
+    const uint8_t* counted = data;  // newlines before here are in `line`
+    int64_t line = 0;
+    auto addMatch = [&](const uint8_t* line_begin, const uint8_t* line_end) {
+        line += (int64_t)countByte(counted, (size_t)(line_begin - counted), '\n');
+        counted = line_begin;
+        result.matches.push_back({(int64_t)(line_begin - data), line, std::string((const char*)line_begin, (size_t)(line_end - line_begin))});
+    };
+
+    const uint8_t* at = first + 1;
+    if(query.regex) {
+        while(at <= last && result.matches.size() < limit) {
+            const uint8_t* line_end = (const uint8_t*)memchr(at, '\n', (size_t)(last - at) + 1);
+            if(matcher.matches(at, (size_t)(line_end - at))) {
+                addMatch(at, line_end);
+            }
+            at = line_end + 1;
+        }
+        return result;
+    }
+    // Substrings are searched for over all the lines at once, which skips the ones without a match
+    // at the kernel's speed. A hit is widened to its line.
+    const uint8_t* needle = (const uint8_t*)query.pattern.data();
+    size_t needle_length = query.pattern.size();
+    while(at <= last && result.matches.size() < limit) {
+        const uint8_t* hit = findSubstring(at, (size_t)(last - at), needle, needle_length);
+        if(hit == nullptr) {
+            break;
+        }
+        const uint8_t* line_begin = lastByte(at, (size_t)(hit - at), '\n');
+        line_begin = line_begin == nullptr ? at : line_begin + 1;
+        const uint8_t* line_end = (const uint8_t*)memchr(hit, '\n', (size_t)(last - hit) + 1);
+        if(line_end - hit < (ptrdiff_t)needle_length) {
+            // The hit spans a newline, look again from the next line.
+            at = line_end + 1;
+            continue;
+        }
+        addMatch(line_begin, line_end);
+        at = line_end + 1;
+    }
+    return result;
+}
+
+void writeScanResult(std::ostream& ostr, const ScanResult& result) {
+    BinaryWriter writer(ostr, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+    writer << (Int64)result.lines;
+    writer << result.has_newline;
+    writer << (UInt32)result.histogram.size();
+    for(auto it=result.histogram.begin(); it!=result.histogram.end(); ++it) {
+        writer << *it;
+    }
+    writer << (UInt32)result.matches.size();
+    for(auto it=result.matches.begin(); it!=result.matches.end(); ++it) {
+        writer << (Int64)it->offset;
+        writer << (Int64)it->line;
+        writer << it->text;
+    }
+    writer << result.head;
+    writer << result.tail;
+    writer.flush();
+}
+
+ScanResult readScanResult(std::istream& istr) {
+    BinaryReader reader(istr, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+    ScanResult result;
+    Int64 lines = 0;
+    UInt32 count = 0;
+    reader >> lines;
+    reader >> result.has_newline;
+    reader >> count;
+    if(count > 256) {
+        throw DataFormatException("Bad scan histogram");
+    }
+    result.lines = lines;
+    result.histogram.resize(count);
+    for(UInt32 i=0; i<count; i++) {
+        reader >> result.histogram[i];
+    }
+    reader >> count;
+    for(UInt32 i=0; i<count && reader.good(); i++) {
+        Int64 offset = 0, line = 0;
+        std::string text;
+        reader >> offset;
+        reader >> line;
+        reader >> text;
+        result.matches.push_back({offset, line, text});
+    }
+    reader >> result.head;
+    reader >> result.tail;
+    if(!reader.good()) {
+        throw DataFormatException("Truncated scan result");
+    }
+    return result;
+}
+
+ScanMerger::ScanMerger(const ScanQuery& query):
+    lines(0),
+    truncated(false),
+    query(query),
+    matcher(query),
+    pending_offset(0)
+{
+    if(query.op == SCAN_HISTOGRAM) {
+        histogram.assign(256, 0);
+    }
+}
+
+void ScanMerger::add(int64_t position, int64_t length, const ScanResult& result) {
+    int64_t lines_before = lines;
+    lines += result.lines;
+    for(size_t i=0; i<histogram.size() && i<result.histogram.size(); i++) {
+        histogram[i] += result.histogram[i];
+    }
+    if(query.op != SCAN_GREP) {
+        return;
+    }
+
+    pending += result.head;
+    if(!result.has_newline) {
+        return;
+    }
+    // The line that started before this extent ends at its first newline.
+    if(matcher.matches((const uint8_t*)pending.data(), pending.size())) {
+        addMatch(pending_offset, lines_before + 1, pending);
+    }
+    for(auto it=result.matches.begin(); it!=result.matches.end(); ++it) {
+        addMatch(position + it->offset, lines_before + it->line + 1, it->text);
+    }
+    pending = result.tail;
+    pending_offset = position + length - (int64_t)result.tail.size();
+}
+
+void ScanMerger::finish() {
+    if(query.op == SCAN_GREP && !pending.empty() && matcher.matches((const uint8_t*)pending.data(), pending.size())) {
+        addMatch(pending_offset, lines + 1, pending);
+    }
+    pending.clear();
+}
+
+void ScanMerger::addMatch(int64_t offset, int64_t line, const std::string& text) {
+    if((int64_t)matches.size() >= query.max_matches) {
+        truncated = true;
+        return;
+    }
+    matches.push_back({offset, line, text});
+}
+
+std::vector<bool> requestScanChunks(std::string address, const ScanQuery& query, const std::vector<ChunkExtent>& extents, std::vector<ScanResult>& results) {
+    std::vector<bool> scanned(extents.size(), false);
+    results.assign(extents.size(), ScanResult());
+
+    JSON::Array::Ptr chunks_json(new JSON::Array);
+    for(auto it=extents.begin(); it!=extents.end(); ++it) {
+        JSON::Object::Ptr extent_json(new JSON::Object);
+        extent_json->set("chunk_id", it->chunk_id);
+        extent_json->set("offset", it->offset);
+        extent_json->set("length", it->length);
+        chunks_json->add(extent_json);
+    }
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("op", scanOpName(query.op));
+    req_json->set("pattern", query.pattern);
+    req_json->set("regex", query.regex);
+    req_json->set("max_matches", query.max_matches);
+    req_json->set("chunks", chunks_json);
+
+    URI uri("http://"+address);
+    uri.setPath("/scan");
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/json");
+    request.setChunkedTransferEncoding(true);
+
+    try {
+        PooledSession session(uri.getHost(), uri.getPort());
+        req_json->stringify(session.sendRequest(request));
+
+        HTTPResponse response;
+        std::istream& resp_stream = session.receiveResponse(response);
+        if(response.getStatus() != HTTPResponse::HTTP_OK) {
+            return scanned;
+        }
+
+        // A frame per extent in request order, its data is the serialized ScanResult.
+        ChunkFrame frame;
+        for(size_t i=0; i<extents.size() && readChunkFrame(resp_stream, frame); i++) {
+            if(frame.chunk_id != extents[i].chunk_id) {
+                throw DataFormatException("Unexpected chunk " + frame.chunk_id + " in scan from " + address);
+            }
+            if(frame.status == HTTPResponse::HTTP_OK) {
+                std::istringstream frame_stream(std::string(frame.data.begin(), frame.data.end()));
+                results[i] = readScanResult(frame_stream);
+                scanned[i] = true;
+            }
+        }
+    } catch(Exception& e) {
+        Application::instance().logger().warning("Scanning " + std::to_string(extents.size()) + " chunks on " + address + " failed: " + e.displayText());
+    }
+    return scanned;
+}
+
+}
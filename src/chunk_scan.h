@@ -0,0 +1,123 @@
+#ifndef DISTFS_CHUNK_SCAN_H
+#define DISTFS_CHUNK_SCAN_H
+
+#include "common.h"
+
+#include <Poco/RegularExpression.h>
+#include <Poco/SharedPtr.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// What a scan computes over a range of a file.
+enum ScanOp {
+    SCAN_LINES = 0,         // count the lines
+    SCAN_HISTOGRAM = 1,     // count every byte value
+    SCAN_GREP = 2           // the lines that contain the pattern
+};
+
+// "lines", "histogram" or "grep".
+std::string scanOpName(ScanOp op);
+// Returns false for an unknown name.
+bool parseScanOp(const std::string& name, ScanOp& op);
+
+struct ScanQuery {
+    ScanOp op = SCAN_LINES;
+    std::string pattern;
+    bool regex = false;         // pattern is a PCRE matched against each line, a substring otherwise
+    int64_t max_matches = 1000;
+};
+
+struct ScanMatch {
+    int64_t offset;             // of the line, from the start of the scanned range
+    int64_t line;               // newlines in the range before it
+    std::string text;           // without the newline
+};
+
+// What a chunk server returns for one extent. Lines that cross the extent's edges are only known
+// to the caller: the bytes before the first and after the last newline are sent back instead of
+// being matched, and the caller stitches them to the neighbouring extents.
+struct ScanResult {
+    int64_t lines = 0;                  // newlines in the extent
+    std::vector<UInt64> histogram;      // 256 counts, histogram scans only
+    std::vector<ScanMatch> matches;     // grep: the lines in between that match, at most max_matches
+    bool has_newline = false;
+    std::string head;                   // grep: up to the first newline, all of it if there is none
+    std::string tail;                   // grep: after the last newline
+};
+
+// Matches a single line against the query's pattern.
+class LineMatcher {
+public:
+    // Throws RegularExpressionException for a regex that doesn't compile.
+    LineMatcher(const ScanQuery& query);
+
+    bool matches(const uint8_t* line, size_t length) const;
+
+protected:
+    std::string pattern;
+    SharedPtr<RegularExpression> regex;
+};
+
+// Scan `length` bytes of an extent. Throws RegularExpressionException for a bad regex.
+ScanResult scanExtent(const ScanQuery& query, const uint8_t* data, size_t length);
+
+void writeScanResult(std::ostream& ostr, const ScanResult& result);
+// Throws DataFormatException if the stream ends early.
+ScanResult readScanResult(std::istream& istr);
+
+// Puts the results of the consecutive extents of a range back together, in order: lines split
+// between extents are stitched and matched here, counts are summed.
+class ScanMerger {
+public:
+    ScanMerger(const ScanQuery& query);
+
+    // `position` and `length` of the extent in the range.
+    void add(int64_t position, int64_t length, const ScanResult& result);
+    // Matches the last line if it has no newline.
+    void finish();
+
+    int64_t lines;
+    std::vector<UInt64> histogram;
+    // Line numbers are 1-based, counted from the start of the range.
+    std::vector<ScanMatch> matches;
+    bool truncated;
+
+protected:
+    void addMatch(int64_t offset, int64_t line, const std::string& text);
+
+    ScanQuery query;
+    LineMatcher matcher;
+    std::string pending;        // a line that started in an earlier extent
+    int64_t pending_offset;
+};
+
+// Scan extents of chunks on the chunk server at `address` in one request. Fills `results` in the
+// order of `extents` and returns which of them were scanned.
+std::vector<bool> requestScanChunks(std::string address, const ScanQuery& query, const std::vector<ChunkExtent>& extents, std::vector<ScanResult>& results);
+
+// Occurrences of `byte`. Uses AVX2 or SSE2 compares when the CPU has them.
+size_t countByte(const uint8_t* data, size_t length, uint8_t byte);
+size_t countByteSoftware(const uint8_t* data, size_t length, uint8_t byte);
+
+// First occurrence of the needle, null if there is none. The AVX2 path compares the needle's first
+// and last byte at 32 positions at once and only checks the rest where both match.
+const uint8_t* findSubstring(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length);
+const uint8_t* findSubstringSoftware(const uint8_t* data, size_t length, const uint8_t* needle, size_t needle_length);
+
+// Whether every byte is 0, the write path stores such chunks as holes. The vector paths OR 128
+// bytes at a time together and stop at the first block with a nonzero byte.
+bool allZero(const uint8_t* data, size_t length);
+bool allZeroSoftware(const uint8_t* data, size_t length);
+
+// Adds the count of every byte value to `counts[256]`.
+void byteHistogram(const uint8_t* data, size_t length, UInt64* counts);
+
+// "avx2", "sse2" or "scalar".
+const char* scanImplementation();
+
+}
+#endif
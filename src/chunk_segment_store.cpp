@@ -0,0 +1,466 @@
+#include "chunk_segment_store.h"
+#include "crc32c.h"
+
+#include <Poco/File.h>
+#include <Poco/BinaryWriter.h>
+#include <Poco/BinaryReader.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/NumberFormatter.h>
+#include <Poco/NumberParser.h>
+#include <Poco/Timestamp.h>
+#include <algorithm>
+#include <sstream>
+
+namespace DistFS {
+
+// Every record is the magic, the length and CRC32C of the header, the header, then the chunk
+// data. The data is covered by the block checksums in the header.
+static const char* RECORD_MAGIC = "DFSR";
+static const int64_t RECORD_PREFIX = 12;
+static const UInt32 MAX_HEADER = 16*1024*1024;
+
+static const UInt8 RECORD_CHUNK = 1;
+static const UInt8 RECORD_TOMBSTONE = 2;
+
+SegmentChunkStore::SegmentChunkStore(const Path& root_directory, long open_files):
+    ChunkStore(root_directory),
+    segment_size(64*1024*1024),
+    compaction_threshold(0.5),
+    active_segment(0),
+    closed(false),
+    file_cache(open_files)
+{
+    segment_directory = Path(root_directory).pushDirectory("segments");
+    catalog_path = Path(segment_directory).append("index");
+}
+
+void SegmentChunkStore::open() {
+    makeDirectories(segment_directory);
+    file_cache.setDiskEngine(disk_engine, direct_io, io_scheduler);
+
+    bool loaded = openCatalog();
+
+    ScopedLock<Mutex> lock(segment_mutex);
+    std::vector<std::string> files = listDirectory(segment_directory);
+    for(auto it=files.begin(); it!=files.end(); ++it) {
+        unsigned number = 0;
+        if(it->compare(0, 8, "segment-") == 0 && NumberParser::tryParseUnsigned(it->substr(8), number)) {
+            segments[number].size = (int64_t)File(segmentPath(number)).getSize();
+        }
+    }
+
+    if(!loaded) {
+        rebuildCatalog();
+    }
+
+    std::vector<std::string> chunks = catalog.ids();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        ChunkMeta meta;
+        if(catalog.find(*it, meta)) {
+            segments[meta.segment].live += meta.size;
+        }
+    }
+
+    // Always append to a fresh segment, so a tail torn by a crash is never written after.
+    startSegment(segments.empty() ? 1 : segments.rbegin()->first + 1);
+}
+
+void SegmentChunkStore::close() {
+    ScopedLock<Mutex> lock(segment_mutex);
+    if(closed) {
+        return;
+    }
+    closed = true;
+    active_stream.close();
+    saveCatalog();
+}
+
+void SegmentChunkStore::create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) {
+    std::string buffer;
+    StreamCopier::copyToString(content, buffer);
+    std::vector<uint8_t> data(buffer.begin(), buffer.end());
+
+    ChunkMeta meta;
+    meta.size = (int64_t)data.size();
+    meta.created = source.created != 0 ? source.created : Timestamp().epochMicroseconds();
+    meta.checksum_block_size = checksum_block_size;
+    meta.block_checksums = blockChecksums(data.data(), meta.size, checksum_block_size);
+    meta.codec = source.codec;
+    meta.uncompressed_size = source.uncompressed_size;
+    meta.version = source.version;
+
+    {
+        ScopedLock<Mutex> lock(segment_mutex);
+        putChunk(chunk_id, meta, data);
+    }
+    // Outside segment_mutex, so concurrent writers can share a group sync.
+    makeDurable({segmentPath(meta.segment), segment_directory.toString()});
+}
+
+bool SegmentChunkStore::update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) {
+    UInt32 segment;
+    {
+        ScopedLock<Mutex> lock(segment_mutex);
+        if(!writeVersion(chunk_id, new_id, begin_pos, content, segment)) {
+            return false;
+        }
+    }
+    makeDurable({segmentPath(segment), segment_directory.toString()});
+    return true;
+}
+
+bool SegmentChunkStore::writeVersion(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content, UInt32& segment) {
+    // Caller holds segment_mutex.
+
+    if(begin_pos < 0) {
+        throw InvalidArgumentException("Negative write position in chunk " + chunk_id);
+    }
+    ChunkMeta src_meta;
+    if(!catalog.find(chunk_id, src_meta)) {
+        return false;
+    }
+    if(src_meta.codec != CODEC_NONE) {
+        throw InvalidAccessException("Chunk " + chunk_id + " is compressed");
+    }
+
+    // Verified, so a corrupt chunk isn't copied into a new version.
+    std::vector<uint8_t> data = read(chunk_id, 0, src_meta.size);
+    int64_t end_pos = begin_pos + (int64_t)content.size();
+    data.resize((size_t)std::max(src_meta.size, end_pos), 0);
+    std::copy(content.begin(), content.end(), data.begin() + begin_pos);
+
+    ChunkMeta meta;
+    meta.size = (int64_t)data.size();
+    meta.created = Timestamp().epochMicroseconds();
+    meta.checksum_block_size = checksum_block_size;
+    meta.block_checksums = blockChecksums(data.data(), meta.size, checksum_block_size);
+    putChunk(new_id, meta, data);
+    segment = meta.segment;
+    return true;
+}
+
+bool SegmentChunkStore::remove(const std::string& chunk_id) {
+    ScopedLock<Mutex> lock(segment_mutex);
+
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        return false;
+    }
+
+    ChunkMeta tombstone;
+    append(chunk_id, tombstone, nullptr, 0, true);
+    catalog.erase(chunk_id);
+    release(meta);
+    return true;
+}
+
+int SegmentChunkStore::compact(int limit) {
+    ScopedLock<Mutex> lock(segment_mutex);
+    if(closed) {
+        // The catalog has already been saved, don't change anything behind its back.
+        return 0;
+    }
+
+    std::vector<std::pair<double, UInt32>> candidates;
+    for(auto it=segments.begin(); it!=segments.end(); ++it) {
+        if(it->first == active_segment) {
+            continue;
+        }
+        double live = it->second.size > 0 ? (double)it->second.live / (double)it->second.size : 0.0;
+        if(live < compaction_threshold) {
+            candidates.push_back({live, it->first});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    int compacted = 0;
+    for(auto it=candidates.begin(); it!=candidates.end() && compacted < limit; ++it) {
+        compactSegment(it->second);
+        compacted++;
+    }
+    return compacted;
+}
+
+void SegmentChunkStore::quarantine(const std::string& chunk_id) {
+    ScopedLock<Mutex> lock(segment_mutex);
+
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        return;
+    }
+
+    // Keep the bad bytes around for inspection.
+    try {
+        writeFile(corruptPath(chunk_id), readRaw(chunk_id, 0, meta.size));
+    } catch(Exception&) {
+        // Losing the copy is fine, serving it is not.
+    }
+
+    ChunkMeta tombstone;
+    append(chunk_id, tombstone, nullptr, 0, true);
+    catalog.erase(chunk_id);
+    release(meta);
+
+    chunk_corrupted.notify(this, chunk_id);
+}
+
+std::string SegmentChunkStore::segmentPath(UInt32 segment) {
+    return Path(segment_directory).append("segment-" + NumberFormatter::format0(segment, 8)).toString();
+}
+
+int64_t SegmentChunkStore::scanSegment(UInt32 segment, const std::function<void(const Record&)>& visit) {
+    std::string path = segmentPath(segment);
+    std::ifstream ifile(path.c_str(), std::ios::binary);
+    if(!ifile.good()) {
+        throw FileNotFoundException(path);
+    }
+    int64_t file_size = (int64_t)File(path).getSize();
+    BinaryReader reader(ifile, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+
+    int64_t pos = 0;
+    while(pos + RECORD_PREFIX <= file_size) {
+        std::string magic;
+        UInt32 header_size = 0;
+        UInt32 header_crc = 0;
+        reader.readRaw(4, magic);
+        reader >> header_size;
+        reader >> header_crc;
+        if(!reader.good() || magic != RECORD_MAGIC || header_size > MAX_HEADER || pos + RECORD_PREFIX + header_size > file_size) {
+            break;
+        }
+
+        std::string header;
+        reader.readRaw(header_size, header);
+        if(!reader.good() || crc32c(0, header.data(), header.size()) != header_crc) {
+            break;
+        }
+
+        std::istringstream header_stream(header);
+        BinaryReader header_reader(header_stream, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+        UInt8 type = 0;
+        Int64 created = 0;
+        Int64 size = 0;
+        Record record;
+        header_reader >> type;
+        header_reader >> record.chunk_id;
+        header_reader >> created;
+        header_reader >> size;
+        header_reader >> record.meta.checksum_block_size;
+        header_reader >> record.meta.block_checksums;
+        // Records written before compression end here.
+        if(header_reader.good() && header_stream.peek() != std::char_traits<char>::eof()) {
+            Int64 uncompressed_size = 0;
+            header_reader >> record.meta.codec;
+            header_reader >> uncompressed_size;
+            record.meta.uncompressed_size = uncompressed_size;
+        }
+
+        int64_t data_offset = pos + RECORD_PREFIX + header_size;
+        if(!header_reader.good() || size < 0 || data_offset + size > file_size) {
+            break;
+        }
+        record.tombstone = type == RECORD_TOMBSTONE;
+        record.meta.size = size;
+        record.meta.created = created;
+        record.meta.segment = segment;
+        record.meta.offset = data_offset;
+        visit(record);
+
+        pos = data_offset + size;
+        ifile.seekg(pos);
+    }
+    return pos;
+}
+
+void SegmentChunkStore::rebuildCatalog() {
+    // Caller holds segment_mutex. Later records win, and segments are numbered in write order.
+    for(auto it=segments.begin(); it!=segments.end(); ++it) {
+        scanSegment(it->first, [this](const Record& record) {
+            if(record.tombstone) {
+                catalog.erase(record.chunk_id);
+            } else {
+                catalog.put(record.chunk_id, record.meta);
+            }
+        });
+    }
+}
+
+void SegmentChunkStore::startSegment(UInt32 segment) {
+    active_stream.close();
+    active_stream.clear();
+
+    active_segment = segment;
+    std::string path = segmentPath(segment);
+    active_stream.open(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+    if(!active_stream.good()) {
+        throw CreateFileException(path);
+    }
+    segments[segment].size = 0;
+}
+
+void SegmentChunkStore::append(const std::string& chunk_id, ChunkMeta& meta, const uint8_t* data, int64_t length, bool tombstone) {
+    // Caller holds segment_mutex.
+    std::ostringstream header_stream;
+    BinaryWriter header_writer(header_stream, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+    header_writer << (tombstone ? RECORD_TOMBSTONE : RECORD_CHUNK);
+    header_writer << chunk_id;
+    header_writer << (Int64)meta.created;
+    header_writer << (Int64)length;
+    header_writer << meta.checksum_block_size;
+    header_writer << meta.block_checksums;
+    header_writer << meta.codec;
+    header_writer << (Int64)meta.uncompressed_size;
+    header_writer.flush();
+    std::string header = header_stream.str();
+
+    Segment& segment = segments[active_segment];
+    IoScheduler::Ticket ticket(io_scheduler, RECORD_PREFIX + (int64_t)header.size() + length);
+    BinaryWriter writer(active_stream, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+    writer.writeRaw(RECORD_MAGIC, 4);
+    writer << (UInt32)header.size();
+    writer << crc32c(0, header.data(), header.size());
+    writer.writeRaw(header);
+    writer.writeRaw((const char*)data, (std::streamsize)length);
+    writer.flush();
+    // Readers pread the segment file, so the record has to leave our buffer before it is indexed.
+    active_stream.flush();
+    if(!active_stream.good()) {
+        throw WriteFileException(segmentPath(active_segment));
+    }
+
+    meta.size = length;
+    meta.segment = active_segment;
+    meta.offset = segment.size + RECORD_PREFIX + (int64_t)header.size();
+    meta.overlay = false;
+    segment.size = meta.offset + length;
+
+    if(segment.size >= segment_size) {
+        startSegment(active_segment + 1);
+    }
+}
+
+void SegmentChunkStore::putChunk(const std::string& chunk_id, ChunkMeta& meta, const std::vector<uint8_t>& data) {
+    // Caller holds segment_mutex.
+    ChunkMeta old_meta;
+    bool replaced = catalog.find(chunk_id, old_meta);
+
+    append(chunk_id, meta, data.data(), (int64_t)data.size(), false);
+    catalog.put(chunk_id, meta);
+    segments[meta.segment].live += meta.size;
+
+    if(replaced) {
+        release(old_meta);
+    }
+}
+
+void SegmentChunkStore::release(const ChunkMeta& meta) {
+    auto it = segments.find(meta.segment);
+    if(it != segments.end()) {
+        it->second.live -= meta.size;
+    }
+}
+
+void SegmentChunkStore::relocate(const std::string& chunk_id, const ChunkMeta& current) {
+    // Caller holds segment_mutex.
+    std::vector<uint8_t> data;
+    try {
+        data = read(chunk_id, 0, current.size);
+    } catch(ChunkCorruptException&) {
+        // Quarantined, nothing left to move.
+        return;
+    }
+
+    ChunkMeta meta = current;
+    append(chunk_id, meta, data.data(), (int64_t)data.size(), false);
+    catalog.put(chunk_id, meta);
+    segments[meta.segment].live += meta.size;
+    release(current);
+}
+
+void SegmentChunkStore::compactSegment(UInt32 segment) {
+    // Caller holds segment_mutex.
+    bool older_segments = segments.begin()->first < segment;
+    UInt32 first_written = active_segment;
+
+    scanSegment(segment, [this, segment, older_segments](const Record& record) {
+        ChunkMeta current;
+        bool live = catalog.find(record.chunk_id, current);
+        if(record.tombstone) {
+            // Still needed while an older segment may hold the record it deletes.
+            if(!live && older_segments) {
+                ChunkMeta tombstone;
+                append(record.chunk_id, tombstone, nullptr, 0, true);
+            }
+            return;
+        }
+        if(live && current.segment == segment && current.offset == record.meta.offset) {
+            relocate(record.chunk_id, current);
+        }
+    });
+
+    // Records past a damaged one were never visited, move them by their catalog entries.
+    if(segments[segment].live > 0) {
+        std::vector<std::string> chunks = catalog.ids();
+        for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+            ChunkMeta current;
+            if(catalog.find(*it, current) && current.segment == segment) {
+                relocate(*it, current);
+            }
+        }
+    }
+
+    // The records moved out have to be durable before the only other copy goes.
+    std::vector<std::string> written;
+    for(UInt32 s=first_written; s<=active_segment; s++) {
+        written.push_back(segmentPath(s));
+    }
+    written.push_back(segment_directory.toString());
+    makeDurable(written);
+
+    // Readers still holding the open segment can finish, the data stays until they let go.
+    std::string path = segmentPath(segment);
+    file_cache.invalidate(path);
+    File(path).remove();
+    segments.erase(segment);
+}
+
+std::vector<uint8_t> SegmentChunkStore::readRaw(const std::string& chunk_id, int64_t offset, int64_t length) {
+    for(int attempt=0; ; attempt++) {
+        ChunkMeta meta;
+        if(!catalog.find(chunk_id, meta)) {
+            throw FileNotFoundException(chunk_id);
+        }
+        int64_t start = std::min(offset, meta.size);
+        int64_t count = (length < 0 || start + length > meta.size) ? meta.size - start : length;
+
+        try {
+            SharedPtr<ChunkFile> file = file_cache.open(segmentPath(meta.segment));
+            std::vector<uint8_t> content((size_t)count);
+            content.resize((size_t)file->read(meta.offset + start, content.data(), count));
+            return content;
+        } catch(FileNotFoundException&) {
+            // Compaction may have moved the chunk and dropped the segment since we looked it up.
+            ChunkMeta moved;
+            if(attempt >= 2 || !catalog.find(chunk_id, moved) || moved.segment == meta.segment) {
+                throw;
+            }
+        }
+    }
+}
+
+int64_t SegmentChunkStore::computeChecksums(const std::string& chunk_id) {
+    // Only the catalog learns them, so they are kept across clean restarts only. The records
+    // written by this store always carry checksums, so this is rare.
+    ScopedLock<Mutex> lock(segment_mutex);
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta) || !meta.block_checksums.empty()) {
+        return 0;
+    }
+    std::vector<uint8_t> data = readRaw(chunk_id, 0, meta.size);
+    meta.checksum_block_size = checksum_block_size;
+    meta.block_checksums = blockChecksums(data.data(), (int64_t)data.size(), checksum_block_size);
+    catalog.put(chunk_id, meta);
+    return (int64_t)data.size();
+}
+
+}
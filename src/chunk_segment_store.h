@@ -0,0 +1,86 @@
+#ifndef DISTFS_CHUNK_SEGMENT_STORE_H
+#define DISTFS_CHUNK_SEGMENT_STORE_H
+
+#include "chunk_store.h"
+
+#include <functional>
+#include <fstream>
+
+namespace DistFS {
+
+// Log-structured storage for small chunks. Chunks are appended as records to large segment files
+// in `segments/`, so millions of chunks take a few hundred files instead of an inode each, and
+// writing one is an append to an already open file. The catalog doubles as the index from chunk
+// id to segment and offset; after a crash it is rebuilt by replaying the segments in order.
+// Deletes append a tombstone, and the space of dead records is reclaimed by copying the live
+// records out of mostly dead segments and dropping them.
+//
+// Updates always append the complete new version. Chunks stored here are small, so there is
+// nothing to gain from overlays.
+class SegmentChunkStore: public ChunkStore {
+public:
+    SegmentChunkStore(const Path& root_directory, long open_files);
+
+    void open() override;
+    void close() override;
+
+    using ChunkStore::create;
+    void create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) override;
+    bool update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) override;
+    bool remove(const std::string& chunk_id) override;
+
+    // Rewrite up to `limit` sealed segments whose live fraction fell below compaction_threshold,
+    // emptiest first. Returns the number of segments dropped.
+    int compact(int limit) override;
+
+    // The record is copied to `corrupt/` and a tombstone appended.
+    void quarantine(const std::string& chunk_id) override;
+
+    Path segment_directory;
+    int64_t segment_size;           // a new segment is started once the active one is this large
+    double compaction_threshold;    // fraction of live data below which a segment is compacted
+
+protected:
+    struct Record {
+        bool tombstone;
+        std::string chunk_id;
+        ChunkMeta meta;             // segment and offset point at the data
+    };
+
+    struct Segment {
+        int64_t size = 0;
+        int64_t live = 0;           // bytes of chunk data the catalog still points at
+    };
+
+    std::string segmentPath(UInt32 segment);
+
+    // Calls `visit` for every intact record of the segment, in order. Stops at the first torn or
+    // damaged record and returns the offset where the intact records end.
+    int64_t scanSegment(UInt32 segment, const std::function<void(const Record&)>& visit);
+    void rebuildCatalog();
+    void startSegment(UInt32 segment);
+
+    // Append a record to the active segment and point `meta` at its data.
+    void append(const std::string& chunk_id, ChunkMeta& meta, const uint8_t* data, int64_t length, bool tombstone);
+    // update() without the sync. `segment` is set to the segment the new version went to.
+    bool writeVersion(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content, UInt32& segment);
+    void putChunk(const std::string& chunk_id, ChunkMeta& meta, const std::vector<uint8_t>& data);
+    void release(const ChunkMeta& meta);
+    void relocate(const std::string& chunk_id, const ChunkMeta& current);
+    void compactSegment(UInt32 segment);
+
+    std::vector<uint8_t> readRaw(const std::string& chunk_id, int64_t offset, int64_t length) override;
+    int64_t computeChecksums(const std::string& chunk_id) override;
+
+    // Guards the active segment, the segment table and changes to the catalog.
+    Mutex segment_mutex;
+    std::map<UInt32, Segment> segments;
+    UInt32 active_segment;
+    std::ofstream active_stream;
+    bool closed;
+
+    ChunkFileCache file_cache;
+};
+
+}
+#endif
@@ -5,15 +5,201 @@
 #include <Poco/DirectoryIterator.h>
 #include <Poco/Environment.h>
 #include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/URI.h>
 #include <Poco/StreamCopier.h>
+#include <Poco/Delegate.h>
+#include <Poco/Event.h>
+#include <Poco/Timestamp.h>
+#include <Poco/StringTokenizer.h>
+#include <Poco/BufferedStreamBuf.h>
+#include <Poco/NullStream.h>
+#include <Poco/MemoryStream.h>
+#include <Poco/String.h>
+#include <Poco/Net/HTTPClientSession.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <iterator>
 #include <algorithm>
 
+#if POCO_OS == POCO_OS_LINUX
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
 namespace DistFS {
 
+// Send `length` bytes of `file`, starting from `offset`, as the response body.
+// The headers (with Content-Length) are flushed first, then on Linux the body goes straight
+// from the page cache to the socket with sendfile(2), so the bytes never enter user space.
+// Other platforms copy the file through the response stream. The body goes out in windows,
+// the disk read of each one admitted by the file's I/O scheduler.
+void sendFileRange(HTTPServerRequest& request, HTTPServerResponse& response, ChunkFile& file, int64_t offset, int64_t length) {
+    response.setContentLength64(length);
+    // Not in chunks, even on a keep-alive connection: the body goes around the response stream.
+    response.setChunkedTransferEncoding(false);
+
+#if POCO_OS == POCO_OS_LINUX
+    int fd = file.fd();
+
+    std::ostream& ostr = response.send();
+    ostr.flush();
+
+    StreamSocket& socket = static_cast<HTTPServerRequestImpl&>(request).socket();
+    int sock_fd = socket.impl()->sockfd();
+
+    const int64_t window = 1024*1024;
+    off_t pos = (off_t)offset;
+    int64_t remaining = length;
+    while(remaining > 0) {
+        off_t window_end = pos + (off_t)std::min(remaining, window);
+        {
+            // Only the disk read is admitted: the window is read into the page cache under the
+            // ticket, so a slow client holds up its own connection and not the disk's slots.
+            IoScheduler::Ticket ticket(file.scheduler(), window_end - pos);
+            ::readahead(fd, pos, (size_t)(window_end - pos));
+        }
+        while(pos < window_end) {
+            ssize_t sent = ::sendfile(sock_fd, fd, &pos, (size_t)(window_end - pos));
+            if(sent < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw NetException("sendfile failed on " + file.path(), errno);
+            }
+            if(sent == 0) {
+                // File is shorter than expected (truncated under us), the peer will see a short body.
+                return;
+            }
+            remaining -= sent;
+        }
+    }
+#else
+    std::ifstream ifile(file.path().c_str(), std::ios::binary);
+    ifile.seekg(offset);
+    std::ostream& ostr = response.send();
+    StreamCopier::copyStream(ifile, ostr);
+    ifile.close();
+#endif
+}
+
+// The I/O class a request asks for in its X-IO-Priority header, `fallback` if it doesn't.
+IoClass requestIoClass(const HTTPServerRequest& request, IoClass fallback) {
+    IoClass io_class = fallback;
+    if(!parseIoClass(request.get("X-IO-Priority", ""), io_class)) {
+        return fallback;
+    }
+    return io_class;
+}
+
+// Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range against a file of
+// `size` bytes. Returns false if the header is malformed or the range can't be satisfied.
+bool parseByteRange(const std::string& header, int64_t size, int64_t& offset, int64_t& length) {
+    const std::string prefix = "bytes=";
+    if(header.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    std::string spec = header.substr(prefix.size());
+    size_t dash = spec.find('-');
+    if(dash == std::string::npos || spec.find(',') != std::string::npos) {
+        // Multipart ranges are not supported.
+        return false;
+    }
+    std::string first = spec.substr(0, dash);
+    std::string last = spec.substr(dash+1);
+
+    try {
+        if(first.empty()) {
+            int64_t suffix = std::stoll(last);
+            if(suffix <= 0) {
+                return false;
+            }
+            offset = std::max<int64_t>(0, size - suffix);
+            length = size - offset;
+        } else {
+            offset = std::stoll(first);
+            int64_t end = last.empty() ? size - 1 : std::min<int64_t>(std::stoll(last), size - 1);
+            if(offset >= size || end < offset) {
+                return false;
+            }
+            length = end - offset + 1;
+        }
+    } catch(std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// Whether an Accept-Encoding header lists `encoding` without refusing it with q=0.
+bool acceptsEncoding(const std::string& header, const std::string& encoding) {
+    StringTokenizer codings(header, ",", StringTokenizer::TOK_IGNORE_EMPTY|StringTokenizer::TOK_TRIM);
+    for(auto it=codings.begin(); it!=codings.end(); ++it) {
+        StringTokenizer params(*it, ";", StringTokenizer::TOK_IGNORE_EMPTY|StringTokenizer::TOK_TRIM);
+        if(params.count() == 0 || icompare(params[0], encoding) != 0) {
+            continue;
+        }
+        for(size_t i=1; i<params.count(); i++) {
+            if(params[i] == "q=0" || params[i] == "q=0.0" || params[i] == "q=0.00" || params[i] == "q=0.000") {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// The request body of a chain-replicated create, read in blocks of CHAIN_BLOCK bytes. Each block
+// is passed on to the next replica as it is read, before the local store sees it. If the next
+// replica stops taking the body, it is dropped and the local copy goes on.
+class ChainForwardStreamBuf: public BufferedStreamBuf {
+public:
+    static const std::streamsize CHAIN_BLOCK = 64*1024;
+
+    ChainForwardStreamBuf(std::istream& source, std::ostream* next):
+        // BufferedStreamBuf keeps 4 bytes of the buffer for putback.
+        BufferedStreamBuf(CHAIN_BLOCK + 4, std::ios::in), source(source), next(next) {}
+
+    // Whether the whole body read so far reached the next replica.
+    bool forwarding() const {
+        return next != nullptr;
+    }
+
+protected:
+    int readFromDevice(char* buffer, std::streamsize length) {
+        source.read(buffer, length);
+        std::streamsize n = source.gcount();
+        if(n > 0 && next != nullptr) {
+            try {
+                next->write(buffer, n);
+                if(!next->good()) {
+                    next = nullptr;
+                }
+            } catch(Exception&) {
+                next = nullptr;
+            }
+        }
+        return (int)n;
+    }
+
+private:
+    std::istream& source;
+    std::ostream* next;
+};
+
+class ChainForwardStream: public std::istream {
+public:
+    ChainForwardStream(std::istream& source, std::ostream* next): std::istream(&buf), buf(source, next) {}
+
+    bool forwarding() const {
+        return buf.forwarding();
+    }
+
+private:
+    ChainForwardStreamBuf buf;
+};
+
 class GetChunkRequestHandler: public HTTPRequestHandler {
 public:
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
@@ -22,6 +208,7 @@ public:
 
         std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
         std::string chunk_id = query_map["chunk_id"];
+        IoScheduler::Scope io_scope(requestIoClass(request, IO_INTERACTIVE));
 
         /* Use json to get chunk id
         JSON::Parser jsonParser;
@@ -29,21 +216,157 @@ public:
         std::string chunk_id = req_json->getValue<std::string>("chunk_id");
         //*/
 
-        File chunk_file(Path(server.chunk_directory).append(chunk_id));
-        
-        if(!chunk_file.exists()  || !chunk_file.isFile()) {
+        ChunkStore& store = *server.chunk_store;
+
+        if(!store.exists(chunk_id)) {
             response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
             return;
         }
 
-        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        ChunkMeta meta;
+        if(!store.meta(chunk_id, meta)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
+            return;
+        }
+
+        int64_t size = meta.length();
+        int64_t offset = 0;
+        int64_t length = size;
+
+        // The extent can be given either as offset/length query parameters or as a Range header.
+        if(query_map.find("offset") != query_map.end() || query_map.find("length") != query_map.end()) {
+            try {
+                if(query_map.find("offset") != query_map.end()) {
+                    offset = std::stoll(query_map["offset"]);
+                }
+                if(query_map.find("length") != query_map.end()) {
+                    length = std::stoll(query_map["length"]);
+                }
+            } catch(std::exception&) {
+                response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+                response.send();
+                return;
+            }
+            if(offset < 0 || length < 0) {
+                response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+                response.send();
+                return;
+            }
+            length = std::min<int64_t>(length, size - offset);
+            if(offset > size) {
+                response.setStatusAndReason(HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE);
+                response.send();
+                return;
+            }
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        } else if(request.has("Range")) {
+            if(!parseByteRange(request.get("Range"), size, offset, length)) {
+                response.setStatusAndReason(HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE);
+                response.set("Content-Range", "bytes */" + std::to_string(size));
+                response.send();
+                return;
+            }
+            response.setStatusAndReason(HTTPResponse::HTTP_PARTIAL_CONTENT);
+            response.set("Content-Range", "bytes " + std::to_string(offset) + "-" + std::to_string(offset+length-1) + "/" + std::to_string(size));
+        } else {
+            // A client that inflates itself gets a whole compressed chunk as stored.
+            if(meta.codec == CODEC_ZLIB && acceptsEncoding(request.get("Accept-Encoding", ""), "deflate")) {
+                std::vector<uint8_t> stored;
+                try {
+                    stored = store.read(chunk_id, 0, meta.size);
+                } catch(ChunkCorruptException& e) {
+                    app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+                    response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+                    response.send();
+                    return;
+                }
+                response.setStatusAndReason(HTTPResponse::HTTP_OK);
+                response.setContentType("application/octet-stream");
+                response.set("Content-Encoding", "deflate");
+                response.set("X-Uncompressed-Length", std::to_string(meta.uncompressed_size));
+                response.sendBuffer(stored.data(), stored.size());
+                return;
+            }
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        }
+
+        response.set("Accept-Ranges", "bytes");
         response.setContentType("application/octet-stream");
 
-        { // ifile scope
-            std::ifstream ifile(chunk_file.path().c_str(), std::ios::binary);
-            std::ostream& ostr = response.send();
-            ostr << ifile.rdbuf();
-            ifile.close();
+        // Compressed chunks are inflated as a whole, and cached inflated.
+        if(meta.codec != CODEC_NONE) {
+            ChunkCache::Content content;
+            try {
+                content = server.inflatedChunk(chunk_id, meta);
+            } catch(Exception& e) {
+                app.logger().error("Chunk " + chunk_id + " is unreadable: " + e.displayText());
+                response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+                response.send();
+                return;
+            }
+            response.sendBuffer(content->data() + offset, (std::size_t)length);
+            return;
+        }
+
+        ChunkCache::Content cached;
+        try {
+            cached = server.cachedChunk(chunk_id, size);
+        } catch(ChunkCorruptException& e) {
+            app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send();
+            return;
+        }
+        if(!cached.isNull()) {
+            response.sendBuffer(cached->data() + offset, (std::size_t)length);
+            return;
+        }
+
+        SharedPtr<ChunkFile> file = store.openPlain(chunk_id);
+        if(!file.isNull()) {
+            // With verify_reads, a chunk is checked in full on its first read, later reads go out
+            // with sendfile too.
+            try {
+                if(store.verify_reads) {
+                    server.verifyOnce(chunk_id, meta);
+                }
+            } catch(ChunkCorruptException& e) {
+                app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+                response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+                response.send();
+                return;
+            }
+            sendFileRange(request, response, *file, offset, length);
+            return;
+        }
+
+        // Overlay chunks have to go through user space. Send the range one window at a time, the
+        // first one is read before the headers go out so that a corrupt chunk can still be
+        // answered with an error.
+        const int64_t window = 1024*1024;
+        std::vector<uint8_t> content;
+        try {
+            content = store.read(chunk_id, offset, std::min(length, window));
+        } catch(ChunkCorruptException& e) {
+            app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send();
+            return;
+        }
+
+        response.setContentLength64(length);
+        response.setChunkedTransferEncoding(false);
+        std::ostream& ostr = response.send();
+        int64_t pos = offset;
+        while(true) {
+            ostr.write((const char*)content.data(), content.size());
+            pos += (int64_t)content.size();
+            if(pos >= offset + length || content.empty()) {
+                break;
+            }
+            content = store.read(chunk_id, pos, std::min(offset + length - pos, window));
         }
     }
 };
@@ -59,7 +382,7 @@ public:
         app.logger().information("Pushing chunks list to "+ meta_server_addr+"...");
 
         std::vector<std::string> chunks_list = server.getChunksList();
-        int resp_code = requestUpdateChunksList(meta_server_addr, server.server_id, chunks_list);
+        int resp_code = requestUpdateChunksList(meta_server_addr, server.server_id, chunks_list, server.chunk_store->versions());
 
         app.logger().information("Push chunks list response code: "+std::to_string(resp_code));
         response.setStatusAndReason(HTTPResponse::HTTP_OK);
@@ -75,21 +398,122 @@ public:
         std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
 
         std::string chunk_id = query_map["chunk_id"];
+        IoClass io_class = requestIoClass(request, IO_WRITE);
+        IoScheduler::Scope io_scope(io_class);
 
-        File chunk_file(Path(server.chunk_directory).append(chunk_id));
-        
-        { // ofile scope
-            std::ofstream ofile(chunk_file.path().c_str(), std::ios::out|std::ios::binary);
-            std::istream& istr = request.stream();
-            StreamCopier copier;
-            copier.copyStream(istr, ofile);
-            ofile.close();
+        UInt8 codec = CODEC_NONE;
+        if(!parseCodec(query_map["compression"], codec)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
         }
 
-        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        // Chain replication: the replicas after this one, in order. The body is passed on to the
+        // next one while it is still arriving, and it is acknowledged once the whole rest of the
+        // chain has answered. The answer tells whether this server stored it, and which servers of
+        // the chain after it did, so the sender can retry the others.
+        std::vector<std::string> chain;
+        StringTokenizer chain_tokens(query_map["chain"], ",", StringTokenizer::TOK_IGNORE_EMPTY|StringTokenizer::TOK_TRIM);
+        chain.assign(chain_tokens.begin(), chain_tokens.end());
+
+        std::istream& body = request.stream();
+        SharedPtr<PooledSession> next_session;
+        std::ostream* next_stream = nullptr;
+        if(!chain.empty()) {
+            std::vector<std::string> rest(chain.begin()+1, chain.end());
+            URI uri("http://"+chain.front());
+            uri.setPath("/create_chunk");
+            URI::QueryParameters param = {
+                {"chunk_id", chunk_id},
+                {"chain", cat(std::string(","), rest.begin(), rest.end())}
+            };
+            if(codec != CODEC_NONE) {
+                param.push_back({"compression", codecName(codec)});
+            }
+            uri.setQueryParameters(param);
+            HTTPRequest next_request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+            next_request.setContentType("application/octet-stream");
+            next_request.set("X-IO-Priority", ioClassName(io_class));
+            if(request.hasContentLength()) {
+                next_request.setContentLength64(request.getContentLength64());
+            } else {
+                next_request.setChunkedTransferEncoding(true);
+            }
+            try {
+                next_session = new PooledSession(uri.getHost(), uri.getPort());
+                next_stream = &next_session->sendRequest(next_request);
+            } catch(Exception& e) {
+                app.logger().warning("Chain replication of chunk " + chunk_id + " to " + chain.front() + " failed: " + e.displayText());
+                next_session.reset();
+                next_stream = nullptr;
+            }
+        }
+
+        ChainForwardStream forward(body, next_stream);
+
+        bool stored = false;
+        try {
+            if(codec != CODEC_NONE) {
+                // Every replica compresses its own copy, the chain carries the plain bytes.
+                std::string body;
+                StreamCopier::copyToString(forward, body);
+                server.storeChunk(chunk_id, std::vector<uint8_t>(body.begin(), body.end()), codec);
+            } else {
+                server.chunk_store->create(chunk_id, forward);
+            }
+            stored = true;
+        } catch(Exception& e) {
+            app.logger().warning("Creating chunk " + chunk_id + " failed: " + e.displayText());
+        }
+        // Whatever the local store left unread still has to reach the rest of the chain.
+        NullOutputStream discard;
+        StreamCopier::copyStream(forward, discard);
+
+        // A connection that dropped early ends the body early, never store a truncated chunk.
+        ChunkMeta meta;
+        if(stored && request.hasContentLength() &&
+                (!server.chunk_store->meta(chunk_id, meta) || meta.length() != request.getContentLength64())) {
+            app.logger().warning("Chunk " + chunk_id + " arrived truncated");
+            server.chunk_store->remove(chunk_id);
+            stored = false;
+        }
+
+        JSON::Array::Ptr committed_json(new JSON::Array);
+        if(next_stream && !forward.forwarding()) {
+            app.logger().warning("Chain replication of chunk " + chunk_id + " to " + chain.front() + " failed while sending");
+        } else if(next_stream) {
+            try {
+                next_stream->flush();
+                HTTPResponse next_response;
+                std::istream& next_istr = next_session->receiveResponse(next_response);
+                JSON::Parser parser;
+                JSON::Object::Ptr next_json = parser.parse(next_istr).extract<JSON::Object::Ptr>();
+                if(next_json->optValue<bool>("stored", false)) {
+                    committed_json->add(chain.front());
+                }
+                JSON::Array::Ptr next_committed = next_json->getArray("committed");
+                for(size_t i=0; !next_committed.isNull() && i<next_committed->size(); i++) {
+                    committed_json->add(next_committed->getElement<std::string>(i));
+                }
+            } catch(Exception& e) {
+                app.logger().warning("Chain replication of chunk " + chunk_id + " to " + chain.front() + " failed: " + e.displayText());
+            }
+        }
+        int replicas = (stored ? 1 : 0) + (int)committed_json->size();
+
+        bool all_ok = replicas == (int)chain.size() + 1;
+        if(all_ok) {
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        } else {
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+        }
         response.setContentType("application/json");
         JSON::Object::Ptr resp_json(new JSON::Object);
-        resp_json->set("status", "success");
+        resp_json->set("status", all_ok ? "success" : "failed");
+        // Replicas written by this server and the ones after it.
+        resp_json->set("replicas", replicas);
+        resp_json->set("stored", stored);
+        resp_json->set("committed", committed_json);
         std::ostream& ostr = response.send();
         resp_json->stringify(ostr);
 
@@ -107,25 +531,65 @@ public:
 
         std::string chunk_id = query_map["chunk_id"];
         std::string new_id = query_map["new_id"];
-        int64_t begin_pos = std::stoi(query_map["begin_pos"]);
+        IoScheduler::Scope io_scope(requestIoClass(request, IO_WRITE));
+        int64_t begin_pos = 0;
+        try {
+            begin_pos = std::stoll(query_map["begin_pos"]);
+        } catch(std::exception&) {
+            begin_pos = -1;
+        }
+        if(begin_pos < 0) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
 
-        File chunk_file(Path(server.chunk_directory).append(chunk_id));
-        
-        { // file scope
-            std::fstream file(chunk_file.path().c_str(), std::ios::in|std::ios::out|std::ios::binary);
-            file.seekp(begin_pos);
-            std::istream& istr = request.stream();
-            std::cout << istr.tellg();
-            //file << istr.rdbuf();
-            //file.close();
-            StreamCopier copier;
-            copier.copyStream(istr, file);
-            file.close();
-            std::cout << istr.tellg();
-        }
-        // rename the file
-        chunk_file.copyTo(Path(server.chunk_directory).append(new_id).toString());
-        //chunk_file.renameTo(Path(server.chunk_directory).append(new_id).toString());
+        std::string body;
+        StreamCopier::copyToString(request.stream(), body);
+        std::vector<uint8_t> content(body.begin(), body.end());
+
+        ChunkStore& store = *server.chunk_store;
+        ChunkMeta meta;
+        if(!store.meta(chunk_id, meta)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
+            return;
+        }
+        // Checked before the codec decides how the write is applied: a compressed chunk is
+        // rewritten in memory, so it can't grow past the largest chunk.
+        if(meta.codec != CODEC_NONE && begin_pos > server.max_chunk_size - (int64_t)content.size()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        // The original chunk is left untouched, new_id is created next to it.
+        try {
+            if(meta.codec != CODEC_NONE) {
+                // The write is at an offset of the inflated content, so the new version is
+                // inflated, written to and compressed again.
+                std::vector<uint8_t> data = decompressChunk(meta.codec, store.read(chunk_id, 0, meta.size), meta.uncompressed_size);
+                int64_t end_pos = begin_pos + (int64_t)content.size();
+                data.resize((size_t)std::max((int64_t)data.size(), end_pos), 0);
+                std::copy(content.begin(), content.end(), data.begin() + begin_pos);
+                server.storeChunk(new_id, data, meta.codec);
+            } else if(!store.update(chunk_id, new_id, begin_pos, content)) {
+                response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+                response.send();
+                return;
+            }
+        } catch(ChunkCorruptException& e) {
+            // Don't copy a corrupt chunk into a new version.
+            app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send();
+            return;
+        } catch(DataFormatException& e) {
+            app.logger().error("Chunk " + chunk_id + " doesn't inflate: " + e.displayText());
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send();
+            return;
+        }
 
         response.setStatusAndReason(HTTPResponse::HTTP_OK);
         response.setContentType("application/json");
@@ -139,6 +603,76 @@ public:
     } 
 };
 
+// Extends a chunk in place for an append to the file's tail chunk. The meta server keeps the
+// version every replica is expected at, a replica that missed an append is left at an older one.
+class AppendChunkRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+        std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
+
+        std::string chunk_id = query_map["chunk_id"];
+        IoScheduler::Scope io_scope(requestIoClass(request, IO_WRITE));
+        int64_t offset = 0;
+        UInt32 version = 0;
+        try {
+            offset = std::stoll(query_map["offset"]);
+            version = (UInt32)std::stoul(query_map["version"]);
+        } catch(std::exception&) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        std::string body;
+        StreamCopier::copyToString(request.stream(), body);
+        std::vector<uint8_t> content(body.begin(), body.end());
+
+        ChunkStore& store = *server.chunk_store;
+        ChunkMeta meta;
+        if(!store.meta(chunk_id, meta)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
+            return;
+        }
+
+        HTTPResponse::HTTPStatus status = HTTPResponse::HTTP_OK;
+        if(meta.version == version && meta.size == offset + (int64_t)content.size()) {
+            // A retry of an append that already went through.
+        } else {
+            try {
+                if(!store.append(chunk_id, offset, content, version)) {
+                    status = HTTPResponse::HTTP_NOT_IMPLEMENTED;
+                }
+            } catch(ChunkVersionException& e) {
+                app.logger().warning("Append to " + chunk_id + " as version " + std::to_string(version) + " refused: " + e.displayText());
+                status = HTTPResponse::HTTP_CONFLICT;
+            } catch(FileNotFoundException&) {
+                status = HTTPResponse::HTTP_NOT_FOUND;
+            } catch(ChunkCorruptException& e) {
+                app.logger().error("Chunk " + chunk_id + " is corrupt: " + e.displayText());
+                status = HTTPResponse::HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+        if(status == HTTPResponse::HTTP_OK && server.chunk_cache != nullptr) {
+            server.chunk_cache->invalidate(chunk_id);
+        }
+
+        response.setStatusAndReason(status);
+        if(status != HTTPResponse::HTTP_OK) {
+            response.send();
+            return;
+        }
+        response.setContentType("application/json");
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", "success");
+        resp_json->set("version", version);
+        std::ostream& ostr = response.send();
+        resp_json->stringify(ostr);
+    }
+};
+
 class DeleteChunkRequestHandler: public HTTPRequestHandler {
 public:
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
@@ -148,15 +682,315 @@ public:
         JSON::Object::Ptr req_json = jsonParser.parse(request.stream()).extract<JSON::Object::Ptr>();
         std::string chunk_id = req_json->getValue<std::string>("chunk_id");
 
-        File chunk_file(Path(server.chunk_directory).append(chunk_id));
-        
-        if(!chunk_file.exists()  || !chunk_file.isFile()) {
+        if(server.chunk_cache != nullptr) {
+            server.chunk_cache->invalidate(chunk_id);
+        }
+        if(!server.chunk_store->remove(chunk_id)) {
             response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+            response.send();
             return;
         }
 
-        chunk_file.remove();
         response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.send();
+    }
+};
+
+// Read many chunk extents in one round trip. The body lists them as {"chunks": [{"chunk_id",
+// "offset", "length"}]}, and a frame per extent is streamed back in the same order.
+class MultiGetChunksRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+        IoScheduler::Scope io_scope(requestIoClass(request, IO_INTERACTIVE));
+
+        JSON::Array::Ptr chunks_json;
+        try {
+            JSON::Parser parser;
+            JSON::Object::Ptr req_json = parser.parse(request.stream()).extract<JSON::Object::Ptr>();
+            chunks_json = req_json->getArray("chunks");
+        } catch(Exception& e) {
+        }
+        if(chunks_json.isNull()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.setContentType("application/octet-stream");
+        response.setChunkedTransferEncoding(true);
+        std::ostream& ostr = response.send();
+        // Every extent is on its way from the disk while the first ones are sent.
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            JSON::Object::Ptr extent_json = chunks_json->getObject(i);
+            server.chunk_store->prefetch(extent_json->getValue<std::string>("chunk_id"),
+                extent_json->optValue<int64_t>("offset", 0), extent_json->optValue<int64_t>("length", -1));
+        }
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            JSON::Object::Ptr extent_json = chunks_json->getObject(i);
+            std::string chunk_id = extent_json->getValue<std::string>("chunk_id");
+            std::vector<uint8_t> content;
+            int status = server.readChunk(chunk_id, extent_json->optValue<int64_t>("offset", 0), extent_json->optValue<int64_t>("length", -1), content);
+            if(status != HTTPResponse::HTTP_OK) {
+                content.clear();
+            }
+            writeChunkFrame(ostr, chunk_id, status, content.data(), (int64_t)content.size());
+            AdmissionControl::streamed((int64_t)content.size());
+        }
+    }
+};
+
+// Evaluate a scan on chunk extents stored here, so only its result crosses the network. The body
+// is the query ({"op", "pattern", "regex", "max_matches"}) and the extents as for multi_get; a frame
+// per extent with the serialized ScanResult is streamed back in the same order.
+class ScanChunksRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+        IoScheduler::Scope io_scope(requestIoClass(request, IO_INTERACTIVE));
+
+        ScanQuery query;
+        JSON::Array::Ptr chunks_json;
+        try {
+            JSON::Parser parser;
+            JSON::Object::Ptr req_json = parser.parse(request.stream()).extract<JSON::Object::Ptr>();
+            if(parseScanOp(req_json->optValue<std::string>("op", "lines"), query.op)) {
+                chunks_json = req_json->getArray("chunks");
+            }
+            query.pattern = req_json->optValue<std::string>("pattern", "");
+            query.regex = req_json->optValue<bool>("regex", false);
+            query.max_matches = req_json->optValue<int64_t>("max_matches", query.max_matches);
+            LineMatcher check(query);
+        } catch(Exception& e) {
+            chunks_json.reset();
+        }
+        if(chunks_json.isNull()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.setContentType("application/octet-stream");
+        response.setChunkedTransferEncoding(true);
+        std::ostream& ostr = response.send();
+        // Every extent is on its way from the disk while the first ones are sent.
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            JSON::Object::Ptr extent_json = chunks_json->getObject(i);
+            server.chunk_store->prefetch(extent_json->getValue<std::string>("chunk_id"),
+                extent_json->optValue<int64_t>("offset", 0), extent_json->optValue<int64_t>("length", -1));
+        }
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            JSON::Object::Ptr extent_json = chunks_json->getObject(i);
+            std::string chunk_id = extent_json->getValue<std::string>("chunk_id");
+            std::vector<uint8_t> content;
+            int status = server.readChunk(chunk_id, extent_json->optValue<int64_t>("offset", 0), extent_json->optValue<int64_t>("length", -1), content);
+            std::string result;
+            if(status == HTTPResponse::HTTP_OK) {
+                std::ostringstream result_stream;
+                writeScanResult(result_stream, scanExtent(query, content.data(), content.size()));
+                result = result_stream.str();
+            }
+            writeChunkFrame(ostr, chunk_id, status, (const uint8_t*)result.data(), (int64_t)result.size());
+        }
+    }
+};
+
+// Create many chunks in one round trip: the body is a frame per chunk. Like create_chunk, the
+// batch is passed down the `chain` while it arrives, and the answer counts the replicas stored
+// of every chunk. It also lists the chunks this server stored, and which servers of the chain
+// after it stored each chunk.
+class MultiCreateChunksRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+        std::map<std::string, std::string> query_map = getQueryMap(URI(request.getURI()));
+        IoClass io_class = requestIoClass(request, IO_WRITE);
+        IoScheduler::Scope io_scope(io_class);
+
+        UInt8 codec = CODEC_NONE;
+        if(!parseCodec(query_map["compression"], codec)) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        std::vector<std::string> chain;
+        StringTokenizer chain_tokens(query_map["chain"], ",", StringTokenizer::TOK_IGNORE_EMPTY|StringTokenizer::TOK_TRIM);
+        chain.assign(chain_tokens.begin(), chain_tokens.end());
+
+        SharedPtr<PooledSession> next_session;
+        std::ostream* next_stream = nullptr;
+        if(!chain.empty()) {
+            std::vector<std::string> rest(chain.begin()+1, chain.end());
+            URI uri("http://"+chain.front());
+            uri.setPath("/multi_create");
+            URI::QueryParameters param = {
+                {"chain", cat(std::string(","), rest.begin(), rest.end())}
+            };
+            if(codec != CODEC_NONE) {
+                param.push_back({"compression", codecName(codec)});
+            }
+            uri.setQueryParameters(param);
+            HTTPRequest next_request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+            next_request.setContentType("application/octet-stream");
+            next_request.set("X-IO-Priority", ioClassName(io_class));
+            next_request.setChunkedTransferEncoding(true);
+            try {
+                next_session = new PooledSession(uri.getHost(), uri.getPort());
+                next_stream = &next_session->sendRequest(next_request);
+            } catch(Exception& e) {
+                app.logger().warning("Chain replication of a chunk batch to " + chain.front() + " failed: " + e.displayText());
+                next_session.reset();
+                next_stream = nullptr;
+            }
+        }
+
+        ChainForwardStream forward(request.stream(), next_stream);
+
+        // chunk id -> stored by this server
+        std::map<std::string, bool> stored;
+        SyncQueue::Deferred deferred_sync(server.sync_queue);
+        try {
+            ChunkFrame frame;
+            while(readChunkFrame(forward, frame, server.max_chunk_size)) {
+                AdmissionControl::streamed((int64_t)frame.data.size());
+                stored[frame.chunk_id] = false;
+                try {
+                    server.storeChunk(frame.chunk_id, frame.data, codec);
+                    stored[frame.chunk_id] = true;
+                } catch(Exception& e) {
+                    app.logger().warning("Creating chunk " + frame.chunk_id + " failed: " + e.displayText());
+                }
+            }
+        } catch(DataFormatException& e) {
+            // A connection that dropped early, or a frame too big to take: the partial chunk
+            // isn't stored.
+            app.logger().warning("Chunk batch arrived truncated: " + e.displayText());
+        }
+        NullOutputStream discard;
+        StreamCopier::copyStream(forward, discard);
+
+        // One sync for the whole batch, while the rest of the chain stores its copies.
+        try {
+            deferred_sync.commit();
+        } catch(Exception& e) {
+            app.logger().warning("Syncing a chunk batch failed: " + e.displayText());
+            for(auto it=stored.begin(); it!=stored.end(); ++it) {
+                it->second = false;
+            }
+        }
+
+        // chunk id -> the servers after this one that stored it
+        std::map<std::string, std::vector<std::string>> committed;
+        if(next_stream && !forward.forwarding()) {
+            app.logger().warning("Chain replication of a chunk batch to " + chain.front() + " failed while sending");
+        } else if(next_stream) {
+            try {
+                next_stream->flush();
+                HTTPResponse next_response;
+                std::istream& next_istr = next_session->receiveResponse(next_response);
+                JSON::Parser parser;
+                JSON::Object::Ptr next_json = parser.parse(next_istr).extract<JSON::Object::Ptr>();
+                JSON::Array::Ptr next_stored = next_json->getArray("stored");
+                for(size_t i=0; !next_stored.isNull() && i<next_stored->size(); i++) {
+                    committed[next_stored->getElement<std::string>(i)].push_back(chain.front());
+                }
+                JSON::Object::Ptr next_committed = next_json->getObject("committed");
+                for(auto it=stored.begin(); !next_committed.isNull() && it!=stored.end(); ++it) {
+                    JSON::Array::Ptr servers_json = next_committed->getArray(it->first);
+                    for(size_t i=0; !servers_json.isNull() && i<servers_json->size(); i++) {
+                        committed[it->first].push_back(servers_json->getElement<std::string>(i));
+                    }
+                }
+            } catch(Exception& e) {
+                app.logger().warning("Chain replication of a chunk batch to " + chain.front() + " failed: " + e.displayText());
+            }
+        }
+
+        bool all_ok = true;
+        JSON::Object::Ptr replicas_json(new JSON::Object);
+        JSON::Array::Ptr stored_json(new JSON::Array);
+        JSON::Object::Ptr committed_json(new JSON::Object);
+        for(auto it=stored.begin(); it!=stored.end(); ++it) {
+            const std::vector<std::string>& servers = committed[it->first];
+            int replicas = (it->second ? 1 : 0) + (int)servers.size();
+            replicas_json->set(it->first, replicas);
+            if(it->second) {
+                stored_json->add(it->first);
+            }
+            JSON::Array::Ptr servers_json(new JSON::Array);
+            for(auto s=servers.begin(); s!=servers.end(); ++s) {
+                servers_json->add(*s);
+            }
+            committed_json->set(it->first, servers_json);
+            if(replicas != (int)chain.size() + 1) {
+                all_ok = false;
+            }
+        }
+        if(all_ok) {
+            response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        } else {
+            response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+        }
+        response.setContentType("application/json");
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", all_ok ? "success" : "failed");
+        resp_json->set("replicas", replicas_json);
+        resp_json->set("stored", stored_json);
+        resp_json->set("committed", committed_json);
+        std::ostream& ostr = response.send();
+        resp_json->stringify(ostr);
+    }
+};
+
+// Delete many chunks in one round trip. The body lists them as {"chunks": [...]}, the answer
+// tells which were deleted and which weren't there.
+class MultiDeleteChunksRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+
+        JSON::Array::Ptr chunks_json;
+        try {
+            JSON::Parser parser;
+            JSON::Object::Ptr req_json = parser.parse(request.stream()).extract<JSON::Object::Ptr>();
+            chunks_json = req_json->getArray("chunks");
+        } catch(Exception& e) {
+        }
+        if(chunks_json.isNull()) {
+            response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send();
+            return;
+        }
+
+        JSON::Array::Ptr deleted_json(new JSON::Array);
+        JSON::Array::Ptr missing_json(new JSON::Array);
+        for(unsigned int i=0; i<chunks_json->size(); i++) {
+            std::string chunk_id = chunks_json->getElement<std::string>(i);
+            if(server.chunk_cache != nullptr) {
+                server.chunk_cache->invalidate(chunk_id);
+            }
+            if(server.chunk_store->remove(chunk_id)) {
+                deleted_json->add(chunk_id);
+            } else {
+                missing_json->add(chunk_id);
+            }
+        }
+
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        response.setContentType("application/json");
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", "success");
+        resp_json->set("deleted", deleted_json);
+        resp_json->set("missing", missing_json);
+        std::ostream& ostr = response.send();
+        resp_json->stringify(ostr);
     }
 };
 
@@ -184,17 +1018,314 @@ public:
     }
 };
 
+class MetricsRequestHandler: public HTTPRequestHandler {
+public:
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+        Application& app = Application::instance();
+        ChunkServer& server = dynamic_cast<ChunkServer&>(app);
+
+        JSON::Object::Ptr durability_json(new JSON::Object);
+        SyncQueue* sync_queue = server.sync_queue;
+        durability_json->set("mode", durabilityName(sync_queue->durability()));
+        durability_json->set("writes", sync_queue->writes());
+        durability_json->set("flushes", sync_queue->flushes());
+        durability_json->set("group_syncs", sync_queue->batches());
+        durability_json->set("sync_wait_us", sync_queue->waitMicros());
+
+        JSON::Object::Ptr resp_json(new JSON::Object);
+        resp_json->set("status", "success");
+        resp_json->set("durability", durability_json);
+
+        // Summed over the disks.
+        JSON::Object::Ptr io_json(new JSON::Object);
+        for(int i=0; i<IO_CLASSES; i++) {
+            IoScheduler::Stats total;
+            for(auto it=server.io_schedulers.begin(); it!=server.io_schedulers.end(); ++it) {
+                IoScheduler::Stats stats = (*it)->stats((IoClass)i);
+                total.ops += stats.ops;
+                total.bytes += stats.bytes;
+                total.wait_us += stats.wait_us;
+                total.queued += stats.queued;
+                total.inflight += stats.inflight;
+            }
+            JSON::Object::Ptr class_json(new JSON::Object);
+            class_json->set("ops", total.ops);
+            class_json->set("bytes", total.bytes);
+            class_json->set("wait_us", total.wait_us);
+            class_json->set("queued", total.queued);
+            class_json->set("inflight", total.inflight);
+            io_json->set(ioClassName((IoClass)i), class_json);
+        }
+        resp_json->set("io", io_json);
+        TieredChunkStore* tiers = dynamic_cast<TieredChunkStore*>(server.chunk_store);
+        if(tiers != nullptr) {
+            TieredChunkStore::Stats stats = tiers->stats();
+            JSON::Object::Ptr tiers_json(new JSON::Object);
+            tiers_json->set("fast_chunks", stats.fast_chunks);
+            tiers_json->set("fast_bytes", stats.fast_bytes);
+            tiers_json->set("fast_capacity", tiers->fast_capacity);
+            tiers_json->set("capacity_chunks", stats.capacity_chunks);
+            tiers_json->set("capacity_bytes", stats.capacity_bytes);
+            tiers_json->set("promotions", stats.promotions);
+            tiers_json->set("demotions", stats.demotions);
+            resp_json->set("tiers", tiers_json);
+        }
+        if(server.chunk_cache != nullptr) {
+            JSON::Object::Ptr cache_json(new JSON::Object);
+            cache_json->set("capacity", server.chunk_cache->capacity());
+            cache_json->set("used", server.chunk_cache->used());
+            cache_json->set("hits", server.chunk_cache->hits());
+            cache_json->set("misses", server.chunk_cache->misses());
+            resp_json->set("cache", cache_json);
+        }
+        AdmissionControl::Stats admission = server.admission->stats();
+        JSON::Object::Ptr admission_json(new JSON::Object);
+        admission_json->set("admitted", admission.admitted);
+        admission_json->set("overloaded", admission.overloaded);
+        admission_json->set("throttled", admission.throttled);
+        admission_json->set("inflight", admission.inflight);
+        admission_json->set("inflight_bytes", admission.inflight_bytes);
+        admission_json->set("clients", admission.clients);
+        resp_json->set("admission", admission_json);
+        SessionPool::Stats connections = SessionPool::instance().stats();
+        JSON::Object::Ptr connections_json(new JSON::Object);
+        connections_json->set("created", connections.created);
+        connections_json->set("reused", connections.reused);
+        connections_json->set("evicted", connections.evicted);
+        connections_json->set("active", connections.active);
+        connections_json->set("idle", connections.idle);
+        resp_json->set("connections", connections_json);
+
+        response.setStatusAndReason(HTTPResponse::HTTP_OK);
+        std::ostream& ostr = response.send();
+        resp_json->stringify(ostr);
+    }
+};
+
 ChunkServer::ChunkServer() {
     help_requested = false;
+    bench_requested = false;
+    chunk_store = nullptr;
+    chunk_cache = nullptr;
+    sync_queue = nullptr;
+    admission = nullptr;
+    thread_pool = nullptr;
+    max_chunk_size = 64*1024*1024;
+
     request_handler_factory = new ChunkServerRequestHandlerFactory(this);
 }
 
 ChunkServer::~ChunkServer() {
+    delete thread_pool;
+    delete admission;
+    delete chunk_store;
+    delete chunk_cache;
+    delete sync_queue;
+    for(auto it=disk_engines.begin(); it!=disk_engines.end(); ++it) {
+        delete *it;
+    }
+    for(auto it=io_schedulers.begin(); it!=io_schedulers.end(); ++it) {
+        delete *it;
+    }
+}
+
+void ChunkServer::storeChunk(const std::string& chunk_id, const std::vector<uint8_t>& content, UInt8 codec) {
+    if(codec != CODEC_NONE) {
+        std::vector<uint8_t> compressed = compressChunk(codec, content);
+        if(compressed.size() < content.size()) {
+            MemoryInputStream istr((const char*)compressed.data(), compressed.size());
+            chunk_store->create(chunk_id, istr, codec, (int64_t)content.size());
+            return;
+        }
+    }
+    MemoryInputStream istr((const char*)content.data(), content.size());
+    chunk_store->create(chunk_id, istr);
+}
+
+IoScheduler* ChunkServer::createIoScheduler() {
+    // Interactive reads get most of the disk under contention. Background work is capped in
+    // bandwidth and in how many of the slots it may take, so it can't queue up ahead of them.
+    int slots = config().getInt("ChunkServer.io_slots", 16);
+    IoScheduler* scheduler = new IoScheduler(slots);
+    scheduler->configure(IO_INTERACTIVE, config().getInt("ChunkServer.io_weight.interactive", 8),
+        config().getInt64("ChunkServer.io_bandwidth.interactive", 0), 0);
+    scheduler->configure(IO_WRITE, config().getInt("ChunkServer.io_weight.write", 4),
+        config().getInt64("ChunkServer.io_bandwidth.write", 0), 0);
+    scheduler->configure(IO_BACKGROUND, config().getInt("ChunkServer.io_weight.background", 1),
+        config().getInt64("ChunkServer.io_bandwidth.background", 32*1024*1024),
+        config().getInt("ChunkServer.io_slots.background", std::max(slots / 4, 1)));
+    return scheduler;
+}
+
+ChunkCache::Content ChunkServer::inflatedChunk(const std::string& chunk_id, const ChunkMeta& meta) {
+    ChunkCache::Content content;
+    if(chunk_cache != nullptr) {
+        content = chunk_cache->get(chunk_id);
+    }
+    if(content.isNull() || (int64_t)content->size() != meta.length()) {
+        content = new std::vector<uint8_t>(decompressChunk(meta.codec, chunk_store->read(chunk_id, 0, meta.size), meta.uncompressed_size));
+        if(chunk_cache != nullptr && chunk_cache->admits(chunk_id, meta.length())) {
+            chunk_cache->put(chunk_id, content);
+        }
+    }
+    return content;
+}
 
+ChunkCache::Content ChunkServer::cachedChunk(const std::string& chunk_id, int64_t size) {
+    if(chunk_cache == nullptr) {
+        return ChunkCache::Content();
+    }
+    // On a miss the whole chunk is only read in when the cache would keep it. A copy of another
+    // length is from before an append.
+    ChunkCache::Content cached = chunk_cache->get(chunk_id);
+    if(!cached.isNull() && (int64_t)cached->size() != size) {
+        cached.reset();
+    }
+    if(cached.isNull() && chunk_cache->admits(chunk_id, size)) {
+        cached = new std::vector<uint8_t>(chunk_store->read(chunk_id, 0, size));
+        chunk_cache->put(chunk_id, cached);
+    }
+    if(cached.isNull() || (int64_t)cached->size() != size) {
+        return ChunkCache::Content();
+    }
+    return cached;
+}
+
+void ChunkServer::verifyOnce(const std::string& chunk_id, const ChunkMeta& meta) {
+    // The same id at another version or creation is another content.
+    std::string key = chunk_id + "@" + std::to_string(meta.created) + "." + std::to_string(meta.version) + "." + std::to_string(meta.size);
+    {
+        ScopedLock<Mutex> lock(verified_chunks_mutex);
+        if(verified_chunks.count(key) != 0) {
+            return;
+        }
+    }
+    chunk_store->verify(chunk_id);
+    ScopedLock<Mutex> lock(verified_chunks_mutex);
+    // Entries of removed chunks are left behind, start over once there are too many.
+    if(verified_chunks.size() >= MAX_VERIFIED_CHUNKS) {
+        verified_chunks.clear();
+    }
+    verified_chunks.insert(key);
+}
+
+int ChunkServer::readChunk(const std::string& chunk_id, int64_t offset, int64_t length, std::vector<uint8_t>& content) {
+    ChunkMeta meta;
+    if(!chunk_store->meta(chunk_id, meta)) {
+        return HTTPResponse::HTTP_NOT_FOUND;
+    }
+    int64_t size = meta.length();
+    if(offset < 0 || offset > size) {
+        return HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE;
+    }
+    if(length < 0 || length > size - offset) {
+        length = size - offset;
+    }
+
+    try {
+        ChunkCache::Content whole = meta.codec != CODEC_NONE ? inflatedChunk(chunk_id, meta) : cachedChunk(chunk_id, size);
+        if(!whole.isNull()) {
+            content.assign(whole->begin() + offset, whole->begin() + offset + length);
+        } else {
+            content = chunk_store->read(chunk_id, offset, length);
+        }
+    } catch(FileNotFoundException&) {
+        // Deleted since the lookup.
+        return HTTPResponse::HTTP_NOT_FOUND;
+    } catch(Exception& e) {
+        logger().error("Chunk " + chunk_id + " is unreadable: " + e.displayText());
+        return HTTPResponse::HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return HTTPResponse::HTTP_OK;
 }
 
 std::vector<std::string> ChunkServer::getChunksList() {
-    return listDirectory(chunk_directory);
+    return chunk_store->list();
+}
+
+void ChunkServer::onChunkCorrupted(const void*, const std::string& chunk_id) {
+    // Called with store locks held, the heartbeat thread sends the report.
+    logger().error("Chunk " + chunk_id + " failed checksum verification and was quarantined.");
+    if(chunk_cache != nullptr) {
+        chunk_cache->invalidate(chunk_id);
+    }
+    ScopedLock<Mutex> lock(corrupt_chunks_mutex);
+    corrupt_chunks.push_back(chunk_id);
+}
+
+void ChunkServer::onDiskFailed(const void*, const std::string& reason) {
+    // Its chunks are already gone from the list, the next heartbeat reports them missing.
+    logger().critical("Disk isolated after I/O errors, " + reason);
+}
+
+std::vector<Path> ChunkServer::directoryList(const std::string& key) {
+    std::vector<Path> directories;
+    StringTokenizer tokens(config().getString(key, ""), ",", StringTokenizer::TOK_TRIM|StringTokenizer::TOK_IGNORE_EMPTY);
+    for(auto it=tokens.begin(); it!=tokens.end(); ++it) {
+        directories.push_back(Path(*it).makeDirectory());
+    }
+    return directories;
+}
+
+ChunkStore* ChunkServer::createDiskSet(const std::string& type, const std::vector<Path>& directories) {
+    std::vector<ChunkStore*> disks;
+    for(auto it=directories.begin(); it!=directories.end(); ++it) {
+        ChunkStore* disk = createChunkStore(type, *it);
+        // Chunk reads are queued to io_uring (or a thread pool) instead of blocking handler
+        // threads one pread at a time.
+        DiskEngine* engine = DiskEngine::create(config().getString("ChunkServer.disk_engine", "auto"),
+            config().getInt("ChunkServer.io_queue_depth", 256), config().getInt("ChunkServer.io_threads", 16),
+            config().getInt64("ChunkServer.io_size", 128*1024));
+        disk->disk_engine = engine;
+        disk_engines.push_back(engine);
+        IoScheduler* scheduler = createIoScheduler();
+        disk->io_scheduler = scheduler;
+        io_schedulers.push_back(scheduler);
+        disks.push_back(disk);
+        logger().information("Data directory " + it->toString() + ", disk engine: " + (engine != nullptr ? engine->name() : std::string("sync")));
+    }
+
+    if(disks.size() == 1) {
+        return disks.front();
+    }
+    MultiDiskChunkStore* disk_set = new MultiDiskChunkStore(disks, directories);
+    disk_set->max_disk_errors = config().getInt("ChunkServer.max_disk_errors", 3);
+    disk_set->disk_error_window = config().getInt("ChunkServer.disk_error_window", 60);
+    disk_set->disk_failed += delegate(this, &ChunkServer::onDiskFailed);
+    return disk_set;
+}
+
+ChunkStore* ChunkServer::createChunkStore(const std::string& type, const Path& directory) {
+    long open_files = config().getInt("ChunkServer.open_files", 1024);
+    if(type == "segments") {
+        SegmentChunkStore* segment_store = new SegmentChunkStore(directory, open_files);
+        segment_store->segment_size = config().getInt64("ChunkServer.segment_size", 64*1024*1024);
+        segment_store->compaction_threshold = config().getDouble("ChunkServer.segment_compaction_threshold", 0.5);
+        return segment_store;
+    }
+    return new FileChunkStore(directory, open_files);
+}
+
+void ChunkServer::reportCorruptChunks() {
+    std::vector<std::string> chunks;
+    {
+        ScopedLock<Mutex> lock(corrupt_chunks_mutex);
+        chunks.swap(corrupt_chunks);
+    }
+
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        int resp_code = 0;
+        try {
+            resp_code = requestReportCorruptChunk(meta_server_addr, server_id, *it);
+        } catch(Exception& e) {
+            logger().warning("Failed to report corrupt chunk " + (*it) + ": " + e.displayText());
+        }
+        if(resp_code != HTTPResponse::HTTP_OK) {
+            // Try again on the next heartbeat.
+            ScopedLock<Mutex> lock(corrupt_chunks_mutex);
+            corrupt_chunks.push_back(*it);
+        }
+    }
 }
 
 void ChunkServer::initialize(Application& self) {
@@ -237,6 +1368,33 @@ void ChunkServer::defineOptions(OptionSet& options)
             .argument("metadata_server")
             .binding("ChunkServer.meta_server_address")
     );
+    options.addOption(
+        Option("bench", "b", "benchmark the chunk store and print the results as JSON, instead of serving")
+            .required(false)
+            .repeatable(false)
+            .callback(OptionCallback<ChunkServer>(this, &ChunkServer::handleBench))
+    );
+    options.addOption(
+        Option("bench_sizes", "", "chunk sizes to benchmark, comma separated")
+            .required(false)
+            .repeatable(false)
+            .argument("sizes")
+            .binding("ChunkServer.bench_sizes")
+    );
+    options.addOption(
+        Option("bench_concurrency", "", "concurrency levels to benchmark, comma separated")
+            .required(false)
+            .repeatable(false)
+            .argument("threads")
+            .binding("ChunkServer.bench_concurrency")
+    );
+    options.addOption(
+        Option("bench_operations", "", "operations of every kind per size and concurrency")
+            .required(false)
+            .repeatable(false)
+            .argument("count")
+            .binding("ChunkServer.bench_operations")
+    );
 }
 
 //==========add by Hua
@@ -255,7 +1413,8 @@ public:
 			std::vector<std::string> chunks_list = server->getChunksList();
 			try
 			{
-				requestUpdateChunksList(server->meta_server_addr, server->server_id, chunks_list);
+				requestUpdateChunksList(server->meta_server_addr, server->server_id, chunks_list, server->chunk_store->versions());
+				server->reportCorruptChunks();
 			}
 			catch (const std::exception&)
 			{
@@ -269,6 +1428,91 @@ public:
 
 };
 
+// Runs the chunk store's background compaction: folding overlays back into plain chunk files, or
+// reclaiming the dead space of segments.
+class ChunkCompactor: public Poco::Runnable {
+private:
+    int n;
+    ChunkServer* server;
+    Event stopping;
+public:
+    ChunkCompactor(int n, ChunkServer* server): stopping(false) {
+        this->server = server;
+        this->n = n;
+    }
+    // Ends run() after the pass in progress, the store has to stay open until then.
+    void stop() {
+        stopping.set();
+    }
+    virtual void run() {
+        // Rewrites hold the segment lock, so they aren't throttled like the background class.
+        IoScheduler::Scope io_scope(IO_WRITE);
+        do {
+            try {
+                int compacted = server->chunk_store->compact(100);
+                if(compacted > 0) {
+                    server->logger().information("Compacted " + std::to_string(compacted) + " overlays/segments.");
+                }
+            } catch(Exception& e) {
+                server->logger().warning("Chunk store compaction failed: " + e.displayText());
+            }
+        } while(!stopping.tryWait(this->n * 1000));
+    }
+};
+
+// Reads every chunk in the background and checks it against its block checksums, so corruption
+// of rarely read chunks is found while other replicas are still good. Limited to `rate` bytes
+// per second to stay out of the way of client traffic, 0 for no limit.
+class ChunkScrubber: public Poco::Runnable {
+private:
+    int64_t rate;
+    int interval;
+    ChunkServer* server;
+    Event stopping;
+public:
+    ChunkScrubber(int64_t rate, int interval, ChunkServer* server): stopping(false) {
+        this->server = server;
+        this->rate = rate;
+        this->interval = interval;
+    }
+    // Ends run() after the chunk being checked, the store has to stay open until then.
+    void stop() {
+        stopping.set();
+    }
+    virtual void run() {
+        IoScheduler::Scope io_scope(IO_BACKGROUND);
+        do {
+            std::vector<std::string> chunks_list = server->chunk_store->list();
+            int64_t scrubbed = 0;
+            int corrupt = 0;
+            Timestamp started;
+
+            for(auto it=chunks_list.begin(); it!=chunks_list.end(); ++it) {
+                int64_t bytes = 0;
+                try {
+                    bytes = server->chunk_store->verify(*it);
+                } catch(ChunkCorruptException&) {
+                    corrupt++;
+                } catch(FileNotFoundException&) {
+                    // Deleted since we took the list.
+                } catch(Exception& e) {
+                    server->logger().warning("Scrubbing chunk " + (*it) + " failed: " + e.displayText());
+                }
+                scrubbed += bytes;
+
+                // Sleep off whatever we are ahead of the rate limit.
+                int64_t due = rate > 0 ? scrubbed * 1000 / rate - started.elapsed() / 1000 : 0;
+                if(stopping.tryWait(due > 0 ? (long)due : 0)) {
+                    return;
+                }
+            }
+
+            server->logger().information("Scrubbed " + std::to_string(chunks_list.size()) + " chunks (" +
+                std::to_string(scrubbed) + " bytes), " + std::to_string(corrupt) + " corrupt.");
+        } while(!stopping.tryWait(this->interval * 1000));
+    }
+};
+
 int ChunkServer::main(const std::vector<std::string>& args) {
     if(help_requested) {
         return Application::EXIT_OK;
@@ -291,8 +1535,91 @@ int ChunkServer::main(const std::vector<std::string>& args) {
     makeDirectories(root_directory);
     makeDirectories(chunk_directory);
 
+    // "files" keeps a file per chunk, "segments" packs small chunks into large segment files.
+    std::string store_type = config().getString("ChunkServer.store", "files");
+    if(store_type != "files" && store_type != "segments") {
+        logger().error("Unknown chunk store \"" + store_type + "\", use \"files\" or \"segments\".");
+        return Application::EXIT_CONFIG;
+    }
+    logger().information("Chunk store: " + store_type);
+
+    // Every data directory (one per disk) gets a store and disk engine of its own. Without a list
+    // the root directory is the only one. With fast_directories (SSDs) as well, the data
+    // directories are the capacity tier and chunks move between the tiers by how often they are read.
+    std::vector<Path> data_directories = directoryList("ChunkServer.data_directories");
+    if(data_directories.empty()) {
+        data_directories.push_back(root_directory);
+    }
+    std::vector<Path> fast_directories = directoryList("ChunkServer.fast_directories");
+
+    chunk_store = createDiskSet(store_type, data_directories);
+    if(!fast_directories.empty()) {
+        TieredChunkStore* tiers = new TieredChunkStore(createDiskSet(store_type, fast_directories), chunk_store, fast_directories);
+        tiers->fast_capacity = config().getInt64("ChunkServer.fast_tier_capacity", 0);
+        tiers->low_watermark = config().getDouble("ChunkServer.fast_tier_low_watermark", 0.8);
+        tiers->cold_after = config().getInt64("ChunkServer.cold_after", 7*24*3600);
+        tiers->promote_hits = config().getInt("ChunkServer.promote_hits", 2);
+        tiers->promote_window = config().getInt64("ChunkServer.promote_window", 600);
+        chunk_store = tiers;
+        logger().information("Storage tiering on, fast tier: " + config().getString("ChunkServer.fast_directories"));
+    }
+    // "none" acknowledges writes from the page cache, "fsync" syncs every chunk before answering,
+    // "group" syncs the chunks written within group_sync_interval milliseconds together.
+    Durability durability;
+    if(!parseDurability(config().getString("ChunkServer.durability", "group"), durability)) {
+        logger().error("Unknown durability mode \"" + config().getString("ChunkServer.durability") + "\", use \"none\", \"fsync\" or \"group\".");
+        return Application::EXIT_CONFIG;
+    }
+    sync_queue = new SyncQueue(durability, config().getInt("ChunkServer.group_sync_interval", 2),
+        (size_t)config().getInt("ChunkServer.group_sync_max_batch", 256));
+    sync_queue->start();
+    logger().information("Durability: " + durabilityName(durability));
+
+    chunk_store->direct_io = config().getBool("ChunkServer.direct_io", false);
+    chunk_store->sync_queue = sync_queue;
+    chunk_store->checksum_block_size = (UInt32)config().getInt("ChunkServer.checksum_block_size", 64*1024);
+    chunk_store->verify_reads = config().getBool("ChunkServer.verify_reads", true);
+    max_chunk_size = std::max<int64_t>(config().getInt64("ChunkServer.max_chunk_size", 64*1024*1024), 1);
+    chunk_store->chunk_corrupted += delegate(this, &ChunkServer::onChunkCorrupted);
+    chunk_store->open();
+
+    if(bench_requested) {
+        int status = runBenchmark(store_type, durabilityName(durability));
+        chunk_store->close();
+        sync_queue->stop();
+        return status;
+    }
+
+    // 0 turns the in-memory chunk cache off.
+    int64_t cache_size = config().getInt64("ChunkServer.cache_size", 64*1024*1024);
+    if(cache_size > 0) {
+        chunk_cache = new ChunkCache(cache_size, config().getInt("ChunkServer.cache_shards", 16));
+    }
+
+    // Data requests past the limits are answered with 503 and Retry-After before they are handled.
+    AdmissionLimits limits;
+    if(!loadAdmissionLimits(config(), "ChunkServer", limits)) {
+        logger().error("client_quotas is a comma separated list of \"client ops_per_second bytes_per_second\".");
+        return Application::EXIT_CONFIG;
+    }
+    admission = new AdmissionControl(limits);
+
+    // Connections to the other servers are kept for the next request.
+    SessionPool::instance().configure(config(), "ChunkServer");
+
+    // Up to max_queued connections wait for one of the threads, more are dropped.
+    int threads = std::max(config().getInt("ChunkServer.threads", 16), 1);
+    HTTPServerParams* params = new HTTPServerParams;
+    params->setMaxThreads(threads);
+    params->setMaxQueued(config().getInt("ChunkServer.max_queued", 64));
+    // An idle connection of another server's pool holds a thread until keep_alive_timeout, which
+    // has to be above their pool_idle_timeout.
+    params->setKeepAliveTimeout(Timespan(std::max(config().getInt("ChunkServer.keep_alive_timeout", 5), 1), 0));
+    thread_pool = new ThreadPool(std::min(threads, 2), threads);
+
     ServerSocket server_socket(listen_addr);
-    http_server = new HTTPServer(request_handler_factory, server_socket, new HTTPServerParams);
+    http_server = new HTTPServer(new KeepAliveRequestHandlerFactory(*request_handler_factory), *thread_pool, server_socket, params);
+    admission->tcp_server = http_server;
 
 
 	//==========add by Hua
@@ -300,11 +1627,28 @@ int ChunkServer::main(const std::vector<std::string>& args) {
 	Thread heartBeat;
 	heartBeat.start(sender);
 
+    ChunkCompactor compactor(config().getInt("ChunkServer.compaction_interval", 10), this);
+    Thread compaction;
+    compaction.start(compactor);
+
+    ChunkScrubber scrubber(std::max<int64_t>(config().getInt64("ChunkServer.scrub_rate", 8*1024*1024), 0), config().getInt("ChunkServer.scrub_interval", 3600), this);
+    Thread scrubbing;
+    scrubbing.setPriority(Thread::PRIO_LOW);
+    scrubbing.start(scrubber);
+
 
     http_server->start();
     waitForTerminationRequest();
     http_server->stop();
 
+    compactor.stop();
+    scrubber.stop();
+    compaction.join();
+    scrubbing.join();
+
+    chunk_store->close();
+    sync_queue->stop();
+
     return Application::EXIT_OK;
 }
 
@@ -318,6 +1662,65 @@ void ChunkServer::handleHelp(const std::string& name, const std::string& value)
     help_requested = true;
 }
 
+void ChunkServer::handleBench(const std::string& name, const std::string& value) {
+    bench_requested = true;
+}
+
+int ChunkServer::runBenchmark(const std::string& store_type, const std::string& durability) {
+    // The chunk cache stays off, reads go to the store.
+    BenchConfig bench;
+    try {
+        StringTokenizer sizes(config().getString("ChunkServer.bench_sizes", "4096,65536,1048576"), ",", StringTokenizer::TOK_TRIM|StringTokenizer::TOK_IGNORE_EMPTY);
+        for(auto it=sizes.begin(); it!=sizes.end(); ++it) {
+            bench.chunk_sizes.push_back(std::stoll(*it));
+        }
+        StringTokenizer levels(config().getString("ChunkServer.bench_concurrency", "1,4,16"), ",", StringTokenizer::TOK_TRIM|StringTokenizer::TOK_IGNORE_EMPTY);
+        for(auto it=levels.begin(); it!=levels.end(); ++it) {
+            bench.concurrency.push_back(std::stoi(*it));
+        }
+    } catch(std::exception&) {
+        logger().error("bench_sizes and bench_concurrency are comma separated numbers.");
+        return Application::EXIT_CONFIG;
+    }
+    bench.operations = config().getInt64("ChunkServer.bench_operations", 1000);
+    bench.update_size = config().getInt64("ChunkServer.bench_update_size", 4096);
+    if(!parseCodec(config().getString("ChunkServer.bench_compression", "none"), bench.codec)) {
+        logger().error("Unknown codec \"" + config().getString("ChunkServer.bench_compression") + "\", use \"none\" or \"zlib\".");
+        return Application::EXIT_CONFIG;
+    }
+    for(auto it=bench.chunk_sizes.begin(); it!=bench.chunk_sizes.end(); ++it) {
+        if(*it <= 0) {
+            logger().error("Chunk sizes have to be positive.");
+            return Application::EXIT_CONFIG;
+        }
+    }
+    for(auto it=bench.concurrency.begin(); it!=bench.concurrency.end(); ++it) {
+        if(*it <= 0) {
+            logger().error("Concurrency levels have to be positive.");
+            return Application::EXIT_CONFIG;
+        }
+    }
+
+    logger().information("Benchmarking the chunk store, " + std::to_string(bench.operations) + " operations per run.");
+    ChunkBenchmark benchmark(*this, bench);
+    std::vector<BenchStats> results = benchmark.run();
+
+    JSON::Array::Ptr results_json(new JSON::Array);
+    for(auto it=results.begin(); it!=results.end(); ++it) {
+        results_json->add(ChunkBenchmark::toJSON(*it));
+    }
+    JSON::Object::Ptr report_json(new JSON::Object);
+    report_json->set("server_id", server_id);
+    report_json->set("store", store_type);
+    report_json->set("durability", durability);
+    report_json->set("compression", codecName(bench.codec));
+    report_json->set("direct_io", chunk_store->direct_io);
+    report_json->set("results", results_json);
+    report_json->stringify(std::cout, 4);
+    std::cout << std::endl;
+    return Application::EXIT_OK;
+}
+
 ChunkServerRequestHandlerFactory::ChunkServerRequestHandlerFactory(ChunkServer* srv) {
     this->server = srv;
 }
@@ -327,17 +1730,29 @@ HTTPRequestHandler* ChunkServerRequestHandlerFactory::createRequestHandler(const
     if(uri.getPath() == "/ping") {
         return new PingRequestHandler();
     } else if(uri.getPath() == "/get_chunk") {
-        return new GetChunkRequestHandler();
+        return server->admission->admit(request, new GetChunkRequestHandler());
     } else if(uri.getPath() == "/force_push_chunks_list") {
         return new ForcePushChunksListRequestHandler();
     } else if(uri.getPath() == "/create_chunk") {
-        return new CreateChunkRequestHandler();
+        return server->admission->admit(request, new CreateChunkRequestHandler());
     } else if(uri.getPath() == "/update_chunk") {
-        return new UpdateChunkRequestHandler();
+        return server->admission->admit(request, new UpdateChunkRequestHandler());
+    } else if(uri.getPath() == "/append_chunk") {
+        return server->admission->admit(request, new AppendChunkRequestHandler());
     } else if(uri.getPath() == "/delete_chunk") {
-        return new DeleteChunkRequestHandler();
+        return server->admission->admit(request, new DeleteChunkRequestHandler());
+    } else if(uri.getPath() == "/multi_get") {
+        return server->admission->admit(request, new MultiGetChunksRequestHandler());
+    } else if(uri.getPath() == "/scan") {
+        return server->admission->admit(request, new ScanChunksRequestHandler());
+    } else if(uri.getPath() == "/multi_create") {
+        return server->admission->admit(request, new MultiCreateChunksRequestHandler());
+    } else if(uri.getPath() == "/multi_delete") {
+        return server->admission->admit(request, new MultiDeleteChunksRequestHandler());
     } else if(uri.getPath() == "/list_chunks") {
         return new ListChunksRequestHandler();
+    } else if(uri.getPath() == "/metrics") {
+        return new MetricsRequestHandler();
     }
     return nullptr;
 }
@@ -2,7 +2,16 @@
 #define DISTFS_CHUNK_SERVER_H
 
 #include "common.h"
+#include "chunk_store.h"
+#include "chunk_segment_store.h"
+#include "chunk_disk_set.h"
+#include "chunk_tiers.h"
+#include "chunk_scan.h"
+#include "chunk_cache.h"
+#include "chunk_bench.h"
+#include "admission.h"
 
+#include <Poco/ThreadPool.h>
 #include <Poco/Util/Subsystem.h>
 #include <Poco/Util/Application.h>
 #include <Poco/Util/ServerApplication.h>
@@ -37,11 +46,36 @@ public:
     ChunkServer();
     virtual ~ChunkServer();
     std::vector<std::string> getChunksList();
+    void onChunkCorrupted(const void* sender, const std::string& chunk_id);
+    void reportCorruptChunks();
+    void onDiskFailed(const void* sender, const std::string& reason);
+    // Store `content` encoded with `codec`, or as is if that doesn't make it smaller.
+    void storeChunk(const std::string& chunk_id, const std::vector<uint8_t>& content, UInt8 codec);
+    // The inflated content of a compressed chunk, from the cache or decoded (and cached) now.
+    ChunkCache::Content inflatedChunk(const std::string& chunk_id, const ChunkMeta& meta);
+    // The cached content of a plain chunk of `size` bytes, read in now if the cache admits it.
+    // Null if it isn't cached.
+    ChunkCache::Content cachedChunk(const std::string& chunk_id, int64_t size);
+    // Read `length` bytes (-1 for the rest) at `offset` of a chunk, inflated, into `content`.
+    // Returns the HTTP status to answer with.
+    int readChunk(const std::string& chunk_id, int64_t offset, int64_t length, std::vector<uint8_t>& content);
+    // Check a chunk against its block checksums in full, unless it was already checked at its
+    // current version since the server started. Throws ChunkCorruptException.
+    void verifyOnce(const std::string& chunk_id, const ChunkMeta& meta);
 
     Path root_directory;
     Path chunk_directory;
     std::string server_id;
     std::string meta_server_addr;
+    ChunkStore* chunk_store;
+    ChunkCache* chunk_cache;
+    std::vector<DiskEngine*> disk_engines;
+    std::vector<IoScheduler*> io_schedulers;
+    SyncQueue* sync_queue;
+    AdmissionControl* admission;
+    // Largest chunk a batched create takes, bigger frames are refused. Updates can't grow a
+    // compressed chunk past it either.
+    int64_t max_chunk_size;
 
 protected:
     void initialize(Application& self) override;
@@ -50,9 +84,28 @@ protected:
     int main(const std::vector<std::string>& args) override;
 
     void handleHelp(const std::string& name, const std::string& value);
+    void handleBench(const std::string& name, const std::string& value);
+    // Runs the storage benchmark on the opened store and prints the results as JSON.
+    int runBenchmark(const std::string& store_type, const std::string& durability);
+    std::vector<Path> directoryList(const std::string& key);
+    // A store for every directory, spread over as a disk set if there are several.
+    ChunkStore* createDiskSet(const std::string& type, const std::vector<Path>& directories);
+    ChunkStore* createChunkStore(const std::string& type, const Path& directory);
+    IoScheduler* createIoScheduler();
 
     bool help_requested;
+    bool bench_requested;
 
+    // Quarantined chunks not yet reported to the meta server.
+    Mutex corrupt_chunks_mutex;
+    std::vector<std::string> corrupt_chunks;
+
+    // Chunks verifyOnce() has checked, by id and version.
+    static const size_t MAX_VERIFIED_CHUNKS = 1000000;
+    Mutex verified_chunks_mutex;
+    std::set<std::string> verified_chunks;
+
+    ThreadPool* thread_pool;
     HTTPServer* http_server;
     ChunkServerRequestHandlerFactory* request_handler_factory;
 
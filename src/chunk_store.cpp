@@ -0,0 +1,948 @@
+#include "chunk_store.h"
+#include "crc32c.h"
+
+#include <Poco/File.h>
+#include <Poco/BinaryWriter.h>
+#include <Poco/BinaryReader.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/Exception.h>
+#include <Poco/Timestamp.h>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+#if POCO_OS == POCO_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+namespace DistFS {
+
+void ChunkOverlay::apply(int64_t offset, std::vector<uint8_t>& buffer) const {
+    // Later extents were written later, so they win.
+    int64_t end = offset + (int64_t)buffer.size();
+    for(auto it=extents.begin(); it!=extents.end(); ++it) {
+        int64_t lo = std::max(offset, it->offset);
+        int64_t hi = std::min(end, it->offset + (int64_t)it->data.size());
+        if(lo < hi) {
+            std::memcpy(buffer.data() + (lo - offset), it->data.data() + (lo - it->offset), (size_t)(hi - lo));
+        }
+    }
+}
+
+void ChunkOverlay::save(const std::string& path) const {
+    std::ofstream ofile(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+    BinaryWriter writer(ofile, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+
+    writer.writeRaw("DFSO", 4);
+    writer << (UInt32)1;
+    writer << base_id;
+    writer << (Int64)length;
+    writer << (UInt32)extents.size();
+    for(auto it=extents.begin(); it!=extents.end(); ++it) {
+        writer << (Int64)it->offset;
+        writer << (UInt32)it->data.size();
+        writer.writeRaw((const char*)it->data.data(), (std::streamsize)it->data.size());
+    }
+    writer.flush();
+    ofile.close();
+
+    if(!ofile.good()) {
+        throw WriteFileException(path);
+    }
+}
+
+ChunkOverlay ChunkOverlay::load(const std::string& path) {
+    std::ifstream ifile(path.c_str(), std::ios::binary);
+    if(!ifile.good()) {
+        throw FileNotFoundException(path);
+    }
+    BinaryReader reader(ifile, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+
+    std::string magic;
+    reader.readRaw(4, magic);
+    UInt32 version = 0;
+    reader >> version;
+    if(magic != "DFSO" || version != 1) {
+        throw DataFormatException("Bad chunk overlay " + path);
+    }
+
+    ChunkOverlay overlay;
+    Int64 length = 0;
+    UInt32 extent_count = 0;
+    reader >> overlay.base_id;
+    reader >> length;
+    reader >> extent_count;
+    overlay.length = length;
+
+    for(UInt32 i=0; i<extent_count; i++) {
+        Int64 offset = 0;
+        UInt32 size = 0;
+        reader >> offset;
+        reader >> size;
+
+        Extent extent;
+        extent.offset = offset;
+        extent.data.resize(size);
+        ifile.read((char*)extent.data.data(), size);
+        overlay.extents.push_back(extent);
+    }
+
+    if(!reader.good()) {
+        throw DataFormatException("Truncated chunk overlay " + path);
+    }
+    return overlay;
+}
+
+POCO_IMPLEMENT_EXCEPTION(ChunkCorruptException, DataException, "Chunk checksum mismatch")
+POCO_IMPLEMENT_EXCEPTION(ChunkVersionException, RuntimeException, "Chunk version conflict")
+
+ChunkStore::ChunkStore(const Path& root_directory):
+    checksum_block_size(64*1024),
+    verify_reads(true),
+    disk_engine(nullptr),
+    direct_io(false),
+    io_scheduler(nullptr),
+    sync_queue(nullptr)
+{
+    corrupt_directory = Path(root_directory).pushDirectory("corrupt");
+    tmp_directory = Path(root_directory).pushDirectory("tmp");
+    catalog_path = Path(root_directory).append("catalog");
+}
+
+ChunkStore::~ChunkStore() {
+}
+
+bool ChunkStore::openCatalog() {
+    makeDirectories(corrupt_directory);
+    makeDirectories(tmp_directory);
+
+    // Anything left in tmp/ was never renamed into place, so it was never acknowledged.
+    std::vector<std::string> leftovers = listDirectory(tmp_directory);
+    for(auto it=leftovers.begin(); it!=leftovers.end(); ++it) {
+        File(tmpPath(*it)).remove();
+    }
+
+    // The saved catalog is only trusted if the previous run shut down cleanly, otherwise the
+    // data on disk is the source of truth.
+    File clean_marker(catalog_path.toString() + ".clean");
+    bool loaded = clean_marker.exists() && catalog.load(catalog_path.toString());
+    if(clean_marker.exists()) {
+        clean_marker.remove();
+    }
+    return loaded;
+}
+
+void ChunkStore::saveCatalog() {
+    std::string tmp_path = tmpPath("catalog");
+    catalog.save(tmp_path);
+    File(tmp_path).renameTo(catalog_path.toString());
+    File(catalog_path.toString() + ".clean").createFile();
+}
+
+FileChunkStore::FileChunkStore(const Path& root_directory, long open_files):
+    ChunkStore(root_directory),
+    reflink_supported(true),
+    closed(false),
+    file_cache(open_files)
+{
+    chunk_directory = Path(root_directory).pushDirectory("chunks");
+    overlay_directory = Path(root_directory).pushDirectory("overlays");
+    checksum_directory = Path(root_directory).pushDirectory("checksums");
+}
+
+void FileChunkStore::open() {
+    makeDirectories(chunk_directory);
+    makeDirectories(overlay_directory);
+    makeDirectories(checksum_directory);
+    file_cache.setDiskEngine(disk_engine, direct_io, io_scheduler);
+
+    if(!openCatalog()) {
+        rebuildCatalog();
+    }
+
+    ScopedLock<Mutex> lock(overlay_mutex);
+    std::vector<std::string> chunks = catalog.ids();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        ChunkMeta meta;
+        if(catalog.find(*it, meta) && meta.overlay) {
+            ChunkOverlay overlay = ChunkOverlay::load(overlayPath(*it));
+            overlay_dependents[overlay.base_id].insert(*it);
+        }
+    }
+}
+
+void FileChunkStore::close() {
+    ScopedLock<Mutex> lock(overlay_mutex);
+    if(closed) {
+        return;
+    }
+    closed = true;
+    saveCatalog();
+}
+
+bool ChunkStore::exists(const std::string& chunk_id) {
+    ChunkMeta meta;
+    return catalog.find(chunk_id, meta);
+}
+
+int64_t ChunkStore::size(const std::string& chunk_id) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    return meta.size;
+}
+
+bool ChunkStore::meta(const std::string& chunk_id, ChunkMeta& meta) {
+    return catalog.find(chunk_id, meta);
+}
+
+SharedPtr<ChunkFile> ChunkStore::openPlain(const std::string&) {
+    return SharedPtr<ChunkFile>();
+}
+
+SharedPtr<ChunkFile> FileChunkStore::openPlain(const std::string& chunk_id) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta) || meta.overlay) {
+        return SharedPtr<ChunkFile>();
+    }
+    return file_cache.open(chunkPath(chunk_id));
+}
+
+void ChunkStore::prefetch(const std::string& chunk_id, int64_t offset, int64_t length) {
+    try {
+        SharedPtr<ChunkFile> file = openPlain(chunk_id);
+        if(!file.isNull()) {
+            file->prefetch(offset, length);
+        }
+    } catch(Exception&) {
+        // Gone since, read() tells.
+    }
+}
+
+std::vector<uint8_t> ChunkStore::read(const std::string& chunk_id, int64_t offset, int64_t length) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(offset > meta.size) {
+        offset = meta.size;
+    }
+    if(length < 0 || offset + length > meta.size) {
+        length = meta.size - offset;
+    }
+
+    if(!verify_reads || meta.block_checksums.empty()) {
+        return readRaw(chunk_id, offset, length);
+    }
+
+    // Checksums cover whole blocks, so read every block the range touches.
+    int64_t block_size = meta.checksum_block_size;
+    int64_t first = offset / block_size * block_size;
+    int64_t last = std::min(meta.size, (offset + length + block_size - 1) / block_size * block_size);
+
+    std::vector<uint8_t> data = readRaw(chunk_id, first, last - first);
+    verifyBlocks(chunk_id, meta, first, data);
+
+    if(first == offset && last == offset + length) {
+        return data;
+    }
+    return std::vector<uint8_t>(data.begin() + (offset - first), data.begin() + (offset - first + length));
+}
+
+void ChunkStore::create(const std::string& chunk_id, std::istream& content, UInt8 codec, int64_t uncompressed_size) {
+    ChunkMeta source;
+    source.codec = codec;
+    source.uncompressed_size = uncompressed_size;
+    create(chunk_id, content, source);
+}
+
+void FileChunkStore::create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) {
+    std::string tmp_path = tmpPath(chunk_id);
+
+    ChunkMeta meta;
+    meta.created = source.created != 0 ? source.created : Timestamp().epochMicroseconds();
+    meta.checksum_block_size = checksum_block_size;
+    meta.codec = source.codec;
+    meta.uncompressed_size = source.uncompressed_size;
+    meta.version = source.version;
+
+    { // ofile scope
+        std::ofstream ofile(tmp_path.c_str(), std::ios::out|std::ios::binary);
+        std::vector<char> buffer(64*1024);
+        UInt32 block_crc = 0;
+        int64_t block_fill = 0;
+
+        while(content.good()) {
+            content.read(buffer.data(), buffer.size());
+            int64_t n = (int64_t)content.gcount();
+            if(n <= 0) {
+                break;
+            }
+            {
+                IoScheduler::Ticket ticket(io_scheduler, n);
+                ofile.write(buffer.data(), n);
+            }
+
+            for(int64_t pos=0; pos<n;) {
+                int64_t piece = std::min(n - pos, (int64_t)checksum_block_size - block_fill);
+                block_crc = crc32c(block_crc, buffer.data() + pos, (size_t)piece);
+                block_fill += piece;
+                pos += piece;
+                if(block_fill == checksum_block_size) {
+                    meta.block_checksums.push_back(block_crc);
+                    block_crc = 0;
+                    block_fill = 0;
+                }
+            }
+            meta.size += n;
+        }
+        if(block_fill > 0) {
+            meta.block_checksums.push_back(block_crc);
+        }
+
+        ofile.close();
+        if(!ofile.good()) {
+            throw WriteFileException(tmp_path);
+        }
+    }
+
+    saveChecksums(chunk_id, meta);
+    File(tmp_path).renameTo(chunkPath(chunk_id));
+    // A re-created chunk must not be read through a descriptor of the file it replaced.
+    file_cache.invalidate(chunkPath(chunk_id));
+
+    makeDurable({chunkPath(chunk_id), checksumPath(chunk_id), chunk_directory.toString(), checksum_directory.toString()});
+    catalog.put(chunk_id, meta);
+}
+
+bool FileChunkStore::update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) {
+    if(!writeVersion(chunk_id, new_id, begin_pos, content)) {
+        return false;
+    }
+    // Outside overlay_mutex, so concurrent updates can share a group sync. The new version is
+    // either a plain chunk or an overlay, the other path doesn't exist and is skipped.
+    makeDurable({chunkPath(new_id), overlayPath(new_id), checksumPath(new_id),
+        chunk_directory.toString(), overlay_directory.toString(), checksum_directory.toString()});
+    return true;
+}
+
+bool FileChunkStore::writeVersion(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) {
+    if(begin_pos < 0) {
+        throw InvalidArgumentException("Negative write position in chunk " + chunk_id);
+    }
+    ScopedLock<Mutex> lock(overlay_mutex);
+
+    ChunkMeta src_meta;
+    if(!catalog.find(chunk_id, src_meta)) {
+        return false;
+    }
+    if(src_meta.codec != CODEC_NONE) {
+        // Offsets of the write are in the uncompressed content, the caller has to re-encode.
+        throw InvalidAccessException("Chunk " + chunk_id + " is compressed");
+    }
+
+    std::string src_path = chunkPath(chunk_id);
+    std::string tmp_path = tmpPath(new_id);
+    int64_t end_pos = begin_pos + (int64_t)content.size();
+
+    ChunkMeta meta;
+    meta.size = std::max(src_meta.size, end_pos);
+    meta.created = Timestamp().epochMicroseconds();
+
+    if(!src_meta.block_checksums.empty()) {
+        // Only the blocks the write touches get new checksums, so they are the only ones we read.
+        // Everything in between the old end and begin_pos reads back as zeros.
+        int64_t block_size = src_meta.checksum_block_size;
+        int64_t touch_begin = std::min(begin_pos, src_meta.size);
+        meta.checksum_block_size = src_meta.checksum_block_size;
+        meta.block_checksums = src_meta.block_checksums;
+        meta.block_checksums.resize((size_t)((meta.size + block_size - 1) / block_size), 0);
+
+        if(end_pos > touch_begin) {
+            int64_t first = touch_begin / block_size * block_size;
+            int64_t last = std::min(meta.size, (end_pos + block_size - 1) / block_size * block_size);
+
+            std::vector<uint8_t> blocks = read(chunk_id, first, last - first);
+            blocks.resize((size_t)(last - first), 0);
+            std::copy(content.begin(), content.end(), blocks.begin() + (begin_pos - first));
+
+            std::vector<UInt32> checksums = blockChecksums(blocks.data(), (int64_t)blocks.size(), meta.checksum_block_size);
+            std::copy(checksums.begin(), checksums.end(), meta.block_checksums.begin() + (first / block_size));
+        }
+    }
+
+    if(!src_meta.overlay) {
+        int64_t base_size = src_meta.size;
+
+        if(cloneFile(src_path, tmp_path)) {
+            // The clone shares extents with the base, only the blocks we write here get copied.
+            {
+                IoScheduler::Ticket ticket(io_scheduler, (int64_t)content.size());
+                std::fstream file(tmp_path.c_str(), std::ios::in|std::ios::out|std::ios::binary);
+                file.seekp(begin_pos);
+                file.write((const char*)content.data(), content.size());
+                file.close();
+            }
+            saveChecksums(new_id, meta);
+            File(tmp_path).renameTo(chunkPath(new_id));
+            catalog.put(new_id, meta);
+            return true;
+        }
+
+        if((int64_t)content.size() * 2 >= base_size) {
+            // Most of the chunk is rewritten anyway, an overlay would not save anything.
+            std::vector<uint8_t> data = read(chunk_id, 0, base_size);
+            data.resize((size_t)meta.size, 0);
+            std::copy(content.begin(), content.end(), data.begin() + begin_pos);
+            writeFile(tmp_path, data);
+
+            if(meta.block_checksums.empty()) {
+                meta.checksum_block_size = checksum_block_size;
+                meta.block_checksums = blockChecksums(data.data(), (int64_t)data.size(), checksum_block_size);
+            }
+            saveChecksums(new_id, meta);
+            File(tmp_path).renameTo(chunkPath(new_id));
+            catalog.put(new_id, meta);
+            return true;
+        }
+
+        ChunkOverlay overlay;
+        overlay.base_id = chunk_id;
+        overlay.length = meta.size;
+        overlay.extents.push_back({begin_pos, content});
+        {
+            IoScheduler::Ticket ticket(io_scheduler, (int64_t)content.size());
+            overlay.save(tmp_path);
+        }
+        saveChecksums(new_id, meta);
+        File(tmp_path).renameTo(overlayPath(new_id));
+        overlay_dependents[chunk_id].insert(new_id);
+    } else {
+        // Stack the new extent on the same base instead of chaining overlays.
+        ChunkOverlay overlay = ChunkOverlay::load(overlayPath(chunk_id));
+        overlay.length = meta.size;
+        overlay.extents.push_back({begin_pos, content});
+        {
+            IoScheduler::Ticket ticket(io_scheduler, (int64_t)content.size());
+            overlay.save(tmp_path);
+        }
+        saveChecksums(new_id, meta);
+        File(tmp_path).renameTo(overlayPath(new_id));
+        overlay_dependents[overlay.base_id].insert(new_id);
+    }
+
+    meta.overlay = true;
+    catalog.put(new_id, meta);
+    return true;
+}
+
+bool FileChunkStore::append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) {
+    if(!appendInPlace(chunk_id, offset, content, version)) {
+        return false;
+    }
+    makeDurable({chunkPath(chunk_id), checksumPath(chunk_id), checksum_directory.toString()});
+    return true;
+}
+
+bool FileChunkStore::appendInPlace(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) {
+    ScopedLock<Mutex> lock(overlay_mutex);
+
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(meta.overlay || meta.codec != CODEC_NONE || overlay_dependents.count(chunk_id) > 0) {
+        // Overlays read through to their base past their own extents, it has to stay as it is.
+        return false;
+    }
+    if(meta.version + 1 != version || meta.size != offset) {
+        throw ChunkVersionException("Chunk " + chunk_id + " is at version " + std::to_string(meta.version) +
+            " with " + std::to_string(meta.size) + " bytes");
+    }
+
+    // The last block grows, its old bytes are read back (and checked) to checksum it again.
+    // A chunk without checksums gets them all now, they are where its version is kept.
+    int64_t first = 0;
+    if(meta.block_checksums.empty()) {
+        meta.checksum_block_size = checksum_block_size;
+    } else {
+        first = offset / meta.checksum_block_size * meta.checksum_block_size;
+    }
+    std::vector<uint8_t> tail = read(chunk_id, first, offset - first);
+    tail.insert(tail.end(), content.begin(), content.end());
+    std::vector<UInt32> checksums = blockChecksums(tail.data(), (int64_t)tail.size(), meta.checksum_block_size);
+    meta.block_checksums.resize((size_t)(first / meta.checksum_block_size));
+    meta.block_checksums.insert(meta.block_checksums.end(), checksums.begin(), checksums.end());
+
+    {
+        IoScheduler::Ticket ticket(io_scheduler, (int64_t)content.size());
+        std::fstream file(chunkPath(chunk_id).c_str(), std::ios::in|std::ios::out|std::ios::binary);
+        file.seekp(offset);
+        file.write((const char*)content.data(), content.size());
+        file.close();
+        if(!file.good()) {
+            throw WriteFileException(chunkPath(chunk_id));
+        }
+    }
+
+    // Readers holding the old meta only read up to the old size, which didn't change.
+    meta.size += (int64_t)content.size();
+    meta.version = version;
+    saveChecksums(chunk_id, meta);
+    catalog.put(chunk_id, meta);
+    return true;
+}
+
+bool FileChunkStore::remove(const std::string& chunk_id) {
+    ScopedLock<Mutex> lock(overlay_mutex);
+
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        return false;
+    }
+
+    // Overlays still need this chunk as their base, give them their own copy first.
+    auto dependents = overlay_dependents.find(chunk_id);
+    if(dependents != overlay_dependents.end()) {
+        std::set<std::string> overlays = dependents->second;
+        for(auto it=overlays.begin(); it!=overlays.end(); ++it) {
+            try {
+                compactOverlay(*it);
+            } catch(ChunkCorruptException&) {
+                // Quarantined, nothing left to preserve.
+            }
+        }
+        overlay_dependents.erase(chunk_id);
+    }
+
+    catalog.erase(chunk_id);
+    File checksum_file(checksumPath(chunk_id));
+    if(checksum_file.exists()) {
+        checksum_file.remove();
+    }
+
+    if(!meta.overlay) {
+        file_cache.invalidate(chunkPath(chunk_id));
+        File(chunkPath(chunk_id)).remove();
+        return true;
+    }
+
+    File overlay_file(overlayPath(chunk_id));
+    ChunkOverlay overlay = ChunkOverlay::load(overlay_file.path());
+    overlay_file.remove();
+    overlay_dependents[overlay.base_id].erase(chunk_id);
+    if(overlay_dependents[overlay.base_id].empty()) {
+        overlay_dependents.erase(overlay.base_id);
+    }
+    return true;
+}
+
+bool ChunkStore::append(const std::string&, int64_t, const std::vector<uint8_t>&, UInt32) {
+    return false;
+}
+
+std::map<std::string, UInt32> ChunkStore::versions() {
+    return catalog.versions();
+}
+
+std::vector<std::string> ChunkStore::list() {
+    return catalog.ids();
+}
+
+int FileChunkStore::compact(int limit) {
+    ScopedLock<Mutex> lock(overlay_mutex);
+    if(closed) {
+        // The catalog has already been saved, don't change anything behind its back.
+        return 0;
+    }
+
+    std::vector<std::string> pending;
+    for(auto it=overlay_dependents.begin(); it!=overlay_dependents.end() && (int)pending.size() < limit; ++it) {
+        for(auto jt=it->second.begin(); jt!=it->second.end() && (int)pending.size() < limit; ++jt) {
+            pending.push_back(*jt);
+        }
+    }
+
+    for(auto it=pending.begin(); it!=pending.end(); ++it) {
+        try {
+            compactOverlay(*it);
+        } catch(ChunkCorruptException&) {
+            // Already quarantined, carry on with the rest.
+        }
+    }
+    return (int)pending.size();
+}
+
+int64_t ChunkStore::verify(const std::string& chunk_id) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        return 0;
+    }
+
+    if(meta.block_checksums.empty()) {
+        // Nothing to check against yet.
+        return computeChecksums(chunk_id);
+    }
+
+    // Go through the chunk a few blocks at a time to keep memory bounded for large chunks.
+    int64_t window = (int64_t)meta.checksum_block_size * 16;
+    for(int64_t offset=0; offset<meta.size; offset+=window) {
+        int64_t length = std::min(window, meta.size - offset);
+        if(offset + window < meta.size) {
+            prefetch(chunk_id, offset + window, window);
+        }
+        std::vector<uint8_t> data = readRaw(chunk_id, offset, length);
+        verifyBlocks(chunk_id, meta, offset, data);
+    }
+    return meta.size;
+}
+
+void FileChunkStore::quarantine(const std::string& chunk_id) {
+    ScopedLock<Mutex> lock(overlay_mutex);
+
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        return;
+    }
+
+    // Overlays read their untouched blocks from this chunk, so they are lost with it.
+    auto dependents = overlay_dependents.find(chunk_id);
+    if(dependents != overlay_dependents.end()) {
+        std::set<std::string> overlays = dependents->second;
+        for(auto it=overlays.begin(); it!=overlays.end(); ++it) {
+            quarantine(*it);
+        }
+        overlay_dependents.erase(chunk_id);
+    }
+
+    catalog.erase(chunk_id);
+
+    std::string corrupt_path = corruptPath(chunk_id);
+    if(meta.overlay) {
+        File overlay_file(overlayPath(chunk_id));
+        ChunkOverlay overlay = ChunkOverlay::load(overlay_file.path());
+        overlay_file.renameTo(corrupt_path);
+        overlay_dependents[overlay.base_id].erase(chunk_id);
+        if(overlay_dependents[overlay.base_id].empty()) {
+            overlay_dependents.erase(overlay.base_id);
+        }
+    } else {
+        file_cache.invalidate(chunkPath(chunk_id));
+        File(chunkPath(chunk_id)).renameTo(corrupt_path);
+    }
+
+    File checksum_file(checksumPath(chunk_id));
+    if(checksum_file.exists()) {
+        checksum_file.renameTo(corrupt_path + ".crc");
+    }
+
+    chunk_corrupted.notify(this, chunk_id);
+}
+
+std::string ChunkStore::tmpPath(const std::string& chunk_id) {
+    return Path(tmp_directory).append(chunk_id).toString();
+}
+
+std::string ChunkStore::corruptPath(const std::string& chunk_id) {
+    return Path(corrupt_directory).append(chunk_id).toString();
+}
+
+std::string FileChunkStore::chunkPath(const std::string& chunk_id) {
+    return Path(chunk_directory).append(chunk_id).toString();
+}
+
+std::string FileChunkStore::overlayPath(const std::string& chunk_id) {
+    return Path(overlay_directory).append(chunk_id).toString();
+}
+
+std::string FileChunkStore::checksumPath(const std::string& chunk_id) {
+    return Path(checksum_directory).append(chunk_id).toString();
+}
+
+void FileChunkStore::rebuildCatalog() {
+    std::vector<std::string> chunks = listDirectory(chunk_directory);
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        File chunk_file(chunkPath(*it));
+        ChunkMeta meta;
+        meta.size = (int64_t)chunk_file.getSize();
+        meta.created = chunk_file.getLastModified().epochMicroseconds();
+        loadChecksums(*it, meta);
+        catalog.put(*it, meta);
+    }
+
+    std::vector<std::string> overlays = listDirectory(overlay_directory);
+    for(auto it=overlays.begin(); it!=overlays.end(); ++it) {
+        if(exists(*it)) {
+            // Crashed between renaming the compacted chunk into place and removing its overlay.
+            File(overlayPath(*it)).remove();
+            continue;
+        }
+        File overlay_file(overlayPath(*it));
+        ChunkMeta meta;
+        meta.size = ChunkOverlay::load(overlay_file.path()).length;
+        meta.created = overlay_file.getLastModified().epochMicroseconds();
+        meta.overlay = true;
+        loadChecksums(*it, meta);
+        catalog.put(*it, meta);
+    }
+
+    // Checksums written for a chunk that was never renamed into place.
+    std::vector<std::string> checksums = listDirectory(checksum_directory);
+    for(auto it=checksums.begin(); it!=checksums.end(); ++it) {
+        if(!exists(*it)) {
+            File(checksumPath(*it)).remove();
+        }
+    }
+}
+
+void FileChunkStore::saveChecksums(const std::string& chunk_id, const ChunkMeta& meta) {
+    if(meta.block_checksums.empty()) {
+        return;
+    }
+
+    std::string tmp_path = tmpPath(chunk_id + ".crc");
+    { // ofile scope
+        std::ofstream ofile(tmp_path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+        BinaryWriter writer(ofile, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+        writer.writeRaw("DFSK", 4);
+        writer << (UInt32)3;
+        writer << meta.checksum_block_size;
+        writer << meta.block_checksums;
+        // The catalog may have to be rebuilt from the directory, so the encoding is kept here too.
+        writer << meta.codec;
+        writer << (Int64)meta.uncompressed_size;
+        writer << meta.version;
+        writer.flush();
+        ofile.close();
+        if(!ofile.good()) {
+            throw WriteFileException(tmp_path);
+        }
+    }
+    File(tmp_path).renameTo(checksumPath(chunk_id));
+}
+
+bool FileChunkStore::loadChecksums(const std::string& chunk_id, ChunkMeta& meta) {
+    std::ifstream ifile(checksumPath(chunk_id).c_str(), std::ios::binary);
+    if(!ifile.good()) {
+        return false;
+    }
+    BinaryReader reader(ifile, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+
+    std::string magic;
+    UInt32 version = 0;
+    UInt32 block_size = 0;
+    std::vector<UInt32> checksums;
+    reader.readRaw(4, magic);
+    reader >> version;
+    reader >> block_size;
+    reader >> checksums;
+    // Version 1 predates compression, version 2 appends in place.
+    UInt8 codec = CODEC_NONE;
+    Int64 uncompressed_size = 0;
+    UInt32 chunk_version = 0;
+    if(version >= 2) {
+        reader >> codec;
+        reader >> uncompressed_size;
+    }
+    if(version >= 3) {
+        reader >> chunk_version;
+    }
+
+    // After a crash in the middle of an append the checksums don't cover the file. The chunk
+    // then falls back to version 0, so the meta server takes it for a stale replica.
+    if(!reader.good() || magic != "DFSK" || version < 1 || version > 3 || block_size == 0 ||
+        (int64_t)checksums.size() != (meta.size + block_size - 1) / block_size) {
+        // Unusable, the scrubber will compute fresh checksums.
+        return false;
+    }
+    meta.checksum_block_size = block_size;
+    meta.block_checksums.swap(checksums);
+    meta.codec = codec;
+    meta.uncompressed_size = uncompressed_size;
+    meta.version = chunk_version;
+    return true;
+}
+
+std::vector<UInt32> ChunkStore::blockChecksums(const uint8_t* data, int64_t length, UInt32 block_size) {
+    std::vector<UInt32> checksums;
+    for(int64_t pos=0; pos<length; pos+=block_size) {
+        int64_t n = std::min((int64_t)block_size, length - pos);
+        checksums.push_back(crc32c(0, data + pos, (size_t)n));
+    }
+    return checksums;
+}
+
+void ChunkStore::verifyBlocks(const std::string& chunk_id, const ChunkMeta& meta, int64_t offset, const std::vector<uint8_t>& data) {
+    // `offset` is block aligned and `data` ends on a block boundary or at the end of the chunk.
+    int64_t block_size = meta.checksum_block_size;
+    int64_t expected = std::min(meta.size - offset, (int64_t)data.size());
+    bool ok = (int64_t)data.size() == expected;
+
+    for(int64_t pos=0; ok && pos<(int64_t)data.size(); pos+=block_size) {
+        size_t block = (size_t)((offset + pos) / block_size);
+        int64_t n = std::min(block_size, (int64_t)data.size() - pos);
+        if(block >= meta.block_checksums.size() || crc32c(0, data.data() + pos, (size_t)n) != meta.block_checksums[block]) {
+            ok = false;
+        }
+    }
+
+    if(!ok) {
+        quarantine(chunk_id);
+        throw ChunkCorruptException(chunk_id);
+    }
+}
+
+std::vector<uint8_t> FileChunkStore::readRaw(const std::string& chunk_id, int64_t offset, int64_t length) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(!meta.overlay) {
+        return readPlain(chunk_id, offset, length);
+    }
+
+    // Overlay reads hold the lock so the base can't be deleted (or the overlay compacted) under us.
+    ScopedLock<Mutex> lock(overlay_mutex);
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(!meta.overlay) {
+        // Compacted while we were waiting for the lock.
+        return readPlain(chunk_id, offset, length);
+    }
+
+    ChunkOverlay overlay = ChunkOverlay::load(overlayPath(chunk_id));
+    if(offset > overlay.length) {
+        offset = overlay.length;
+    }
+    if(length < 0 || offset + length > overlay.length) {
+        length = overlay.length - offset;
+    }
+
+    std::vector<uint8_t> content = readPlain(overlay.base_id, offset, length);
+    content.resize((size_t)length, 0);
+    overlay.apply(offset, content);
+    return content;
+}
+
+int64_t FileChunkStore::computeChecksums(const std::string& chunk_id) {
+    // Hold the lock so a concurrent delete can't be undone by putting the entry back.
+    ScopedLock<Mutex> lock(overlay_mutex);
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta) || !meta.block_checksums.empty()) {
+        return 0;
+    }
+    std::vector<uint8_t> data = readRaw(chunk_id, 0, meta.size);
+    meta.checksum_block_size = checksum_block_size;
+    meta.block_checksums = blockChecksums(data.data(), (int64_t)data.size(), checksum_block_size);
+    saveChecksums(chunk_id, meta);
+    catalog.put(chunk_id, meta);
+    return (int64_t)data.size();
+}
+
+std::vector<uint8_t> FileChunkStore::readPlain(const std::string& chunk_id, int64_t offset, int64_t length) {
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta)) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(offset > meta.size) {
+        offset = meta.size;
+    }
+    if(length < 0 || offset + length > meta.size) {
+        length = meta.size - offset;
+    }
+
+    SharedPtr<ChunkFile> file = file_cache.open(chunkPath(chunk_id));
+    std::vector<uint8_t> content((size_t)length);
+    content.resize((size_t)file->read(offset, content.data(), length));
+    return content;
+}
+
+void ChunkStore::makeDurable(const std::vector<std::string>& paths) {
+    if(sync_queue != nullptr) {
+        sync_queue->sync(paths);
+    }
+}
+
+void ChunkStore::writeFile(const std::string& path, const std::vector<uint8_t>& content) {
+    IoScheduler::Ticket ticket(io_scheduler, (int64_t)content.size());
+    std::ofstream ofile(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+    ofile.write((const char*)content.data(), content.size());
+    ofile.close();
+    if(!ofile.good()) {
+        throw WriteFileException(path);
+    }
+}
+
+bool FileChunkStore::cloneFile(const std::string& src_path, const std::string& dst_path) {
+#if POCO_OS == POCO_OS_LINUX && defined(FICLONE)
+    if(!reflink_supported) {
+        return false;
+    }
+
+    int src_fd = ::open(src_path.c_str(), O_RDONLY);
+    if(src_fd < 0) {
+        return false;
+    }
+    int dst_fd = ::open(dst_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(dst_fd < 0) {
+        ::close(src_fd);
+        return false;
+    }
+
+    int rc = ::ioctl(dst_fd, FICLONE, src_fd);
+    int err = errno;
+    ::close(src_fd);
+    ::close(dst_fd);
+
+    if(rc != 0) {
+        if(err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV || err == ENOSYS) {
+            // The filesystem can't reflink, don't try again for every update.
+            reflink_supported = false;
+        }
+        File(dst_path).remove();
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FileChunkStore::compactOverlay(const std::string& chunk_id) {
+    // Caller holds overlay_mutex.
+    ChunkMeta meta;
+    if(!catalog.find(chunk_id, meta) || !meta.overlay) {
+        return;
+    }
+
+    // Verified, so a corrupt base isn't baked into a plain chunk.
+    std::vector<uint8_t> content = read(chunk_id, 0, meta.size);
+    content.resize((size_t)meta.size, 0);
+
+    std::string overlay_path = overlayPath(chunk_id);
+    ChunkOverlay overlay = ChunkOverlay::load(overlay_path);
+
+    std::string tmp_path = tmpPath(chunk_id);
+    writeFile(tmp_path, content);
+    File(tmp_path).renameTo(chunkPath(chunk_id));
+    // The overlay is the only durable copy until the plain chunk is.
+    makeDurable({chunkPath(chunk_id), chunk_directory.toString()});
+
+    meta.overlay = false;
+    catalog.put(chunk_id, meta);
+
+    File(overlay_path).remove();
+
+    overlay_dependents[overlay.base_id].erase(chunk_id);
+    if(overlay_dependents[overlay.base_id].empty()) {
+        overlay_dependents.erase(overlay.base_id);
+    }
+}
+
+}
@@ -0,0 +1,201 @@
+#ifndef DISTFS_CHUNK_STORE_H
+#define DISTFS_CHUNK_STORE_H
+
+#include "common.h"
+#include "chunk_catalog.h"
+#include "durability.h"
+
+#include <Poco/Path.h>
+#include <Poco/Mutex.h>
+#include <Poco/Exception.h>
+#include <Poco/BasicEvent.h>
+#include <atomic>
+#include <map>
+#include <set>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// Thrown when chunk data doesn't match its block checksums. The chunk is quarantined by then.
+POCO_DECLARE_EXCEPTION(, ChunkCorruptException, DataException)
+// Thrown when an append in place doesn't continue the chunk's current version at its end.
+POCO_DECLARE_EXCEPTION(, ChunkVersionException, RuntimeException)
+
+// An overlay chunk is a new chunk version stored as the id of an immutable base chunk plus the
+// extents written on top of it. It lets update_chunk create a new version without copying (or
+// touching) the base when the filesystem can't reflink.
+class ChunkOverlay {
+public:
+    struct Extent {
+        int64_t offset;
+        std::vector<uint8_t> data;
+    };
+
+    std::string base_id;
+    int64_t length;
+    std::vector<Extent> extents;
+
+    void apply(int64_t offset, std::vector<uint8_t>& buffer) const;
+    void save(const std::string& path) const;
+    static ChunkOverlay load(const std::string& path);
+};
+
+// Storage of the chunks on one chunk server. Lookups are answered from the in-memory catalog, and
+// every chunk carries CRC32C checksums of its blocks that reads are verified against. Backends
+// decide how the bytes are laid out on disk.
+class ChunkStore {
+public:
+    ChunkStore(const Path& root_directory);
+    virtual ~ChunkStore();
+
+    virtual void open() = 0;
+    virtual void close() = 0;
+
+    virtual bool exists(const std::string& chunk_id);
+    virtual int64_t size(const std::string& chunk_id);
+    virtual bool meta(const std::string& chunk_id, ChunkMeta& meta);
+
+    // Open handle of the chunk if it is stored as a file of its own, null otherwise.
+    virtual SharedPtr<ChunkFile> openPlain(const std::string& chunk_id);
+
+    // Reads are checked against the block checksums when verify_reads is set.
+    virtual std::vector<uint8_t> read(const std::string& chunk_id, int64_t offset, int64_t length);
+    // Start reading a range of a plain chunk in the background, for a read() soon after. A negative
+    // length is the rest of the chunk.
+    void prefetch(const std::string& chunk_id, int64_t offset, int64_t length);
+    // `content` is stored as is. With a codec it is already encoded, and uncompressed_size is the
+    // length it decodes to.
+    void create(const std::string& chunk_id, std::istream& content, UInt8 codec = CODEC_NONE, int64_t uncompressed_size = 0);
+    // The same with the codec, version and, if set, creation time of `source`, for a copy of a
+    // chunk held elsewhere.
+    virtual void create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) = 0;
+
+    // Create `new_id` as `chunk_id` with `content` written at `begin_pos`. `chunk_id` is never modified.
+    // Throws InvalidAccessException for a compressed chunk, InvalidArgumentException if begin_pos is negative.
+    virtual bool update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) = 0;
+    virtual bool remove(const std::string& chunk_id) = 0;
+    virtual std::vector<std::string> list();
+
+    // Extend `chunk_id` with `content` in place and make it `version`. `offset` has to be its current
+    // size and `version` the one after its current one, or ChunkVersionException is thrown. Returns
+    // false if the chunk can't grow in place (the backend doesn't support it, or it is compressed or
+    // shares data with overlays), the caller writes a new chunk instead.
+    virtual bool append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version);
+    // Versions of the chunks appended to in place, the others are at 0.
+    virtual std::map<std::string, UInt32> versions();
+
+    // Background housekeeping of the backend, doing at most `limit` units of work.
+    // Returns the number done.
+    virtual int compact(int limit) = 0;
+
+    // Check every block of the chunk against its checksums, or compute them if it has none yet.
+    // Returns the number of bytes read. Throws ChunkCorruptException.
+    virtual int64_t verify(const std::string& chunk_id);
+
+    // Move a corrupt chunk to `corrupt/`, so it's no longer served or reported.
+    virtual void quarantine(const std::string& chunk_id) = 0;
+
+    // Fired with the chunk id whenever a chunk is quarantined.
+    BasicEvent<const std::string> chunk_corrupted;
+
+    Path corrupt_directory;
+    Path tmp_directory;
+    Path catalog_path;
+
+    UInt32 checksum_block_size;
+    bool verify_reads;
+    // Engine that executes the reads (null reads in the calling thread), and whether they bypass
+    // the page cache. Set before open().
+    DiskEngine* disk_engine;
+    bool direct_io;
+    // Admits the store's reads and writes by priority class (null admits everything). Set before open().
+    IoScheduler* io_scheduler;
+    // Syncs new chunks before create() and update() return (null doesn't sync). Set before open().
+    SyncQueue* sync_queue;
+
+protected:
+    std::string tmpPath(const std::string& chunk_id);
+    std::string corruptPath(const std::string& chunk_id);
+
+    // Empties tmp/ and loads the catalog saved by the last clean shutdown. Returns false if the
+    // backend has to rebuild it from disk.
+    bool openCatalog();
+    void saveCatalog();
+
+    // Read the logical content of a chunk without checking it.
+    virtual std::vector<uint8_t> readRaw(const std::string& chunk_id, int64_t offset, int64_t length) = 0;
+    // Take the current content of a chunk without checksums as the reference. Returns the bytes read.
+    virtual int64_t computeChecksums(const std::string& chunk_id) = 0;
+
+    void writeFile(const std::string& path, const std::vector<uint8_t>& content);
+    // Wait until the files and directories written for a chunk are durable, as sync_queue asks.
+    void makeDurable(const std::vector<std::string>& paths);
+    static std::vector<UInt32> blockChecksums(const uint8_t* data, int64_t length, UInt32 block_size);
+    void verifyBlocks(const std::string& chunk_id, const ChunkMeta& meta, int64_t offset, const std::vector<uint8_t>& data);
+
+    ChunkCatalog catalog;
+
+private:
+    ChunkStore(const ChunkStore&);
+    ChunkStore& operator = (const ChunkStore&);
+};
+
+// File-per-chunk storage. Plain chunks live in `chunks/`, overlay chunks in `overlays/`,
+// and `tmp/` holds files that are renamed into place once complete.
+// Reads go through cached open files.
+class FileChunkStore: public ChunkStore {
+public:
+    FileChunkStore(const Path& root_directory, long open_files);
+
+    void open() override;
+    void close() override;
+
+    SharedPtr<ChunkFile> openPlain(const std::string& chunk_id) override;
+    using ChunkStore::create;
+    void create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) override;
+    bool update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) override;
+    bool remove(const std::string& chunk_id) override;
+    // Plain chunks that aren't the base of an overlay grow in place.
+    bool append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) override;
+
+    // Materialize up to `limit` overlays into plain chunks. Returns the number compacted.
+    int compact(int limit) override;
+
+    // Overlays built on a corrupt chunk are quarantined with it.
+    void quarantine(const std::string& chunk_id) override;
+
+    Path chunk_directory;
+    Path overlay_directory;
+    Path checksum_directory;
+
+protected:
+    std::string chunkPath(const std::string& chunk_id);
+    std::string overlayPath(const std::string& chunk_id);
+    std::string checksumPath(const std::string& chunk_id);
+
+    void rebuildCatalog();
+    void saveChecksums(const std::string& chunk_id, const ChunkMeta& meta);
+    bool loadChecksums(const std::string& chunk_id, ChunkMeta& meta);
+
+    std::vector<uint8_t> readRaw(const std::string& chunk_id, int64_t offset, int64_t length) override;
+    int64_t computeChecksums(const std::string& chunk_id) override;
+    std::vector<uint8_t> readPlain(const std::string& chunk_id, int64_t offset, int64_t length);
+    bool cloneFile(const std::string& src_path, const std::string& dst_path);
+    // update() without the sync, under overlay_mutex.
+    bool writeVersion(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content);
+    // append() without the sync, under overlay_mutex.
+    bool appendInPlace(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version);
+    void compactOverlay(const std::string& chunk_id);
+
+    // Guards the overlay files and overlay_dependents.
+    Mutex overlay_mutex;
+    // base chunk id -> overlays built on top of it
+    std::map<std::string, std::set<std::string>> overlay_dependents;
+    std::atomic<bool> reflink_supported;
+    bool closed;
+
+    ChunkFileCache file_cache;
+};
+}
+#endif
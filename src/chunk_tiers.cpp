@@ -0,0 +1,393 @@
+#include "chunk_tiers.h"
+#include "io_scheduler.h"
+
+#include <Poco/File.h>
+#include <Poco/Delegate.h>
+#include <Poco/MemoryStream.h>
+#include <algorithm>
+#include <tuple>
+
+namespace DistFS {
+
+TieredChunkStore::TieredChunkStore(ChunkStore* fast, ChunkStore* capacity, const std::vector<Path>& fast_directories):
+    ChunkStore(fast_directories.front()),
+    fast_capacity(0),
+    low_watermark(0.8),
+    cold_after(0),
+    promote_hits(2),
+    promote_window(600),
+    fast(fast),
+    capacity(capacity),
+    fast_directories(fast_directories),
+    fast_used(0)
+{
+}
+
+TieredChunkStore::~TieredChunkStore() {
+    delete fast;
+    delete capacity;
+}
+
+void TieredChunkStore::open() {
+    ChunkStore* tiers[] = {fast, capacity};
+    for(ChunkStore* tier: tiers) {
+        tier->checksum_block_size = checksum_block_size;
+        tier->verify_reads = verify_reads;
+        tier->direct_io = direct_io;
+        tier->sync_queue = sync_queue;
+        tier->chunk_corrupted += delegate(this, &TieredChunkStore::onChunkCorrupted);
+        tier->open();
+    }
+
+    if(fast_capacity <= 0) {
+        for(auto it=fast_directories.begin(); it!=fast_directories.end(); ++it) {
+            fast_capacity += (int64_t)(File(*it).totalSpace() / 10 * 9);
+        }
+    }
+
+    int64_t used = 0;
+    std::vector<std::string> chunks = fast->list();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        ChunkMeta meta;
+        if(fast->meta(*it, meta)) {
+            used += meta.size;
+        }
+    }
+    fast_used = used;
+}
+
+void TieredChunkStore::close() {
+    fast->close();
+    capacity->close();
+}
+
+bool TieredChunkStore::exists(const std::string& chunk_id) {
+    return fast->exists(chunk_id) || capacity->exists(chunk_id);
+}
+
+int64_t TieredChunkStore::size(const std::string& chunk_id) {
+    return onTier<int64_t>(chunk_id, [&](ChunkStore& tier) {
+        return tier.size(chunk_id);
+    });
+}
+
+bool TieredChunkStore::meta(const std::string& chunk_id, ChunkMeta& meta) {
+    return fast->meta(chunk_id, meta) || capacity->meta(chunk_id, meta);
+}
+
+SharedPtr<ChunkFile> TieredChunkStore::openPlain(const std::string& chunk_id) {
+    ChunkStore* tier = tierOf(chunk_id);
+    if(tier == nullptr) {
+        return SharedPtr<ChunkFile>();
+    }
+    // Reading an open file keeps working after a migration has removed it.
+    SharedPtr<ChunkFile> file = tier->openPlain(chunk_id);
+    if(!file.isNull()) {
+        recordRead(chunk_id, *tier);
+    }
+    return file;
+}
+
+std::vector<uint8_t> TieredChunkStore::read(const std::string& chunk_id, int64_t offset, int64_t length) {
+    return onTier<std::vector<uint8_t>>(chunk_id, [&](ChunkStore& tier) {
+        std::vector<uint8_t> data = tier.read(chunk_id, offset, length);
+        recordRead(chunk_id, tier);
+        return data;
+    });
+}
+
+void TieredChunkStore::create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) {
+    // A chunk written again stays on its tier, so there is never a stale copy on the other one.
+    ChunkStore* tier = tierOf(chunk_id);
+    if(tier == nullptr) {
+        tier = fast_used.load() < fast_capacity ? fast : capacity;
+    }
+    tier->create(chunk_id, content, source);
+
+    ChunkMeta meta;
+    if(tier == fast && fast->meta(chunk_id, meta)) {
+        fast_used += meta.size;
+    }
+}
+
+bool TieredChunkStore::update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) {
+    // The new version goes to the tier of its source, so reflinks and overlays keep working.
+    for(int attempt=0; attempt<2; attempt++) {
+        ChunkStore* tier = tierOf(chunk_id);
+        if(tier == nullptr) {
+            return false;
+        }
+        ChunkStore* other = tier == fast ? capacity : fast;
+        if(other->exists(new_id)) {
+            other->remove(new_id);
+        }
+
+        if(tier->update(chunk_id, new_id, begin_pos, content)) {
+            ChunkMeta meta;
+            if(tier == fast && fast->meta(new_id, meta)) {
+                fast_used += meta.size;
+            }
+            return true;
+        }
+        // The source may have been moved to the other tier meanwhile.
+    }
+    return false;
+}
+
+bool TieredChunkStore::remove(const std::string& chunk_id) {
+    bool removed = false;
+    {
+        FastMutex::ScopedLock lock(remove_mutex);
+        // Both, in case a migration has already copied it.
+        if(fast->exists(chunk_id)) {
+            removed = fast->remove(chunk_id) || removed;
+        }
+        if(capacity->exists(chunk_id)) {
+            removed = capacity->remove(chunk_id) || removed;
+        }
+    }
+
+    FastMutex::ScopedLock lock(access_mutex);
+    accesses.erase(chunk_id);
+    hot.erase(chunk_id);
+    return removed;
+}
+
+std::vector<std::string> TieredChunkStore::list() {
+    std::vector<std::string> chunks = fast->list();
+    std::unordered_set<std::string> on_fast(chunks.begin(), chunks.end());
+    std::vector<std::string> capacity_chunks = capacity->list();
+    for(auto it=capacity_chunks.begin(); it!=capacity_chunks.end(); ++it) {
+        if(on_fast.count(*it) == 0) {
+            chunks.push_back(*it);
+        }
+    }
+    return chunks;
+}
+
+bool TieredChunkStore::append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) {
+    // Not while a migration finishes, it would drop the appended bytes with the original.
+    FastMutex::ScopedLock lock(remove_mutex);
+    ChunkStore* tier = tierOf(chunk_id);
+    if(tier == nullptr) {
+        throw FileNotFoundException(chunk_id);
+    }
+    if(!tier->append(chunk_id, offset, content, version)) {
+        return false;
+    }
+    if(tier == fast) {
+        fast_used += (int64_t)content.size();
+    }
+    return true;
+}
+
+std::map<std::string, UInt32> TieredChunkStore::versions() {
+    std::map<std::string, UInt32> result = fast->versions();
+    std::map<std::string, UInt32> capacity_versions = capacity->versions();
+    result.insert(capacity_versions.begin(), capacity_versions.end());
+    return result;
+}
+
+int TieredChunkStore::compact(int limit) {
+    int done = rebalance(limit);
+    if(done < limit) {
+        done += fast->compact(limit - done);
+    }
+    if(done < limit) {
+        done += capacity->compact(limit - done);
+    }
+    return done;
+}
+
+int64_t TieredChunkStore::verify(const std::string& chunk_id) {
+    ChunkStore* tier = tierOf(chunk_id);
+    if(tier == nullptr) {
+        return 0;
+    }
+    return tier->verify(chunk_id);
+}
+
+void TieredChunkStore::quarantine(const std::string& chunk_id) {
+    ChunkStore* tier = tierOf(chunk_id);
+    if(tier != nullptr) {
+        tier->quarantine(chunk_id);
+    }
+}
+
+TieredChunkStore::Stats TieredChunkStore::stats() {
+    Stats result;
+    std::vector<std::string> chunks = fast->list();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        ChunkMeta meta;
+        if(fast->meta(*it, meta)) {
+            result.fast_chunks++;
+            result.fast_bytes += (UInt64)meta.size;
+        }
+    }
+    chunks = capacity->list();
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        ChunkMeta meta;
+        if(capacity->meta(*it, meta)) {
+            result.capacity_chunks++;
+            result.capacity_bytes += (UInt64)meta.size;
+        }
+    }
+    result.promotions = (UInt64)promotions.value();
+    result.demotions = (UInt64)demotions.value();
+    return result;
+}
+
+ChunkStore* TieredChunkStore::tierOf(const std::string& chunk_id) {
+    if(fast->exists(chunk_id)) {
+        return fast;
+    }
+    if(capacity->exists(chunk_id)) {
+        return capacity;
+    }
+    return nullptr;
+}
+
+void TieredChunkStore::recordRead(const std::string& chunk_id, ChunkStore& tier) {
+    Timestamp::TimeVal now = Timestamp().epochMicroseconds();
+    FastMutex::ScopedLock lock(access_mutex);
+    Access& access = accesses[chunk_id];
+    if(now - access.last > promote_window * 1000000) {
+        access.hits = 0;
+    }
+    access.hits++;
+    access.last = now;
+    if(&tier == capacity && access.hits >= promote_hits) {
+        hot.insert(chunk_id);
+    }
+}
+
+bool TieredChunkStore::migrate(const std::string& chunk_id, ChunkStore& from, ChunkStore& to) {
+    ChunkMeta meta;
+    if(!from.meta(chunk_id, meta) || meta.overlay) {
+        // Overlays stay with their base until compaction turns them into plain chunks.
+        return false;
+    }
+
+    // The stored bytes, a compressed chunk stays compressed, under the same version so appends in
+    // place go on. The copy is durable before the original goes.
+    std::vector<uint8_t> data;
+    try {
+        data = from.read(chunk_id, 0, meta.size);
+    } catch(FileNotFoundException&) {
+        return false;
+    } catch(ChunkCorruptException&) {
+        // Already quarantined, there is nothing left to move.
+        return false;
+    }
+    MemoryInputStream istr((const char*)data.data(), data.size());
+    to.create(chunk_id, istr, meta);
+
+    FastMutex::ScopedLock lock(remove_mutex);
+    ChunkMeta now;
+    ChunkMeta copied;
+    if(!from.meta(chunk_id, now) || now.version != meta.version || !to.meta(chunk_id, copied) || copied.version != meta.version) {
+        // Removed or appended to while it was copied.
+        to.remove(chunk_id);
+        return false;
+    }
+    from.remove(chunk_id);
+    return true;
+}
+
+int TieredChunkStore::rebalance(int limit) {
+    // Migrations must not take the disk from client reads and writes.
+    IoScheduler::Scope io_scope(IO_BACKGROUND);
+    Timestamp::TimeVal now = Timestamp().epochMicroseconds();
+
+    // (last read, size, id) of the fast tier's plain chunks, coldest first.
+    std::vector<std::tuple<Timestamp::TimeVal, int64_t, std::string>> candidates;
+    int64_t used = 0;
+    std::vector<std::string> chunks = fast->list();
+    {
+        FastMutex::ScopedLock lock(access_mutex);
+        for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+            ChunkMeta meta;
+            if(!fast->meta(*it, meta)) {
+                continue;
+            }
+            used += meta.size;
+            if(meta.overlay) {
+                continue;
+            }
+            auto access = accesses.find(*it);
+            Timestamp::TimeVal last = access != accesses.end() ? std::max(access->second.last, meta.created) : meta.created;
+            candidates.emplace_back(last, meta.size, *it);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    int done = 0;
+    int64_t target = used > fast_capacity ? (int64_t)((double)fast_capacity * low_watermark) : used;
+    auto coldest = candidates.begin();
+    for(; coldest!=candidates.end() && done < limit; ++coldest) {
+        bool cold = cold_after > 0 && now - std::get<0>(*coldest) > cold_after * 1000000;
+        if(!cold && used <= target) {
+            // The rest were read more recently.
+            break;
+        }
+        if(migrate(std::get<2>(*coldest), *fast, *capacity)) {
+            used -= std::get<1>(*coldest);
+            ++demotions;
+            done++;
+        }
+    }
+
+    std::vector<std::string> promote;
+    {
+        FastMutex::ScopedLock lock(access_mutex);
+        promote.assign(hot.begin(), hot.end());
+        hot.clear();
+    }
+    // A hot chunk takes the place of fast tier chunks that weren't read within promote_window.
+    Timestamp::TimeVal recent = now - promote_window * 1000000;
+    for(auto it=promote.begin(); it!=promote.end() && done < limit; ++it) {
+        ChunkMeta meta;
+        if(!capacity->meta(*it, meta)) {
+            continue;
+        }
+        while(used + meta.size > fast_capacity && coldest != candidates.end() && std::get<0>(*coldest) < recent && done < limit) {
+            if(migrate(std::get<2>(*coldest), *fast, *capacity)) {
+                used -= std::get<1>(*coldest);
+                ++demotions;
+                done++;
+            }
+            ++coldest;
+        }
+        if(used + meta.size > fast_capacity || done >= limit) {
+            continue;
+        }
+        if(migrate(*it, *capacity, *fast)) {
+            used += meta.size;
+            ++promotions;
+            done++;
+        }
+    }
+
+    fast_used = used;
+    return done;
+}
+
+void TieredChunkStore::onChunkCorrupted(const void*, const std::string& chunk_id) {
+    {
+        FastMutex::ScopedLock lock(access_mutex);
+        accesses.erase(chunk_id);
+        hot.erase(chunk_id);
+    }
+    chunk_corrupted.notify(this, chunk_id);
+}
+
+std::vector<uint8_t> TieredChunkStore::readRaw(const std::string& chunk_id, int64_t offset, int64_t length) {
+    // read() is delegated as a whole, the tier's store does the checking.
+    return read(chunk_id, offset, length);
+}
+
+int64_t TieredChunkStore::computeChecksums(const std::string& chunk_id) {
+    return verify(chunk_id);
+}
+
+}
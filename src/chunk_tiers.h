@@ -0,0 +1,130 @@
+#ifndef DISTFS_CHUNK_TIERS_H
+#define DISTFS_CHUNK_TIERS_H
+
+#include "chunk_store.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/AtomicCounter.h>
+#include <Poco/Timestamp.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+
+namespace DistFS {
+
+// Splits the chunks of one chunk server between a fast tier (SSDs) and a capacity tier (HDDs).
+// New chunks go to the fast tier while it has room. compact() moves the chunks that weren't read
+// for cold_after seconds down to the capacity tier, and the least recently read ones as well
+// while the fast tier is above its capacity. Chunks on the capacity tier that are read
+// promote_hits times within promote_window seconds are moved back up.
+//
+// Only reads that reach the store count; chunks served from the chunk cache don't need the fast
+// tier. A chunk being moved is on both tiers until the copy is complete, readers find it on either.
+class TieredChunkStore: public ChunkStore {
+public:
+    // Takes ownership of the tiers. Their disk_engine and io_scheduler have to be set by the caller,
+    // the remaining settings are copied from this store on open(). `fast_directories` are the data
+    // directories of the fast tier, the default capacity is taken from their size.
+    TieredChunkStore(ChunkStore* fast, ChunkStore* capacity, const std::vector<Path>& fast_directories);
+    ~TieredChunkStore();
+
+    void open() override;
+    void close() override;
+
+    bool exists(const std::string& chunk_id) override;
+    int64_t size(const std::string& chunk_id) override;
+    bool meta(const std::string& chunk_id, ChunkMeta& meta) override;
+    SharedPtr<ChunkFile> openPlain(const std::string& chunk_id) override;
+    std::vector<uint8_t> read(const std::string& chunk_id, int64_t offset, int64_t length) override;
+
+    using ChunkStore::create;
+    void create(const std::string& chunk_id, std::istream& content, const ChunkMeta& source) override;
+    bool update(const std::string& chunk_id, const std::string& new_id, int64_t begin_pos, const std::vector<uint8_t>& content) override;
+    bool remove(const std::string& chunk_id) override;
+    std::vector<std::string> list() override;
+    bool append(const std::string& chunk_id, int64_t offset, const std::vector<uint8_t>& content, UInt32 version) override;
+    std::map<std::string, UInt32> versions() override;
+
+    // Migrates up to `limit` chunks between the tiers, then compacts both.
+    int compact(int limit) override;
+    int64_t verify(const std::string& chunk_id) override;
+    void quarantine(const std::string& chunk_id) override;
+
+    // Bytes of chunks the fast tier may hold, 0 for 90% of its directories' space. Set before open().
+    int64_t fast_capacity;
+    // Demotion under pressure goes down to this fraction of fast_capacity.
+    double low_watermark;
+    // Seconds without reads after which a chunk leaves the fast tier, 0 to only demote under pressure.
+    int64_t cold_after;
+    int promote_hits;
+    int64_t promote_window;
+
+    struct Stats {
+        UInt64 fast_chunks = 0;
+        UInt64 fast_bytes = 0;
+        UInt64 capacity_chunks = 0;
+        UInt64 capacity_bytes = 0;
+        UInt64 promotions = 0;
+        UInt64 demotions = 0;
+    };
+    // Walks both tiers.
+    Stats stats();
+
+protected:
+    struct Access {
+        Timestamp::TimeVal last = 0;    // epoch microseconds of the last read
+        int hits = 0;                   // reads within promote_window of each other
+    };
+
+    // The tier holding the chunk, the fast one if it is on both. Null if neither does.
+    ChunkStore* tierOf(const std::string& chunk_id);
+
+    // Run `operation` on the chunk's tier. A chunk moved meanwhile is looked up once more.
+    template <typename Result, typename Function>
+    Result onTier(const std::string& chunk_id, Function operation) {
+        for(int attempt=0; ; attempt++) {
+            ChunkStore* tier = tierOf(chunk_id);
+            if(tier == nullptr) {
+                throw FileNotFoundException(chunk_id);
+            }
+            try {
+                return operation(*tier);
+            } catch(FileNotFoundException&) {
+                if(attempt > 0) {
+                    throw;
+                }
+            }
+        }
+    }
+
+    void recordRead(const std::string& chunk_id, ChunkStore& tier);
+    // Copy the chunk to `to` and remove it from `from`. Returns false if there was nothing to move.
+    bool migrate(const std::string& chunk_id, ChunkStore& from, ChunkStore& to);
+    // Demote what is cold or over capacity, then promote what is hot while there is room.
+    int rebalance(int limit);
+    void onChunkCorrupted(const void* sender, const std::string& chunk_id);
+
+    std::vector<uint8_t> readRaw(const std::string& chunk_id, int64_t offset, int64_t length) override;
+    int64_t computeChecksums(const std::string& chunk_id) override;
+
+    ChunkStore* fast;
+    ChunkStore* capacity;
+    std::vector<Path> fast_directories;
+    // Estimate between rebalances, so create() doesn't have to add up the fast tier.
+    std::atomic<int64_t> fast_used;
+
+    FastMutex access_mutex;
+    std::unordered_map<std::string, Access> accesses;
+    // Capacity tier chunks that reached promote_hits.
+    std::unordered_set<std::string> hot;
+
+    // Removes and appends must not interleave with the end of a migration of the same chunk, or
+    // the copy could outlive the chunk or miss the appended bytes.
+    FastMutex remove_mutex;
+
+    AtomicCounter promotions;
+    AtomicCounter demotions;
+};
+
+}
+#endif
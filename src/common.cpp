@@ -3,6 +3,13 @@
 #include <Poco/DirectoryIterator.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/StreamCopier.h>
+#include <Poco/String.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/BinaryWriter.h>
+#include <Poco/BinaryReader.h>
+#include <Poco/NullStream.h>
+#include <exception>
+#include <algorithm>
 
 using namespace DistFS;
 
@@ -290,17 +297,252 @@ std::map<std::string, std::string> getQueryMap(const URI uri) {
     return ret;
 }
 
-std::vector<uint8_t> getChunk(std::string& address, std::string chunk_id) {
+namespace {
+
+// Past this, the rest of a response isn't skipped to keep its connection.
+const std::streamsize MAX_SKIPPED = 64*1024;
+
+class KeepAliveRequestHandler: public HTTPRequestHandler {
+public:
+    KeepAliveRequestHandler(HTTPRequestHandler* handler): handler(handler) {
+    }
+
+    ~KeepAliveRequestHandler() {
+        delete handler;
+    }
+
+    void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        // Handlers that give a length, or send a buffer, turn the chunks off again.
+        bool keep_alive = response.getKeepAlive() && request.getVersion() == HTTPMessage::HTTP_1_1;
+        if(keep_alive) {
+            response.setChunkedTransferEncoding(true);
+        }
+        handler->handleRequest(request, response);
+        if(!keep_alive || !response.getKeepAlive()) {
+            return;
+        }
+        if(request.hasContentLength() || request.getChunkedTransferEncoding()) {
+            // Or it would be read as the next request.
+            NullOutputStream null;
+            StreamCopier::copyStream(request.stream(), null);
+        } else if(request.getMethod() == HTTPRequest::HTTP_POST || request.getMethod() == HTTPRequest::HTTP_PUT) {
+            // The body ends when the client closes the connection.
+            response.setKeepAlive(false);
+        }
+    }
+
+protected:
+    HTTPRequestHandler* handler;
+};
+
+}
+
+SessionPool& SessionPool::instance() {
+    static SessionPool pool;
+    return pool;
+}
+
+SessionPool::SessionPool():
+    max_per_host(64),
+    max_idle_per_host(4),
+    idle_timeout(2, 0),
+    wait_timeout(10, 0)
+{
+}
+
+void SessionPool::configure(const AbstractConfiguration& config, const std::string& prefix) {
+    ScopedLock<Mutex> lock(mutex);
+    max_per_host = std::max(config.getInt(prefix + ".pool_max_per_host", 64), 0);
+    max_idle_per_host = std::max(config.getInt(prefix + ".pool_max_idle_per_host", 4), 0);
+    idle_timeout = Timespan(std::max(config.getInt(prefix + ".pool_idle_timeout", 2), 0), 0);
+    wait_timeout = Timespan(std::max(config.getInt(prefix + ".pool_wait_timeout", 10), 0), 0);
+    cluster_secret = config.getString(prefix + ".cluster_secret", "");
+}
+
+std::string SessionPool::clusterSecret() {
+    ScopedLock<Mutex> lock(mutex);
+    return cluster_secret;
+}
+
+SharedPtr<HTTPClientSession> SessionPool::acquire(const std::string& host, UInt16 port) {
+    std::string key = host + ":" + std::to_string(port);
+    ScopedLock<Mutex> lock(mutex);
+    Timestamp waiting;
+    while(max_per_host > 0 && hosts[key].active >= max_per_host) {
+        long remaining = (long)((wait_timeout.totalMicroseconds() - waiting.elapsed()) / 1000);
+        if(remaining <= 0 || !released.tryWait(mutex, remaining)) {
+            throw TimeoutException("No connection to " + key + " given back in time");
+        }
+    }
+    Host& entry = hosts[key];
+    entry.active++;
+    evict(entry);
+    // The most recent first, the others may go idle long enough to be dropped.
+    while(!entry.idle.empty()) {
+        SharedPtr<HTTPClientSession> session = entry.idle.back().session;
+        entry.idle.pop_back();
+        if(healthy(*session)) {
+            counters.reused++;
+            return session;
+        }
+        counters.evicted++;
+    }
+    counters.created++;
+    // Connects on the first request.
+    SharedPtr<HTTPClientSession> session(new HTTPClientSession(host, port));
+    session->setKeepAlive(true);
+    // How long a session has been idle is the pool's business, Poco's timeout counts from the
+    // start of the last request.
+    session->setKeepAliveTimeout(Timespan(Timespan::DAYS));
+    return session;
+}
+
+void SessionPool::release(const std::string& host, UInt16 port, SharedPtr<HTTPClientSession> session, bool reusable) {
+    std::string key = host + ":" + std::to_string(port);
+    ScopedLock<Mutex> lock(mutex);
+    Host& entry = hosts[key];
+    entry.active--;
+    if(reusable && session->connected() && (int)entry.idle.size() < max_idle_per_host && idle_timeout > 0) {
+        entry.idle.push_back({session, Timestamp()});
+    }
+    if(swept.isElapsed(idle_timeout.totalMicroseconds())) {
+        swept.update();
+        for(auto it=hosts.begin(); it!=hosts.end();) {
+            evict(it->second);
+            if(it->second.active == 0 && it->second.idle.empty()) {
+                it = hosts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    released.broadcast();
+}
+
+SessionPool::Stats SessionPool::stats() {
+    ScopedLock<Mutex> lock(mutex);
+    Stats result = counters;
+    for(auto it=hosts.begin(); it!=hosts.end(); ++it) {
+        result.active += it->second.active;
+        result.idle += (int)it->second.idle.size();
+    }
+    return result;
+}
+
+bool SessionPool::healthy(HTTPClientSession& session) {
+    try {
+        // Nothing arrives on an idle connection, unless the server closed it.
+        return session.connected() && !session.socket().poll(Timespan(0), Socket::SELECT_READ | Socket::SELECT_ERROR);
+    } catch(Exception& e) {
+        return false;
+    }
+}
+
+void SessionPool::evict(Host& host) {
+    while(!host.idle.empty() && host.idle.front().since.isElapsed(idle_timeout.totalMicroseconds())) {
+        host.idle.pop_front();
+        counters.evicted++;
+    }
+}
+
+namespace {
+
+thread_local std::string thread_client;
+
+}
+
+ClientScope::ClientScope(const std::string& client):
+    previous(thread_client)
+{
+    thread_client = client;
+}
+
+ClientScope::~ClientScope() {
+    thread_client = previous;
+}
+
+std::string ClientScope::current() {
+    return thread_client;
+}
+
+PooledSession::PooledSession(const std::string& host, UInt16 port):
+    host(host),
+    port(port),
+    session(SessionPool::instance().acquire(host, port)),
+    response_stream(nullptr),
+    keep_alive(false)
+{
+}
+
+PooledSession::~PooledSession() {
+    bool reusable = false;
+    if(response_stream != nullptr && keep_alive && !std::uncaught_exception()) {
+        try {
+            // Or it would be read as the next response.
+            response_stream->ignore(MAX_SKIPPED);
+            reusable = response_stream->eof() && !response_stream->bad() && session->networkException() == nullptr;
+        } catch(...) {
+            reusable = false;
+        }
+    }
+    SessionPool::instance().release(host, port, session, reusable);
+}
+
+std::ostream& PooledSession::sendRequest(HTTPRequest& request) {
+    request.setVersion(HTTPMessage::HTTP_1_1);
+    request.setKeepAlive(true);
+    if(!request.hasContentLength() && !request.getChunkedTransferEncoding() &&
+            (request.getMethod() == HTTPRequest::HTTP_POST || request.getMethod() == HTTPRequest::HTTP_PUT)) {
+        request.setChunkedTransferEncoding(true);
+    }
+    std::string secret = SessionPool::instance().clusterSecret();
+    if(!secret.empty()) {
+        request.set("X-DistFS-Cluster-Secret", secret);
+    }
+    std::string client = ClientScope::current();
+    if(!client.empty() && !request.has("X-DistFS-Client")) {
+        request.set("X-DistFS-Client", client);
+    }
+    response_stream = nullptr;
+    return session->sendRequest(request);
+}
+
+std::istream& PooledSession::receiveResponse(HTTPResponse& response) {
+    std::istream& istr = session->receiveResponse(response);
+    keep_alive = response.getKeepAlive();
+    response_stream = &istr;
+    return istr;
+}
+
+KeepAliveRequestHandlerFactory::KeepAliveRequestHandlerFactory(HTTPRequestHandlerFactory& factory): factory(factory) {
+}
+
+HTTPRequestHandler* KeepAliveRequestHandlerFactory::createRequestHandler(const HTTPServerRequest& request) {
+    HTTPRequestHandler* handler = factory.createRequestHandler(request);
+    return handler != nullptr ? new KeepAliveRequestHandler(handler) : nullptr;
+}
+
+std::vector<uint8_t> getChunk(std::string& address, std::string chunk_id, int64_t offset, int64_t length) {
     URI uri("http://"+address);
     uri.setPath("/get_chunk");
     URI::QueryParameters param = {
         {"chunk_id", chunk_id}
     };
+    if(offset > 0) {
+        param.push_back({"offset", std::to_string(offset)});
+    }
+    if(length >= 0) {
+        param.push_back({"length", std::to_string(length)});
+    }
 
     uri.setQueryParameters(param);
     HTTPRequest request(HTTPRequest::HTTP_GET, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    if(offset <= 0 && length < 0) {
+        // Compressed chunks then come over the wire as stored.
+        request.set("Accept-Encoding", "deflate");
+    }
 
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
     std::ostream& out = session.sendRequest(request);
 
     HTTPResponse response;
@@ -313,11 +555,83 @@ std::vector<uint8_t> getChunk(std::string& address, std::string chunk_id) {
         return content;
     }
 
-    std::istream_iterator<uint8_t> isit(resp_stream);
-    std::copy(isit, std::istream_iterator<uint8_t>(), std::back_inserter(content));
+    if(icompare(response.get("Content-Encoding", ""), "deflate") == 0) {
+        InflatingInputStream inflater(resp_stream, InflatingStreamBuf::STREAM_ZLIB);
+        std::string body;
+        StreamCopier::copyToString(inflater, body);
+        content.assign(body.begin(), body.end());
+        if(response.has("X-Uncompressed-Length") && (int64_t)content.size() != std::stoll(response.get("X-Uncompressed-Length"))) {
+            // Same as a short read, the caller tries another replica.
+            content.clear();
+        }
+    } else if(response.hasContentLength()) {
+        content.resize((size_t)response.getContentLength64());
+        resp_stream.read((char*)content.data(), content.size());
+        content.resize((size_t)resp_stream.gcount());
+    } else {
+        std::string body;
+        StreamCopier::copyToString(resp_stream, body);
+        content.assign(body.begin(), body.end());
+    }
     return content;
 }
 
+void writeChunkFrame(std::ostream& ostr, const std::string& chunk_id, int status, const uint8_t* data, int64_t length) {
+    BinaryWriter writer(ostr, BinaryWriter::LITTLE_ENDIAN_BYTE_ORDER);
+    writer << chunk_id;
+    writer << (Int32)status;
+    writer << (Int64)length;
+    writer.writeRaw((const char*)data, (std::streamsize)length);
+    writer.flush();
+}
+
+bool readChunkFrame(std::istream& istr, ChunkFrame& frame, int64_t max_length) {
+    if(istr.peek() == std::char_traits<char>::eof()) {
+        return false;
+    }
+    BinaryReader reader(istr, BinaryReader::LITTLE_ENDIAN_BYTE_ORDER);
+    Int32 status = 0;
+    Int64 length = -1;
+    reader >> frame.chunk_id;
+    reader >> status;
+    reader >> length;
+    if(!reader.good() || length < 0) {
+        throw DataFormatException("Truncated chunk frame");
+    }
+    if(max_length >= 0 && length > max_length) {
+        throw DataFormatException("Chunk frame " + frame.chunk_id + " of " + std::to_string(length) + " bytes is too big");
+    }
+    frame.status = status;
+    frame.data.resize((size_t)length);
+    istr.read((char*)frame.data.data(), (std::streamsize)length);
+    if(istr.gcount() != length) {
+        throw DataFormatException("Truncated chunk frame " + frame.chunk_id);
+    }
+    return true;
+}
+
+const std::string HOLE_CHUNK_ID = "hole";
+
+std::string fragmentId(const std::string& chunk_id, int index) {
+    return chunk_id + "." + std::to_string(index);
+}
+
+std::vector<int64_t> chunkOffsets(JSON::Object::Ptr file_meta) {
+    JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+    JSON::Array::Ptr lengths_json = file_meta->getArray("chunk_lengths");
+    int64_t length = file_meta->getValue<int64_t>("length");
+    int64_t chunk_size = file_meta->getValue<int64_t>("chunk_size");
+
+    std::vector<int64_t> offsets;
+    int64_t offset = 0;
+    for(unsigned int i=0; i<chunks_json->size(); i++) {
+        offsets.push_back(std::min(offset, length));
+        offset += lengths_json.isNull() ? chunk_size : lengths_json->getElement<int64_t>(i);
+    }
+    offsets.push_back(length);
+    return offsets;
+}
+
 bool writeChunksOnServers(std::vector<std::string>& addresses, std::string chunk_id, std::istream& content) {
     HTTPRequest request(HTTPRequest::HTTP_POST, "/create_chunk", HTTPMessage::HTTP_1_1);
     request.setContentType("application/octet-stream");
@@ -325,9 +639,7 @@ bool writeChunksOnServers(std::vector<std::string>& addresses, std::string chunk
     for(auto it=addresses.begin(); it!=addresses.end(); ++it) {
         std::string address = (*it);
         URI uri(address);
-        HTTPClientSession session(uri.getHost(), uri.getPort());
-
-        session.setKeepAlive(true);
+        PooledSession session(uri.getHost(), uri.getPort());
         std::ostream& out = session.sendRequest(request);
         content.seekg(0);
         StreamCopier::copyStream(content, out);
@@ -345,7 +657,7 @@ JSON::Object::Ptr getFileMeta(std::string address, std::string filename) {
     uri.setQueryParameters(param);
     HTTPRequest request(HTTPRequest::HTTP_GET, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
     
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
 
     std::ostream& out = session.sendRequest(request);
 
@@ -362,16 +674,30 @@ JSON::Object::Ptr getFileMeta(std::string address, std::string filename) {
     return resp_json;
 }
 
-int requestCreateFile(std::string address, std::string filename) {
+int requestCreateFile(std::string address, std::string filename, std::string compression,
+        std::string layout, std::string data_shards, std::string parity_shards, std::string dedup) {
     URI uri("http://"+address);
     uri.setPath("/create_file");
     URI::QueryParameters param = {
-        {"filename", filename}
+        {"filename", filename},
+        {"compression", compression}
     };
+    if(!layout.empty()) {
+        param.push_back({"layout", layout});
+    }
+    if(!data_shards.empty()) {
+        param.push_back({"data_shards", data_shards});
+    }
+    if(!parity_shards.empty()) {
+        param.push_back({"parity_shards", parity_shards});
+    }
+    if(!dedup.empty()) {
+        param.push_back({"dedup", dedup});
+    }
     uri.setQueryParameters(param);
     HTTPRequest request(HTTPRequest::HTTP_GET, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
 
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
 
     std::ostream& out = session.sendRequest(request);
 
@@ -391,7 +717,7 @@ int requestCreateChunk(std::string address, std::string chunk_id, std::vector<ui
     HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
     request.setContentType("application/octet-stream");
 
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
 
     std::ostream& out = session.sendRequest(request);
     StreamCopier copier;
@@ -404,6 +730,79 @@ int requestCreateChunk(std::string address, std::string chunk_id, std::vector<ui
     return response.getStatus();
 }
 
+// One pass down the chain. Returns the addresses that stored the chunk.
+static std::vector<std::string> createChunkOnChain(const std::vector<std::string>& addresses, const std::string& chunk_id,
+        const std::vector<uint8_t>& content, const std::string& compression) {
+    std::vector<std::string> committed;
+    URI uri("http://"+addresses.front());
+    uri.setPath("/create_chunk");
+    URI::QueryParameters param = {
+        {"chunk_id", chunk_id},
+        {"chain", cat(std::string(","), addresses.begin()+1, addresses.end())}
+    };
+    if(compression != "none") {
+        param.push_back({"compression", compression});
+    }
+    uri.setQueryParameters(param);
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/octet-stream");
+    request.setContentLength64(content.size());
+
+    try {
+        PooledSession session(uri.getHost(), uri.getPort());
+
+        std::ostream& out = session.sendRequest(request);
+        out.write((const char*)content.data(), content.size());
+        out.flush();
+
+        HTTPResponse response;
+        std::istream& istr = session.receiveResponse(response);
+
+        JSON::Parser parser;
+        JSON::Object::Ptr resp_json = parser.parse(istr).extract<JSON::Object::Ptr>();
+        if(resp_json->optValue<bool>("stored", false)) {
+            committed.push_back(addresses.front());
+        }
+        JSON::Array::Ptr committed_json = resp_json->getArray("committed");
+        for(size_t i=0; !committed_json.isNull() && i<committed_json->size(); i++) {
+            committed.push_back(committed_json->getElement<std::string>(i));
+        }
+    } catch(Exception& e) {
+        Application::instance().logger().warning("Creating chunk " + chunk_id + " on " + addresses.front() + " failed: " + e.displayText());
+    }
+    return committed;
+}
+
+int requestCreateChunkChain(std::vector<std::string> addresses, std::string chunk_id, std::vector<uint8_t>& content, std::string compression) {
+    std::vector<std::string> stored;
+    std::vector<std::string> missing;
+    // A server that failed makes the ones after it miss the chunk too: send it again down a chain
+    // of the ones that don't have it. If none of them stored it, the head is taken to be down.
+    while(!addresses.empty()) {
+        std::vector<std::string> got = createChunkOnChain(addresses, chunk_id, content, compression);
+        std::vector<std::string> rest;
+        for(auto it=addresses.begin(); it!=addresses.end(); ++it) {
+            auto found = std::find(got.begin(), got.end(), *it);
+            if(found == got.end()) {
+                rest.push_back(*it);
+            } else {
+                got.erase(found);
+                stored.push_back(*it);
+            }
+        }
+        if(rest.size() == addresses.size()) {
+            missing.push_back(rest.front());
+            rest.erase(rest.begin());
+        }
+        addresses.swap(rest);
+    }
+    if(!missing.empty()) {
+        Application::instance().logger().warning("Chunk " + chunk_id + " stored on " + cat(std::string(","), stored.begin(), stored.end()) +
+            ", not on " + cat(std::string(","), missing.begin(), missing.end()));
+    }
+    return (int)stored.size();
+}
+
 int requestUpdateChunk(std::string address, std::string chunk_id, std::string new_id, int64_t begin_pos, std::vector<uint8_t>& content) {
     URI uri("http://"+address);
     uri.setPath("/update_chunk");
@@ -416,7 +815,7 @@ int requestUpdateChunk(std::string address, std::string chunk_id, std::string ne
     HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
     request.setContentType("application/octet-stream");
 
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
 
     std::ostream& out = session.sendRequest(request);
 
@@ -429,13 +828,237 @@ int requestUpdateChunk(std::string address, std::string chunk_id, std::string ne
     return response.getStatus();
 }
 
-int requestUpdateChunksList(std::string address, std::string chunk_server_id, std::vector<std::string> chunks_list) {
+int requestAppendChunk(std::string address, std::string chunk_id, int64_t offset, int64_t version, const std::vector<uint8_t>& content) {
+    URI uri("http://"+address);
+    uri.setPath("/append_chunk");
+    URI::QueryParameters param = {
+        {"chunk_id", chunk_id},
+        {"offset", std::to_string(offset)},
+        {"version", std::to_string(version)},
+    };
+    uri.setQueryParameters(param);
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+    request.setContentType("application/octet-stream");
+    request.setContentLength64(content.size());
+
+    PooledSession session(uri.getHost(), uri.getPort());
+
+    std::ostream& out = session.sendRequest(request);
+    out.write((const char*)content.data(), content.size());
+    out.flush();
+
+    HTTPResponse response;
+    session.receiveResponse(response);
+
+    return response.getStatus();
+}
+
+int requestDeleteChunk(std::string address, std::string chunk_id) {
+    URI uri("http://"+address);
+    uri.setPath("/delete_chunk");
+
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("chunk_id", chunk_id);
+
+    std::ostream& out = session.sendRequest(request);
+    req_json->stringify(out);
+
+    HTTPResponse response;
+    std::istream& istr = session.receiveResponse(response);
+
+    return response.getStatus();
+}
+
+std::vector<std::vector<uint8_t>> requestGetChunks(std::string address, const std::vector<ChunkExtent>& extents) {
+    std::vector<std::vector<uint8_t>> contents(extents.size());
+
+    JSON::Array::Ptr chunks_json(new JSON::Array);
+    for(auto it=extents.begin(); it!=extents.end(); ++it) {
+        JSON::Object::Ptr extent_json(new JSON::Object);
+        extent_json->set("chunk_id", it->chunk_id);
+        extent_json->set("offset", it->offset);
+        extent_json->set("length", it->length);
+        chunks_json->add(extent_json);
+    }
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("chunks", chunks_json);
+
+    URI uri("http://"+address);
+    uri.setPath("/multi_get");
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/json");
+    request.setChunkedTransferEncoding(true);
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    req_json->stringify(session.sendRequest(request));
+
+    HTTPResponse response;
+    std::istream& resp_stream = session.receiveResponse(response);
+    if(response.getStatus() != HTTPResponse::HTTP_OK) {
+        return contents;
+    }
+
+    // Frames come back in request order. One that is missing or failed leaves its extent empty.
+    ChunkFrame frame;
+    for(size_t i=0; i<extents.size() && readChunkFrame(resp_stream, frame, extents[i].length); i++) {
+        if(frame.chunk_id != extents[i].chunk_id) {
+            throw DataFormatException("Unexpected chunk " + frame.chunk_id + " in batch from " + address);
+        }
+        if(frame.status == HTTPResponse::HTTP_OK && (extents[i].length < 0 || (int64_t)frame.data.size() == extents[i].length)) {
+            contents[i].swap(frame.data);
+        }
+    }
+    return contents;
+}
+
+// One pass of the batch down the chain. Returns the addresses that stored each chunk.
+static std::map<std::string, std::vector<std::string>> createChunksOnChain(const std::vector<std::string>& addresses,
+        const std::vector<std::pair<std::string, const std::vector<uint8_t>*>>& chunks, const std::string& compression) {
+    std::map<std::string, std::vector<std::string>> committed;
+    URI uri("http://"+addresses.front());
+    uri.setPath("/multi_create");
+    URI::QueryParameters param = {
+        {"chain", cat(std::string(","), addresses.begin()+1, addresses.end())}
+    };
+    if(compression != "none") {
+        param.push_back({"compression", compression});
+    }
+    uri.setQueryParameters(param);
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/octet-stream");
+    request.setChunkedTransferEncoding(true);
+
+    try {
+        PooledSession session(uri.getHost(), uri.getPort());
+        std::ostream& out = session.sendRequest(request);
+        for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+            writeChunkFrame(out, it->first, 0, it->second->data(), (int64_t)it->second->size());
+        }
+        out.flush();
+
+        HTTPResponse response;
+        std::istream& istr = session.receiveResponse(response);
+        JSON::Parser parser;
+        JSON::Object::Ptr resp_json = parser.parse(istr).extract<JSON::Object::Ptr>();
+        JSON::Array::Ptr stored_json = resp_json->getArray("stored");
+        for(size_t i=0; !stored_json.isNull() && i<stored_json->size(); i++) {
+            committed[stored_json->getElement<std::string>(i)].push_back(addresses.front());
+        }
+        JSON::Object::Ptr committed_json = resp_json->getObject("committed");
+        for(auto it=chunks.begin(); !committed_json.isNull() && it!=chunks.end(); ++it) {
+            JSON::Array::Ptr servers_json = committed_json->getArray(it->first);
+            for(size_t i=0; !servers_json.isNull() && i<servers_json->size(); i++) {
+                committed[it->first].push_back(servers_json->getElement<std::string>(i));
+            }
+        }
+    } catch(Exception& e) {
+        Application::instance().logger().warning("Creating " + std::to_string(chunks.size()) + " chunks on " + addresses.front() + " failed: " + e.displayText());
+    }
+    return committed;
+}
+
+std::map<std::string, int> requestCreateChunksChain(std::vector<std::string> addresses, const std::vector<std::pair<std::string, const std::vector<uint8_t>*>>& chunks, std::string compression) {
+    std::map<std::string, int> replicas;
+    for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+        replicas[it->first] = 0;
+    }
+
+    // chain -> the chunks still to send down it. Like requestCreateChunkChain, a chunk goes down
+    // a chain of the servers that miss it again, without the head if none of them stored it.
+    std::map<std::vector<std::string>, std::vector<std::pair<std::string, const std::vector<uint8_t>*>>> pending;
+    if(!addresses.empty() && !chunks.empty()) {
+        pending[addresses] = chunks;
+    }
+    while(!pending.empty()) {
+        std::vector<std::string> chain = pending.begin()->first;
+        std::vector<std::pair<std::string, const std::vector<uint8_t>*>> batch;
+        batch.swap(pending.begin()->second);
+        pending.erase(pending.begin());
+
+        std::map<std::string, std::vector<std::string>> committed = createChunksOnChain(chain, batch, compression);
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            std::vector<std::string>& got = committed[it->first];
+            std::vector<std::string> rest;
+            for(auto a=chain.begin(); a!=chain.end(); ++a) {
+                auto found = std::find(got.begin(), got.end(), *a);
+                if(found == got.end()) {
+                    rest.push_back(*a);
+                } else {
+                    got.erase(found);
+                    replicas[it->first]++;
+                }
+            }
+            if(rest.size() == chain.size()) {
+                rest.erase(rest.begin());
+            }
+            if(!rest.empty()) {
+                pending[rest].push_back(*it);
+            }
+        }
+    }
+    return replicas;
+}
+
+std::vector<std::string> requestDeleteChunks(std::string address, const std::vector<std::string>& chunk_ids) {
+    JSON::Array::Ptr chunks_json(new JSON::Array);
+    for(auto it=chunk_ids.begin(); it!=chunk_ids.end(); ++it) {
+        chunks_json->add(*it);
+    }
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("chunks", chunks_json);
+
+    URI uri("http://"+address);
+    uri.setPath("/multi_delete");
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/json");
+    request.setChunkedTransferEncoding(true);
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    req_json->stringify(session.sendRequest(request));
+
+    HTTPResponse response;
+    std::istream& istr = session.receiveResponse(response);
+
+    std::vector<std::string> deleted;
+    if(response.getStatus() != HTTPResponse::HTTP_OK) {
+        return deleted;
+    }
+    JSON::Parser parser;
+    JSON::Object::Ptr resp_json = parser.parse(istr).extract<JSON::Object::Ptr>();
+    JSON::Array::Ptr deleted_json = resp_json->getArray("deleted");
+    for(unsigned int i=0; !deleted_json.isNull() && i<deleted_json->size(); i++) {
+        deleted.push_back(deleted_json->getElement<std::string>(i));
+    }
+    return deleted;
+}
+
+int requestUpdateFileMeta(std::string address, JSON::Object::Ptr file_meta) {
+    URI uri("http://"+address);
+    uri.setPath("/update_file_meta");
+
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    std::ostream& out = session.sendRequest(request);
+    file_meta->stringify(out);
+
+    HTTPResponse response;
+    std::istream& istr = session.receiveResponse(response);
+
+    return response.getStatus();
+}
+
+int requestUpdateChunksList(std::string address, std::string chunk_server_id, std::vector<std::string> chunks_list,
+    const std::map<std::string, UInt32>& versions) {
     URI uri("http://"+address);
     uri.setPath("/update_chunks_list");
 
     HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
 
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
     JSON::Object::Ptr req_json(new JSON::Object);
 
     req_json->set("server_id", chunk_server_id);
@@ -447,6 +1070,12 @@ int requestUpdateChunksList(std::string address, std::string chunk_server_id, st
     }
     req_json->set("chunks", chunks_json);
 
+    JSON::Object::Ptr versions_json(new JSON::Object);
+    for(auto it=versions.begin(); it!=versions.end(); ++it) {
+        versions_json->set(it->first, it->second);
+    }
+    req_json->set("versions", versions_json);
+
     try {
         std::ostream& out = session.sendRequest(request);
         req_json->stringify(out);
@@ -468,7 +1097,7 @@ std::vector<std::pair<std::string, std::string>> requestGetActiveChunkServersLis
 
     HTTPRequest request(HTTPRequest::HTTP_GET, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
     
-    HTTPClientSession session(uri.getHost(), uri.getPort());
+    PooledSession session(uri.getHost(), uri.getPort());
 
     std::ostream& out = session.sendRequest(request);
 
@@ -493,4 +1122,61 @@ std::vector<std::pair<std::string, std::string>> requestGetActiveChunkServersLis
     return result;
 }
 
+std::map<std::string, std::vector<std::string>> requestLookupChunks(std::string address, const std::vector<std::string>& chunk_ids) {
+    JSON::Array::Ptr chunks_json(new JSON::Array);
+    for(auto it=chunk_ids.begin(); it!=chunk_ids.end(); ++it) {
+        chunks_json->add(*it);
+    }
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("chunks", chunks_json);
+
+    URI uri("http://"+address);
+    uri.setPath("/lookup_chunks");
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
+    request.setContentType("application/json");
+    request.setChunkedTransferEncoding(true);
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    req_json->stringify(session.sendRequest(request));
+
+    HTTPResponse response;
+    std::istream& resp_stream = session.receiveResponse(response);
+
+    std::map<std::string, std::vector<std::string>> result;
+    if(response.getStatus() != HTTPResponse::HTTP_OK) {
+        return result;
+    }
+
+    JSON::Parser jsonParser;
+    JSON::Object::Ptr resp_json = jsonParser.parse(resp_stream).extract<JSON::Object::Ptr>();
+    JSON::Object::Ptr found_json = resp_json->getObject("chunks");
+    for(auto it=found_json->begin(); it!=found_json->end(); ++it) {
+        JSON::Array::Ptr servers_json = found_json->getArray(it->first);
+        for(unsigned int i=0; i<servers_json->size(); i++) {
+            result[it->first].push_back(servers_json->getObject(i)->getValue<std::string>("address"));
+        }
+    }
+    return result;
 }
+
+int requestReportCorruptChunk(std::string address, std::string chunk_server_id, std::string chunk_id) {
+    URI uri("http://"+address);
+    uri.setPath("/report_corrupt_chunk");
+
+    HTTPRequest request(HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+
+    PooledSession session(uri.getHost(), uri.getPort());
+    JSON::Object::Ptr req_json(new JSON::Object);
+    req_json->set("server_id", chunk_server_id);
+    req_json->set("chunk_id", chunk_id);
+
+    std::ostream& out = session.sendRequest(request);
+    req_json->stringify(out);
+
+    HTTPResponse response;
+    std::istream& istr = session.receiveResponse(response);
+
+    return response.getStatus();
+}
+
+}
\ No newline at end of file
@@ -31,6 +31,13 @@
 #include <Poco/FIFOBuffer.h>
 #include <Poco/Delegate.h>
 #include <Poco/URI.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+#include <Poco/Timespan.h>
+#include <deque>
+#include <map>
 
 namespace DistFS {
 
@@ -252,17 +259,196 @@ public:
     static FileInfo* fromJSON(JSON::Object::Ptr obj);
 };
 
+// One chunk in the body of a batched request or response: the chunk id, a status (the HTTP
+// code of that chunk in responses, 0 in requests) and the data.
+struct ChunkFrame {
+    std::string chunk_id;
+    int status = 0;
+    std::vector<uint8_t> data;
+};
+
+void writeChunkFrame(std::ostream& ostr, const std::string& chunk_id, int status, const uint8_t* data, int64_t length);
+// Returns false at the end of the body. Throws DataFormatException if it ends inside a frame, or
+// the frame holds more than `max_length` bytes (-1 for no limit).
+bool readChunkFrame(std::istream& istr, ChunkFrame& frame, int64_t max_length = -1);
+
+// A range of a chunk, length -1 for the rest of it.
+struct ChunkExtent {
+    std::string chunk_id;
+    int64_t offset;
+    int64_t length;
+};
+
+// Keep-alive connections to the other servers, shared by every request of the process so that
+// an RPC doesn't pay for a TCP handshake. Sessions are taken with PooledSession.
+//
+// At most max_per_host connections to a server are open at once, more wait for one to be given
+// back. Of those given back, up to max_idle_per_host are kept, and dropped once they have been
+// idle for idle_timeout, which has to be below the keep-alive timeout of the servers (an idle
+// connection also holds one of their threads). A kept connection the server has closed, or sent
+// anything on, is dropped instead of reused.
+class SessionPool {
+public:
+    static SessionPool& instance();
+
+    // Reads `prefix`.pool_max_per_host, .pool_max_idle_per_host, .pool_idle_timeout and
+    // .pool_wait_timeout, in seconds. 0 lifts max_per_host, and turns reuse off for the others.
+    // Also reads .cluster_secret, sent with every request to prove it comes from the cluster.
+    void configure(const AbstractConfiguration& config, const std::string& prefix);
+    std::string clusterSecret();
+
+    // A session to host:port, kept or new. Throws TimeoutException if the server still has
+    // max_per_host connections after wait_timeout.
+    SharedPtr<HTTPClientSession> acquire(const std::string& host, UInt16 port);
+    // Gives back a session from acquire(). It is kept if `reusable`, and closed otherwise.
+    void release(const std::string& host, UInt16 port, SharedPtr<HTTPClientSession> session, bool reusable);
+
+    struct Stats {
+        UInt64 created = 0;
+        UInt64 reused = 0;
+        UInt64 evicted = 0;     // idle too long, or closed by the server
+        int active = 0;
+        int idle = 0;
+    };
+    Stats stats();
+
+protected:
+    SessionPool();
+
+    struct Idle {
+        SharedPtr<HTTPClientSession> session;
+        Timestamp since;
+    };
+    struct Host {
+        std::deque<Idle> idle;      // oldest first
+        int active = 0;
+    };
+
+    static bool healthy(HTTPClientSession& session);
+    // Drops the idle sessions of `host` past idle_timeout.
+    void evict(Host& host);
+
+    int max_per_host;
+    int max_idle_per_host;
+    Timespan idle_timeout;
+    Timespan wait_timeout;
+    std::string cluster_secret;
+
+    Mutex mutex;
+    Condition released;
+    std::map<std::string, Host> hosts;
+    Timestamp swept;
+    Stats counters;
+
+private:
+    SessionPool(const SessionPool&);
+    SessionPool& operator = (const SessionPool&);
+};
+
+// The client the calling thread's requests to other servers are made for, until out of scope.
+// PooledSession names it in their X-DistFS-Client header, so that the servers charge its quota.
+class ClientScope {
+public:
+    ClientScope(const std::string& client);
+    ~ClientScope();
+
+    // Empty for requests of the servers' own.
+    static std::string current();
+
+private:
+    std::string previous;
+};
+
+// One request and response on a session of the SessionPool, a drop-in for HTTPClientSession.
+// The session goes back to the pool when this is destroyed, unless the exchange failed: then
+// the connection is closed. Whatever is left of the response is skipped first, or the connection
+// closed if that is more than a few KiB.
+class PooledSession {
+public:
+    PooledSession(const std::string& host, UInt16 port);
+    ~PooledSession();
+
+    // Sends the request as keep-alive HTTP/1.1. A POST or PUT body of unknown length goes in
+    // chunks, since ending it by closing the sending side would close the connection. The
+    // request carries the cluster secret and the client of the ClientScope, if any.
+    std::ostream& sendRequest(HTTPRequest& request);
+    std::istream& receiveResponse(HTTPResponse& response);
+
+protected:
+    std::string host;
+    UInt16 port;
+    SharedPtr<HTTPClientSession> session;
+    std::istream* response_stream;
+    bool keep_alive;
+
+private:
+    PooledSession(const PooledSession&);
+    PooledSession& operator = (const PooledSession&);
+};
+
+// Lets the connection of a keep-alive request carry the next one. The answers of the handlers of
+// `factory` that don't give their length are sent in chunks, instead of being ended by closing
+// the connection, and what a handler left of the request body is skipped.
+class KeepAliveRequestHandlerFactory: public HTTPRequestHandlerFactory {
+public:
+    KeepAliveRequestHandlerFactory(HTTPRequestHandlerFactory& factory);
+    HTTPRequestHandler* createRequestHandler(const HTTPServerRequest& request) override;
+
+protected:
+    HTTPRequestHandlerFactory& factory;
+};
+
 std::vector<std::string> listDirectory(Path& path);
 bool makeDirectories(Path& path);
 std::map<std::string, std::string> getQueryMap(const URI uri);
-std::vector<uint8_t> getChunk(std::string& address, std::string chunk_id);
+// Read `length` bytes of a chunk starting at `offset`. A negative length reads to the end of the chunk.
+std::vector<uint8_t> getChunk(std::string& address, std::string chunk_id, int64_t offset = 0, int64_t length = -1);
+
+// Chunk list entry of a hole in a sparse file: a chunk of zeros that isn't stored anywhere.
+extern const std::string HOLE_CHUNK_ID;
+
+// Id of fragment `index` of an erasure-coded chunk.
+std::string fragmentId(const std::string& chunk_id, int index);
+// Offset in the file of each chunk of `file_meta`, then the length of the file. The chunks of a
+// deduplicated file have the lengths in its "chunk_lengths", those of the others chunk_size.
+std::vector<int64_t> chunkOffsets(JSON::Object::Ptr file_meta);
 
 bool writeChunksOnServers(std::vector<std::string>& addresses, std::string chunk_id, std::istream& content);
 JSON::Object::Ptr getFileMeta(std::string address, std::string filename);
-int requestCreateFile(std::string address, std::string filename);
+// `compression` is the codec the chunk servers compress the chunks of the file with. `layout` is
+// "replicated" or "rs", erasure coded with `data_shards` + `parity_shards` fragments. `dedup`
+// "true" makes a deduplicated file. Empty arguments take the meta server's defaults.
+int requestCreateFile(std::string address, std::string filename, std::string compression = "none",
+    std::string layout = "", std::string data_shards = "", std::string parity_shards = "", std::string dedup = "");
 int requestCreateChunk(std::string address, std::string chunk_id, std::vector<uint8_t>& content);
+// Create the chunk on every address with one upload: the first server passes it down the chain.
+// The servers a failed one cut off are sent it again on a chain of their own. Returns the number
+// of servers that stored it.
+int requestCreateChunkChain(std::vector<std::string> addresses, std::string chunk_id, std::vector<uint8_t>& content, std::string compression = "none");
 int requestUpdateChunk(std::string address, std::string chunk_id, std::string new_id, int64_t begin_pos, std::vector<uint8_t>& content);
-int requestUpdateChunksList(std::string address, std::string chunk_server_id, std::vector<std::string> chunks_list);
+// Extend the chunk in place at `offset`, its current end, making it `version`. 409 means the
+// replica isn't at the version before, 501 that it can't grow in place.
+int requestAppendChunk(std::string address, std::string chunk_id, int64_t offset, int64_t version, const std::vector<uint8_t>& content);
+int requestDeleteChunk(std::string address, std::string chunk_id);
+
+// Batched versions of the above, one round trip for many chunks of the same server (or chain).
+// Read every extent; a chunk the server couldn't deliver in full comes back empty.
+std::vector<std::vector<uint8_t>> requestGetChunks(std::string address, const std::vector<ChunkExtent>& extents);
+// Create the chunks on every address of the chain. Chunks a failed server cut off from the rest
+// of the chain are sent again to the servers that miss them. Returns the number of servers that
+// stored each chunk, by chunk id.
+std::map<std::string, int> requestCreateChunksChain(std::vector<std::string> addresses, const std::vector<std::pair<std::string, const std::vector<uint8_t>*>>& chunks, std::string compression = "none");
+// Returns the ids of the chunks deleted.
+std::vector<std::string> requestDeleteChunks(std::string address, const std::vector<std::string>& chunk_ids);
+// `file_meta` holds the filename and the fields to change.
+int requestUpdateFileMeta(std::string address, JSON::Object::Ptr file_meta);
+// `versions` are those of the chunks appended to in place.
+int requestUpdateChunksList(std::string address, std::string chunk_server_id, std::vector<std::string> chunks_list,
+    const std::map<std::string, UInt32>& versions = std::map<std::string, UInt32>());
 std::vector<std::pair<std::string, std::string>> requestGetActiveChunkServersList(std::string address);
+// Ask the meta server's fingerprint index which of the chunks are stored already: chunk id ->
+// addresses of its replicas. Chunks it doesn't know are left out.
+std::map<std::string, std::vector<std::string>> requestLookupChunks(std::string address, const std::vector<std::string>& chunk_ids);
+int requestReportCorruptChunk(std::string address, std::string chunk_server_id, std::string chunk_id);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DISTFS_CRC32C_X86 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTFS_TARGET_SSE42
+#else
+#define DISTFS_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+namespace DistFS {
+
+namespace {
+
+const uint32_t POLY = 0x82f63b78;
+
+// The hardware path runs three independent crc32 streams over LONG (then SHORT) byte blocks,
+// since the instruction has a latency of three cycles, and then shifts the partial CRCs
+// together with the zeros operators below.
+const size_t LONG = 8192;
+const size_t SHORT = 256;
+
+struct Tables {
+    uint32_t slicing[8][256];
+    uint32_t long_zeros[4][256];
+    uint32_t short_zeros[4][256];
+
+    Tables();
+};
+
+uint32_t gf2MatrixTimes(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while(vec) {
+        if(vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+void gf2MatrixSquare(uint32_t* square, const uint32_t* mat) {
+    for(int n=0; n<32; n++) {
+        square[n] = gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+// Operator that appends `length` zero bytes to a CRC. `length` must be a power of two.
+void zerosOperator(uint32_t* even, size_t length) {
+    uint32_t odd[32];
+    odd[0] = POLY;
+    uint32_t row = 1;
+    for(int n=1; n<32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd);     // two zero bits
+    gf2MatrixSquare(odd, even);     // four zero bits
+
+    // The first square below gives the operator for one zero byte, each next one doubles it.
+    do {
+        gf2MatrixSquare(even, odd);
+        length >>= 1;
+        if(length == 0) {
+            return;
+        }
+        gf2MatrixSquare(odd, even);
+        length >>= 1;
+    } while(length);
+
+    for(int n=0; n<32; n++) {
+        even[n] = odd[n];
+    }
+}
+
+void zerosTables(uint32_t zeros[4][256], size_t length) {
+    uint32_t op[32];
+    zerosOperator(op, length);
+    for(uint32_t n=0; n<256; n++) {
+        zeros[0][n] = gf2MatrixTimes(op, n);
+        zeros[1][n] = gf2MatrixTimes(op, n << 8);
+        zeros[2][n] = gf2MatrixTimes(op, n << 16);
+        zeros[3][n] = gf2MatrixTimes(op, n << 24);
+    }
+}
+
+Tables::Tables() {
+    for(uint32_t n=0; n<256; n++) {
+        uint32_t crc = n;
+        for(int k=0; k<8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        slicing[0][n] = crc;
+    }
+    for(uint32_t n=0; n<256; n++) {
+        for(int k=1; k<8; k++) {
+            slicing[k][n] = (slicing[k-1][n] >> 8) ^ slicing[0][slicing[k-1][n] & 0xff];
+        }
+    }
+    zerosTables(long_zeros, LONG);
+    zerosTables(short_zeros, SHORT);
+}
+
+const Tables& tables() {
+    static Tables instance;
+    return instance;
+}
+
+#if defined(DISTFS_CRC32C_X86)
+
+inline uint32_t shift(const uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+DISTFS_TARGET_SSE42 inline uint64_t load64(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+DISTFS_TARGET_SSE42 uint32_t crc32cHardware(uint32_t crc, const void* data, size_t length) {
+    const Tables& t = tables();
+    const unsigned char* next = (const unsigned char*)data;
+    uint64_t crc0 = crc ^ 0xffffffff;
+
+    while(length && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next);
+        next++;
+        length--;
+    }
+
+    while(length >= LONG*3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char* end = next + LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(next));
+            crc1 = _mm_crc32_u64(crc1, load64(next + LONG));
+            crc2 = _mm_crc32_u64(crc2, load64(next + LONG*2));
+            next += 8;
+        } while(next < end);
+        crc0 = shift(t.long_zeros, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(t.long_zeros, (uint32_t)crc0) ^ crc2;
+        next += LONG*2;
+        length -= LONG*3;
+    }
+
+    while(length >= SHORT*3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char* end = next + SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(next));
+            crc1 = _mm_crc32_u64(crc1, load64(next + SHORT));
+            crc2 = _mm_crc32_u64(crc2, load64(next + SHORT*2));
+            next += 8;
+        } while(next < end);
+        crc0 = shift(t.short_zeros, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(t.short_zeros, (uint32_t)crc0) ^ crc2;
+        next += SHORT*2;
+        length -= SHORT*3;
+    }
+
+    const unsigned char* end = next + (length - (length & 7));
+    while(next < end) {
+        crc0 = _mm_crc32_u64(crc0, load64(next));
+        next += 8;
+    }
+    length &= 7;
+
+    while(length) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next);
+        next++;
+        length--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+bool detectSSE42() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif
+
+typedef uint32_t (*Crc32cFunction)(uint32_t, const void*, size_t);
+
+Crc32cFunction selectImplementation() {
+#if defined(DISTFS_CRC32C_X86)
+    if(detectSSE42()) {
+        return crc32cHardware;
+    }
+#endif
+    return crc32cSoftware;
+}
+
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t length) {
+    const Tables& t = tables();
+    const unsigned char* next = (const unsigned char*)data;
+    crc = ~crc;
+
+    while(length >= 8) {
+        crc ^= (uint32_t)next[0] | ((uint32_t)next[1] << 8) | ((uint32_t)next[2] << 16) | ((uint32_t)next[3] << 24);
+        crc = t.slicing[7][crc & 0xff] ^ t.slicing[6][(crc >> 8) & 0xff] ^
+              t.slicing[5][(crc >> 16) & 0xff] ^ t.slicing[4][crc >> 24] ^
+              t.slicing[3][next[4]] ^ t.slicing[2][next[5]] ^
+              t.slicing[1][next[6]] ^ t.slicing[0][next[7]];
+        next += 8;
+        length -= 8;
+    }
+    while(length) {
+        crc = (crc >> 8) ^ t.slicing[0][(crc ^ *next) & 0xff];
+        next++;
+        length--;
+    }
+    return ~crc;
+}
+
+bool crc32cHardwareAvailable() {
+    return selectImplementation() != crc32cSoftware;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    static const Crc32cFunction implementation = selectImplementation();
+    return implementation(crc, data, length);
+}
+
+}
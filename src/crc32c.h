@@ -0,0 +1,20 @@
+#ifndef DISTFS_CRC32C_H
+#define DISTFS_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DistFS {
+
+// CRC32C (Castagnoli) of `length` bytes, continuing from `crc` (0 to start a new checksum).
+// Uses the SSE4.2 crc32 instruction on three interleaved streams when the CPU has it, and a
+// slicing-by-8 table implementation otherwise.
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+// The portable implementation, exposed so the hardware path can be checked against it.
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t length);
+
+bool crc32cHardwareAvailable();
+
+}
+#endif
@@ -0,0 +1,455 @@
+#include "disk_engine.h"
+
+#include <Poco/Exception.h>
+#include <Poco/Error.h>
+#include <Poco/Mutex.h>
+#include <Poco/Semaphore.h>
+#include <Poco/Thread.h>
+#include <Poco/Runnable.h>
+#include <Poco/Notification.h>
+#include <Poco/NotificationQueue.h>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(POCO_OS_FAMILY_UNIX)
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#if POCO_OS == POCO_OS_LINUX && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DISTFS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace DistFS {
+
+AlignedBuffer::AlignedBuffer(size_t size, size_t alignment):
+    buffer(nullptr),
+    buffer_size(size)
+{
+#if defined(POCO_OS_FAMILY_UNIX)
+    void* memory = nullptr;
+    if(::posix_memalign(&memory, alignment, size > 0 ? size : alignment) != 0) {
+        throw OutOfMemoryException("AlignedBuffer");
+    }
+    buffer = (uint8_t*)memory;
+#else
+    buffer = (uint8_t*)std::malloc(size > 0 ? size : 1);
+    if(buffer == nullptr) {
+        throw OutOfMemoryException("AlignedBuffer");
+    }
+#endif
+}
+
+AlignedBuffer::~AlignedBuffer() {
+    std::free(buffer);
+}
+
+uint8_t* AlignedBuffer::data() {
+    return buffer;
+}
+
+size_t AlignedBuffer::size() const {
+    return buffer_size;
+}
+
+DiskEngine::Batch::Batch(int pieces):
+    pending(pieces),
+    done(true)
+{
+}
+
+DiskEngine::DiskEngine(int64_t io_size):
+    io_size(io_size > 0 ? io_size : 128*1024)
+{
+    // O_DIRECT reads are aligned as a whole, their pieces have to stay aligned too.
+    const int64_t alignment = (int64_t)DIRECT_IO_ALIGNMENT;
+    this->io_size = (this->io_size + alignment - 1) / alignment * alignment;
+}
+
+DiskEngine::~DiskEngine() {
+}
+
+int64_t DiskEngine::read(int fd, int64_t offset, uint8_t* buffer, int64_t length) {
+    if(length <= 0) {
+        return 0;
+    }
+
+    int count = (int)((length + io_size - 1) / io_size);
+    Batch batch(count);
+    std::vector<Piece> pieces((size_t)count);
+    for(int i=0; i<count; i++) {
+        Piece& piece = pieces[i];
+        piece.batch = &batch;
+        piece.fd = fd;
+        piece.offset = offset + i * io_size;
+        piece.buffer = buffer + i * io_size;
+        piece.length = std::min(io_size, length - i * io_size);
+        piece.result = 0;
+    }
+
+    submit(pieces);
+    batch.done.wait();
+
+    // The pieces are contiguous, so the data ends at the first piece that came back short.
+    int64_t total = 0;
+    for(auto it=pieces.begin(); it!=pieces.end(); ++it) {
+        int64_t result = it->result;
+        if(result >= 0 && result < it->length) {
+            // Short reads can happen before the end of the file too, finish the piece here.
+            int64_t rest = preadFully(fd, it->offset + result, it->buffer + result, it->length - result);
+            result = rest < 0 ? rest : result + rest;
+        }
+        if(result < 0) {
+            throw ReadFileException(Error::getMessage((int)-result), (int)-result);
+        }
+        total += result;
+        if(result < it->length) {
+            break;
+        }
+    }
+    return total;
+}
+
+void DiskEngine::complete(Piece& piece, int64_t result) {
+    piece.result = result;
+    if(--piece.batch->pending == 0) {
+        piece.batch->done.set();
+    }
+}
+
+int64_t DiskEngine::preadFully(int fd, int64_t offset, uint8_t* buffer, int64_t length) {
+#if defined(POCO_OS_FAMILY_UNIX)
+    int64_t done = 0;
+    while(done < length) {
+        ssize_t n = ::pread(fd, buffer + done, (size_t)(length - done), (off_t)(offset + done));
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if(n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+#else
+    throw NotImplementedException("pread");
+#endif
+}
+
+#if defined(POCO_OS_FAMILY_UNIX)
+
+// Fallback engine: a fixed set of threads doing blocking preads off a shared queue.
+class ThreadPoolDiskEngine: public DiskEngine, public Runnable {
+public:
+    ThreadPoolDiskEngine(int threads, int64_t io_size);
+    ~ThreadPoolDiskEngine();
+
+    std::string name() const override;
+    void run() override;
+
+protected:
+    class PieceNotification: public Notification {
+    public:
+        PieceNotification(Piece* piece): piece(piece) {}
+        Piece* piece;
+    };
+
+    void submit(std::vector<Piece>& pieces) override;
+
+    NotificationQueue queue;
+    std::vector<SharedPtr<Thread>> workers;
+};
+
+ThreadPoolDiskEngine::ThreadPoolDiskEngine(int threads, int64_t io_size):
+    DiskEngine(io_size)
+{
+    for(int i=0; i<std::max(threads, 1); i++) {
+        SharedPtr<Thread> worker(new Thread("DiskIO"));
+        worker->start(*this);
+        workers.push_back(worker);
+    }
+}
+
+ThreadPoolDiskEngine::~ThreadPoolDiskEngine() {
+    queue.wakeUpAll();
+    for(auto it=workers.begin(); it!=workers.end(); ++it) {
+        (*it)->join();
+    }
+}
+
+std::string ThreadPoolDiskEngine::name() const {
+    return "threads(" + std::to_string(workers.size()) + ")";
+}
+
+void ThreadPoolDiskEngine::submit(std::vector<Piece>& pieces) {
+    for(auto it=pieces.begin(); it!=pieces.end(); ++it) {
+        queue.enqueueNotification(new PieceNotification(&(*it)));
+    }
+}
+
+void ThreadPoolDiskEngine::run() {
+    while(true) {
+        // Null once wakeUpAll() is called on shutdown.
+        AutoPtr<Notification> notification(queue.waitDequeueNotification());
+        if(notification.isNull()) {
+            break;
+        }
+        Piece* piece = static_cast<PieceNotification*>(notification.get())->piece;
+        complete(*piece, preadFully(piece->fd, piece->offset, piece->buffer, piece->length));
+    }
+}
+
+#endif
+
+#if defined(DISTFS_IO_URING)
+
+// io_uring engine, talking to the kernel directly through the submission and completion rings.
+// Handler threads fill submission entries for all pieces of a read and submit them with a single
+// io_uring_enter; one reaper thread waits for completions and wakes the handlers up.
+class IoUringDiskEngine: public DiskEngine, public Runnable {
+public:
+    IoUringDiskEngine(unsigned entries, int64_t io_size);
+    ~IoUringDiskEngine();
+
+    std::string name() const override;
+    void run() override;
+
+protected:
+    void submit(std::vector<Piece>& pieces) override;
+    // Caller holds submit_mutex.
+    void queueEntry(UInt8 opcode, Piece* piece);
+    void enter(unsigned to_submit);
+
+    int ring_fd;
+    struct io_uring_params params;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    FastMutex submit_mutex;
+    // One slot per submission entry, so the completion ring can't overflow.
+    int slot_count;
+    Semaphore slots;
+    Thread reaper;
+    bool stopping;
+};
+
+IoUringDiskEngine::IoUringDiskEngine(unsigned entries, int64_t io_size):
+    DiskEngine(io_size),
+    ring_fd(-1),
+    sq_ring(MAP_FAILED),
+    cq_ring(MAP_FAILED),
+    sqes((struct io_uring_sqe*)MAP_FAILED),
+    slot_count((int)entries),
+    slots((int)entries, (int)entries),
+    reaper("DiskIO"),
+    stopping(false)
+{
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+    if(ring_fd < 0) {
+        throw IOException("io_uring_setup: " + Error::getMessage(errno), errno);
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = ::mmap(nullptr, cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)::mmap(nullptr, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        int err = errno;
+        if(sqes != MAP_FAILED) {
+            ::munmap(sqes, sqes_size);
+        }
+        if(cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            ::munmap(cq_ring, cq_ring_size);
+        }
+        if(sq_ring != MAP_FAILED) {
+            ::munmap(sq_ring, sq_ring_size);
+        }
+        ::close(ring_fd);
+        throw IOException("io_uring mmap: " + Error::getMessage(err), err);
+    }
+
+    uint8_t* sq = (uint8_t*)sq_ring;
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    uint8_t* cq = (uint8_t*)cq_ring;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    reaper.start(*this);
+}
+
+IoUringDiskEngine::~IoUringDiskEngine() {
+    // Every slot back means nothing is in flight any more: completions can arrive in any order,
+    // so the nop that stops the reaper must not overtake a read.
+    for(int i=0; i<slot_count; i++) {
+        slots.wait();
+    }
+    {
+        FastMutex::ScopedLock lock(submit_mutex);
+        stopping = true;
+        queueEntry(IORING_OP_NOP, nullptr);
+        enter(1);
+    }
+    reaper.join();
+
+    ::munmap(sqes, sqes_size);
+    if(cq_ring != sq_ring) {
+        ::munmap(cq_ring, cq_ring_size);
+    }
+    ::munmap(sq_ring, sq_ring_size);
+    ::close(ring_fd);
+}
+
+std::string IoUringDiskEngine::name() const {
+    return "io_uring(" + std::to_string(params.sq_entries) + ")";
+}
+
+void IoUringDiskEngine::queueEntry(UInt8 opcode, Piece* piece) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+
+    struct io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->user_data = (UInt64)(uintptr_t)piece;
+    if(piece != nullptr) {
+        // READV works on every kernel with io_uring, READ needs 5.6.
+        piece->iov.iov_base = piece->buffer;
+        piece->iov.iov_len = (size_t)piece->length;
+        sqe->fd = piece->fd;
+        sqe->off = (UInt64)piece->offset;
+        sqe->addr = (UInt64)(uintptr_t)&piece->iov;
+        sqe->len = 1;
+    }
+
+    sq_array[index] = index;
+    // The entry has to be visible to the kernel before the new tail.
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void IoUringDiskEngine::enter(unsigned to_submit) {
+    while(to_submit > 0) {
+        int submitted = (int)::syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+        if(submitted < 0) {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            throw IOException("io_uring_enter: " + Error::getMessage(errno), errno);
+        }
+        to_submit -= (unsigned)submitted;
+    }
+}
+
+void IoUringDiskEngine::submit(std::vector<Piece>& pieces) {
+    // Queue as many pieces as there are free slots, then submit them together. If the ring is
+    // full, submit what's queued so far before waiting for a slot.
+    unsigned queued = 0;
+    for(auto it=pieces.begin(); it!=pieces.end(); ++it) {
+        if(!slots.tryWait(0)) {
+            if(queued > 0) {
+                FastMutex::ScopedLock lock(submit_mutex);
+                enter(queued);
+                queued = 0;
+            }
+            slots.wait();
+        }
+        FastMutex::ScopedLock lock(submit_mutex);
+        queueEntry(IORING_OP_READV, &(*it));
+        queued++;
+    }
+    if(queued > 0) {
+        FastMutex::ScopedLock lock(submit_mutex);
+        enter(queued);
+    }
+}
+
+void IoUringDiskEngine::run() {
+    bool stop = false;
+    while(!stop) {
+        int rc = (int)::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if(rc < 0 && errno != EINTR) {
+            // Nothing sensible to do but wait for the next completion.
+            Thread::sleep(1);
+        }
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail) {
+            struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            Piece* piece = (Piece*)(uintptr_t)cqe->user_data;
+            if(piece == nullptr) {
+                stop = true;
+            } else {
+                complete(*piece, cqe->res);
+            }
+            head++;
+            slots.set();
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif
+
+DiskEngine* DiskEngine::create(const std::string& type, int queue_depth, int threads, int64_t io_size) {
+    if(type == "sync") {
+        return nullptr;
+    }
+    if(type != "auto" && type != "io_uring" && type != "threads") {
+        throw InvalidArgumentException("Unknown disk engine \"" + type + "\"");
+    }
+#if defined(DISTFS_IO_URING)
+    if(type != "threads") {
+        try {
+            return new IoUringDiskEngine((unsigned)std::max(queue_depth, 1), io_size);
+        } catch(IOException&) {
+            // Old kernel, or io_uring disabled by the sysctl or a seccomp filter.
+        }
+    }
+#endif
+#if defined(POCO_OS_FAMILY_UNIX)
+    return new ThreadPoolDiskEngine(threads, io_size);
+#else
+    return nullptr;
+#endif
+}
+
+}
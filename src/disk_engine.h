@@ -0,0 +1,89 @@
+#ifndef DISTFS_DISK_ENGINE_H
+#define DISTFS_DISK_ENGINE_H
+
+#include "common.h"
+
+#include <Poco/Event.h>
+#include <Poco/AtomicCounter.h>
+
+#if defined(POCO_OS_FAMILY_UNIX)
+#include <sys/uio.h>
+#endif
+
+namespace DistFS {
+
+using namespace Poco;
+
+// Heap buffer aligned for O_DIRECT transfers.
+class AlignedBuffer {
+public:
+    AlignedBuffer(size_t size, size_t alignment);
+    ~AlignedBuffer();
+
+    uint8_t* data();
+    size_t size() const;
+
+private:
+    uint8_t* buffer;
+    size_t buffer_size;
+
+    AlignedBuffer(const AlignedBuffer&);
+    AlignedBuffer& operator = (const AlignedBuffer&);
+};
+
+// Executes positional reads for the chunk stores. A read is cut into pieces of at most io_size
+// bytes (rounded up to DIRECT_IO_ALIGNMENT) that are all in flight at the same time, and the
+// calling handler thread sleeps until the last one completes. Many handler threads share one
+// engine, so the device sees a deep queue without a thread per outstanding I/O. A handler that
+// knows its next reads prefetches them (ChunkFile::prefetch), so it keeps more than one read in
+// flight.
+class DiskEngine {
+public:
+    DiskEngine(int64_t io_size);
+    virtual ~DiskEngine();
+
+    // Reads up to `length` bytes at `offset` of `fd`. Returns the number read, which is less only
+    // at the end of the file. Throws ReadFileException.
+    int64_t read(int fd, int64_t offset, uint8_t* buffer, int64_t length);
+
+    virtual std::string name() const = 0;
+
+    // "io_uring" or "auto" use io_uring and fall back to a pool of `threads` when the kernel
+    // doesn't allow it, "threads" always uses the pool. "sync" returns null: callers then read in
+    // their own thread.
+    static DiskEngine* create(const std::string& type, int queue_depth, int threads, int64_t io_size);
+
+    // pread(2) until `length` bytes are read or the file ends. Returns the bytes read or -errno.
+    static int64_t preadFully(int fd, int64_t offset, uint8_t* buffer, int64_t length);
+
+    static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+protected:
+    struct Batch {
+        Batch(int pieces);
+
+        AtomicCounter pending;
+        Event done;
+    };
+
+    struct Piece {
+        Batch* batch;
+        int fd;
+        int64_t offset;
+        uint8_t* buffer;
+        int64_t length;
+        int64_t result;     // bytes read or -errno
+#if defined(POCO_OS_FAMILY_UNIX)
+        struct iovec iov;
+#endif
+    };
+
+    // Start every piece; complete() is called for each one as it finishes, from any thread.
+    virtual void submit(std::vector<Piece>& pieces) = 0;
+    void complete(Piece& piece, int64_t result);
+
+    int64_t io_size;
+};
+
+}
+#endif
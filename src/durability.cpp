@@ -0,0 +1,286 @@
+#include "durability.h"
+
+#include <Poco/Exception.h>
+#include <Poco/Timestamp.h>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#if defined(POCO_OS_FAMILY_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#endif
+
+namespace DistFS {
+
+namespace {
+
+// Distinct files on one filesystem in a batch from which a single syncfs is cheaper than
+// syncing them one by one.
+const size_t SYNCFS_THRESHOLD = 16;
+
+// Paths collected by the calling thread's innermost SyncQueue::Deferred, if any.
+thread_local std::vector<std::string>* deferred_paths = nullptr;
+
+}
+
+std::string durabilityName(Durability durability) {
+    switch(durability) {
+    case DURABILITY_FSYNC:
+        return "fsync";
+    case DURABILITY_GROUP:
+        return "group";
+    default:
+        return "none";
+    }
+}
+
+bool parseDurability(const std::string& name, Durability& durability) {
+    if(name == "none") {
+        durability = DURABILITY_NONE;
+    } else if(name == "fsync") {
+        durability = DURABILITY_FSYNC;
+    } else if(name == "group") {
+        durability = DURABILITY_GROUP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+SyncQueue::SyncQueue(Durability durability, long interval_ms, size_t max_batch):
+    mode(durability),
+    interval_ms(interval_ms),
+    max_batch(std::max(max_batch, (size_t)1)),
+    stopping(true),
+    wait_micros(0)
+{
+}
+
+SyncQueue::~SyncQueue() {
+    stop();
+}
+
+void SyncQueue::start() {
+    if(mode != DURABILITY_GROUP) {
+        return;
+    }
+    ScopedLock<Mutex> lock(mutex);
+    if(!stopping) {
+        return;
+    }
+    stopping = false;
+    thread.start(*this);
+}
+
+void SyncQueue::stop() {
+    {
+        ScopedLock<Mutex> lock(mutex);
+        if(stopping) {
+            return;
+        }
+        stopping = true;
+        pending_changed.broadcast();
+    }
+    thread.join();
+}
+
+Durability SyncQueue::durability() const {
+    return mode;
+}
+
+UInt64 SyncQueue::writes() const {
+    return (UInt64)write_count.value();
+}
+
+UInt64 SyncQueue::flushes() const {
+    return (UInt64)flush_count.value();
+}
+
+UInt64 SyncQueue::batches() const {
+    return (UInt64)batch_count.value();
+}
+
+UInt64 SyncQueue::waitMicros() const {
+    return wait_micros.load();
+}
+
+void SyncQueue::sync(const std::vector<std::string>& paths) {
+    ++write_count;
+    if(mode == DURABILITY_NONE) {
+        return;
+    }
+    if(deferred_paths != nullptr) {
+        deferred_paths->insert(deferred_paths->end(), paths.begin(), paths.end());
+        return;
+    }
+    syncNow(paths);
+}
+
+void SyncQueue::syncNow(const std::vector<std::string>& paths) {
+
+    Timestamp started;
+    std::string failed;
+    bool queued = false;
+    Request request;
+    if(mode == DURABILITY_GROUP) {
+        request.paths = paths;
+        ScopedLock<Mutex> lock(mutex);
+        if(!stopping) {
+            pending.push_back(&request);
+            pending_changed.signal();
+            while(!request.done) {
+                batch_done.wait(mutex);
+            }
+            failed = request.error;
+            queued = true;
+        }
+    }
+    if(!queued) {
+        // Per-chunk mode, or the flusher isn't running.
+        failed = flush(paths);
+    }
+    wait_micros += (UInt64)started.elapsed();
+
+    if(!failed.empty()) {
+        throw WriteFileException("Sync failed", failed);
+    }
+}
+
+SyncQueue::Deferred::Deferred(SyncQueue* queue):
+    queue(queue),
+    previous(deferred_paths),
+    active(true)
+{
+    deferred_paths = &paths;
+}
+
+SyncQueue::Deferred::~Deferred() {
+    if(active) {
+        deferred_paths = previous;
+    }
+}
+
+void SyncQueue::Deferred::commit() {
+    if(!active) {
+        return;
+    }
+    deferred_paths = previous;
+    active = false;
+    if(queue != nullptr && !paths.empty()) {
+        queue->syncNow(paths);
+    }
+}
+
+void SyncQueue::run() {
+    while(true) {
+        std::vector<Request*> batch;
+        {
+            ScopedLock<Mutex> lock(mutex);
+            while(pending.empty() && !stopping) {
+                pending_changed.wait(mutex);
+            }
+            if(pending.empty()) {
+                return;
+            }
+            // Let the writes arriving shortly after the first one share its sync.
+            Timestamp first;
+            while(!stopping && pending.size() < max_batch) {
+                long left = interval_ms - (long)(first.elapsed() / 1000);
+                if(left <= 0) {
+                    break;
+                }
+                pending_changed.tryWait(mutex, left);
+            }
+            while(!pending.empty() && batch.size() < max_batch) {
+                batch.push_back(pending.front());
+                pending.pop_front();
+            }
+        }
+
+        std::vector<std::string> paths;
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            paths.insert(paths.end(), (*it)->paths.begin(), (*it)->paths.end());
+        }
+        std::string failed = flush(paths);
+        ++batch_count;
+
+        ScopedLock<Mutex> lock(mutex);
+        for(auto it=batch.begin(); it!=batch.end(); ++it) {
+            (*it)->error = failed;
+            (*it)->done = true;
+        }
+        batch_done.broadcast();
+    }
+}
+
+std::string SyncQueue::flush(const std::vector<std::string>& paths) {
+#if defined(POCO_OS_FAMILY_UNIX)
+    std::set<std::string> distinct(paths.begin(), paths.end());
+
+    // filesystem -> its paths in this batch
+    std::map<dev_t, std::vector<std::string>> filesystems;
+    for(auto it=distinct.begin(); it!=distinct.end(); ++it) {
+        struct stat st;
+        if(::stat(it->c_str(), &st) != 0) {
+            if(errno == ENOENT) {
+                continue;
+            }
+            return *it;
+        }
+        filesystems[st.st_dev].push_back(*it);
+    }
+
+    for(auto it=filesystems.begin(); it!=filesystems.end(); ++it) {
+        const std::vector<std::string>& fs_paths = it->second;
+#if POCO_OS == POCO_OS_LINUX
+        if(fs_paths.size() >= SYNCFS_THRESHOLD) {
+            int fd = ::open(fs_paths.front().c_str(), O_RDONLY|O_CLOEXEC);
+            if(fd >= 0) {
+                int result = ::syncfs(fd);
+                ::close(fd);
+                ++flush_count;
+                if(result != 0) {
+                    return fs_paths.front();
+                }
+                continue;
+            }
+        }
+#endif
+        for(auto path=fs_paths.begin(); path!=fs_paths.end(); ++path) {
+            if(!flushPath(*path)) {
+                return *path;
+            }
+        }
+    }
+#endif
+    return "";
+}
+
+bool SyncQueue::flushPath(const std::string& path) {
+#if defined(POCO_OS_FAMILY_UNIX)
+    int fd = ::open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd < 0) {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    int result = ::fstat(fd, &st);
+    if(result == 0) {
+#if POCO_OS == POCO_OS_LINUX
+        // A new file's size is part of what fdatasync writes; directories need the full fsync.
+        result = S_ISDIR(st.st_mode) ? ::fsync(fd) : ::fdatasync(fd);
+#else
+        result = ::fsync(fd);
+#endif
+    }
+    ::close(fd);
+    ++flush_count;
+    return result == 0;
+#else
+    return true;
+#endif
+}
+
+}
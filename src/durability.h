@@ -0,0 +1,110 @@
+#ifndef DISTFS_DURABILITY_H
+#define DISTFS_DURABILITY_H
+
+#include "common.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Thread.h>
+#include <Poco/Runnable.h>
+#include <Poco/AtomicCounter.h>
+#include <atomic>
+#include <deque>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// When a chunk write counts as done.
+enum Durability {
+    DURABILITY_NONE = 0,    // once it is in the page cache
+    DURABILITY_FSYNC = 1,   // once its files are synced, by the writing thread itself
+    DURABILITY_GROUP = 2    // once a group sync covering it completes
+};
+
+// "none", "fsync" or "group".
+std::string durabilityName(Durability durability);
+// Returns false for an unknown name.
+bool parseDurability(const std::string& name, Durability& durability);
+
+// Makes chunk writes durable before they are acknowledged. In group mode the handler threads
+// queue the files they wrote and sleep; a flusher thread collects the writes arriving within
+// `interval`, syncs every distinct file once (or the whole filesystem with syncfs when a batch
+// touches many files on it) and wakes them all. Under load many writes then share one device
+// flush instead of paying for one each.
+class SyncQueue: public Runnable {
+public:
+    SyncQueue(Durability durability, long interval_ms, size_t max_batch);
+    ~SyncQueue();
+
+    void start();
+    void stop();
+
+    // Returns once the files and directories in `paths` are on stable storage, as far as the mode
+    // asks for. Paths that no longer exist were removed meanwhile and are skipped. Throws
+    // WriteFileException if a sync fails.
+    void sync(const std::vector<std::string>& paths);
+
+    Durability durability() const;
+
+    // Writes made durable, fsync/fdatasync/syncfs calls made, group syncs run, and the total time
+    // writers waited for their sync.
+    UInt64 writes() const;
+    UInt64 flushes() const;
+    UInt64 batches() const;
+    UInt64 waitMicros() const;
+
+    void run() override;
+
+    // While one exists, the syncs of the calling thread are only collected; commit() does them
+    // all at once. A batch of writes then waits for one sync instead of one each.
+    class Deferred {
+    public:
+        Deferred(SyncQueue* queue);
+        ~Deferred();
+
+        // Throws WriteFileException if a sync fails.
+        void commit();
+
+    private:
+        SyncQueue* queue;
+        std::vector<std::string> paths;
+        std::vector<std::string>* previous;
+        bool active;
+    };
+
+protected:
+    struct Request {
+        std::vector<std::string> paths;
+        bool done = false;
+        std::string error;
+    };
+
+    void syncNow(const std::vector<std::string>& paths);
+    // Sync the paths, each distinct one once. Returns the failed path, or "" if all succeeded.
+    std::string flush(const std::vector<std::string>& paths);
+    bool flushPath(const std::string& path);
+
+    Durability mode;
+    long interval_ms;
+    size_t max_batch;
+
+    Mutex mutex;
+    Condition pending_changed;
+    Condition batch_done;
+    std::deque<Request*> pending;
+    bool stopping;
+    Thread thread;
+
+    AtomicCounter write_count;
+    AtomicCounter flush_count;
+    AtomicCounter batch_count;
+    std::atomic<UInt64> wait_micros;
+
+private:
+    SyncQueue(const SyncQueue&);
+    SyncQueue& operator = (const SyncQueue&);
+};
+
+}
+#endif
@@ -0,0 +1,113 @@
+#include "erasure_stripe.h"
+
+namespace DistFS {
+
+namespace {
+
+std::vector<std::string> fragmentAddresses(JSON::Object::Ptr chunk_servers, const std::string& fragment_id) {
+    std::vector<std::string> addresses;
+    JSON::Array::Ptr servers_json = chunk_servers->getArray(fragment_id);
+    if(servers_json.isNull()) {
+        return addresses;
+    }
+    for(unsigned int i=0; i<servers_json->size(); i++) {
+        addresses.push_back(servers_json->getObject(i)->getValue<std::string>("address"));
+    }
+    return addresses;
+}
+
+// Read `length` bytes at `offset` of a fragment from any server holding it. Returns false if none
+// could deliver all of them.
+bool readFragment(JSON::Object::Ptr chunk_servers, const std::string& fragment_id, int64_t offset, int64_t length, std::vector<uint8_t>& content) {
+    std::vector<std::string> addresses = fragmentAddresses(chunk_servers, fragment_id);
+    for(auto it=addresses.begin(); it!=addresses.end(); ++it) {
+        try {
+            content = getChunk(*it, fragment_id, offset, length);
+        } catch(Exception&) {
+            content.clear();
+        }
+        if((int64_t)content.size() == length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+int64_t fragmentSize(int64_t chunk_length, int data_shards) {
+    return (chunk_length + data_shards - 1) / data_shards;
+}
+
+int writeStripe(const ReedSolomon& code, const std::vector<std::string>& addresses, const std::string& chunk_id,
+        std::vector<uint8_t>& content, const std::string& compression) {
+    if(addresses.empty()) {
+        return 0;
+    }
+    int64_t fragment_size = fragmentSize((int64_t)content.size(), code.dataShards());
+
+    std::vector<std::vector<uint8_t>> shards((size_t)code.totalShards());
+    for(int i=0; i<code.dataShards(); i++) {
+        int64_t begin = std::min((int64_t)content.size(), i * fragment_size);
+        int64_t end = std::min((int64_t)content.size(), begin + fragment_size);
+        shards[i].assign(content.begin() + begin, content.begin() + end);
+        shards[i].resize((size_t)fragment_size, 0);
+    }
+    code.encode(shards);
+
+    int stored = 0;
+    for(int i=0; i<code.totalShards(); i++) {
+        std::vector<std::string> chain = {addresses[i % addresses.size()]};
+        stored += requestCreateChunkChain(chain, fragmentId(chunk_id, i), shards[i], compression);
+    }
+    return stored;
+}
+
+std::vector<uint8_t> readStripe(const ReedSolomon& code, JSON::Object::Ptr chunk_servers, const std::string& chunk_id,
+        int64_t chunk_length, int64_t offset, int64_t length) {
+    std::vector<uint8_t> content;
+    if(length <= 0) {
+        return content;
+    }
+    int64_t fragment_size = fragmentSize(chunk_length, code.dataShards());
+
+    // Healthy stripe: the range straight from the data fragments, no decoding.
+    bool complete = true;
+    int first = (int)(offset / fragment_size);
+    int last = (int)((offset + length - 1) / fragment_size);
+    for(int i=first; i<=last && complete; i++) {
+        int64_t begin = std::max(offset, i * fragment_size) - i * fragment_size;
+        int64_t end = std::min(offset + length, (i + 1) * fragment_size) - i * fragment_size;
+        std::vector<uint8_t> piece;
+        complete = readFragment(chunk_servers, fragmentId(chunk_id, i), begin, end - begin, piece);
+        content.insert(content.end(), piece.begin(), piece.end());
+    }
+    if(complete) {
+        return content;
+    }
+
+    // Degraded: any data_shards whole fragments, the rest is reconstructed.
+    std::vector<std::vector<uint8_t>> shards((size_t)code.totalShards());
+    std::vector<bool> present((size_t)code.totalShards(), false);
+    int available = 0;
+    for(int i=0; i<code.totalShards() && available < code.dataShards(); i++) {
+        if(readFragment(chunk_servers, fragmentId(chunk_id, i), 0, fragment_size, shards[i])) {
+            present[i] = true;
+            available++;
+        }
+    }
+    code.reconstruct(shards, present);
+
+    content.clear();
+    content.reserve((size_t)length);
+    for(int64_t pos=offset; pos<offset+length;) {
+        int i = (int)(pos / fragment_size);
+        int64_t begin = pos - i * fragment_size;
+        int64_t count = std::min(offset + length - pos, fragment_size - begin);
+        content.insert(content.end(), shards[i].begin() + begin, shards[i].begin() + begin + count);
+        pos += count;
+    }
+    return content;
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef DISTFS_ERASURE_STRIPE_H
+#define DISTFS_ERASURE_STRIPE_H
+
+#include "common.h"
+#include "reed_solomon.h"
+
+namespace DistFS {
+
+// A chunk of an erasure-coded file is stored as a stripe: its content cut into data_shards
+// fragments, padded with zeros to the same size, plus parity_shards parity fragments. Every
+// fragment is a chunk of its own, fragmentId(chunk id, index), kept once on its own chunk server,
+// so any parity_shards servers can be lost. The chunk length isn't stored, it follows from the
+// file length.
+
+int64_t fragmentSize(int64_t chunk_length, int data_shards);
+
+// Encode `content` and store fragment i on addresses[i % addresses.size()]. Returns the number of
+// fragments stored, the stripe is readable if that is at least data_shards.
+int writeStripe(const ReedSolomon& code, const std::vector<std::string>& addresses, const std::string& chunk_id,
+    std::vector<uint8_t>& content, const std::string& compression = "none");
+
+// Read `length` bytes at `offset` of a stripe of `chunk_length` bytes. `chunk_servers` is the
+// fragment id -> servers map of get_file_meta. Only the data fragments holding the range are read
+// while they are all there; otherwise any data_shards fragments are read and the range is
+// reconstructed from them. Throws DataException if too few fragments are left.
+std::vector<uint8_t> readStripe(const ReedSolomon& code, JSON::Object::Ptr chunk_servers, const std::string& chunk_id,
+    int64_t chunk_length, int64_t offset, int64_t length);
+
+}
+#endif
@@ -0,0 +1,163 @@
+#include "io_scheduler.h"
+
+#include <algorithm>
+
+namespace DistFS {
+
+namespace {
+
+thread_local IoClass thread_io_class = IO_INTERACTIVE;
+
+// How often waiters look again at a class that is out of tokens.
+const long THROTTLE_POLL_MS = 10;
+
+}
+
+std::string ioClassName(IoClass io_class) {
+    switch(io_class) {
+    case IO_WRITE:
+        return "write";
+    case IO_BACKGROUND:
+        return "background";
+    default:
+        return "interactive";
+    }
+}
+
+bool parseIoClass(const std::string& name, IoClass& io_class) {
+    if(name == "interactive") {
+        io_class = IO_INTERACTIVE;
+    } else if(name == "write") {
+        io_class = IO_WRITE;
+    } else if(name == "background") {
+        io_class = IO_BACKGROUND;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+IoScheduler::IoScheduler(int slots):
+    slots(std::max(slots, 1)),
+    busy(0),
+    virtual_time(0)
+{
+}
+
+void IoScheduler::configure(IoClass io_class, int weight, int64_t bandwidth, int max_inflight) {
+    ScopedLock<Mutex> lock(mutex);
+    ClassState& state = classes[io_class];
+    state.weight = std::max(weight, 1);
+    state.bandwidth = std::max<int64_t>(bandwidth, 0);
+    state.max_inflight = std::max(max_inflight, 0);
+    // A tenth of a second worth of burst.
+    state.tokens = (double)state.bandwidth / 10;
+    state.refilled.update();
+}
+
+void IoScheduler::acquire(IoClass io_class, int64_t bytes) {
+    ScopedLock<Mutex> lock(mutex);
+    ClassState& state = classes[io_class];
+
+    // Each byte costs 1/weight of virtual time, a class's requests finish in tag order.
+    Waiter waiter;
+    waiter.bytes = std::max<int64_t>(bytes, 1);
+    waiter.tag = std::max(virtual_time, state.last_tag) + (double)waiter.bytes / state.weight;
+    state.last_tag = waiter.tag;
+    state.queue.push_back(&waiter);
+
+    Timestamp queued;
+    while(busy >= slots || choose() != io_class || state.queue.front() != &waiter) {
+        changed.tryWait(mutex, THROTTLE_POLL_MS);
+    }
+
+    state.queue.pop_front();
+    busy++;
+    state.stats.inflight++;
+    state.stats.ops++;
+    state.stats.bytes += (UInt64)waiter.bytes;
+    state.stats.wait_us += (UInt64)queued.elapsed();
+    if(state.bandwidth > 0) {
+        // May go negative: a large I/O borrows from the tokens of the next ones.
+        state.tokens -= (double)waiter.bytes;
+    }
+    virtual_time = std::max(virtual_time, waiter.tag - (double)waiter.bytes / state.weight);
+    // Another slot may still be free for the next head.
+    changed.broadcast();
+}
+
+void IoScheduler::release(IoClass io_class) {
+    ScopedLock<Mutex> lock(mutex);
+    busy--;
+    classes[io_class].stats.inflight--;
+    changed.broadcast();
+}
+
+IoScheduler::Stats IoScheduler::stats(IoClass io_class) {
+    ScopedLock<Mutex> lock(mutex);
+    Stats result = classes[io_class].stats;
+    result.queued = (int)classes[io_class].queue.size();
+    return result;
+}
+
+bool IoScheduler::mayRun(ClassState& state) {
+    // Caller holds mutex.
+    if(state.max_inflight > 0 && state.stats.inflight >= state.max_inflight) {
+        return false;
+    }
+    if(state.bandwidth > 0) {
+        double burst = (double)state.bandwidth / 10;
+        state.tokens = std::min(burst, state.tokens + (double)state.refilled.elapsed() * (double)state.bandwidth / 1000000.0);
+        state.refilled.update();
+        if(state.tokens <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int IoScheduler::choose() {
+    // Caller holds mutex.
+    int chosen = -1;
+    for(int i=0; i<IO_CLASSES; i++) {
+        ClassState& state = classes[i];
+        if(state.queue.empty() || !mayRun(state)) {
+            continue;
+        }
+        if(chosen < 0 || state.queue.front()->tag < classes[chosen].queue.front()->tag) {
+            chosen = i;
+        }
+    }
+    return chosen;
+}
+
+IoClass IoScheduler::current() {
+    return thread_io_class;
+}
+
+IoScheduler::Scope::Scope(IoClass io_class):
+    previous(thread_io_class)
+{
+    thread_io_class = io_class;
+}
+
+IoScheduler::Scope::~Scope() {
+    thread_io_class = previous;
+}
+
+IoScheduler::Ticket::Ticket(IoScheduler* scheduler, int64_t bytes):
+    scheduler(scheduler),
+    io_class(IoScheduler::current())
+{
+    if(scheduler != nullptr) {
+        scheduler->acquire(io_class, bytes);
+    }
+}
+
+IoScheduler::Ticket::~Ticket() {
+    if(scheduler != nullptr) {
+        scheduler->release(io_class);
+    }
+}
+
+}
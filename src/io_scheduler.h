@@ -0,0 +1,112 @@
+#ifndef DISTFS_IO_SCHEDULER_H
+#define DISTFS_IO_SCHEDULER_H
+
+#include "common.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+#include <deque>
+
+namespace DistFS {
+
+using namespace Poco;
+
+// Priority classes of disk I/O on a chunk server.
+enum IoClass {
+    IO_INTERACTIVE = 0,     // client reads
+    IO_WRITE = 1,           // chunk creates and updates
+    IO_BACKGROUND = 2,      // repair, rebalancing, scrubbing and compaction
+    IO_CLASSES = 3
+};
+
+// "interactive", "write" or "background".
+std::string ioClassName(IoClass io_class);
+// Returns false for an unknown name.
+bool parseIoClass(const std::string& name, IoClass& io_class);
+
+// Orders the I/O of one disk by priority class. At most `slots` I/Os run at a time; when one
+// finishes, the next is picked by weighted fair queuing over the classes that may run, so each
+// class gets a share of the disk in proportion to its weight, and a busy class can't starve the
+// others. A class can be capped in bandwidth (token bucket) and in concurrent I/Os, which keeps
+// background work from filling the queue ahead of interactive reads.
+//
+// The class of an I/O is the one set by the innermost Scope on the calling thread.
+class IoScheduler {
+public:
+    IoScheduler(int slots);
+
+    // `bandwidth` in bytes per second and `max_inflight` of 0 mean unlimited. Set before use.
+    void configure(IoClass io_class, int weight, int64_t bandwidth, int max_inflight);
+
+    // Blocks until an I/O of `bytes` in `io_class` may run. Every acquire() needs a release().
+    void acquire(IoClass io_class, int64_t bytes);
+    void release(IoClass io_class);
+
+    struct Stats {
+        UInt64 ops = 0;
+        UInt64 bytes = 0;
+        UInt64 wait_us = 0;     // total time spent queued
+        int queued = 0;
+        int inflight = 0;
+    };
+    Stats stats(IoClass io_class);
+
+    // The class of the calling thread's I/O, interactive unless a Scope says otherwise.
+    static IoClass current();
+
+    // Sets the calling thread's class until it goes out of scope.
+    class Scope {
+    public:
+        Scope(IoClass io_class);
+        ~Scope();
+    private:
+        IoClass previous;
+    };
+
+    // One I/O of the calling thread's class, admitted for as long as the ticket lives. A null
+    // scheduler admits everything.
+    class Ticket {
+    public:
+        Ticket(IoScheduler* scheduler, int64_t bytes);
+        ~Ticket();
+    private:
+        IoScheduler* scheduler;
+        IoClass io_class;
+    };
+
+protected:
+    struct Waiter {
+        double tag;             // virtual finish time
+        int64_t bytes;
+    };
+
+    struct ClassState {
+        int weight = 1;
+        int64_t bandwidth = 0;
+        int max_inflight = 0;
+        double tokens = 0;
+        Timestamp refilled;
+        double last_tag = 0;
+        std::deque<Waiter*> queue;
+        Stats stats;
+    };
+
+    bool mayRun(ClassState& state);
+    // The class whose head should run next, or -1 if none may.
+    int choose();
+
+    Mutex mutex;
+    Condition changed;
+    int slots;
+    int busy;
+    double virtual_time;
+    ClassState classes[IO_CLASSES];
+
+private:
+    IoScheduler(const IoScheduler&);
+    IoScheduler& operator = (const IoScheduler&);
+};
+
+}
+#endif
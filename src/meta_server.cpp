@@ -7,6 +7,7 @@
 #include <Poco/UUIDGenerator.h>
 #include <iostream>
 #include <fstream>
+#include <set>
 
 namespace DistFS {
 
@@ -47,7 +48,7 @@ namespace DistFS {
 		}
 		template < typename T>
 		void Delet(std::vector<T> &src,T target) {
-			std::vector<T>::iterator it;
+			typename std::vector<T>::iterator it;
 			for (it = src.begin(); it != src.end(); it++) {
 				if (*it == target)
 				{
@@ -118,11 +119,23 @@ namespace DistFS {
 				// We need to delete old records related to that server first.
 				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
 
+				std::set<std::string> reported;
+				for (int i = 0; i < chunks_list_json->size(); i++) {
+					reported.insert(chunks_list_json->getElement<std::string>(i));
+				}
+
 				// remove from chunk_servers_map
 				std::vector<std::string>& chunks_list = server.server_chunks_map[server_id];
 				for (auto it = chunks_list.begin(); it != chunks_list.end(); ++it) {
 					std::vector<std::string>& vec = server.chunk_servers_map[*it];
 					vec.erase(std::remove(vec.begin(), vec.end(), server_id), vec.end());
+					if (reported.count(*it) == 0 && server.chunk_versions_map.count(*it) > 0) {
+						// The replica is gone, and with it its version.
+						server.chunk_versions_map[*it].erase(server_id);
+						if (server.chunk_versions_map[*it].empty()) {
+							server.chunk_versions_map.erase(*it);
+						}
+					}
 				}
 				// remove from server_chunks_map
 				server.server_chunks_map[server_id].clear();
@@ -133,6 +146,16 @@ namespace DistFS {
 					server.server_chunks_map[server_id].push_back(chunk_id);
 					server.chunk_servers_map[chunk_id].push_back(server_id);
 				}
+
+				// A replica's version only goes up. A report sent before an append the access server
+				// has already recorded doesn't take it back.
+				if (json_req->has("versions")) {
+					JSON::Object::Ptr versions_json = json_req->getObject("versions");
+					for (auto it = versions_json->begin(); it != versions_json->end(); ++it) {
+						int64_t& version = server.chunk_versions_map[it->first][server_id];
+						version = std::max(version, it->second.convert<int64_t>());
+					}
+				}
 				
 				//add by Hua
 				std::map<std::string, int64_t>::const_iterator it = server.chunk_servers_time_map.find(server_id);
@@ -221,6 +244,38 @@ namespace DistFS {
 		}
 	};
 
+	class ReportCorruptChunkRequestHandler : public HTTPRequestHandler {
+	public:
+		void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+			Application& app = Application::instance();
+			MetaServer& server = dynamic_cast<MetaServer&>(app);
+
+			JSON::Parser jsonParser;
+			JSON::Object::Ptr json_req = jsonParser.parse(request.stream()).extract<JSON::Object::Ptr>();
+
+			std::string server_id = json_req->getValue<std::string>("server_id");
+			std::string chunk_id = json_req->getValue<std::string>("chunk_id");
+
+			size_t replicas = 0;
+			{
+				// The chunk server has quarantined its copy, stop handing it out to readers.
+				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
+				std::vector<std::string>& servers = server.chunk_servers_map[chunk_id];
+				servers.erase(std::remove(servers.begin(), servers.end(), server_id), servers.end());
+				std::vector<std::string>& chunks = server.server_chunks_map[server_id];
+				chunks.erase(std::remove(chunks.begin(), chunks.end(), chunk_id), chunks.end());
+				replicas = servers.size();
+			}
+			app.logger().warning("Chunk " + chunk_id + " on " + server_id + " is corrupt, " + std::to_string(replicas) + " good replicas left.");
+
+			response.setStatusAndReason(HTTPResponse::HTTP_OK);
+			JSON::Object::Ptr json_resp(new JSON::Object);
+			json_resp->set("status", "success");
+			std::ostream& ostr = response.send();
+			json_resp->stringify(ostr);
+		}
+	};
+
 	class CreateFileRequestHandler : public HTTPRequestHandler {
 	public:
 		void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
@@ -240,6 +295,49 @@ namespace DistFS {
 
 			int64_t replica_count = server.default_replica_count;
 
+			// Chunks of the file are compressed by the chunk servers with this codec.
+			std::string compression = "none";
+			if (query_map.find("compression") != query_map.end()) {
+				compression = query_map["compression"];
+			}
+			if (compression != "none" && compression != "zlib") {
+				response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+				response.send();
+				return;
+			}
+
+			// "replicated" keeps replica_count copies of every chunk, "rs" stores every chunk as a
+			// Reed-Solomon stripe of data_shards + parity_shards fragments.
+			std::string layout = "replicated";
+			if (query_map.find("layout") != query_map.end()) {
+				layout = query_map["layout"];
+			}
+			int64_t data_shards = server.default_data_shards;
+			int64_t parity_shards = server.default_parity_shards;
+			try {
+				if (query_map.find("data_shards") != query_map.end()) {
+					data_shards = std::stoll(query_map["data_shards"]);
+				}
+				if (query_map.find("parity_shards") != query_map.end()) {
+					parity_shards = std::stoll(query_map["parity_shards"]);
+				}
+			} catch (std::exception&) {
+				data_shards = 0;
+			}
+			if ((layout != "replicated" && layout != "rs") || data_shards <= 0 || parity_shards < 0 || parity_shards > 256 - data_shards) {
+				response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+				response.send();
+				return;
+			}
+			// A deduplicated file is cut at content-defined boundaries into chunks named by their
+			// hash, which other files may share. Only replicated chunks can be shared.
+			bool dedup = query_map.find("dedup") != query_map.end() && query_map["dedup"] == "true";
+			if (dedup && layout != "replicated") {
+				response.setStatusAndReason(HTTPResponse::HTTP_BAD_REQUEST);
+				response.send();
+				return;
+			}
+
 			File meta_file(Path(server.meta_directory).append(filename));
 
 			if (meta_file.exists()) {
@@ -253,6 +351,16 @@ namespace DistFS {
 			meta_json->set("length", 0);
 			meta_json->set("chunk_size", chunk_size);
 			meta_json->set("replica_count", replica_count);
+			meta_json->set("compression", compression);
+			meta_json->set("layout", layout);
+			if (layout == "rs") {
+				meta_json->set("data_shards", data_shards);
+				meta_json->set("parity_shards", parity_shards);
+			}
+			if (dedup) {
+				meta_json->set("dedup", true);
+				meta_json->set("chunk_lengths", JSON::Array::Ptr(new JSON::Array));
+			}
 
 			JSON::Array::Ptr chunks_json(new JSON::Array);
 			//std::string first_chunk = UUIDGenerator().createOne().toString();
@@ -337,25 +445,66 @@ namespace DistFS {
 			resp_json->set("chunk_size", file_meta->get("chunk_size"));
 			resp_json->set("chunks", chunks_json);
 			resp_json->set("replica_count", file_meta->get("replica_count"));
+			// Files created before compression was supported have no policy.
+			resp_json->set("compression", file_meta->has("compression") ? file_meta->get("compression") : Var("none"));
+			std::string layout = file_meta->optValue<std::string>("layout", "replicated");
+			resp_json->set("layout", layout);
+			if (file_meta->optValue<bool>("dedup", false)) {
+				resp_json->set("dedup", true);
+				resp_json->set("chunk_lengths", file_meta->getArray("chunk_lengths"));
+			}
 
 			// return the chunk to server map so the client don't need to send another request.
+			// Holes aren't stored anywhere.
 			std::vector<std::string> chunks_list;
 			for (int i = 0; i < chunks_json->size(); i++) {
-				chunks_list.push_back(chunks_json->getElement<std::string>(i));
+				std::string chunk_id = chunks_json->getElement<std::string>(i);
+				if (chunk_id != HOLE_CHUNK_ID) {
+					chunks_list.push_back(chunk_id);
+				}
+			}
+			if (layout == "rs") {
+				// The servers are those of the fragments, the chunks themselves aren't stored.
+				int64_t data_shards = file_meta->getValue<int64_t>("data_shards");
+				int64_t parity_shards = file_meta->getValue<int64_t>("parity_shards");
+				resp_json->set("data_shards", data_shards);
+				resp_json->set("parity_shards", parity_shards);
+
+				std::vector<std::string> fragments_list;
+				for (auto it = chunks_list.begin(); it != chunks_list.end(); ++it) {
+					for (int i = 0; i < data_shards + parity_shards; i++) {
+						fragments_list.push_back(fragmentId(*it, i));
+					}
+				}
+				chunks_list.swap(fragments_list);
 			}
 
+			// Chunks appended to in place, and the version their replicas have to be at.
+			JSON::Object::Ptr versions_json = file_meta->has("versions") ? file_meta->getObject("versions") : JSON::Object::Ptr(new JSON::Object);
+			resp_json->set("versions", versions_json);
+
 			JSON::Object::Ptr chunk_servers(new JSON::Object);
-			for (auto it = chunks_list.begin(); it != chunks_list.end(); ++it) {
-
-				JSON::Array::Ptr servers_json(new JSON::Array);
-				std::vector<std::string> servers_list = server.chunk_servers_map[*it];
-				for (auto jt = servers_list.begin(); jt != servers_list.end(); ++jt) {
-					JSON::Object::Ptr server_json(new JSON::Object);
-					server_json->set("id", *jt);
-					server_json->set("address", server.servers_id_address_map[*jt]);
-					servers_json->add(server_json);
+			{
+				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
+				for (auto it = chunks_list.begin(); it != chunks_list.end(); ++it) {
+					int64_t version = versions_json->optValue<int64_t>(*it, 0);
+					auto replica_versions = server.chunk_versions_map.find(*it);
+
+					JSON::Array::Ptr servers_json(new JSON::Array);
+					std::vector<std::string> servers_list = server.chunk_servers_map[*it];
+					for (auto jt = servers_list.begin(); jt != servers_list.end(); ++jt) {
+						if (version > 0 && (replica_versions == server.chunk_versions_map.end() ||
+							replica_versions->second.count(*jt) == 0 || replica_versions->second[*jt] < version)) {
+							// Stale, it missed an append.
+							continue;
+						}
+						JSON::Object::Ptr server_json(new JSON::Object);
+						server_json->set("id", *jt);
+						server_json->set("address", server.servers_id_address_map[*jt]);
+						servers_json->add(server_json);
+					}
+					chunk_servers->set(*it, servers_json);
 				}
-				chunk_servers->set(*it, servers_json);
 			}
 
 			resp_json->set("chunk_servers", chunk_servers);
@@ -399,8 +548,104 @@ namespace DistFS {
 				file_meta->set("chunk_size", json_req->getValue<std::string>("chunk_size"));
 			}
 			if (json_req->has("chunks")) {
+				if (file_meta->optValue<bool>("dedup", false)) {
+					// The chunks the file stops referencing lose a reference, the new ones gain one.
+					JSON::Array::Ptr old_json = file_meta->getArray("chunks");
+					JSON::Array::Ptr new_json = json_req->getArray("chunks");
+					ScopedLock<Mutex> fingerprints_lock(server.fingerprints_mutex);
+					for (int i = 0; i < new_json->size(); i++) {
+						if (new_json->getElement<std::string>(i) != HOLE_CHUNK_ID) {
+							server.fingerprints[new_json->getElement<std::string>(i)]++;
+						}
+					}
+					for (int i = 0; i < old_json->size(); i++) {
+						auto it = server.fingerprints.find(old_json->getElement<std::string>(i));
+						if (it != server.fingerprints.end() && --it->second <= 0) {
+							// Its replicas stay on the chunk servers, a later write of the same
+							// content can't find them anymore.
+							server.fingerprints.erase(it);
+						}
+					}
+				}
 				file_meta->set("chunks", json_req->getArray("chunks"));
 			}
+			// Lengths of the chunks of a deduplicated file, sent with its chunks.
+			if (json_req->has("chunk_lengths")) {
+				file_meta->set("chunk_lengths", json_req->getArray("chunk_lengths"));
+			}
+			// Servers the chunks were just created on. They are taken as holders until the servers'
+			// next reports, which replace them.
+			if (json_req->has("created_replicas")) {
+				JSON::Object::Ptr replicas_json = json_req->getObject("created_replicas");
+				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
+				for (auto it = replicas_json->begin(); it != replicas_json->end(); ++it) {
+					JSON::Array::Ptr servers_json = replicas_json->getArray(it->first);
+					std::vector<std::string>& holders = server.chunk_servers_map[it->first];
+					for (int i = 0; i < servers_json->size(); i++) {
+						std::string server_id = servers_json->getElement<std::string>(i);
+						if (std::find(holders.begin(), holders.end(), server_id) == holders.end()) {
+							holders.push_back(server_id);
+							server.server_chunks_map[server_id].push_back(it->first);
+						}
+					}
+				}
+			}
+			// An append only sends the chunks it added after the last one.
+			if (json_req->has("appended_chunks")) {
+				JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+				JSON::Array::Ptr appended_json = json_req->getArray("appended_chunks");
+				for (int i = 0; i < appended_json->size(); i++) {
+					chunks_json->add(appended_json->getElement<std::string>(i));
+				}
+			}
+			// Versions of the chunks appended to in place, and the servers whose replicas took the append.
+			if (json_req->has("versions")) {
+				JSON::Object::Ptr versions_json = file_meta->has("versions") ? file_meta->getObject("versions") : JSON::Object::Ptr(new JSON::Object);
+				JSON::Object::Ptr updated_json = json_req->getObject("versions");
+				for (auto it = updated_json->begin(); it != updated_json->end(); ++it) {
+					versions_json->set(it->first, it->second);
+				}
+				file_meta->set("versions", versions_json);
+			}
+			if (json_req->has("appended_replicas")) {
+				JSON::Object::Ptr versions_json = file_meta->getObject("versions");
+				JSON::Object::Ptr replicas_json = json_req->getObject("appended_replicas");
+				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
+				for (auto it = replicas_json->begin(); it != replicas_json->end(); ++it) {
+					int64_t version = versions_json->optValue<int64_t>(it->first, 0);
+					JSON::Array::Ptr servers_json = replicas_json->getArray(it->first);
+					for (int i = 0; i < servers_json->size(); i++) {
+						int64_t& replica_version = server.chunk_versions_map[it->first][servers_json->getElement<std::string>(i)];
+						replica_version = std::max(replica_version, version);
+					}
+				}
+			}
+			if (file_meta->has("versions")) {
+				// Chunks replaced by new ones take their versions with them.
+				JSON::Object::Ptr versions_json = file_meta->getObject("versions");
+				JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+				std::set<std::string> chunks;
+				for (int i = 0; i < chunks_json->size(); i++) {
+					chunks.insert(chunks_json->getElement<std::string>(i));
+				}
+				std::vector<std::string> dropped;
+				for (auto it = versions_json->begin(); it != versions_json->end(); ++it) {
+					if (chunks.count(it->first) == 0) {
+						dropped.push_back(it->first);
+					}
+				}
+				for (auto it = dropped.begin(); it != dropped.end(); ++it) {
+					versions_json->remove(*it);
+				}
+			}
+			// Set together with the chunks when a file is converted to another layout.
+			if (json_req->has("layout")) {
+				file_meta->set("layout", json_req->getValue<std::string>("layout"));
+				if (json_req->has("data_shards")) {
+					file_meta->set("data_shards", json_req->getValue<int64_t>("data_shards"));
+					file_meta->set("parity_shards", json_req->getValue<int64_t>("parity_shards"));
+				}
+			}
 
 			{
 				std::ofstream ofile(meta_file.path().c_str(), std::ios::out | std::ios::binary);
@@ -413,6 +658,55 @@ namespace DistFS {
 		}
 	};
 
+	// Which of the chunks in the request body, {"chunks": [...]}, some deduplicated file already
+	// references, with the servers that have them: {"chunks": {"<id>": [{"id", "address"}]}}.
+	class LookupChunksRequestHandler : public HTTPRequestHandler {
+	public:
+		void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) {
+			Application& app = Application::instance();
+			MetaServer& server = dynamic_cast<MetaServer&>(app);
+
+			JSON::Parser jsonParser;
+			JSON::Object::Ptr json_req = jsonParser.parse(request.stream()).extract<JSON::Object::Ptr>();
+			JSON::Array::Ptr chunks_json = json_req->getArray("chunks");
+
+			std::vector<std::string> known;
+			{
+				ScopedLock<Mutex> fingerprints_lock(server.fingerprints_mutex);
+				for (int i = 0; i < chunks_json->size(); i++) {
+					std::string chunk_id = chunks_json->getElement<std::string>(i);
+					if (server.fingerprints.count(chunk_id) > 0) {
+						known.push_back(chunk_id);
+					}
+				}
+			}
+
+			JSON::Object::Ptr found_json(new JSON::Object);
+			{
+				ScopedLock<Mutex> chunks_map_lock(server.chunks_map_mutex);
+				for (auto it = known.begin(); it != known.end(); ++it) {
+					JSON::Array::Ptr servers_json(new JSON::Array);
+					std::vector<std::string> servers_list = server.chunk_servers_map[*it];
+					for (auto jt = servers_list.begin(); jt != servers_list.end(); ++jt) {
+						JSON::Object::Ptr server_json(new JSON::Object);
+						server_json->set("id", *jt);
+						server_json->set("address", server.servers_id_address_map[*jt]);
+						servers_json->add(server_json);
+					}
+					found_json->set(*it, servers_json);
+				}
+			}
+
+			JSON::Object::Ptr resp_json(new JSON::Object);
+			resp_json->set("status", "success");
+			resp_json->set("chunks", found_json);
+
+			response.setStatusAndReason(HTTPResponse::HTTP_OK);
+			response.setContentType("application/json");
+			resp_json->stringify(response.send());
+		}
+	};
+
 	MetaServer::MetaServer() {
 		help_requested = false;
 		request_handler_factory = new MetaServerRequestHandlerFactory(this);
@@ -475,8 +769,13 @@ namespace DistFS {
 		makeDirectories(meta_directory);
 
 		loadServersList();
+		loadFingerprints();
 		ServerSocket server_socket(listen_addr);
-		http_server = new HTTPServer(request_handler_factory, server_socket, new HTTPServerParams);
+		// The chunk and access servers keep their connections for the next request. An idle one
+		// holds a thread until keep_alive_timeout, which has to be above their pool_idle_timeout.
+		HTTPServerParams* params = new HTTPServerParams;
+		params->setKeepAliveTimeout(Timespan(std::max(config().getInt("MetaServer.keep_alive_timeout", 5), 1), 0));
+		http_server = new HTTPServer(new KeepAliveRequestHandlerFactory(*request_handler_factory), server_socket, params);
 
 
 		//====added by Hua
@@ -530,6 +829,41 @@ namespace DistFS {
 
 	}
 
+	// The meta files are the record of which chunks the deduplicated files reference, the index
+	// is counted again from them.
+	void MetaServer::loadFingerprints() {
+		std::vector<std::string> files_list = listDirectory(meta_directory);
+		for (auto it = files_list.begin(); it != files_list.end(); ++it) {
+			File meta_file(Path(meta_directory).append(*it));
+			if (!meta_file.isFile()) {
+				continue;
+			}
+
+			JSON::Object::Ptr file_meta;
+			try {
+				std::ifstream ifile(meta_file.path().c_str(), std::ios::binary);
+				JSON::Parser jsonParser;
+				file_meta = jsonParser.parse(ifile).extract<JSON::Object::Ptr>();
+				ifile.close();
+			}
+			catch (Exception& e) {
+				logger().warning("Can't read the meta of " + (*it) + ": " + e.displayText());
+				continue;
+			}
+
+			if (!file_meta->optValue<bool>("dedup", false)) {
+				continue;
+			}
+			JSON::Array::Ptr chunks_json = file_meta->getArray("chunks");
+			for (int i = 0; i < chunks_json->size(); i++) {
+				if (chunks_json->getElement<std::string>(i) != HOLE_CHUNK_ID) {
+					fingerprints[chunks_json->getElement<std::string>(i)]++;
+				}
+			}
+		}
+		logger().information(std::to_string(fingerprints.size()) + " deduplicated chunks in the fingerprint index.");
+	}
+
 	MetaServerRequestHandlerFactory::MetaServerRequestHandlerFactory(MetaServer* srv) {
 		this->server = srv;
 	}
@@ -551,6 +885,9 @@ namespace DistFS {
 		else if (uri.getPath() == "/get_chunk_chunk_servers") {
 			return new GetChunkChunkServersRequestHandler();
 		}
+		else if (uri.getPath() == "/report_corrupt_chunk") {
+			return new ReportCorruptChunkRequestHandler();
+		}
 		else if (uri.getPath() == "/create_file") {
 			return new CreateFileRequestHandler();
 		}
@@ -560,6 +897,9 @@ namespace DistFS {
 		else if (uri.getPath() == "/update_file_meta") {
 			return new UpdateFileMetaRequestHandler();
 		}
+		else if (uri.getPath() == "/lookup_chunks") {
+			return new LookupChunksRequestHandler();
+		}
 		return nullptr;
 	}
 
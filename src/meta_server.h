@@ -40,10 +40,19 @@ public:
     Path meta_directory;
     int64_t default_chunk_size = 4096;
     int64_t default_replica_count = 3;
+    int64_t default_data_shards = 6;
+    int64_t default_parity_shards = 3;
 
     Mutex chunks_map_mutex;
     std::map<std::string, std::vector<std::string>> server_chunks_map;
     std::map<std::string, std::vector<std::string>> chunk_servers_map;
+    // chunk id -> server id -> version of the replica there, for the chunks appended to in place
+    std::map<std::string, std::map<std::string, int64_t>> chunk_versions_map;
+
+    // Fingerprint index of the deduplicated files: content-addressed chunk id -> how many times
+    // the chunk lists of those files reference it.
+    Mutex fingerprints_mutex;
+    std::map<std::string, int64_t> fingerprints;
 
     std::vector<std::string> live_chunk_servers;
     std::map<std::string, std::string> servers_id_address_map;
@@ -59,6 +68,7 @@ protected:
 
     void handleHelp(const std::string& name, const std::string& value);
     void loadServersList();
+    void loadFingerprints();
 
     std::string server_id;
     bool help_requested;
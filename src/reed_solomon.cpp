@@ -0,0 +1,356 @@
+#include "reed_solomon.h"
+
+#include <Poco/Exception.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DISTFS_GF_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTFS_TARGET_SSSE3
+#define DISTFS_TARGET_AVX2
+#else
+#define DISTFS_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define DISTFS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace DistFS {
+
+namespace {
+
+const unsigned POLY = 0x11d;
+
+struct Tables {
+    uint8_t exp[512];   // doubled, so exp[log a + log b] needs no modulo
+    uint8_t log[256];
+
+    Tables() {
+        unsigned x = 1;
+        for(int i=0; i<255; i++) {
+            exp[i] = (uint8_t)x;
+            exp[i + 255] = (uint8_t)x;
+            log[x] = (uint8_t)i;
+            x <<= 1;
+            if(x & 0x100) {
+                x ^= POLY;
+            }
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+        log[0] = 0;
+    }
+};
+
+const Tables& tables() {
+    static const Tables t;
+    return t;
+}
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+    if(a == 0 || b == 0) {
+        return 0;
+    }
+    const Tables& t = tables();
+    return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t gfInverse(uint8_t a) {
+    const Tables& t = tables();
+    return t.exp[255 - t.log[a]];
+}
+
+uint8_t gfPow(uint8_t a, int n) {
+    uint8_t result = 1;
+    for(int i=0; i<n; i++) {
+        result = gfMul(result, a);
+    }
+    return result;
+}
+
+void xorInto(const uint8_t* src, uint8_t* dst, size_t length) {
+    for(size_t i=0; i<length; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+#if defined(DISTFS_GF_X86)
+
+// Split every byte into nibbles and look both up in 16-entry product tables: c*x is
+// c*(x & 0x0f) ^ c*(x & 0xf0), and pshufb does 16 (or 32) lookups at once.
+void nibbleTables(uint8_t c, uint8_t* low, uint8_t* high) {
+    for(int i=0; i<16; i++) {
+        low[i] = gfMul(c, (uint8_t)i);
+        high[i] = gfMul(c, (uint8_t)(i << 4));
+    }
+}
+
+DISTFS_TARGET_SSSE3 void gfMulAddSSSE3(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length) {
+    uint8_t low[16], high[16];
+    nibbleTables(c, low, high);
+    const __m128i table_low = _mm_loadu_si128((const __m128i*)low);
+    const __m128i table_high = _mm_loadu_si128((const __m128i*)high);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i l = _mm_and_si128(s, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(table_low, l), _mm_shuffle_epi8(table_high, h));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, product));
+    }
+    gfMulAddSoftware(c, src + i, dst + i, length - i);
+}
+
+DISTFS_TARGET_AVX2 void gfMulAddAVX2(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length) {
+    uint8_t low[16], high[16];
+    nibbleTables(c, low, high);
+    // vpshufb looks up within each 128-bit lane, so both lanes get the same table.
+    const __m256i table_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+    const __m256i table_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i l = _mm256_and_si256(s, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(table_low, l), _mm256_shuffle_epi8(table_high, h));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, product));
+    }
+    gfMulAddSoftware(c, src + i, dst + i, length - i);
+}
+
+bool detectSSSE3() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+bool detectAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+typedef void (*GfMulAddFunction)(uint8_t, const uint8_t*, uint8_t*, size_t);
+
+GfMulAddFunction selectImplementation(const char** name) {
+#if defined(DISTFS_GF_X86)
+    if(detectAVX2()) {
+        *name = "avx2";
+        return gfMulAddAVX2;
+    }
+    if(detectSSSE3()) {
+        *name = "ssse3";
+        return gfMulAddSSSE3;
+    }
+#endif
+    *name = "scalar";
+    return gfMulAddSoftware;
+}
+
+struct Implementation {
+    const char* name;
+    GfMulAddFunction function;
+
+    Implementation() {
+        function = selectImplementation(&name);
+    }
+};
+
+const Implementation& implementation() {
+    static const Implementation selected;
+    return selected;
+}
+
+// Invert the n x n matrix in place by Gauss-Jordan elimination. Returns false if it is singular.
+bool invert(std::vector<uint8_t>& m, int n) {
+    std::vector<uint8_t> inverse((size_t)(n * n), 0);
+    for(int i=0; i<n; i++) {
+        inverse[i * n + i] = 1;
+    }
+
+    for(int col=0; col<n; col++) {
+        int pivot = col;
+        while(pivot < n && m[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if(pivot == n) {
+            return false;
+        }
+        if(pivot != col) {
+            for(int k=0; k<n; k++) {
+                std::swap(m[pivot * n + k], m[col * n + k]);
+                std::swap(inverse[pivot * n + k], inverse[col * n + k]);
+            }
+        }
+
+        uint8_t scale = gfInverse(m[col * n + col]);
+        for(int k=0; k<n; k++) {
+            m[col * n + k] = gfMul(m[col * n + k], scale);
+            inverse[col * n + k] = gfMul(inverse[col * n + k], scale);
+        }
+
+        for(int row=0; row<n; row++) {
+            uint8_t factor = m[row * n + col];
+            if(row == col || factor == 0) {
+                continue;
+            }
+            for(int k=0; k<n; k++) {
+                m[row * n + k] ^= gfMul(factor, m[col * n + k]);
+                inverse[row * n + k] ^= gfMul(factor, inverse[col * n + k]);
+            }
+        }
+    }
+    m.swap(inverse);
+    return true;
+}
+
+}
+
+void gfMulAddSoftware(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length) {
+    if(c == 0) {
+        return;
+    }
+    if(c == 1) {
+        xorInto(src, dst, length);
+        return;
+    }
+    uint8_t row[256];
+    for(int i=0; i<256; i++) {
+        row[i] = gfMul(c, (uint8_t)i);
+    }
+    for(size_t i=0; i<length; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+void gfMulAdd(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length) {
+    if(c == 0) {
+        return;
+    }
+    if(c == 1) {
+        xorInto(src, dst, length);
+        return;
+    }
+    implementation().function(c, src, dst, length);
+}
+
+const char* gfImplementation() {
+    return implementation().name;
+}
+
+ReedSolomon::ReedSolomon(int data_shards, int parity_shards):
+    data_shards(data_shards),
+    parity_shards(parity_shards)
+{
+    if(data_shards <= 0 || parity_shards < 0 || parity_shards > 256 - data_shards) {
+        throw Poco::InvalidArgumentException("Unsupported Reed-Solomon code");
+    }
+    int total = data_shards + parity_shards;
+
+    // Vandermonde matrix, rows are the powers of distinct elements. Multiplying it with the
+    // inverse of its top square makes the top the identity, and keeps any data_shards rows
+    // linearly independent.
+    std::vector<uint8_t> vandermonde((size_t)(total * data_shards));
+    for(int r=0; r<total; r++) {
+        for(int c=0; c<data_shards; c++) {
+            vandermonde[r * data_shards + c] = gfPow((uint8_t)r, c);
+        }
+    }
+    std::vector<uint8_t> top(vandermonde.begin(), vandermonde.begin() + data_shards * data_shards);
+    invert(top, data_shards);
+
+    matrix.assign((size_t)(total * data_shards), 0);
+    for(int r=0; r<total; r++) {
+        for(int c=0; c<data_shards; c++) {
+            uint8_t value = 0;
+            for(int k=0; k<data_shards; k++) {
+                value ^= gfMul(vandermonde[r * data_shards + k], top[k * data_shards + c]);
+            }
+            matrix[r * data_shards + c] = value;
+        }
+    }
+}
+
+int ReedSolomon::dataShards() const {
+    return data_shards;
+}
+
+int ReedSolomon::parityShards() const {
+    return parity_shards;
+}
+
+int ReedSolomon::totalShards() const {
+    return data_shards + parity_shards;
+}
+
+void ReedSolomon::encode(std::vector<std::vector<uint8_t>>& shards) const {
+    size_t size = shards[0].size();
+    for(int p=data_shards; p<totalShards(); p++) {
+        shards[p].assign(size, 0);
+        for(int d=0; d<data_shards; d++) {
+            gfMulAdd(matrix[p * data_shards + d], shards[d].data(), shards[p].data(), size);
+        }
+    }
+}
+
+void ReedSolomon::reconstruct(std::vector<std::vector<uint8_t>>& shards, const std::vector<bool>& present) const {
+    std::vector<int> sources;
+    for(int i=0; i<totalShards() && (int)sources.size() < data_shards; i++) {
+        if(present[i]) {
+            sources.push_back(i);
+        }
+    }
+    if((int)sources.size() < data_shards) {
+        throw Poco::DataException("Only " + std::to_string(sources.size()) + " of " + std::to_string(data_shards) + " shards needed are left");
+    }
+    size_t size = shards[sources[0]].size();
+
+    // The rows of the surviving shards map the data to them, their inverse maps them back.
+    std::vector<uint8_t> decode((size_t)(data_shards * data_shards));
+    for(int r=0; r<data_shards; r++) {
+        std::memcpy(&decode[r * data_shards], &matrix[sources[r] * data_shards], (size_t)data_shards);
+    }
+    if(!invert(decode, data_shards)) {
+        throw Poco::DataException("Singular decoding matrix");
+    }
+
+    for(int d=0; d<data_shards; d++) {
+        if(present[d]) {
+            continue;
+        }
+        shards[d].assign(size, 0);
+        for(int j=0; j<data_shards; j++) {
+            gfMulAdd(decode[d * data_shards + j], shards[sources[j]].data(), shards[d].data(), size);
+        }
+    }
+    for(int p=data_shards; p<totalShards(); p++) {
+        if(present[p]) {
+            continue;
+        }
+        shards[p].assign(size, 0);
+        for(int d=0; d<data_shards; d++) {
+            gfMulAdd(matrix[p * data_shards + d], shards[d].data(), shards[p].data(), size);
+        }
+    }
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef DISTFS_REED_SOLOMON_H
+#define DISTFS_REED_SOLOMON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace DistFS {
+
+// dst ^= c * src over GF(2^8) (polynomial 0x11d), the one kernel encoding and decoding are made
+// of. Uses AVX2 or SSSE3 nibble table lookups when the CPU has them, and a log/exp table
+// implementation otherwise.
+void gfMulAdd(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length);
+
+// The portable implementation, exposed so the SIMD paths can be checked against it.
+void gfMulAddSoftware(uint8_t c, const uint8_t* src, uint8_t* dst, size_t length);
+
+// "avx2", "ssse3" or "scalar".
+const char* gfImplementation();
+
+// Systematic Reed-Solomon code with `data_shards` data and `parity_shards` parity shards: the
+// data shards are stored as they are, and any `data_shards` of all the shards are enough to get
+// the others back. The encoding matrix is a Vandermonde matrix turned systematic, so every square
+// submatrix of it is invertible.
+class ReedSolomon {
+public:
+    ReedSolomon(int data_shards, int parity_shards);
+
+    int dataShards() const;
+    int parityShards() const;
+    int totalShards() const;
+
+    // `shards` holds totalShards() buffers of the same size, the data shards filled in. Computes
+    // the parity shards.
+    void encode(std::vector<std::vector<uint8_t>>& shards) const;
+
+    // Recompute the shards whose `present` flag is false from the others. Throws
+    // Poco::DataException if fewer than dataShards() are present.
+    void reconstruct(std::vector<std::vector<uint8_t>>& shards, const std::vector<bool>& present) const;
+
+protected:
+    int data_shards;
+    int parity_shards;
+    // totalShards() x data_shards, row major. Row i computes shard i from the data shards.
+    std::vector<uint8_t> matrix;
+};
+
+}
+#endif
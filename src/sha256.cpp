@@ -0,0 +1,217 @@
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DISTFS_SHA_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTFS_TARGET_SHA
+#else
+#include <cpuid.h>
+#define DISTFS_TARGET_SHA __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
+namespace DistFS {
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void transformSoftware(uint32_t* state, const uint8_t* block, size_t blocks) {
+    for(; blocks > 0; blocks--, block += 64) {
+        uint32_t w[64];
+        for(int i=0; i<16; i++) {
+            w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16 | (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+        }
+        for(int i=16; i<64; i++) {
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i=0; i<64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(DISTFS_SHA_X86)
+
+// Intel's SHA extensions: sha256rnds2 does two rounds on the state split as ABEF and CDGH,
+// sha256msg1 and sha256msg2 extend the message schedule four words at a time.
+DISTFS_TARGET_SHA void transformHardware(uint32_t* state, const uint8_t* block, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xf0);
+
+    for(; blocks > 0; blocks--, block += 64) {
+        __m128i abef_saved = abef;
+        __m128i cdgh_saved = cdgh;
+        __m128i w[4];   // w[g % 4] holds words 4g .. 4g+3 of the schedule
+        for(int g=0; g<4; g++) {
+            w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16*g)), byte_swap);
+        }
+        for(int g=0; g<16; g++) {
+            if(g >= 4) {
+                __m128i next = _mm_sha256msg1_epu32(w[g & 3], w[(g+1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(g+3) & 3], w[(g+2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(next, w[(g+3) & 3]);
+            }
+            __m128i words = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i*)&K[4*g]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+bool detectSHA() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    bool sha = (info[1] & (1 << 29)) != 0;
+    __cpuid(info, 1);
+    return sha && (info[2] & (1 << 19)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || (ebx & (1 << 29)) == 0) {
+        return false;
+    }
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif
+
+typedef void (*TransformFunction)(uint32_t*, const uint8_t*, size_t);
+
+TransformFunction selectImplementation() {
+#if defined(DISTFS_SHA_X86)
+    if(detectSHA()) {
+        return transformHardware;
+    }
+#endif
+    return transformSoftware;
+}
+
+const TransformFunction& implementation() {
+    static const TransformFunction selected = selectImplementation();
+    return selected;
+}
+
+}
+
+Sha256::Sha256() {
+    reset();
+}
+
+void Sha256::reset() {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state, initial, sizeof(state));
+    buffered = 0;
+    total = 0;
+}
+
+void Sha256::update(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    total += length;
+    if(buffered > 0) {
+        size_t piece = std::min(length, sizeof(buffer) - buffered);
+        memcpy(buffer + buffered, bytes, piece);
+        buffered += piece;
+        bytes += piece;
+        length -= piece;
+        if(buffered < sizeof(buffer)) {
+            return;
+        }
+        implementation()(state, buffer, 1);
+        buffered = 0;
+    }
+    size_t blocks = length / 64;
+    if(blocks > 0) {
+        implementation()(state, bytes, blocks);
+        bytes += blocks * 64;
+        length -= blocks * 64;
+    }
+    memcpy(buffer, bytes, length);
+    buffered = length;
+}
+
+void Sha256::finish(uint8_t* digest) {
+    uint64_t bits = total * 8;
+    uint8_t padding[72] = {0x80};
+    // Up to 56 mod 64, then the length in bits, big-endian.
+    size_t pad = (buffered < 56 ? 56 : 120) - buffered;
+    for(int i=0; i<8; i++) {
+        padding[pad + i] = (uint8_t)(bits >> (56 - 8*i));
+    }
+    update(padding, pad + 8);
+    for(int i=0; i<8; i++) {
+        digest[4*i] = (uint8_t)(state[i] >> 24);
+        digest[4*i+1] = (uint8_t)(state[i] >> 16);
+        digest[4*i+2] = (uint8_t)(state[i] >> 8);
+        digest[4*i+3] = (uint8_t)state[i];
+    }
+}
+
+bool Sha256::hardwareAvailable() {
+    return implementation() != transformSoftware;
+}
+
+std::string Sha256::hex(const void* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    Sha256 sha;
+    sha.update(data, length);
+    uint8_t digest[32];
+    sha.finish(digest);
+    std::string result(64, '0');
+    for(int i=0; i<32; i++) {
+        result[2*i] = digits[digest[i] >> 4];
+        result[2*i+1] = digits[digest[i] & 0x0f];
+    }
+    return result;
+}
+
+}
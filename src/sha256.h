@@ -0,0 +1,34 @@
+#ifndef DISTFS_SHA256_H
+#define DISTFS_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace DistFS {
+
+// SHA-256 (FIPS 180-4). Poco's Foundation only has SHA-1, and the Crypto library would pull in
+// OpenSSL for a single digest. Uses the SHA extensions when the CPU has them.
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const void* data, size_t length);
+    // Writes the 32 byte digest. The object has to be reset() before it is used again.
+    void finish(uint8_t* digest);
+    void reset();
+
+    // Lowercase hex digest of `length` bytes.
+    static std::string hex(const void* data, size_t length);
+
+    static bool hardwareAvailable();
+
+protected:
+    uint32_t state[8];
+    uint8_t buffer[64];
+    size_t buffered;
+    uint64_t total;
+};
+
+}
+#endif